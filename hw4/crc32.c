@@ -0,0 +1,25 @@
+#include <pthread.h>
+#include "crc32.h"
+
+static uint32_t crc32_table[256];
+static pthread_once_t crc32_table_once = PTHREAD_ONCE_INIT;
+
+/* Fills in the lookup table for the reflected polynomial 0xEDB88320. */
+static void crc32_table_init(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++)
+      c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+    crc32_table[i] = c;
+  }
+}
+
+/* Returns the CRC-32 of the SIZE bytes at DATA, continuing from CRC. */
+uint32_t crc32(uint32_t crc, const void *data, size_t size) {
+  const unsigned char *p = data;
+  pthread_once(&crc32_table_once, crc32_table_init);
+  crc = ~crc;
+  while (size--)
+    crc = crc32_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
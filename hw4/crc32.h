@@ -0,0 +1,14 @@
+#ifndef __CRC32__
+#define __CRC32__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC32 computes the standard (IEEE 802.3) CRC-32 checksum, used to detect
+ * torn or corrupted records in on-disk files.
+ *
+ * To checksum data spread over several buffers, pass the result of the
+ * previous call as CRC; start with a CRC of 0. */
+uint32_t crc32(uint32_t crc, const void *data, size_t size);
+
+#endif
@@ -0,0 +1,86 @@
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "histogram.h"
+
+/* Returns the bucket which VALUE is counted in. */
+static unsigned int histogram_bucket(uint64_t value) {
+  unsigned int magnitude;
+  if (value < HISTOGRAM_SUB_BUCKETS)
+    return value;
+  magnitude = 63 - __builtin_clzll(value); /* floor(log2(value)), at least 3 */
+  if (magnitude - 2 > HISTOGRAM_MAGNITUDES)
+    return HISTOGRAM_BUCKETS - 1;
+  /* The 3 bits below the leading one select the sub-bucket. */
+  return (magnitude - 2) * HISTOGRAM_SUB_BUCKETS +
+         ((value >> (magnitude - 3)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/* Returns the largest value which is counted in BUCKET. */
+static uint64_t histogram_bucket_max(unsigned int bucket) {
+  unsigned int magnitude, sub;
+  if (bucket < HISTOGRAM_SUB_BUCKETS)
+    return bucket;
+  magnitude = bucket / HISTOGRAM_SUB_BUCKETS + 2;
+  sub = bucket % HISTOGRAM_SUB_BUCKETS;
+  return ((uint64_t)(HISTOGRAM_SUB_BUCKETS + sub + 1) << (magnitude - 3)) - 1;
+}
+
+/* Initializes HIST to be empty. */
+void histogram_init(histogram_t *hist) { memset(hist, 0, sizeof(*hist)); }
+
+/* Adds VALUE to HIST. */
+void histogram_record(histogram_t *hist, uint64_t value) {
+  uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&hist->counts[histogram_bucket(value)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&hist->sum, value, __ATOMIC_RELAXED);
+  while (value > max && !__atomic_compare_exchange_n(&hist->max, &max, value, true,
+                                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+/* Adds all values recorded in FROM to INTO. */
+void histogram_merge(histogram_t *into, histogram_t *from) {
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    into->counts[i] += __atomic_load_n(&from->counts[i], __ATOMIC_RELAXED);
+  into->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+  into->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+  if (from->max > into->max)
+    into->max = from->max;
+}
+
+/* Returns the value below which PERCENTILE (between 0 and 100) percent of the
+ * values in HIST fall, or 0 if HIST is empty. */
+uint64_t histogram_percentile(histogram_t *hist, double percentile) {
+  uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED), seen = 0, max, rank;
+  if (count == 0)
+    return 0;
+  rank = (uint64_t)(percentile / 100 * count + 0.5);
+  if (rank < 1)
+    rank = 1;
+  max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += __atomic_load_n(&hist->counts[i], __ATOMIC_RELAXED);
+    if (seen >= rank)
+      return histogram_bucket_max(i) < max ? histogram_bucket_max(i) : max;
+  }
+  return max;
+}
+
+void histogram_print(histogram_t *hist, FILE *out, const char *name, const char *labels) {
+  static const double quantiles[] = {50, 90, 99, 99.9, 100};
+  const char *sep = (labels && labels[0]) ? "," : "";
+  labels = labels ? labels : "";
+  for (int i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+    fprintf(out, "%s{%s%squantile=\"%g\"} %lu\n", name, labels, sep, quantiles[i] / 100,
+            (unsigned long)histogram_percentile(hist, quantiles[i]));
+  fprintf(out, "%s_count{%s} %lu\n", name, labels, (unsigned long)hist->count);
+  fprintf(out, "%s_sum{%s} %lu\n", name, labels, (unsigned long)hist->sum);
+}
+
+uint64_t histogram_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
@@ -0,0 +1,48 @@
+#ifndef __HISTOGRAM__
+#define __HISTOGRAM__
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Histogram records the distribution of latencies (or any other nonnegative
+ * integer values) so that percentiles can be reported.
+ *
+ * Values are counted in log-linear buckets: values below HISTOGRAM_SUB_BUCKETS
+ * each have their own bucket, and every power of two above that is split into
+ * HISTOGRAM_SUB_BUCKETS equally sized buckets. Reported percentiles are thus
+ * within 1 / HISTOGRAM_SUB_BUCKETS (12.5%) of the true value, while a
+ * histogram stays a small, fixed size.
+ *
+ * Recording is lock-free, so a single histogram may be shared by many
+ * threads. Reading while others record gives a slightly stale but consistent
+ * enough view for monitoring.
+ */
+
+/* The number of buckets each power of two is split into. */
+#define HISTOGRAM_SUB_BUCKETS 8
+
+/* The number of powers of two covered; larger values are clamped. */
+#define HISTOGRAM_MAGNITUDES 40
+
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS * (HISTOGRAM_MAGNITUDES + 1))
+
+typedef struct {
+  uint64_t counts[HISTOGRAM_BUCKETS]; /* The number of values in each bucket. */
+  uint64_t count;                     /* The total number of values. */
+  uint64_t sum;                       /* The sum of all values. */
+  uint64_t max;                       /* The largest value. */
+} histogram_t;
+
+void histogram_init(histogram_t *);
+void histogram_record(histogram_t *, uint64_t value);
+void histogram_merge(histogram_t *into, histogram_t *from);
+uint64_t histogram_percentile(histogram_t *, double percentile);
+
+/* Prints HIST as text metrics named NAME, with LABELS (which may be empty)
+ * added to each: one line per quantile, plus NAME_count and NAME_sum. */
+void histogram_print(histogram_t *hist, FILE *out, const char *name, const char *labels);
+
+/* Returns the current time in microseconds, for timing what is recorded. */
+uint64_t histogram_now(void);
+
+#endif
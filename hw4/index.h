@@ -1,27 +1,20 @@
 #ifndef __INDEX__
 #define __INDEX__
 
-#include <unistd.h>
+#include "libhttp.h"
 
 extern const char index_payload[];
 extern int index_payload_size;
 
-#define index_send(sockfd, leader)                                                                 \
+/* Appends the index page (which is a complete response, delimited by closing
+ * the connection) for a leader or follower to the http_buffer_t OUT. */
+#define index_encode(out, leader)                                                                  \
   do {                                                                                             \
-    int bytes_left = index_payload_size, bytes_written;                                            \
-    const char *payload = index_payload;                                                           \
-    while (bytes_left > 0) {                                                                       \
-      bytes_written = write(sockfd, payload, bytes_left);                                          \
-      if (bytes_written < 0) {                                                                     \
-        break;                                                                                     \
-      }                                                                                            \
-      bytes_left -= bytes_written;                                                                 \
-      payload += bytes_written;                                                                    \
-    }                                                                                              \
+    http_buffer_append(out, index_payload, index_payload_size);                                    \
     if (leader)                                                                                    \
-      write(sockfd, "<script>setServerType('leader');</script>", 41);                              \
+      http_buffer_append(out, "<script>setServerType('leader');</script>", 41);                    \
     else                                                                                           \
-      write(sockfd, "<script>setServerType('follower');</script>", 43);                            \
+      http_buffer_append(out, "<script>setServerType('follower');</script>", 43);                  \
   } while (0)
 
 #endif
@@ -0,0 +1,285 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "kvblob.h"
+#include "kvconstants.h"
+#include "kvhash.h"
+
+/* Writes the name of the blob file of KEY within BLOBS into FILENAME. */
+static void kvblob_filename(kvblob_t *blobs, const char *key, char *filename) {
+  sprintf(filename, "%s/%016" PRIx64 KVBLOB_FILETYPE, blobs->dirname, kvhash_str(key));
+}
+
+/* Writes the name of the spool of transaction TXID within BLOBS into
+ * FILENAME. */
+static void kvblob_spoolname(kvblob_t *blobs, uint64_t txid, char *filename) {
+  sprintf(filename, "%s/%" PRIu64 KVBLOB_SPOOLTYPE, blobs->dirname, txid);
+}
+
+/* Flushes the entries of the directory of BLOBS to disk, if BLOBS is
+ * synced. */
+static void kvblob_sync_dir(kvblob_t *blobs) {
+  int fd;
+  if (!blobs->sync || (fd = open(blobs->dirname, O_RDONLY | O_DIRECTORY)) < 0)
+    return;
+  fsync(fd);
+  close(fd);
+}
+
+/* Reads the header of the blob file FD into HEADER and checks that it is the
+ * file of KEY. Returns false if it is not. */
+static bool kvblob_read_header(int fd, const char *key, kvblob_header_t *header) {
+  char buf[sizeof(kvblob_header_t) + MAX_KEYLEN];
+  size_t keylen = strlen(key);
+  ssize_t bytes_read = pread(fd, buf, sizeof(kvblob_header_t) + keylen, 0);
+  if (bytes_read < (ssize_t)(sizeof(kvblob_header_t) + keylen))
+    return false;
+  memcpy(header, buf, sizeof(kvblob_header_t));
+  return header->magic == KVBLOB_MAGIC && header->keylen == keylen &&
+         !memcmp(buf + sizeof(kvblob_header_t), key, keylen);
+}
+
+int kvblob_init(kvblob_t *blobs, const char *dirname, bool sync) {
+  char filename[MAX_FILENAME + 32];
+  struct dirent *dent;
+  size_t length;
+  DIR *dir;
+  if (strlen(dirname) + sizeof(KVBLOB_DIRNAME) + 1 > MAX_FILENAME)
+    return ERR_FILACCESS;
+  sprintf(blobs->dirname, "%s/" KVBLOB_DIRNAME, dirname);
+  if (mkdir(blobs->dirname, 0700) < 0 && errno != EEXIST)
+    return ERR_FILACCESS;
+  blobs->sync = sync;
+  blobs->count = 0;
+  blobs->retired = NULL;
+  blobs->nretired = blobs->capacity = 0;
+  pthread_mutex_init(&blobs->lock, NULL);
+  if ((dir = opendir(blobs->dirname)) == NULL)
+    return ERR_FILACCESS;
+  while ((dent = readdir(dir)) != NULL) {
+    length = strlen(dent->d_name);
+    if (length > strlen(KVBLOB_FILETYPE) &&
+        !strcmp(dent->d_name + length - strlen(KVBLOB_FILETYPE), KVBLOB_FILETYPE)) {
+      blobs->count++;
+    } else if (length > strlen(KVBLOB_LINKTYPE) &&
+               !strcmp(dent->d_name + length - strlen(KVBLOB_LINKTYPE), KVBLOB_LINKTYPE)) {
+      /* A commit which never reached its rename; its COMMIT will be replayed. */
+      if (snprintf(filename, sizeof(filename), "%s/%s", blobs->dirname, dent->d_name) >=
+          (int)sizeof(filename)) {
+        closedir(dir);
+        return ERR_FILLEN;
+      }
+      unlink(filename);
+    }
+  }
+  closedir(dir);
+  return 0;
+}
+
+ssize_t kvblob_receive(kvblob_t *blobs, uint64_t txid, const char *key, http_body_t *body) {
+  char filename[MAX_FILENAME + 32];
+  kvblob_header_t header = {KVBLOB_MAGIC, strlen(key), 0};
+  ssize_t length;
+  int fd;
+  kvblob_spoolname(blobs, txid, filename);
+  if ((fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+    return ERR_FILACCESS;
+  /* The header is written last, so a spool cut short is never taken for a
+   * whole one. */
+  if (lseek(fd, sizeof(header), SEEK_SET) < 0 || http_write(fd, key, header.keylen) < 0) {
+    length = ERR_FILACCESS;
+    goto error;
+  }
+  if ((length = http_body_copy(body, fd)) < 0) {
+    length = ERR_INVLDMSG;
+    goto error;
+  }
+  header.length = length;
+  if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      (blobs->sync && fdatasync(fd) < 0)) {
+    length = ERR_FILACCESS;
+    goto error;
+  }
+  if (close(fd) < 0) {
+    unlink(filename);
+    return ERR_FILACCESS;
+  }
+  return length;
+
+error:
+  close(fd);
+  unlink(filename);
+  return length;
+}
+
+int kvblob_check(kvblob_t *blobs, const char *key) {
+  char filename[MAX_FILENAME + 32];
+  kvblob_header_t header;
+  bool owned;
+  int fd;
+  if (__atomic_load_n(&blobs->count, __ATOMIC_RELAXED) == 0)
+    return 0;
+  kvblob_filename(blobs, key, filename);
+  if ((fd = open(filename, O_RDONLY)) < 0)
+    return errno == ENOENT ? 0 : ERR_FILACCESS;
+  owned = kvblob_read_header(fd, key, &header);
+  close(fd);
+  return owned ? 0 : ERR_FILACCESS;
+}
+
+int kvblob_commit(kvblob_t *blobs, uint64_t txid, const char *key) {
+  char spoolname[MAX_FILENAME + 32], filename[MAX_FILENAME + 32];
+  char linkname[MAX_FILENAME + 32 + sizeof(KVBLOB_LINKTYPE)];
+  bool existed;
+  kvblob_spoolname(blobs, txid, spoolname);
+  kvblob_filename(blobs, key, filename);
+  sprintf(linkname, "%s%s", filename, KVBLOB_LINKTYPE);
+  unlink(linkname);
+  if (link(spoolname, linkname) < 0)
+    return errno == ENOENT ? ERR_NOKEY : ERR_FILACCESS;
+  existed = access(filename, F_OK) == 0;
+  if (rename(linkname, filename) < 0) {
+    unlink(linkname);
+    return ERR_FILACCESS;
+  }
+  /* Renaming a link over another link to the same file (when a COMMIT is
+   * replayed) leaves both in place. */
+  unlink(linkname);
+  if (!existed)
+    __atomic_fetch_add(&blobs->count, 1, __ATOMIC_RELAXED);
+  kvblob_sync_dir(blobs);
+  return 0;
+}
+
+void kvblob_retire(kvblob_t *blobs, uint64_t txid, uint64_t mark) {
+  pthread_mutex_lock(&blobs->lock);
+  if (blobs->nretired == blobs->capacity) {
+    blobs->capacity = blobs->capacity ? blobs->capacity * 2 : 16;
+    blobs->retired = realloc(blobs->retired, blobs->capacity * sizeof(kvblob_retired_t));
+    if (!blobs->retired)
+      fatal_malloc();
+  }
+  blobs->retired[blobs->nretired].txid = txid;
+  blobs->retired[blobs->nretired++].mark = mark;
+  pthread_mutex_unlock(&blobs->lock);
+}
+
+void kvblob_discard(kvblob_t *blobs, uint64_t txid) {
+  char filename[MAX_FILENAME + 32];
+  kvblob_spoolname(blobs, txid, filename);
+  unlink(filename);
+}
+
+void kvblob_sweep(kvblob_t *blobs, uint64_t first) {
+  pthread_mutex_lock(&blobs->lock);
+  for (unsigned int i = 0; i < blobs->nretired;) {
+    if (blobs->retired[i].mark <= first) {
+      kvblob_discard(blobs, blobs->retired[i].txid);
+      blobs->retired[i] = blobs->retired[--blobs->nretired];
+    } else {
+      i++;
+    }
+  }
+  pthread_mutex_unlock(&blobs->lock);
+}
+
+/* Returns true if the spool of transaction TXID has been retired. */
+static bool kvblob_retired(kvblob_t *blobs, uint64_t txid) {
+  bool retired = false;
+  pthread_mutex_lock(&blobs->lock);
+  for (unsigned int i = 0; i < blobs->nretired && !retired; i++)
+    retired = blobs->retired[i].txid == txid;
+  pthread_mutex_unlock(&blobs->lock);
+  return retired;
+}
+
+void kvblob_recover(kvblob_t *blobs, bool (*pending)(void *arg, uint64_t txid), void *arg) {
+  char filename[MAX_FILENAME + 32];
+  struct dirent *dent;
+  uint64_t txid;
+  int len;
+  DIR *dir = opendir(blobs->dirname);
+  if (dir == NULL)
+    return;
+  while ((dent = readdir(dir)) != NULL) {
+    if (sscanf(dent->d_name, "%" SCNu64 "%n", &txid, &len) != 1 ||
+        strcmp(dent->d_name + len, KVBLOB_SPOOLTYPE) || pending(arg, txid) ||
+        kvblob_retired(blobs, txid))
+      continue;
+    /* A spool whose path does not fit was never written by this KVBlob. */
+    if (snprintf(filename, sizeof(filename), "%s/%s", blobs->dirname, dent->d_name) <
+        (int)sizeof(filename))
+      unlink(filename);
+  }
+  closedir(dir);
+}
+
+int kvblob_open(kvblob_t *blobs, const char *key, size_t *length, off_t *offset) {
+  char filename[MAX_FILENAME + 32];
+  kvblob_header_t header;
+  int fd;
+  if (__atomic_load_n(&blobs->count, __ATOMIC_RELAXED) == 0)
+    return ERR_NOKEY;
+  kvblob_filename(blobs, key, filename);
+  if ((fd = open(filename, O_RDONLY)) < 0)
+    return ERR_NOKEY;
+  if (!kvblob_read_header(fd, key, &header)) {
+    close(fd);
+    return ERR_NOKEY;
+  }
+  *length = header.length;
+  *offset = sizeof(header) + header.keylen;
+  return fd;
+}
+
+bool kvblob_exists(kvblob_t *blobs, const char *key) {
+  size_t length;
+  off_t offset;
+  int fd = kvblob_open(blobs, key, &length, &offset);
+  if (fd < 0)
+    return false;
+  close(fd);
+  return true;
+}
+
+int kvblob_del(kvblob_t *blobs, const char *key) {
+  char filename[MAX_FILENAME + 32];
+  if (!kvblob_exists(blobs, key))
+    return ERR_NOKEY;
+  kvblob_filename(blobs, key, filename);
+  if (unlink(filename) < 0)
+    return ERR_NOKEY;
+  __atomic_fetch_sub(&blobs->count, 1, __ATOMIC_RELAXED);
+  kvblob_sync_dir(blobs);
+  return 0;
+}
+
+int kvblob_clean(kvblob_t *blobs) {
+  char filename[MAX_FILENAME + 32];
+  struct dirent *dent;
+  int ret = 0;
+  DIR *dir = opendir(blobs->dirname);
+  if (dir != NULL) {
+    while ((dent = readdir(dir)) != NULL) {
+      if (snprintf(filename, sizeof(filename), "%s/%s", blobs->dirname, dent->d_name) >=
+          (int)sizeof(filename))
+        ret = ERR_FILLEN;
+      else
+        remove(filename);
+    }
+    closedir(dir);
+  }
+  remove(blobs->dirname);
+  free(blobs->retired);
+  blobs->retired = NULL;
+  blobs->nretired = blobs->capacity = 0;
+  blobs->count = 0;
+  pthread_mutex_destroy(&blobs->lock);
+  return ret;
+}
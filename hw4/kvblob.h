@@ -0,0 +1,124 @@
+#ifndef __KV_BLOB__
+#define __KV_BLOB__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "kvconstants.h"
+#include "libhttp.h"
+
+/* KVBlob stores the large values of a TPCFollower (see kvmessage.h), which
+ * are too long for its KVStore, as one file per key in the directory
+ * KVBLOB_DIRNAME beside the store. A blob file is named by the kvhash64 of its
+ * key, and holds a kvblob_header_t, the key and then the value, which is sent
+ * on from there with sendfile, never read into memory.
+ *
+ * The value of a PUT is streamed from the connection it arrives on into a
+ * spool file of its transaction, named by its ID, before the follower votes:
+ * the vote which is logged (a PUTBLOB entry, see tpclog.h) only holds the
+ * key, and the spool is synced before it when the log is. A COMMIT links the
+ * spool into place as the key's blob file, atomically replacing any previous
+ * one, and an ABORT removes it. The spool of a committed transaction is then
+ * retired, and kept until the log, whose COMMIT may be replayed, no longer
+ * holds its vote: kvblob_sweep removes it once the log has been truncated
+ * past the mark it was retired with. Replaying a COMMIT links the spool into
+ * place again, so a blob which a later entry of the log replaced or removed is
+ * put back before that entry is replayed in turn.
+ *
+ * Keys are only ever written by one transaction at a time (see
+ * tpcfollower.h), so no lock is taken for a single key. The number of blobs is
+ * kept so that, as long as there are none, the lookups and removals which
+ * every GET, PUT and DEL of a short value also makes here cost nothing.
+ */
+
+/* The subdirectory of a follower's directory which holds its blobs. */
+#define KVBLOB_DIRNAME "blobs"
+
+/* The filetypes of blob files, spools, and the link a spool is renamed over a
+ * blob file from. */
+#define KVBLOB_FILETYPE ".blob"
+#define KVBLOB_SPOOLTYPE ".spool"
+#define KVBLOB_LINKTYPE ".link"
+
+/* The first bytes of every blob file. */
+#define KVBLOB_MAGIC 0x4B56424C
+
+/* A spool of a committed transaction, kept until the log no longer holds any
+ * entry before MARK (see kvblob_sweep). */
+typedef struct {
+  uint64_t txid; /* The transaction the spool belongs to. */
+  uint64_t mark; /* A sequence number of the log later than that of its vote. */
+} kvblob_retired_t;
+
+/* The header of a blob file. */
+typedef struct {
+  uint32_t magic;  /* KVBLOB_MAGIC. */
+  uint32_t keylen; /* The length of the key which follows. */
+  uint64_t length; /* The length of the value which follows the key. */
+} kvblob_header_t;
+
+/* A KVBlob. */
+typedef struct {
+  char dirname[MAX_FILENAME]; /* The directory holding the blob files and spools. */
+  bool sync;                  /* Whether spools, and the directory, are synced. */
+  unsigned long count;        /* The number of blob files. */
+  pthread_mutex_t lock;       /* Protects RETIRED. */
+  kvblob_retired_t *retired;  /* The spools which await kvblob_sweep. */
+  unsigned int nretired;      /* The number of transactions in RETIRED. */
+  unsigned int capacity;      /* The allocated length of RETIRED. */
+} kvblob_t;
+
+/* Initializes BLOBS in the KVBLOB_DIRNAME subdirectory of DIRNAME, creating
+ * it if necessary. If SYNC is set, spools are synced before they are logged,
+ * and the directory after it changes. Returns 0 if successful, else a
+ * negative error code. */
+int kvblob_init(kvblob_t *, const char *dirname, bool sync);
+
+/* Reads all of BODY into the spool of transaction TXID, as the value of KEY.
+ * Returns the length of the value, else a negative error code, in which case
+ * no spool is left behind. */
+ssize_t kvblob_receive(kvblob_t *, uint64_t txid, const char *key, http_body_t *body);
+
+/* Checks that a value of KEY can be stored: that no other key's blob file
+ * has the same name. Returns 0 if it can, else a negative error code. */
+int kvblob_check(kvblob_t *, const char *key);
+
+/* Links the spool of transaction TXID into place as the blob file of KEY,
+ * leaving the spool itself in place until it is retired. Returns 0 if
+ * successful, else a negative error code. */
+int kvblob_commit(kvblob_t *, uint64_t txid, const char *key);
+
+/* Retires the spool of transaction TXID, once committed, until kvblob_sweep
+ * is called with a FIRST of at least MARK. */
+void kvblob_retire(kvblob_t *, uint64_t txid, uint64_t mark);
+
+/* Removes the spool of transaction TXID, whose value will not be stored. */
+void kvblob_discard(kvblob_t *, uint64_t txid);
+
+/* Removes the spools of the retired transactions whose mark is at most FIRST,
+ * the sequence number of the first entry the log still holds. */
+void kvblob_sweep(kvblob_t *, uint64_t first);
+
+/* Removes every spool left behind by a previous run, except those of the
+ * transactions for which PENDING(ARG, TXID) returns true and those retired
+ * since BLOBS was initialized, by replaying their COMMITs. */
+void kvblob_recover(kvblob_t *, bool (*pending)(void *arg, uint64_t txid), void *arg);
+
+/* Opens the blob file of KEY. Returns the file descriptor, which should be
+ * closed, and sets LENGTH and OFFSET to the length of the value and where it
+ * starts within the file; else returns ERR_NOKEY. */
+int kvblob_open(kvblob_t *, const char *key, size_t *length, off_t *offset);
+
+/* Returns true if KEY has a blob file. */
+bool kvblob_exists(kvblob_t *, const char *key);
+
+/* Removes the blob file of KEY. Returns 0 if successful, else ERR_NOKEY. */
+int kvblob_del(kvblob_t *, const char *key);
+
+/* Removes every blob file and spool of BLOBS, then its directory. BLOBS must
+ * be reinitialized before it is used again. Returns 0 if successful, else
+ * ERR_FILLEN if some file's path was too long to remove it. */
+int kvblob_clean(kvblob_t *);
+
+#endif
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kvconstants.h"
+#include "kvbloom.h"
+
+/* Returns a new, empty filter for at least KEYS keys. */
+static kvbloom_bits_t *kvbloom_new_bits(size_t keys) {
+  size_t nbits = 64;
+  kvbloom_bits_t *bits;
+  while (nbits < keys * KVBLOOM_BITS_PER_KEY)
+    nbits <<= 1;
+  bits = calloc(1, sizeof(kvbloom_bits_t) + nbits / 8);
+  if (!bits)
+    fatal_malloc();
+  bits->nbits = nbits;
+  bits->capacity = nbits / KVBLOOM_BITS_PER_KEY;
+  return bits;
+}
+
+/* Sets *H1 and *H2 to the two hashes the bits of the key with kvhash64 HASH
+ * are derived from. HASH is mixed first, as the keys of a shard share the
+ * remainder of their hash by the number of shards. */
+static void kvbloom_hashes(uint64_t hash, uint64_t *h1, uint64_t *h2) {
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  *h1 = hash;
+  *h2 = (hash >> 32) | 1;
+}
+
+void kvbloom_init(kvbloom_t *bloom) {
+  bloom->bits = kvbloom_new_bits(KVBLOOM_MIN_KEYS);
+  bloom->building = NULL;
+  bloom->seq = 0;
+  bloom->added = 0;
+  bloom->negatives = bloom->false_positives = 0;
+}
+
+void kvbloom_add(kvbloom_t *bloom, uint64_t hash) {
+  kvbloom_bits_t *bits = bloom->building ? bloom->building : bloom->bits;
+  uint64_t h1, h2, bit;
+  kvbloom_hashes(hash, &h1, &h2);
+  for (unsigned int i = 0; i < KVBLOOM_HASHES; i++) {
+    bit = (h1 + i * h2) & (bits->nbits - 1);
+    __atomic_fetch_or(&bits->words[bit / 64], (uint64_t)1 << (bit % 64), __ATOMIC_RELAXED);
+  }
+  bloom->added++;
+}
+
+bool kvbloom_check(kvbloom_t *bloom, uint64_t hash) {
+  unsigned long seq = __atomic_load_n(&bloom->seq, __ATOMIC_ACQUIRE);
+  kvbloom_bits_t *bits = __atomic_load_n(&bloom->bits, __ATOMIC_ACQUIRE);
+  uint64_t h1, h2, bit;
+  bool present = true;
+  if (seq & 1)
+    return true;
+  kvbloom_hashes(hash, &h1, &h2);
+  for (unsigned int i = 0; i < KVBLOOM_HASHES && present; i++) {
+    bit = (h1 + i * h2) & (bits->nbits - 1);
+    present = __atomic_load_n(&bits->words[bit / 64], __ATOMIC_RELAXED) >> (bit % 64) & 1;
+  }
+  /* The bits read are only meaningful if no rebuild in place began since. */
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (present || __atomic_load_n(&bloom->seq, __ATOMIC_RELAXED) != seq)
+    return true;
+  __atomic_fetch_add(&bloom->negatives, 1, __ATOMIC_RELAXED);
+  return false;
+}
+
+bool kvbloom_full(kvbloom_t *bloom) { return bloom->added >= bloom->bits->capacity; }
+
+void kvbloom_rebuild_begin(kvbloom_t *bloom, size_t keys) {
+  kvbloom_bits_t *bits = bloom->bits;
+  bloom->added = 0;
+  if (keys * 2 > bits->capacity) {
+    bloom->building = kvbloom_new_bits(keys * 2);
+    return;
+  }
+  __atomic_store_n(&bloom->seq, bloom->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  for (size_t i = 0; i < bits->nbits / 64; i++)
+    __atomic_store_n(&bits->words[i], 0, __ATOMIC_RELAXED);
+}
+
+void kvbloom_rebuild_end(kvbloom_t *bloom) {
+  if (bloom->building) {
+    bloom->building->retired = bloom->bits;
+    __atomic_store_n(&bloom->bits, bloom->building, __ATOMIC_RELEASE);
+    bloom->building = NULL;
+  } else {
+    __atomic_store_n(&bloom->seq, bloom->seq + 1, __ATOMIC_RELEASE);
+  }
+}
+
+double kvbloom_fpr(kvbloom_t *bloom) {
+  kvbloom_bits_t *bits = bloom->bits;
+  size_t set = 0;
+  double fpr = 1, fill;
+  for (size_t i = 0; i < bits->nbits / 64; i++)
+    set += __builtin_popcountll(__atomic_load_n(&bits->words[i], __ATOMIC_RELAXED));
+  fill = (double)set / bits->nbits;
+  for (unsigned int i = 0; i < KVBLOOM_HASHES; i++)
+    fpr *= fill;
+  return fpr;
+}
+
+size_t kvbloom_size(kvbloom_t *bloom) { return bloom->bits->nbits / 8; }
+
+/* Frees every filter of BLOOM. BLOOM must be reinitialized before it is used
+ * again. */
+void kvbloom_destroy(kvbloom_t *bloom) {
+  kvbloom_bits_t *bits, *retired;
+  for (bits = bloom->bits; bits; bits = retired) {
+    retired = bits->retired;
+    free(bits);
+  }
+  free(bloom->building);
+  bloom->bits = bloom->building = NULL;
+}
@@ -0,0 +1,84 @@
+#ifndef __KV_BLOOM__
+#define __KV_BLOOM__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* KVBloom is a Bloom filter over the keys of a KVStore shard, which lets a
+ * lookup of an absent key be answered without taking the shard's lock.
+ *
+ * Each key sets KVBLOOM_HASHES bits of the filter, picked by double hashing
+ * its kvhash64 (see kvhash.h), and a key some of whose bits are clear was
+ * certainly never added. A filter is sized for a number of keys, with
+ * KVBLOOM_BITS_PER_KEY bits each, which makes about 1% of the lookups of
+ * absent keys pass once it is full. Since bits cannot be cleared when a key
+ * is removed, the owner rebuilds the filter from its keys once as many have
+ * been added as it is sized for; a filter which the keys have outgrown is
+ * replaced by one twice as large, else it is rebuilt in place.
+ *
+ * Keys are added, and filters rebuilt, by a single writer at a time, while
+ * lookups may run concurrently with them and take no lock. A replaced
+ * filter is kept, linked from its successor, until the KVBloom is destroyed,
+ * since a lookup may still be reading it; as each filter is at least twice
+ * as large as the one it replaced, this at most doubles the memory used. A
+ * lookup which overlaps a rebuild in place, detected by a sequence number
+ * which is odd while it runs, reports that the key may be present.
+ */
+
+/* The bits of a filter per key it is sized for. */
+#define KVBLOOM_BITS_PER_KEY 10
+
+/* The bits each key sets, which minimizes false positives for the above. */
+#define KVBLOOM_HASHES 7
+
+/* The fewest keys a filter is sized for. */
+#define KVBLOOM_MIN_KEYS 1024
+
+/* The bits of a single filter. */
+typedef struct kvbloom_bits {
+  size_t capacity;              /* The number of keys the filter is sized for. */
+  size_t nbits;                 /* The number of bits, a power of two. */
+  struct kvbloom_bits *retired; /* The smaller filter this one replaced, if any. */
+  uint64_t words[];             /* The bits. */
+} kvbloom_bits_t;
+
+/* A KVBloom. */
+typedef struct {
+  kvbloom_bits_t *bits;          /* The filter lookups read. */
+  kvbloom_bits_t *building;      /* The larger filter being built to replace it, if any. */
+  unsigned long seq;             /* Odd while BITS is being rebuilt in place. */
+  size_t added;                  /* The keys added since BITS was last built. */
+  unsigned long negatives;       /* Lookups which the filter showed to be absent. */
+  unsigned long false_positives; /* Lookups of absent keys which the filter let pass. */
+} kvbloom_t;
+
+/* Initializes BLOOM to an empty filter of KVBLOOM_MIN_KEYS keys. */
+void kvbloom_init(kvbloom_t *);
+
+/* Adds the key with kvhash64 HASH to BLOOM, or to the filter being built. */
+void kvbloom_add(kvbloom_t *, uint64_t hash);
+
+/* Returns false if the key with kvhash64 HASH was certainly never added to
+ * BLOOM, else true. Counts the former as a negative. Takes no lock. */
+bool kvbloom_check(kvbloom_t *, uint64_t hash);
+
+/* Returns true if as many keys have been added to BLOOM since it was built
+ * as it is sized for, so it should be rebuilt. */
+bool kvbloom_full(kvbloom_t *);
+
+/* Starts rebuilding BLOOM for KEYS keys, which must then all be added before
+ * kvbloom_rebuild_end is called. */
+void kvbloom_rebuild_begin(kvbloom_t *, size_t keys);
+void kvbloom_rebuild_end(kvbloom_t *);
+
+/* Returns the expected fraction of lookups of absent keys which BLOOM lets
+ * pass, from the fraction of its bits which are set. */
+double kvbloom_fpr(kvbloom_t *);
+
+/* Returns the number of bytes of the bits BLOOM reads. */
+size_t kvbloom_size(kvbloom_t *);
+
+void kvbloom_destroy(kvbloom_t *);
+
+#endif
@@ -0,0 +1,237 @@
+#include <stdlib.h>
+#include <string.h>
+#include "kvcache.h"
+#include "utlist.h"
+
+/* Returns the shard of CACHE which holds keys with hash HASH. The low half of
+ * the hash is left to pick buckets and counters within the shard. */
+static kvcache_shard_t *kvcache_shard(kvcache_t *cache, uint64_t hash) {
+  return &cache->shards[(hash >> 32) % KVCACHE_SHARDS];
+}
+
+/* Initializes CACHE to hold at most CAPACITY bytes, split evenly over its
+ * shards, with TinyLFU admission if ADMISSION is set. Each sketch gets
+ * roughly a counter per row for every entry the shard may hold, assuming an
+ * entry takes 64 bytes. Returns 0 if successful, or a negative error code if
+ * not. */
+int kvcache_init(kvcache_t *cache, size_t capacity, bool admission) {
+  int ret;
+  cache->shard_capacity = capacity / KVCACHE_SHARDS;
+  for (cache->sketch_width = 64; cache->sketch_width < cache->shard_capacity / 64;)
+    cache->sketch_width <<= 1;
+  for (int i = 0; i < KVCACHE_SHARDS; i++) {
+    kvcache_shard_t *shard = &cache->shards[i];
+    if ((ret = pthread_mutex_init(&shard->lock, NULL)) != 0)
+      return -ret;
+    shard->table = NULL;
+    shard->lru = NULL;
+    shard->size = 0;
+    shard->version = 0;
+    shard->hits = shard->misses = shard->evictions = shard->rejections = 0;
+    shard->sketch = NULL;
+    shard->samples = 0;
+    if (admission && cache->shard_capacity > 0) {
+      shard->sketch = calloc(KVCACHE_SKETCH_DEPTH * cache->sketch_width, 1);
+      if (!shard->sketch)
+        fatal_malloc();
+    }
+  }
+  return 0;
+}
+
+/* Returns the counter in row ROW of the sketch of SHARD for keys with hash
+ * HASH. Each row combines the two halves of the hash differently. */
+static uint8_t *kvcache_counter(kvcache_t *cache, kvcache_shard_t *shard, uint64_t hash,
+                                unsigned int row) {
+  uint32_t index = (uint32_t)hash + row * (uint32_t)(hash >> 32);
+  return &shard->sketch[row * cache->sketch_width + (index & (cache->sketch_width - 1))];
+}
+
+/* Counts a lookup of the key with hash HASH in the sketch of SHARD, halving
+ * all counters once enough lookups have been counted. Must be called with the
+ * shard's lock held. */
+static void kvcache_sketch_add(kvcache_t *cache, kvcache_shard_t *shard, uint64_t hash) {
+  uint8_t *counter;
+  if (!shard->sketch)
+    return;
+  for (unsigned int row = 0; row < KVCACHE_SKETCH_DEPTH; row++) {
+    counter = kvcache_counter(cache, shard, hash, row);
+    if (*counter < KVCACHE_SKETCH_MAX)
+      (*counter)++;
+  }
+  if (++shard->samples >= KVCACHE_SKETCH_PERIOD * cache->sketch_width) {
+    for (size_t i = 0; i < KVCACHE_SKETCH_DEPTH * cache->sketch_width; i++)
+      shard->sketch[i] >>= 1;
+    shard->samples /= 2;
+  }
+}
+
+/* Returns the estimated number of recent lookups of the key with hash HASH,
+ * the smallest of its counters in the sketch of SHARD. Must be called with
+ * the shard's lock held. */
+static unsigned int kvcache_sketch_estimate(kvcache_t *cache, kvcache_shard_t *shard,
+                                            uint64_t hash) {
+  unsigned int estimate = KVCACHE_SKETCH_MAX, count;
+  for (unsigned int row = 0; row < KVCACHE_SKETCH_DEPTH; row++) {
+    count = *kvcache_counter(cache, shard, hash, row);
+    estimate = min(estimate, count);
+  }
+  return estimate;
+}
+
+/* Removes ENTRY from SHARD and frees it. Must be called with the shard's lock
+ * held. */
+static void kvcache_remove(kvcache_shard_t *shard, kvcache_entry_t *entry) {
+  HASH_DEL(shard->table, entry);
+  DL_DELETE(shard->lru, entry);
+  shard->size -= entry->size;
+  free(entry);
+}
+
+/* Caches VALUE for KEY, which has hash HASH, in SHARD, replacing any
+ * previous value and evicting the least recently used entries to make room.
+ * A value too large to fit in the shard at all is not cached, nor is one
+ * which TinyLFU does not admit. Must be called with the shard's lock held. */
+static void kvcache_insert(kvcache_t *cache, kvcache_shard_t *shard, uint64_t hash, char *key,
+                           char *value) {
+  size_t keylen = strlen(key), vallen = strlen(value);
+  size_t size = sizeof(kvcache_entry_t) + keylen + vallen + 2;
+  kvcache_entry_t *entry;
+
+  HASH_FIND_HASHED(hh, shard->table, key, strlen(key), hash, entry);
+  if (entry)
+    kvcache_remove(shard, entry);
+  if (size > cache->shard_capacity)
+    return;
+  if (shard->sketch && shard->size + size > cache->shard_capacity &&
+      kvcache_sketch_estimate(cache, shard, hash) <=
+          kvcache_sketch_estimate(cache, shard, shard->lru->prev->hash)) {
+    shard->rejections++;
+    return;
+  }
+  while (shard->size + size > cache->shard_capacity) {
+    kvcache_remove(shard, shard->lru->prev);
+    shard->evictions++;
+  }
+
+  entry = malloc(size);
+  if (!entry)
+    fatal_malloc();
+  memcpy(entry->key, key, keylen + 1);
+  entry->value = entry->key + keylen + 1;
+  memcpy(entry->value, value, vallen + 1);
+  entry->size = size;
+  entry->hash = hash;
+  HASH_ADD_KEYPTR(hh, shard->table, entry->key, keylen, entry);
+  DL_PREPEND(shard->lru, entry);
+  shard->size += size;
+}
+
+/* Copies the value of KEY, whose kvhash64 is HASH, into VALUE, which must
+ * have room for MAX_VALLEN + 1 bytes, if it is cached in CACHE, and marks it
+ * as the most recently used entry of its shard. Returns false if it is not,
+ * setting TICKET to the current version of the shard. */
+bool kvcache_get(kvcache_t *cache, char *key, uint64_t hash, char *value, uint64_t *ticket) {
+  kvcache_shard_t *shard;
+  kvcache_entry_t *entry;
+  if (cache->shard_capacity == 0) {
+    *ticket = 0;
+    return false;
+  }
+  shard = kvcache_shard(cache, hash);
+  pthread_mutex_lock(&shard->lock);
+  kvcache_sketch_add(cache, shard, hash);
+  HASH_FIND_HASHED(hh, shard->table, key, strlen(key), hash, entry);
+  if (!entry) {
+    shard->misses++;
+    *ticket = shard->version;
+    pthread_mutex_unlock(&shard->lock);
+    return false;
+  }
+  shard->hits++;
+  if (shard->lru != entry) {
+    DL_DELETE(shard->lru, entry);
+    DL_PREPEND(shard->lru, entry);
+  }
+  strcpy(value, entry->value);
+  pthread_mutex_unlock(&shard->lock);
+  return true;
+}
+
+/* Caches VALUE for KEY in CACHE if nothing has been written to KEY's shard
+ * since kvcache_get handed out TICKET. */
+void kvcache_fill(kvcache_t *cache, char *key, uint64_t hash, char *value, uint64_t ticket) {
+  kvcache_shard_t *shard;
+  if (cache->shard_capacity == 0)
+    return;
+  shard = kvcache_shard(cache, hash);
+  pthread_mutex_lock(&shard->lock);
+  if (shard->version == ticket)
+    kvcache_insert(cache, shard, hash, key, value);
+  pthread_mutex_unlock(&shard->lock);
+}
+
+/* Caches VALUE as the new value of KEY in CACHE. */
+void kvcache_put(kvcache_t *cache, char *key, uint64_t hash, char *value) {
+  kvcache_shard_t *shard;
+  if (cache->shard_capacity == 0)
+    return;
+  shard = kvcache_shard(cache, hash);
+  pthread_mutex_lock(&shard->lock);
+  shard->version++;
+  kvcache_insert(cache, shard, hash, key, value);
+  pthread_mutex_unlock(&shard->lock);
+}
+
+/* Removes KEY from CACHE, if present. */
+void kvcache_del(kvcache_t *cache, char *key, uint64_t hash) {
+  kvcache_shard_t *shard;
+  kvcache_entry_t *entry;
+  if (cache->shard_capacity == 0)
+    return;
+  shard = kvcache_shard(cache, hash);
+  pthread_mutex_lock(&shard->lock);
+  shard->version++;
+  HASH_FIND_HASHED(hh, shard->table, key, strlen(key), hash, entry);
+  if (entry)
+    kvcache_remove(shard, entry);
+  pthread_mutex_unlock(&shard->lock);
+}
+
+/* Prints the hits, misses, evictions and rejections of CACHE, summed over all
+ * shards, and the number of entries and bytes it holds to OUT as text
+ * metrics. */
+void kvcache_print(kvcache_t *cache, FILE *out, const char *name) {
+  unsigned long hits = 0, misses = 0, evictions = 0, rejections = 0, entries = 0;
+  size_t size = 0;
+  for (int i = 0; i < KVCACHE_SHARDS; i++) {
+    kvcache_shard_t *shard = &cache->shards[i];
+    pthread_mutex_lock(&shard->lock);
+    hits += shard->hits;
+    misses += shard->misses;
+    evictions += shard->evictions;
+    rejections += shard->rejections;
+    entries += HASH_COUNT(shard->table);
+    size += shard->size;
+    pthread_mutex_unlock(&shard->lock);
+  }
+  fprintf(out, "%s_hits %lu\n", name, hits);
+  fprintf(out, "%s_misses %lu\n", name, misses);
+  fprintf(out, "%s_evictions %lu\n", name, evictions);
+  fprintf(out, "%s_rejections %lu\n", name, rejections);
+  fprintf(out, "%s_entries %lu\n", name, entries);
+  fprintf(out, "%s_bytes %zu\n", name, size);
+}
+
+/* Frees all entries of CACHE. */
+void kvcache_destroy(kvcache_t *cache) {
+  kvcache_entry_t *entry, *tmp;
+  for (int i = 0; i < KVCACHE_SHARDS; i++) {
+    kvcache_shard_t *shard = &cache->shards[i];
+    HASH_ITER(hh, shard->table, entry, tmp) {
+      kvcache_remove(shard, entry);
+    }
+    free(shard->sketch);
+    pthread_mutex_destroy(&shard->lock);
+  }
+}
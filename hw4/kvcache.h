@@ -0,0 +1,110 @@
+#ifndef __KV_CACHE__
+#define __KV_CACHE__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "kvconstants.h"
+#include "kvhash.h"
+
+/* KVCache is a bounded, in-memory cache of <key, value> entries which may be
+ * shared by many threads.
+ *
+ * Entries are spread over KVCACHE_SHARDS shards by the hash of their key (see
+ * kvhash.h), each with its own lock, hash table and list of entries from most
+ * to least recently used. A shard may hold at most 1 / KVCACHE_SHARDS of the
+ * cache's capacity in bytes (counting keys, values and bookkeeping); once it
+ * is full, its least recently used entries are evicted to make room.
+ *
+ * A value read from the backing store may be stale by the time it is cached,
+ * if the key was written in between. To prevent this, a lookup which misses
+ * returns a ticket, the version of the key's shard, which every kvcache_put
+ * and kvcache_del advances. kvcache_fill only caches a value if its ticket is
+ * still current, so a fill which raced with a write of any key in the same
+ * shard is dropped.
+ *
+ * A cache may be created with TinyLFU admission, so that a burst of keys
+ * which are read once (such as a scan) does not flush out the hot ones. Each
+ * shard then estimates how often every key is looked up with a count-min
+ * sketch: KVCACHE_SKETCH_DEPTH rows of small saturating counters, one per
+ * row incremented for each lookup, of which the smallest is the estimate.
+ * All counters are halved every KVCACHE_SKETCH_PERIOD lookups per counter in
+ * a row, so the estimates follow changes in popularity. A new entry which
+ * would evict others is only admitted if its key is looked up more often than
+ * that of the least recently used entry.
+ */
+
+/* The number of independently locked parts of a cache. */
+#define KVCACHE_SHARDS 16
+
+/* The number of rows of a frequency sketch. */
+#define KVCACHE_SKETCH_DEPTH 4
+
+/* The largest value of a sketch counter. */
+#define KVCACHE_SKETCH_MAX 15
+
+/* The number of lookups, per counter in a row, after which all counters of a
+ * sketch are halved. */
+#define KVCACHE_SKETCH_PERIOD 10
+
+/* A single cached entry. */
+typedef struct kvcache_entry {
+  char *value;                /* The null terminated value. */
+  size_t size;                /* The bytes charged to the shard for this entry. */
+  uint64_t hash;              /* The hash of KEY, which picks its shard. */
+  struct kvcache_entry *prev; /* The next more recently used entry. */
+  struct kvcache_entry *next; /* The next less recently used entry. */
+  UT_hash_handle hh;          /* Makes this structure hashable by KEY. */
+  char key[];                 /* The null terminated key. */
+} kvcache_entry_t;
+
+/* One shard of a cache. */
+typedef struct {
+  pthread_mutex_t lock;     /* A lock used to protect this shard. */
+  kvcache_entry_t *table;   /* The entries of this shard, by key. */
+  kvcache_entry_t *lru;     /* The entries, from most to least recently used. */
+  size_t size;              /* The bytes charged for all entries. */
+  uint64_t version;         /* Advanced by every write to this shard. */
+  unsigned long hits;       /* Lookups which found their key. */
+  unsigned long misses;     /* Lookups which did not. */
+  unsigned long evictions;  /* Entries evicted to make room for others. */
+  unsigned long rejections; /* Entries not admitted, being rarer than the victim. */
+  uint8_t *sketch;          /* The frequency sketch, if admission is enabled. */
+  unsigned long samples;    /* Lookups counted since the sketch was last halved. */
+} kvcache_shard_t;
+
+/* A KVCache. */
+typedef struct {
+  size_t shard_capacity; /* The bytes each shard may hold. */
+  size_t sketch_width;   /* The number of counters in each row of a sketch. */
+  kvcache_shard_t shards[KVCACHE_SHARDS];
+} kvcache_t;
+
+/* Initializes CACHE to hold at most CAPACITY bytes, with TinyLFU admission
+ * if ADMISSION is set. A cache with a capacity of 0 never holds anything. */
+int kvcache_init(kvcache_t *cache, size_t capacity, bool admission);
+
+/* The functions below take the kvhash64 of KEY as HASH, so that a caller
+ * which already knows it (see kvrequest_t) need not compute it again. */
+
+/* Copies the value of KEY into VALUE if it is cached and returns true. Else
+ * returns false and sets TICKET for a later kvcache_fill. */
+bool kvcache_get(kvcache_t *cache, char *key, uint64_t hash, char *value, uint64_t *ticket);
+
+/* Caches VALUE for KEY, which was read from the backing store after
+ * kvcache_get handed out TICKET, unless KEY's shard has since been written. */
+void kvcache_fill(kvcache_t *cache, char *key, uint64_t hash, char *value, uint64_t ticket);
+
+/* Caches VALUE as the new value of KEY. */
+void kvcache_put(kvcache_t *cache, char *key, uint64_t hash, char *value);
+
+/* Removes KEY from CACHE, if present. */
+void kvcache_del(kvcache_t *cache, char *key, uint64_t hash);
+
+/* Prints the counters of CACHE as text metrics, each named NAME_counter. */
+void kvcache_print(kvcache_t *cache, FILE *out, const char *name);
+
+void kvcache_destroy(kvcache_t *cache);
+
+#endif
@@ -26,12 +26,36 @@
 /* Default timeout (in seconds) for a socket */
 #define TIMEOUT 10
 
+/* Time (in seconds) a persistent connection may stay idle between requests
+ * before the server closes it. */
+#define KEEPALIVE_TIMEOUT 5
+
 /* Maximum length for keys and values. */
 #define MAX_KEYLEN 1024
 #define MAX_VALLEN 1024
 
-/* Maximum size for a KVResponse body. */
-#define KVRES_BODY_MAX_SIZE 40
+/* Maximum length for a value sent as the body of a request rather than in its
+ * URL, which may be far longer than MAX_VALLEN (see kvmessage.h). */
+#define MAX_BLOBLEN (64 * 1024 * 1024)
+
+/* Maximum length for a transaction ID, as a decimal string. */
+#define MAX_TXNLEN 20
+
+/* Maximum length for the operations of a batch request. */
+#define MAX_BATCHLEN (16 * 1024)
+
+/* The number of entries a page of a scan holds by default, and at most. */
+#define SCAN_DEFAULT_LIMIT 100
+#define SCAN_MAX_LIMIT 1000
+
+/* Maximum length for the limit of a scan, as a decimal string. */
+#define MAX_LIMITLEN 10
+
+/* Maximum length for the entries of a page of a scan, which fit in a batch. */
+#define MAX_SCANLEN MAX_BATCHLEN
+
+/* Maximum size for a KVResponse body, which may hold a value. */
+#define KVRES_BODY_MAX_SIZE MAX_VALLEN
 
 /* Maximum size for a valid URL path (i.e. "register") */
 #define PATH_MAX_SIZE 8
@@ -53,6 +77,8 @@
 #define ERRMSG_NOT_AT_CAPACITY "error: follower_capacity not yet full"
 #define ERRMSG_FOLLOWER_CAPACITY "error: follower capacity already full"
 #define ERRMSG_GENERIC_ERROR "error: unable to process request"
+#define ERRMSG_LOCKED "error: key locked by another transaction"
+#define ERRMSG_STREAMED "error: value too long for a message"
 
 /* Error types/values */
 /* Error for invalid key length. */
@@ -66,6 +92,13 @@
 /* Error returned if error was encountered accessing a file.
  * NOTE: You shouldn't have to use this one. */
 #define ERR_FILACCESS -17
+/* Error for a key which another transaction held for too long. */
+#define ERR_LOCKED -18
+/* Error for a value which is too long to be sent in a message, and must be
+ * streamed instead. */
+#define ERR_STREAMED -19
+/* Error for a file whose path would be longer than its buffer allows. */
+#define ERR_FILLEN -20
 
 /* Convert an error code to an error message.
  * GETMSG(ERR_NOKEY) --> ERRMSG_NO_KEY --> "error: no key"
@@ -73,13 +106,22 @@
 #define GETMSG(error)                                                                              \
   ((error == ERR_KEYLEN)                                                                           \
        ? ERRMSG_KEY_LEN                                                                            \
-       : ((error == ERR_VALLEN) ? ERRMSG_VAL_LEN                                                   \
-                                : ((error == ERR_NOKEY) ? ERRMSG_NO_KEY : ERRMSG_GENERIC_ERROR)))
+       : ((error == ERR_VALLEN)                                                                    \
+              ? ERRMSG_VAL_LEN                                                                     \
+              : ((error == ERR_NOKEY)                                                              \
+                     ? ERRMSG_NO_KEY                                                               \
+                     : ((error == ERR_LOCKED)                                                      \
+                            ? ERRMSG_LOCKED                                                        \
+                            : ((error == ERR_STREAMED) ? ERRMSG_STREAMED : ERRMSG_GENERIC_ERROR)))))
 
 /* Paths for API endpoints. */
 #define COMMIT_PATH MSG_COMMIT
 #define ABORT_PATH "abort"
 #define REGISTER_PATH "register"
+#define METRICS_PATH "metrics"
+#define BATCH_PATH "batch"
+#define SCAN_PATH "scan"
+#define BLOB_PATH "blob"
 
 /* Message types for use by KVMessage. */
 typedef enum {
@@ -91,6 +133,11 @@ typedef enum {
   REGISTER,
   COMMIT,
   ABORT,
+  METRICS,
+  BATCH,
+  SCAN,
+  BLOB,
+  PUTBLOB,
   /* Responses */
   GETRESP,
   SUCCESS,
@@ -118,4 +165,25 @@ static inline uint64_t strhash64(const char *str) {
 
 static inline bool is_empty_str(const char *str) { return str[0] == '\0'; }
 
+/* A string of LENGTH bytes at DATA, which is not null terminated and points
+ * into memory owned by someone else (such as a receive buffer). */
+typedef struct {
+  const char *data;
+  size_t length;
+} strview_t;
+
+/* Returns true if VIEW holds exactly the string STR. */
+static inline bool strview_equals(strview_t view, const char *str) {
+  return strlen(str) == view.length && !memcmp(view.data, str, view.length);
+}
+
+/* Copies VIEW to DEST as a null terminated string, truncated to MAXLEN
+ * characters. */
+static inline void strview_copy(char *dest, strview_t view, size_t maxlen) {
+  size_t length = min(view.length, maxlen);
+  if (length > 0)
+    memcpy(dest, view.data, length);
+  dest[length] = '\0';
+}
+
 #endif
@@ -1,73 +1,307 @@
+#include <errno.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
 
+#include "histogram.h"
 #include "libhttp.h"
 #include "liburl.h"
 #include "kvmessage.h"
+#include "stats.h"
 
-/* Receives an HTTP request from socket SOCKFD and decodes it into KVREQ.
- * Returns false if there is an error. */
-bool kvrequest_receive(kvrequest_t *kvreq, int sockfd) {
+/* Decodes the transaction ID in TXN, a decimal string, into KVREQ, or sets it
+ * to 0 if TXN is empty. Returns false if TXN is not a valid ID. */
+static bool kvrequest_decode_txid(kvrequest_t *kvreq, strview_t txn) {
+  char buf[MAX_TXNLEN + 1], *end;
+  kvreq->txid = 0;
+  if (txn.length == 0)
+    return true;
+  if (txn.length > MAX_TXNLEN)
+    return false;
+  strview_copy(buf, txn, MAX_TXNLEN);
+  errno = 0;
+  kvreq->txid = strtoull(buf, &end, 10);
+  return *end == '\0' && buf[0] != '-' && errno == 0;
+}
+
+/* Decodes the page size in LIMIT, a decimal string, into KVREQ, or sets it to
+ * SCAN_DEFAULT_LIMIT if LIMIT is empty. A size above SCAN_MAX_LIMIT is
+ * lowered to it. Returns false if LIMIT is not a positive number. */
+static bool kvrequest_decode_limit(kvrequest_t *kvreq, strview_t limit) {
+  char buf[MAX_LIMITLEN + 1], *end;
+  unsigned long value;
+  kvreq->limit = SCAN_DEFAULT_LIMIT;
+  if (limit.length == 0)
+    return true;
+  if (limit.length > MAX_LIMITLEN)
+    return false;
+  strview_copy(buf, limit, MAX_LIMITLEN);
+  value = strtoul(buf, &end, 10);
+  if (*end != '\0' || buf[0] == '-' || value == 0)
+    return false;
+  kvreq->limit = min(value, SCAN_MAX_LIMIT);
+  return true;
+}
+
+/* Copies VIEW, truncated to MAXLEN characters, into ARENA as a null
+ * terminated string and returns the copy. An empty VIEW takes no space. */
+static char *kvarena_copy(kvarena_t *arena, strview_t view, size_t maxlen) {
+  char *copy = arena->data + arena->used;
+  if (view.length == 0)
+    return "";
+  strview_copy(copy, view, maxlen);
+  arena->used += min(view.length, maxlen) + 1;
+  return copy;
+}
+
+/* Decodes the HTTP request REQ into KVREQ. Returns false if there is an
+ * error. The key and value are the only parts of REQ which are copied, into
+ * the arena of KVREQ; the operations of a batch, and a large value (see
+ * kvmessage.h), are left in the body of REQ. */
+bool kvrequest_decode(kvrequest_t *kvreq, http_request_t *req) {
   bool success = false;
   kvreq->type = EMPTY;
+  kvreq->binary = false;
+  kvreq->batch.data = NULL;
+  kvreq->batch.length = 0;
+  kvreq->accepts_binary = strview_equals(req->upgrade, KVFRAME_PROTOCOL);
+  kvreq->large = false;
+  kvreq->blob_fd = -1;
+  kvreq->key = kvreq->val = "";
+  kvreq->arena->used = 0;
+  http_body_init(&kvreq->body, -1, req->body, req->chunked, req->content_length);
 
-  http_request_t req;
-  url_params_t params;
-  zero_params(&params);
-
-  success = http_request_receive(&req, sockfd);
-  if (!success)
-    goto error;
-  success = url_decode(&params, req.path);
+  url_views_t params;
+  success = url_decode(&params, req->path.data, req->path.length);
   if (!success)
     goto error;
 
-  switch (req.method) {
+  switch (req->method) {
   case GET: {
-    kvreq->type = is_empty_str(params.key) ? INDEX : GETREQ;
+    if (strview_equals(params.path, METRICS_PATH))
+      kvreq->type = METRICS;
+    else if (strview_equals(params.path, SCAN_PATH))
+      kvreq->type = SCAN;
+    else if (strview_equals(params.path, BLOB_PATH) && params.key.length > 0)
+      kvreq->type = BLOB;
+    else
+      kvreq->type = params.key.length == 0 ? INDEX : GETREQ;
     break;
   }
   case PUT: {
-    if (is_empty_str(params.key) || is_empty_str(params.val))
+    if (params.key.length == 0)
       goto error;
     kvreq->type = PUTREQ;
+    if (req->streamed || req->body.length > 0) {
+      /* The value is carried in the body instead (see kvmessage.h). */
+      if (params.val.length > 0)
+        goto error;
+      if (req->streamed || req->body.length > MAX_VALLEN)
+        kvreq->large = true;
+      else
+        params.val = req->body;
+    } else if (params.val.length == 0) {
+      goto error;
+    }
     break;
   }
   case DELETE: {
-    if (is_empty_str(params.key))
+    if (params.key.length == 0)
       goto error;
     kvreq->type = DELREQ;
     break;
   }
   case POST: {
-    if (is_empty_str(params.path))
+    if (params.path.length == 0)
       goto error;
-    if (!strcmp(params.path, REGISTER_PATH)) {
-      if (is_empty_str(params.key) || is_empty_str(params.val))
+    if (strview_equals(params.path, REGISTER_PATH)) {
+      if (params.key.length == 0 || params.val.length == 0)
         goto error;
       kvreq->type = REGISTER;
-    } else if (!strcmp(params.path, COMMIT_PATH)) {
+    } else if (strview_equals(params.path, COMMIT_PATH)) {
       kvreq->type = COMMIT;
-    } else if (!strcmp(params.path, ABORT_PATH)) {
+    } else if (strview_equals(params.path, ABORT_PATH)) {
       kvreq->type = ABORT;
+    } else if (strview_equals(params.path, BATCH_PATH)) {
+      if (req->body.length == 0)
+        goto error;
+      kvreq->type = BATCH;
+      kvreq->batch = req->body;
     }
     break;
   }
   default:
     goto error;
   }
-  strcpy(kvreq->key, params.key);
-  strcpy(kvreq->val, params.val);
+  kvreq->limit = 0;
+  if (kvreq->type == SCAN) {
+    /* The prefix of a scan is carried in place of the value. */
+    if (params.prefix.length > MAX_KEYLEN || !kvrequest_decode_limit(kvreq, params.limit))
+      goto error;
+    params.val = params.prefix;
+  }
+  kvreq->key = kvarena_copy(kvreq->arena, params.key, MAX_KEYLEN);
+  kvreq->val = kvarena_copy(kvreq->arena, params.val, MAX_VALLEN);
+  kvreq->hash = kvhash_str(kvreq->key);
+  kvreq->keep_alive = req->keep_alive;
+  if (!kvrequest_decode_txid(kvreq, params.txn))
+    goto error;
+  /* Only a large value may be left to be read from the connection. */
+  if (req->streamed && !kvreq->large)
+    goto error;
 
   return true;
 
 error:
+  kvreq->type = EMPTY;
   return false;
 }
 
+/* Writes the header of a binary frame of TYPE for transaction TXID, holding
+ * KEY_LENGTH bytes of key and VAL_LENGTH bytes of value, to FRAME. */
+static void kvframe_write_header(char *frame, msgtype_t type, uint64_t txid, size_t key_length,
+                                 size_t val_length) {
+  frame[0] = (char)KVFRAME_MAGIC;
+  frame[1] = type;
+  frame[2] = key_length >> 8;
+  frame[3] = key_length & 0xff;
+  frame[4] = val_length >> 8;
+  frame[5] = val_length & 0xff;
+  for (int i = 0; i < 8; i++)
+    frame[6 + i] = txid >> (56 - 8 * i);
+}
+
+/* Parses the binary frame at the start of the LENGTH bytes at DATA, pointing
+ * KEY and VAL into DATA. Returns as kvframe_length does. */
+static ssize_t kvframe_parse(const char *data, size_t length, msgtype_t *type, uint64_t *txid,
+                             strview_t *key, strview_t *val) {
+  const unsigned char *header = (const unsigned char *)data;
+  if (length > 0 && header[0] != KVFRAME_MAGIC)
+    return -1;
+  if (length < KVFRAME_HEADER_SIZE)
+    return 0;
+  *type = header[1];
+  key->length = header[2] << 8 | header[3];
+  val->length = header[4] << 8 | header[5];
+  *txid = 0;
+  for (int i = 0; i < 8; i++)
+    *txid = *txid << 8 | header[6 + i];
+  if (*type >= EMPTY || key->length > MAX_KEYLEN ||
+      val->length > (*type == BATCH ? MAX_BATCHLEN : MAX_VALLEN))
+    return -1;
+  if (length < KVFRAME_HEADER_SIZE + key->length + val->length)
+    return 0;
+  key->data = data + KVFRAME_HEADER_SIZE;
+  val->data = key->data + key->length;
+  return KVFRAME_HEADER_SIZE + key->length + val->length;
+}
+
+ssize_t kvframe_length(const char *data, size_t length) {
+  msgtype_t type;
+  uint64_t txid;
+  strview_t key, val;
+  return kvframe_parse(data, length, &type, &txid, &key, &val);
+}
+
+/* Parses the binary frame at the start of the LENGTH bytes at DATA into
+ * KVREQ. Only the requests a leader sends its followers may be framed. The
+ * operations of a batch are carried in place of the value, and left in
+ * DATA. */
+static ssize_t kvrequest_parse_frame(kvrequest_t *kvreq, const char *data, size_t length) {
+  msgtype_t type;
+  strview_t key, val;
+  ssize_t ret = kvframe_parse(data, length, &type, &kvreq->txid, &key, &val);
+  if (ret <= 0)
+    return ret;
+  switch (type) {
+  case GETREQ:
+  case DELREQ:
+    if (key.length == 0)
+      return -1;
+    break;
+  case PUTREQ:
+    if (key.length == 0 || val.length == 0)
+      return -1;
+    break;
+  case COMMIT:
+  case ABORT:
+    break;
+  case BATCH:
+    if (key.length > 0 || val.length == 0)
+      return -1;
+    kvreq->batch = val;
+    val.length = 0;
+    break;
+  default:
+    return -1;
+  }
+  kvreq->type = type;
+  kvreq->arena->used = 0;
+  kvreq->key = kvarena_copy(kvreq->arena, key, MAX_KEYLEN);
+  kvreq->val = kvarena_copy(kvreq->arena, val, MAX_VALLEN);
+  kvreq->hash = kvhash_str(kvreq->key);
+  kvreq->keep_alive = true;
+  return ret;
+}
+
+/* Continues parsing the HTTP request at the start of the LENGTH bytes at DATA
+ * with PARSER, or the binary frame there, and decodes it into KVREQ once it is
+ * complete. Returns the length of the request, 0 if DATA does not yet hold all
+ * of it, or -1 if there is an error (in which case KVREQ->type is EMPTY). */
+ssize_t kvrequest_parse(kvrequest_t *kvreq, http_parser_t *parser, const char *data,
+                        size_t length) {
+  http_request_t req;
+  ssize_t ret;
+  kvreq->type = EMPTY;
+  kvreq->txid = 0;
+  kvreq->limit = 0;
+  kvreq->binary = kvframe_detect(data, length);
+  kvreq->accepts_binary = false;
+  kvreq->batch.data = NULL;
+  kvreq->batch.length = 0;
+  kvreq->large = false;
+  kvreq->blob_fd = -1;
+  kvreq->body.done = true;
+  kvreq->key = kvreq->val = "";
+  if (kvreq->binary)
+    return kvrequest_parse_frame(kvreq, data, length);
+  ret = http_request_parse(parser, &req, data, length);
+  if (ret > 0 && !kvrequest_decode(kvreq, &req))
+    return -1;
+  return ret;
+}
+
+/* Receives an HTTP request or binary frame from socket SOCKFD into the SIZE
+ * bytes at BUF and decodes it into KVREQ. A large value is left to be read
+ * from SOCKFD. Returns false if there is an error. */
+bool kvrequest_receive(kvrequest_t *kvreq, int sockfd, char *buf, size_t size) {
+  http_parser_t parser;
+  size_t length = 0;
+  ssize_t bytes_read, ret = 0;
+  uint64_t start, parse_us = 0;
+  http_parser_init(&parser);
+  kvreq->type = EMPTY;
+  kvreq->binary = kvreq->large = false;
+  kvreq->blob_fd = -1;
+  kvreq->sockfd = sockfd;
+  while (ret == 0 && length < size) {
+    bytes_read = read(sockfd, buf + length, size - length);
+    if (bytes_read <= 0)
+      return false;
+    length += bytes_read;
+    start = histogram_now();
+    ret = kvrequest_parse(kvreq, &parser, buf, length);
+    parse_us += histogram_now() - start;
+  }
+  if (ret > 0)
+    stats_record(STATS_PARSE, parse_us);
+  kvreq->body.fd = sockfd;
+  return ret > 0;
+}
+
 /* Maps HTTP response codes to their corresponding msgtype_t for KVMessages.
  * Returns EMPTY if the status code isn't supported. */
 static msgtype_t kvresponse_get_status_code(short status) {
@@ -87,30 +321,56 @@ static msgtype_t kvresponse_get_status_code(short status) {
   }
 }
 
-/* Receives an HTTP response from socket SOCKFD and decodes into KVRES.
- * Returns false if there is an error. */
-bool kvresponse_receive(kvresponse_t *kvres, int sockfd) {
-  bool success = false;
-
+ssize_t kvresponse_parse(kvresponse_t *kvres, http_parser_t *parser, const char *data,
+                         size_t length) {
   http_response_t res;
-  success = http_response_receive(&res, sockfd);
-  if (!success)
-    goto error;
-
-  kvres->type = kvresponse_get_status_code(res.status);
-  if (kvres->type == EMPTY)
-    goto error;
-  strcpy(kvres->body, res.body);
-
-  return true;
+  strview_t key;
+  uint64_t txid;
+  ssize_t ret;
+  kvres->type = EMPTY;
+  if (kvframe_detect(data, length)) {
+    ret = kvframe_parse(data, length, &kvres->type, &txid, &key, &res.body);
+    if (ret > 0 && (kvres->type < GETRESP || kvres->type >= EMPTY || key.length > 0))
+      ret = -1;
+  } else {
+    ret = http_response_parse(parser, &res, data, length);
+    /* A streamed body does not fit into a KVResponse. */
+    if (ret > 0 && !res.streamed)
+      kvres->type = kvresponse_get_status_code(res.status);
+  }
+  if (ret <= 0 || kvres->type == EMPTY) {
+    kvres->type = EMPTY;
+    return ret == 0 ? 0 : -1;
+  }
+  strview_copy(kvres->body, res.body, KVRES_BODY_MAX_SIZE);
+  return ret;
+}
 
-error:
-  return false;
+/* Receives an HTTP response or binary frame from socket SOCKFD and decodes
+ * into KVRES. Returns false if there is an error. */
+bool kvresponse_receive(kvresponse_t *kvres, int sockfd) {
+  char buf[HTTP_RECV_MAX_SIZE];
+  http_parser_t parser;
+  size_t length = 0;
+  ssize_t bytes_read, ret = 0;
+  http_parser_init(&parser);
+  kvres->type = EMPTY;
+  while (ret == 0 && length < sizeof(buf)) {
+    bytes_read = read(sockfd, buf + length, sizeof(buf) - length);
+    if (bytes_read <= 0)
+      return false;
+    length += bytes_read;
+    ret = kvresponse_parse(kvres, &parser, buf, length);
+  }
+  return ret > 0;
 }
 
 http_method_t http_method_for_request_type(msgtype_t type) {
   switch (type) {
   case GETREQ:
+  case METRICS:
+  case SCAN:
+  case BLOB:
     return GET;
   case PUTREQ:
     return PUT;
@@ -119,6 +379,7 @@ http_method_t http_method_for_request_type(msgtype_t type) {
   case REGISTER:
   case COMMIT:
   case ABORT:
+  case BATCH:
     return POST;
   default:
     return INVALID;
@@ -133,32 +394,106 @@ char *path_for_request_type(msgtype_t type) {
     return "commit";
   case ABORT:
     return "abort";
+  case METRICS:
+    return "metrics";
+  case BATCH:
+    return "batch";
+  case SCAN:
+    return "scan";
+  case BLOB:
+    return "blob";
   default:
     return "";
   }
 }
 
-/* Sends REQ on socket SOCKFD. Returns the number of bytes which were sent, and
- * 1 on error. */
+/* Sends the message in OUT, built by ENCODED, on SOCKFD and frees OUT.
+ * Returns the number of bytes which were sent, or -1 on error. */
+static int kvmessage_send_buffer(http_buffer_t *out, bool encoded, int sockfd) {
+  int ret = out->length;
+  if (!encoded || http_buffer_send(out, sockfd) < 0)
+    ret = -1;
+  http_buffer_free(out);
+  return ret;
+}
+
+/* Sends REQ on socket SOCKFD, followed by the large value in its BLOB_FD, if
+ * any. Returns the number of bytes which were sent, and -1 on error. */
 int kvrequest_send(kvrequest_t *kvreq, int sockfd) {
-  http_method_t method = http_method_for_request_type(kvreq->type);
-  if (method == INVALID)
+  http_buffer_t out;
+  int ret;
+  http_buffer_init(&out);
+  ret = kvmessage_send_buffer(&out, kvrequest_encode(kvreq, &out), sockfd);
+  if (ret < 0 || kvreq->blob_fd < 0)
+    return ret;
+  if (http_sendfile(sockfd, kvreq->blob_fd, 0, kvreq->blob_length) < 0)
     return -1;
+  return ret + kvreq->blob_length;
+}
 
-  url_params_t params;
-  strcpy(params.path, path_for_request_type(kvreq->type));
-  strcpy(params.key, kvreq->key);
-  strcpy(params.val, kvreq->val);
+bool kvrequest_encode(kvrequest_t *kvreq, http_buffer_t *out) {
+  char *method = http_method_to_string(http_method_for_request_type(kvreq->type)), *path;
+  char txn[24], limit[16], length[48];
+  url_views_t params;
+  if (!method)
+    return false;
 
-  char url[HTTP_MSG_MAX_SIZE + 1];
-  url_encode(url, &params);
+  /* The key and value go straight from where KVREQ points into OUT. */
+  memset(&params, 0, sizeof(params));
+  path = path_for_request_type(kvreq->type);
+  params.path.data = path;
+  params.path.length = strlen(path);
+  params.key.data = kvreq->key;
+  params.key.length = strlen(kvreq->key);
+  if (kvreq->type == SCAN) {
+    params.prefix.data = kvreq->val;
+    params.prefix.length = strlen(kvreq->val);
+    if (kvreq->limit) {
+      params.limit.data = limit;
+      params.limit.length = sprintf(limit, "%u", kvreq->limit);
+    }
+  } else {
+    params.val.data = kvreq->val;
+    params.val.length = strlen(kvreq->val);
+  }
+  if (kvreq->txid) {
+    params.txn.data = txn;
+    params.txn.length = sprintf(txn, "%" PRIu64, kvreq->txid);
+  }
 
-  http_outbound_t msg;
-  if (!http_outbound_init_request(&msg, sockfd, method, url))
-    return -1;
+  http_buffer_append_string(out, method);
+  http_buffer_append(out, " ", 1);
+  url_encode(out, &params);
+  http_buffer_append_string(out, " HTTP/1.1\r\n");
+  if (kvreq->accepts_binary)
+    http_buffer_append_string(out, "Upgrade: " KVFRAME_PROTOCOL "\r\n");
+  if (kvreq->type == BATCH || kvreq->blob_fd >= 0) {
+    sprintf(length, "Content-Length: %zu\r\n",
+            kvreq->type == BATCH ? kvreq->batch.length : kvreq->blob_length);
+    http_buffer_append_string(out, length);
+  }
+  http_buffer_append(out, "\r\n", 2);
+  if (kvreq->type == BATCH)
+    http_buffer_append(out, kvreq->batch.data, kvreq->batch.length);
+  return true;
+}
+
+int kvrequest_send_frame(kvrequest_t *kvreq, int sockfd) {
+  http_buffer_t out;
+  http_buffer_init(&out);
+  return kvmessage_send_buffer(&out, kvrequest_encode_frame(kvreq, &out), sockfd);
+}
 
-  http_outbound_end_headers(&msg);
-  return http_outbound_send(&msg);
+bool kvrequest_encode_frame(kvrequest_t *kvreq, http_buffer_t *out) {
+  char header[KVFRAME_HEADER_SIZE];
+  strview_t key = {kvreq->key, strlen(kvreq->key)}, val = {kvreq->val, strlen(kvreq->val)};
+  if (kvreq->type == BATCH)
+    val = kvreq->batch;
+  kvframe_write_header(header, kvreq->type, kvreq->txid, key.length, val.length);
+  http_buffer_append(out, header, KVFRAME_HEADER_SIZE);
+  http_buffer_append(out, key.data, key.length);
+  http_buffer_append(out, val.data, val.length);
+  return true;
 }
 
 int http_code_for_response_type(msgtype_t type) {
@@ -178,29 +513,106 @@ int http_code_for_response_type(msgtype_t type) {
   }
 }
 
+/* Builds the HTTP response for KVRES into MSG, to be sent on SOCKFD. Returns
+ * false if KVRES has no valid response type. */
 int kvresponse_send(kvresponse_t *kvres, int sockfd) {
+  http_buffer_t out;
+  http_buffer_init(&out);
+  return kvmessage_send_buffer(&out, kvresponse_encode(kvres, &out), sockfd);
+}
+
+bool kvresponse_encode(kvresponse_t *kvres, http_buffer_t *out) {
   int code = http_code_for_response_type(kvres->type);
-  if (code < 0)
-    return -1;
+  return code >= 0 && http_encode_response(out, code, NULL, kvres->body, strlen(kvres->body));
+}
 
-  http_outbound_t msg;
-  if (!http_outbound_init_response(&msg, sockfd, code))
+bool kvresponse_encode_frame(kvresponse_t *kvres, http_buffer_t *out) {
+  char header[KVFRAME_HEADER_SIZE];
+  size_t body_length = strlen(kvres->body);
+  if (kvres->type < GETRESP || kvres->type >= EMPTY)
+    return false;
+  kvframe_write_header(header, kvres->type, 0, 0, body_length);
+  http_buffer_append(out, header, KVFRAME_HEADER_SIZE);
+  http_buffer_append(out, kvres->body, body_length);
+  return true;
+}
+
+/* Returns the length of the word at the start of the LENGTH bytes at DATA,
+ * which ends at a space or the end of DATA. */
+static size_t kvbatch_word(const char *data, size_t length) {
+  const char *end = memchr(data, ' ', length);
+  return end ? (size_t)(end - data) : length;
+}
+
+int kvbatch_next(strview_t batch, size_t *offset, kvbatch_op_t *op) {
+  const char *line, *end;
+  size_t length, word;
+  do {
+    if (*offset >= batch.length)
+      return 0;
+    line = batch.data + *offset;
+    end = memchr(line, '\n', batch.length - *offset);
+    length = end ? (size_t)(end - line) : batch.length - *offset;
+    *offset += length + (end != NULL);
+    if (length > 0 && line[length - 1] == '\r')
+      length--;
+  } while (length == 0);
+
+  word = kvbatch_word(line, length);
+  if (word == 3 && !memcmp(line, "PUT", 3))
+    op->type = PUTREQ;
+  else if (word == 6 && !memcmp(line, "DELETE", 6))
+    op->type = DELREQ;
+  else
     return -1;
+  if (word == length)
+    return -1;
+  line += word + 1;
+  length -= word + 1;
 
-  char lenbuf[10] = "0";
-  if (strlen(kvres->body) > 0)
-    sprintf(lenbuf, "%ld", strlen(kvres->body));
-  http_outbound_add_header(&msg, "Content-Length", lenbuf);
-  http_outbound_end_headers(&msg);
-  http_outbound_add_string(&msg, kvres->body);
+  op->key.data = line;
+  op->key.length = kvbatch_word(line, length);
+  op->val.data = line + op->key.length;
+  op->val.length = 0;
+  if (op->key.length < length) {
+    op->val.data++;
+    op->val.length = length - op->key.length - 1;
+  }
+  if (op->key.length == 0 || op->key.length > MAX_KEYLEN)
+    return -1;
+  if (op->type == PUTREQ ? op->val.length == 0 || op->val.length > MAX_VALLEN
+                         : op->val.length > 0)
+    return -1;
+  return 1;
+}
 
-  return http_outbound_send(&msg);
+void kvbatch_append(http_buffer_t *out, kvbatch_op_t *op) {
+  if (op->type == PUTREQ) {
+    http_buffer_append(out, "PUT ", 4);
+    http_buffer_append(out, op->key.data, op->key.length);
+    http_buffer_append(out, " ", 1);
+    http_buffer_append(out, op->val.data, op->val.length);
+  } else {
+    http_buffer_append(out, "DELETE ", 7);
+    http_buffer_append(out, op->key.data, op->key.length);
+  }
+  http_buffer_append(out, "\n", 1);
 }
 
 void kvrequest_clear(kvrequest_t *req) {
   req->type = EMPTY;
-  memset(req->key, 0, MAX_KEYLEN + 1);
-  memset(req->val, 0, MAX_VALLEN + 1);
+  req->keep_alive = req->binary = req->accepts_binary = false;
+  req->batch.data = NULL;
+  req->batch.length = 0;
+  req->key = req->val = "";
+  req->hash = kvhash_str(req->key);
+  req->txid = 0;
+  req->limit = 0;
+  req->large = false;
+  req->blob_fd = req->sockfd = -1;
+  req->blob_length = 0;
+  req->arena = NULL;
+  http_body_init(&req->body, -1, (strview_t){NULL, 0}, false, 0);
 }
 
 void kvresponse_clear(kvresponse_t *res) {
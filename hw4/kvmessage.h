@@ -1,34 +1,199 @@
 #ifndef __KV_MESSAGE__
 #define __KV_MESSAGE__
 
+#include <sys/types.h>
 #include "kvconstants.h"
+#include "kvhash.h"
+#include "libhttp.h"
 
 /* Structs and methods for KVRequest and KVResponse, our internal
- * representation of API messages.  */
+ * representation of API messages.
+ *
+ * The TPC messages a leader sends its followers carry the ID of the
+ * transaction they belong to, so a follower can tell the votes of concurrent
+ * transactions apart and commit or abort each on its own. Over HTTP, the ID
+ * is sent as a "txn" query parameter; a message without one belongs to
+ * transaction 0.
+ *
+ * Messages are sent as HTTP, except between a leader and its followers, which
+ * may instead use a compact binary framing. A frame is a KVFRAME_HEADER_SIZE
+ * byte header followed by the key and value (or, in a response, the body):
+ *
+ *   magic (1) | msgtype_t (1) | key length (2) | value length (2) |
+ *   transaction ID (8) | key | value
+ *
+ * with lengths and IDs in network byte order, and an ID of 0 in responses.
+ * KVFRAME_MAGIC cannot start an HTTP message, so a receiver tells the two
+ * apart by the first byte and answers in the framing it was sent. A follower
+ * offers binary framing to its leader by registering with an "Upgrade:
+ * kvframe" header; the leader then sends it every TPC and GET request as a
+ * frame, over persistent connections.
+ *
+ * A BATCH request carries many PUT and DELETE operations, which are committed
+ * together in a single transaction. Clients POST them to /batch as the body
+ * of the request, one per line:
+ *
+ *   PUT <key> <value>
+ *   DELETE <key>
+ *
+ * Keys and values may not contain spaces or line breaks. The leader forwards
+ * each follower the operations on its keys in the same form, as the body of
+ * an HTTP request or in place of the value of a frame. The operations are not
+ * copied into the KVRequest, but left in the buffer it was parsed from.
+ *
+ * A SCAN request asks for a page of the entries whose keys start with a
+ * prefix, in order of their keys. Clients send it as
+ *
+ *   GET /scan?key=<after>&prefix=<prefix>&limit=<count>
+ *
+ * all parameters optional, and are answered with at most LIMIT (by default
+ * SCAN_DEFAULT_LIMIT, and never more than SCAN_MAX_LIMIT) of the entries
+ * whose keys sort after AFTER, in the form of a batch of PUT operations, no
+ * longer than MAX_SCANLEN, so a page can be posted back to /batch as is. The
+ * status is 206 (Partial Content) if there may be more entries, which the
+ * next page, asked for with AFTER set to the last key of this one, holds,
+ * else 200. In a KVRequest, the prefix is held in place of the value. A SCAN
+ * is never framed, as it does not fit into a KVResponse.
+ *
+ * A client may instead send the value of a PUT as the body of the request,
+ * with a Content-Length or in chunked transfer coding, which lets it be up to
+ * MAX_BLOBLEN bytes long. A value of at most MAX_VALLEN bytes which arrives
+ * whole is copied into the KVRequest like one sent in the URL; any other is
+ * large, and is left in the body, to be read from the connection with
+ * http_body_read (see libhttp.h) by whoever handles the request, which must
+ * read all of it before the connection can be used for another. The leader
+ * forwards a large value to its followers as the body of an HTTP request with
+ * a Content-Length, sent from the file BLOB_FD, and never as a frame. A GET
+ * of a large value is answered with ERRMSG_STREAMED by a follower, which
+ * instead sends the value as the body of its response to
+ *
+ *   GET /blob?key=<key>
+ *
+ * (a BLOB request); the leader streams it on to its client as the body of a
+ * 200 response, so that clients GET values of any length alike. A BLOB
+ * request for a key with a short value is answered like a GET.
+ *
+ * A KVRequest holds no strings of its own: its KEY and VAL point to null
+ * terminated strings kept elsewhere, and are empty strings when absent. A
+ * received request's are copied, once, from the buffer it was parsed from
+ * into the kvarena_t ARENA of the connection it arrived on, which every parse
+ * starts over, so they only last until the next request on that connection is
+ * parsed. A request to be sent points them at its sender's own strings, which
+ * are copied, once, straight into the message. */
+
+/* The size of an arena: enough for the longest key and value, each null
+ * terminated. */
+#define KVARENA_SIZE (MAX_KEYLEN + MAX_VALLEN + 2)
+
+/* The storage for the key and value of the requests received on one
+ * connection (see above). Only the bytes in use are ever written. */
+typedef struct {
+  size_t used;
+  char data[KVARENA_SIZE];
+} kvarena_t;
+
+/* The first byte of every binary frame. */
+#define KVFRAME_MAGIC 0xCB
+
+/* The size of the header of a binary frame. */
+#define KVFRAME_HEADER_SIZE 14
+
+/* The name under which binary framing is offered in an Upgrade header. */
+#define KVFRAME_PROTOCOL "kvframe"
 
 typedef struct {
   msgtype_t type;
-  char key[MAX_KEYLEN + 1]; // May be NULL, depending on type.
-  char val[MAX_VALLEN + 1]; // May be NULL, depending on type.
+  char *key;                // Null terminated, but may be empty, depending on type (see above).
+  char *val;                // Null terminated, but may be empty, depending on type (see above).
+  bool keep_alive;          // Whether the sender will reuse its connection.
+  bool binary;              // Whether the request arrived, and is answered, as a frame.
+  bool accepts_binary;      // Whether the sender offered to receive frames (see above).
+  strview_t batch;          // The operations of a BATCH request (see above).
+  uint64_t hash;            // The kvhash64 of KEY, set when it is parsed.
+  uint64_t txid;            // The transaction a TPC message belongs to (see above).
+  unsigned int limit;       // The most entries a page of a SCAN may hold (see above).
+  bool large;               // Whether the value of a PUTREQ is too long for VAL (see above).
+  http_body_t body;         // The received body holding a large value, as yet unread.
+  int blob_fd;              // A file holding a large value to be sent, or -1.
+  size_t blob_length;       // The length of the value in BLOB_FD.
+  int sockfd;               // The connection the request arrived on, or -1, for a
+                            // response which is streamed rather than encoded.
+  kvarena_t *arena;         // Where a received KEY and VAL are kept (see above).
 } kvrequest_t;
 
+/* A single operation of a batch. KEY and VAL point into the batch. */
+typedef struct {
+  msgtype_t type; // PUTREQ or DELREQ.
+  strview_t key;
+  strview_t val;  // Empty for DELREQ.
+} kvbatch_op_t;
+
+/* Reads the operation at *OFFSET of BATCH into OP and advances *OFFSET past
+ * it. Returns 1 if an operation was read, 0 at the end of BATCH, or -1 if the
+ * operation is malformed or its key or value is too long. */
+int kvbatch_next(strview_t batch, size_t *offset, kvbatch_op_t *op);
+
+/* Appends the operation OP to the batch in OUT. */
+void kvbatch_append(http_buffer_t *out, kvbatch_op_t *op);
+
 typedef struct {
   msgtype_t type;
   char body[KVRES_BODY_MAX_SIZE + 1]; // May be NULL, depending on type.
 } kvresponse_t;
 
-/* Recieves an HTTP request on SOCKFD and unmarshalls it into a KVRequest. */
-bool kvrequest_receive(kvrequest_t *, int sockfd);
+/* Recieves an HTTP request or binary frame on SOCKFD into the SIZE bytes at
+ * BUF, which should be HTTP_RECV_MAX_SIZE, and unmarshalls it into a
+ * KVRequest, whose large value, if any, is left to be read from SOCKFD. The
+ * ARENA of the KVRequest must be set, here and below, wherever one is
+ * unmarshalled. */
+bool kvrequest_receive(kvrequest_t *, int sockfd, char *buf, size_t size);
+
+/* Unmarshalls an already parsed HTTP request into a KVRequest. */
+bool kvrequest_decode(kvrequest_t *, http_request_t *);
+
+/* Returns true if the LENGTH bytes at DATA start with a binary frame rather
+ * than an HTTP message. */
+static inline bool kvframe_detect(const char *data, size_t length) {
+  return length > 0 && (unsigned char)data[0] == KVFRAME_MAGIC;
+}
+
+/* Returns the length of the binary frame at the start of the LENGTH bytes at
+ * DATA, 0 if DATA does not yet hold all of it, or -1 if it is malformed. */
+ssize_t kvframe_length(const char *data, size_t length);
 
-/* Recieves an HTTP response on SOCKFD and unmarshalls it into a KVResponse. */
+/* Continues parsing the HTTP request (see http_request_parse) or binary frame
+ * at the start of the LENGTH bytes at DATA and unmarshalls it into a
+ * KVRequest once complete. Returns the length of the request, 0 if DATA does
+ * not yet hold all of it, or -1 if it is invalid. */
+ssize_t kvrequest_parse(kvrequest_t *, http_parser_t *parser, const char *data, size_t length);
+
+/* Like kvrequest_parse, for a KVResponse. */
+ssize_t kvresponse_parse(kvresponse_t *, http_parser_t *parser, const char *data, size_t length);
+
+/* Recieves an HTTP response or binary frame on SOCKFD and unmarshalls it into
+ * a KVResponse. */
 bool kvresponse_receive(kvresponse_t *, int sockfd);
 
 /* Marshalls a KVRequest or KVResponse into a HTTP message, respectively, and
- * sends it on SOCKFD. */
+ * sends it on SOCKFD. The large value in the BLOB_FD of a KVRequest, if any,
+ * is sent as its body. */
 int kvrequest_send(kvrequest_t *, int sockfd);
 int kvresponse_send(kvresponse_t *, int sockfd);
 
-/* Helper methods to clear a KVRequest and KVResponse, respectively. */
+/* Marshalls a KVRequest into a binary frame and sends it on SOCKFD. Returns
+ * the number of bytes sent, or -1 on error. */
+int kvrequest_send_frame(kvrequest_t *, int sockfd);
+
+/* Marshalls a KVRequest or KVResponse into a HTTP message or binary frame,
+ * respectively, and appends it to OUT. Only the headers of a KVRequest with a
+ * BLOB_FD are appended, for kvrequest_send to follow with its value. */
+bool kvrequest_encode(kvrequest_t *, http_buffer_t *out);
+bool kvrequest_encode_frame(kvrequest_t *, http_buffer_t *out);
+bool kvresponse_encode(kvresponse_t *, http_buffer_t *out);
+bool kvresponse_encode_frame(kvresponse_t *, http_buffer_t *out);
+
+/* Helper methods to clear a KVRequest and KVResponse, respectively. A cleared
+ * KVRequest has an empty KEY and VAL, and no ARENA. */
 void kvrequest_clear(kvrequest_t *);
 void kvresponse_clear(kvresponse_t *);
 
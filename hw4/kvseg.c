@@ -0,0 +1,546 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include "crc32.h"
+#include "kvconstants.h"
+#include "kvseg.h"
+
+/* Computes the checksum of record REC, whose key and value are at DATA. */
+static uint32_t kvseg_crc(kvrecord_t *rec, const char *data) {
+  uint32_t crc = crc32(0, &rec->keylen, sizeof(kvrecord_t) - sizeof(rec->crc));
+  return crc32(crc, data, rec->keylen + (rec->vallen > 0 ? rec->vallen : 0));
+}
+
+/* Returns the length of the record holding the value of ENTRY. */
+static off_t kvseg_record_size(kvseg_entry_t *entry) {
+  return sizeof(kvrecord_t) + strlen(entry->key) + entry->vallen;
+}
+
+/* Flushes the directory of SEG to disk, so that segments created within it
+ * survive a crash. Returns 0 if successful, else ERR_FILACCESS. */
+static int kvseg_sync_dir(kvseg_t *seg) {
+  int fd = open(seg->dirname, O_RDONLY | O_DIRECTORY), ret;
+  if (fd < 0)
+    return ERR_FILACCESS;
+  ret = fsync(fd) < 0 ? ERR_FILACCESS : 0;
+  close(fd);
+  return ret;
+}
+
+/* Appends the segment open as FD (or -1, if it was compacted away), with SIZE
+ * bytes of records, to SEG's list of segments. */
+static void kvseg_add(kvseg_t *seg, int fd, off_t size) {
+  if (seg->nsegs == seg->capacity) {
+    seg->capacity = seg->capacity ? seg->capacity * 2 : 4;
+    seg->files = realloc(seg->files, seg->capacity * sizeof(kvseg_file_t));
+    if (!seg->files)
+      fatal_malloc();
+  }
+  seg->files[seg->nsegs].fd = fd;
+  seg->files[seg->nsegs].size = size;
+  seg->files[seg->nsegs++].dead = 0;
+}
+
+/* Returns one more than the highest id of any segment within the directory
+ * of SEG, or 0 if there are none. Compacted segments leave gaps below it. */
+static unsigned int kvseg_count(kvseg_t *seg) {
+  unsigned int id, count = 0;
+  struct dirent *dent;
+  char *end;
+  DIR *dir = opendir(seg->dirname);
+  if (dir == NULL)
+    return 0;
+  while ((dent = readdir(dir)) != NULL) {
+    id = strtoul(dent->d_name, &end, 10);
+    if (end != dent->d_name && !strcmp(end, KVSEG_FILETYPE) && id >= count)
+      count = id + 1;
+  }
+  closedir(dir);
+  return count;
+}
+
+/* Opens segment ID of SEG, creating it if CREATE is set, and appends it to
+ * SEG's list of segments. Returns 0 if successful, else ERR_FILACCESS (ENOENT
+ * is left in errno if the segment does not exist). */
+static int kvseg_open(kvseg_t *seg, unsigned int id, bool create) {
+  char filename[MAX_FILENAME];
+  struct stat st;
+  int fd;
+  sprintf(filename, "%s/%u%s", seg->dirname, id, KVSEG_FILETYPE);
+  if ((fd = open(filename, O_RDWR | (create ? O_CREAT : 0), 0600)) < 0)
+    return ERR_FILACCESS;
+  if (fstat(fd, &st) < 0 || (create && seg->sync && kvseg_sync_dir(seg) < 0)) {
+    close(fd);
+    return ERR_FILACCESS;
+  }
+  kvseg_add(seg, fd, st.st_size);
+  return 0;
+}
+
+/* Points the index entry for the KEYLEN bytes at KEY to the value of length
+ * VALLEN at OFFSET within segment ID, adding the entry if necessary. */
+static void kvseg_index_set(kvseg_t *seg, const char *key, size_t keylen, unsigned int id,
+                            off_t offset, int vallen) {
+  kvseg_entry_t *entry;
+  HASH_FIND(hh, seg->index, key, keylen, entry);
+  if (!entry) {
+    entry = malloc(sizeof(kvseg_entry_t) + keylen + 1);
+    if (!entry)
+      fatal_malloc();
+    memcpy(entry->key, key, keylen);
+    entry->key[keylen] = '\0';
+    HASH_ADD_KEYPTR(hh, seg->index, entry->key, keylen, entry);
+  }
+  entry->seg = id;
+  entry->offset = offset;
+  entry->vallen = vallen;
+}
+
+/* Removes the index entry for the KEYLEN bytes at KEY, if there is one. */
+static void kvseg_index_remove(kvseg_t *seg, const char *key, size_t keylen) {
+  kvseg_entry_t *entry;
+  HASH_FIND(hh, seg->index, key, keylen, entry);
+  if (entry) {
+    HASH_DEL(seg->index, entry);
+    free(entry);
+  }
+}
+
+/* Reads all of segment ID of SEG into a newly allocated buffer, setting SIZE
+ * to its length. Returns the buffer, or NULL if the segment could not be
+ * read. */
+static char *kvseg_read(kvseg_t *seg, unsigned int id, size_t *size) {
+  int fd = seg->files[id].fd;
+  struct stat st;
+  off_t offset = 0;
+  ssize_t bytes_read;
+  char *buf;
+
+  if (fstat(fd, &st) < 0)
+    return NULL;
+  *size = st.st_size;
+  buf = malloc(*size + 1);
+  if (!buf)
+    fatal_malloc();
+  while (offset < *size) {
+    bytes_read = pread(fd, buf + offset, *size - offset, offset);
+    if (bytes_read <= 0)
+      break;
+    offset += bytes_read;
+  }
+  *size = offset;
+  return buf;
+}
+
+/* Returns the length of the valid record at OFFSET within the SIZE bytes at
+ * BUF, copying its header into REC, or 0 if there is none. */
+static size_t kvseg_parse(const char *buf, size_t size, off_t offset, kvrecord_t *rec) {
+  size_t datalen;
+  if (offset + sizeof(kvrecord_t) > size)
+    return 0;
+  memcpy(rec, buf + offset, sizeof(kvrecord_t));
+  if (rec->keylen == 0 || rec->keylen > MAX_KEYLEN || rec->vallen < KVSEG_TOMBSTONE ||
+      rec->vallen > MAX_VALLEN)
+    return 0;
+  datalen = rec->keylen + (rec->vallen > 0 ? rec->vallen : 0);
+  if (offset + sizeof(kvrecord_t) + datalen > size)
+    return 0;
+  if (kvseg_crc(rec, buf + offset + sizeof(kvrecord_t)) != rec->crc)
+    return 0;
+  return sizeof(kvrecord_t) + datalen;
+}
+
+/* Replays every valid record of segment ID into the index, in order. Returns
+ * the offset just past the last valid record, or -1 if the segment could not
+ * be read. */
+static off_t kvseg_replay(kvseg_t *seg, unsigned int id) {
+  kvrecord_t rec;
+  off_t offset = 0;
+  size_t size, length;
+  char *buf = kvseg_read(seg, id, &size);
+
+  if (!buf)
+    return -1;
+  while ((length = kvseg_parse(buf, size, offset, &rec)) > 0) {
+    if (rec.vallen == KVSEG_TOMBSTONE)
+      kvseg_index_remove(seg, buf + offset + sizeof(kvrecord_t), rec.keylen);
+    else
+      kvseg_index_set(seg, buf + offset + sizeof(kvrecord_t), rec.keylen, id,
+                      offset + sizeof(kvrecord_t) + rec.keylen, rec.vallen);
+    offset += length;
+  }
+  free(buf);
+  return offset;
+}
+
+/* Frees every entry of the index of SEG. */
+static void kvseg_index_clear(kvseg_t *seg) {
+  kvseg_entry_t *entry, *tmp;
+  HASH_ITER(hh, seg->index, entry, tmp) {
+    HASH_DEL(seg->index, entry);
+    free(entry);
+  }
+}
+
+/* Writes the index of SEG, which must reflect every record of its first NSEGS
+ * segments and no others, to its checkpoint. The checkpoint is written to a
+ * temporary file which is then renamed over the previous one, so a crash
+ * leaves one of them intact. Returns 0 if successful, else ERR_FILACCESS. */
+static int kvseg_checkpoint(kvseg_t *seg, unsigned int nsegs) {
+  char filename[MAX_FILENAME], tmpname[MAX_FILENAME + sizeof(KVSEG_TMPTYPE)];
+  kvseg_checkpoint_t header = {0, nsegs, HASH_COUNT(seg->index)};
+  kvseg_hint_t hint;
+  kvseg_entry_t *entry, *tmp;
+  size_t size = sizeof(header), done = 0;
+  ssize_t written;
+  char *buf, *p;
+  int fd;
+
+  HASH_ITER(hh, seg->index, entry, tmp) {
+    size += sizeof(kvseg_hint_t) + strlen(entry->key);
+  }
+  buf = malloc(size);
+  if (!buf)
+    fatal_malloc();
+  p = buf + sizeof(header);
+  HASH_ITER(hh, seg->index, entry, tmp) {
+    hint.seg = entry->seg;
+    hint.keylen = strlen(entry->key);
+    hint.vallen = entry->vallen;
+    hint.offset = entry->offset;
+    memcpy(p, &hint, sizeof(hint));
+    memcpy(p + sizeof(hint), entry->key, hint.keylen);
+    p += sizeof(hint) + hint.keylen;
+  }
+  memcpy(buf, &header, sizeof(header));
+  header.crc = crc32(0, buf + sizeof(header.crc), size - sizeof(header.crc));
+  memcpy(buf, &header, sizeof(header));
+
+  sprintf(filename, "%s/%s", seg->dirname, KVSEG_CHECKPOINT);
+  sprintf(tmpname, "%s%s", filename, KVSEG_TMPTYPE);
+  if ((fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0) {
+    free(buf);
+    return ERR_FILACCESS;
+  }
+  while (done < size && (written = write(fd, buf + done, size - done)) > 0)
+    done += written;
+  free(buf);
+  if (done < size || (seg->sync && fdatasync(fd) < 0)) {
+    close(fd);
+    unlink(tmpname);
+    return ERR_FILACCESS;
+  }
+  if (close(fd) < 0 || rename(tmpname, filename) < 0) {
+    unlink(tmpname);
+    return ERR_FILACCESS;
+  }
+  return seg->sync ? kvseg_sync_dir(seg) : 0;
+}
+
+/* Loads the checkpoint of SEG into its index, which must be empty, if there
+ * is a valid one covering fewer segments than SEG has. Returns the number of
+ * segments it covers, or 0 (leaving the index empty) if there is none. */
+static unsigned int kvseg_load_checkpoint(kvseg_t *seg) {
+  char filename[MAX_FILENAME];
+  kvseg_checkpoint_t header;
+  kvseg_hint_t hint;
+  struct stat st;
+  size_t offset = sizeof(header);
+  unsigned int count = 0;
+  char *buf;
+  int fd;
+
+  sprintf(filename, "%s/%s", seg->dirname, KVSEG_CHECKPOINT);
+  if ((fd = open(filename, O_RDONLY)) < 0)
+    return 0;
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(header)) {
+    close(fd);
+    return 0;
+  }
+  buf = malloc(st.st_size);
+  if (!buf)
+    fatal_malloc();
+  if (pread(fd, buf, st.st_size, 0) < st.st_size)
+    goto invalid;
+  memcpy(&header, buf, sizeof(header));
+  if (header.crc != crc32(0, buf + sizeof(header.crc), st.st_size - sizeof(header.crc)) ||
+      header.nsegs == 0 || header.nsegs >= seg->nsegs)
+    goto invalid;
+  while (offset + sizeof(hint) <= (size_t)st.st_size) {
+    memcpy(&hint, buf + offset, sizeof(hint));
+    offset += sizeof(hint);
+    if (hint.seg >= header.nsegs || hint.keylen == 0 || hint.keylen > MAX_KEYLEN ||
+        hint.vallen < 0 || hint.vallen > MAX_VALLEN || offset + hint.keylen > (size_t)st.st_size)
+      goto invalid;
+    kvseg_index_set(seg, buf + offset, hint.keylen, hint.seg, hint.offset, hint.vallen);
+    offset += hint.keylen;
+    count++;
+  }
+  if (offset != (size_t)st.st_size || count != header.count)
+    goto invalid;
+  free(buf);
+  close(fd);
+  return header.nsegs;
+
+invalid:
+  kvseg_index_clear(seg);
+  free(buf);
+  close(fd);
+  return 0;
+}
+
+/* Sets how much of every segment of SEG is dead from its index: whatever of
+ * a segment does not hold a live value. */
+static void kvseg_account(kvseg_t *seg) {
+  kvseg_entry_t *entry, *tmp;
+  for (unsigned int i = 0; i < seg->nsegs; i++)
+    seg->files[i].dead = seg->files[i].size;
+  HASH_ITER(hh, seg->index, entry, tmp) {
+    seg->files[entry->seg].dead -= kvseg_record_size(entry);
+  }
+}
+
+static off_t kvseg_append(kvseg_t *seg, char *key, size_t keylen, char *value, int vallen);
+
+/* Compacts segment ID of SEG, unless it is the active segment or less than
+ * KVSEG_COMPACT_PERCENT of it is dead. Its live records, and the tombstones
+ * still needed to hide records in older segments, are appended to the active
+ * segment, and once they are on disk the segment is removed. Returns 0 if
+ * successful (or there was nothing to do), else a negative error code, in
+ * which case the segment is left in place. */
+static int kvseg_compact(kvseg_t *seg, unsigned int id) {
+  char filename[MAX_FILENAME];
+  unsigned int first = seg->nsegs - 1;
+  bool oldest = true;
+  kvseg_entry_t *entry;
+  kvrecord_t rec;
+  off_t offset = 0, moved = 0;
+  size_t size, length;
+  char *buf, *key;
+
+  if (id >= seg->nsegs - 1 || seg->files[id].size == 0 ||
+      seg->files[id].dead * 100 < seg->files[id].size * KVSEG_COMPACT_PERCENT)
+    return 0;
+  for (unsigned int i = 0; i < id; i++)
+    oldest = oldest && seg->files[i].size == 0;
+  if (!(buf = kvseg_read(seg, id, &size)))
+    return ERR_FILACCESS;
+  while (moved >= 0 && (length = kvseg_parse(buf, size, offset, &rec)) > 0) {
+    key = buf + offset + sizeof(kvrecord_t);
+    HASH_FIND(hh, seg->index, key, rec.keylen, entry);
+    if (rec.vallen == KVSEG_TOMBSTONE) {
+      /* No older segment can hold a record of the key if this is the oldest,
+       * and a live key has a newer record which hides them anyway. */
+      if (!entry && !oldest &&
+          (moved = kvseg_append(seg, key, rec.keylen, NULL, KVSEG_TOMBSTONE)) >= 0)
+        seg->files[seg->nsegs - 1].dead += length;
+    } else if (entry && entry->seg == id &&
+               entry->offset == offset + (off_t)(sizeof(kvrecord_t) + rec.keylen)) {
+      moved = kvseg_append(seg, key, rec.keylen, key + rec.keylen, rec.vallen);
+      if (moved >= 0) {
+        entry->seg = seg->nsegs - 1;
+        entry->offset = moved + sizeof(kvrecord_t) + rec.keylen;
+        seg->files[id].dead += length;
+      }
+    }
+    offset += length;
+  }
+  free(buf);
+  if (moved < 0)
+    return moved;
+  /* The moved records must be on disk before the originals are dropped. */
+  for (unsigned int i = first; i < seg->nsegs; i++) {
+    if (fdatasync(seg->files[i].fd) < 0)
+      return ERR_FILACCESS;
+  }
+  /* Should the removal not survive a crash, the segment only holds records
+   * which the moved ones replace on replay. */
+  sprintf(filename, "%s/%u%s", seg->dirname, id, KVSEG_FILETYPE);
+  if (unlink(filename) < 0)
+    return ERR_FILACCESS;
+  close(seg->files[id].fd);
+  seg->files[id].fd = -1;
+  seg->files[id].size = seg->files[id].dead = 0;
+  return 0;
+}
+
+/* Initializes SEG to store its segments within DIRNAME, which must already
+ * exist, and rebuilds the index from any segments already present. If SYNC is
+ * set, every append is made durable before it returns. Returns 0 if
+ * successful, else a negative error code. */
+int kvseg_init(kvseg_t *seg, const char *dirname, bool sync) {
+  unsigned int id = 0;
+  off_t end = 0;
+  struct stat st;
+  seg->dirname = dirname;
+  seg->sync = sync;
+  seg->files = NULL;
+  seg->nsegs = seg->capacity = 0;
+  seg->index = NULL;
+
+  for (unsigned int count = kvseg_count(seg); id < count; id++) {
+    if (kvseg_open(seg, id, false) < 0) {
+      if (errno != ENOENT)
+        goto error;
+      kvseg_add(seg, -1, 0);
+    }
+  }
+  if (seg->nsegs == 0 && kvseg_open(seg, 0, true) < 0)
+    goto error;
+
+  /* Only the segments written since the last checkpoint need replaying. */
+  for (id = kvseg_load_checkpoint(seg); id < seg->nsegs; id++) {
+    if (seg->files[id].fd >= 0 && (end = kvseg_replay(seg, id)) < 0)
+      goto error;
+  }
+
+  /* Drop any torn record at the end of the active segment so that new
+   * records are appended directly after the last valid one. */
+  if (fstat(seg->files[seg->nsegs - 1].fd, &st) < 0)
+    goto error;
+  if (st.st_size > end && ftruncate(seg->files[seg->nsegs - 1].fd, end) < 0)
+    goto error;
+  seg->tail = seg->files[seg->nsegs - 1].size = end;
+
+  /* Reclaim whatever became dead before the last shutdown. A segment which
+   * fails to compact is simply tried again later. */
+  kvseg_account(seg);
+  for (id = 0; id + 1 < seg->nsegs; id++)
+    kvseg_compact(seg, id);
+  return 0;
+
+error:
+  kvseg_close(seg);
+  return ERR_FILACCESS;
+}
+
+/* Appends a record for KEY with the VALLEN bytes at VALUE (or a tombstone, if
+ * VALLEN is KVSEG_TOMBSTONE) to the active segment, starting a new segment
+ * first if this one is full. Returns the offset of the record within the
+ * active segment, or a negative error code. */
+static off_t kvseg_append(kvseg_t *seg, char *key, size_t keylen, char *value, int vallen) {
+  size_t size = sizeof(kvrecord_t) + keylen + (vallen > 0 ? vallen : 0);
+  kvrecord_t *rec;
+  off_t offset;
+  ssize_t written;
+  int fd;
+
+  if (seg->nsegs == 0)
+    return ERR_FILACCESS;
+  if (seg->tail > 0 && seg->tail + size > KVSEG_MAX_SIZE) {
+    if (kvseg_open(seg, seg->nsegs, true) < 0)
+      return ERR_FILACCESS;
+    seg->tail = 0;
+    /* The index now reflects exactly the full segments. A failed checkpoint
+     * only makes the next kvseg_init replay more of them. */
+    kvseg_checkpoint(seg, seg->nsegs - 1);
+  }
+  fd = seg->files[seg->nsegs - 1].fd;
+
+  rec = malloc(size);
+  if (!rec)
+    fatal_malloc();
+  rec->keylen = keylen;
+  rec->vallen = vallen;
+  memcpy(rec + 1, key, keylen);
+  if (vallen > 0)
+    memcpy((char *)(rec + 1) + keylen, value, vallen);
+  rec->crc = kvseg_crc(rec, (char *)(rec + 1));
+
+  offset = seg->tail;
+  written = pwrite(fd, rec, size, offset);
+  free(rec);
+  if (written < (ssize_t)size || (seg->sync && fdatasync(fd) < 0)) {
+    /* Never leave a partial (or unsynced) record in front of the next
+     * append. */
+    if (written > 0)
+      ftruncate(fd, offset);
+    return ERR_FILACCESS;
+  }
+  seg->tail += size;
+  seg->files[seg->nsegs - 1].size = seg->tail;
+  return offset;
+}
+
+/* Retrieves the value of KEY from SEG into VALUE (if VALUE is not NULL).
+ * Returns 0 if successful, else a negative error code. */
+int kvseg_get(kvseg_t *seg, char *key, char *value) {
+  kvseg_entry_t *entry;
+  HASH_FIND_STR(seg->index, key, entry);
+  if (!entry)
+    return ERR_NOKEY;
+  if (value == NULL)
+    return 0;
+  if (pread(seg->files[entry->seg].fd, value, entry->vallen, entry->offset) < entry->vallen)
+    return ERR_FILACCESS;
+  value[entry->vallen] = '\0';
+  return 0;
+}
+
+/* Sets the value of KEY in SEG to VALUE. Returns 0 if successful, else a
+ * negative error code. */
+int kvseg_put(kvseg_t *seg, char *key, char *value) {
+  size_t keylen = strlen(key), vallen = strlen(value);
+  off_t offset = kvseg_append(seg, key, keylen, value, vallen);
+  unsigned int old = seg->nsegs;
+  kvseg_entry_t *entry;
+  if (offset < 0)
+    return offset;
+  HASH_FIND(hh, seg->index, key, keylen, entry);
+  if (entry) {
+    old = entry->seg;
+    seg->files[old].dead += kvseg_record_size(entry);
+  }
+  kvseg_index_set(seg, key, keylen, seg->nsegs - 1, offset + sizeof(kvrecord_t) + keylen,
+                  vallen);
+  /* The put has succeeded even if compaction fails; it is tried again the
+   * next time the segment loses a record. */
+  kvseg_compact(seg, old);
+  return 0;
+}
+
+/* Removes KEY from SEG. Returns 0 if successful, else a negative error
+ * code. */
+int kvseg_del(kvseg_t *seg, char *key) {
+  size_t keylen = strlen(key);
+  kvseg_entry_t *entry;
+  unsigned int old;
+  off_t offset;
+  HASH_FIND(hh, seg->index, key, keylen, entry);
+  if (!entry)
+    return ERR_NOKEY;
+  offset = kvseg_append(seg, key, keylen, NULL, KVSEG_TOMBSTONE);
+  if (offset < 0)
+    return offset;
+  old = entry->seg;
+  seg->files[old].dead += kvseg_record_size(entry);
+  seg->files[seg->nsegs - 1].dead += sizeof(kvrecord_t) + keylen;
+  kvseg_index_remove(seg, key, keylen);
+  kvseg_compact(seg, old);
+  return 0;
+}
+
+/* Returns true if SEG contains KEY, else false. */
+bool kvseg_haskey(kvseg_t *seg, char *key) {
+  kvseg_entry_t *entry;
+  HASH_FIND_STR(seg->index, key, entry);
+  return entry != NULL;
+}
+
+/* Closes all segments of SEG and frees its index. The segment files are left
+ * in place. */
+void kvseg_close(kvseg_t *seg) {
+  kvseg_index_clear(seg);
+  for (unsigned int i = 0; i < seg->nsegs; i++) {
+    if (seg->files[i].fd >= 0)
+      close(seg->files[i].fd);
+  }
+  free(seg->files);
+  seg->files = NULL;
+  seg->nsegs = seg->capacity = 0;
+}
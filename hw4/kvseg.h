@@ -0,0 +1,128 @@
+#ifndef __KV_SEG__
+#define __KV_SEG__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "kvconstants.h"
+#include "kvhash.h"
+
+/* KVSeg is the log-structured storage backend of a KVStore (see kvstore.h).
+ *
+ * Entries are appended to segment files within the store's directory, named
+ * "0.seg", "1.seg", and so on. Each record is a kvrecord_t header followed by
+ * the key and the value, without null terminators. A record whose VALLEN is
+ * KVSEG_TOMBSTONE marks its key as deleted. Once the active (highest numbered)
+ * segment grows past KVSEG_MAX_SIZE, a new segment is started.
+ *
+ * An in-memory hash index maps every live key to the location of its most
+ * recent value, so a lookup costs a single pread and an update a single
+ * append. The index is rebuilt on initialization by replaying all segments in
+ * order. A torn record at the end of the active segment (e.g. from a crash in
+ * the middle of an append) fails its checksum and is truncated away.
+ *
+ * To bound the time this takes, the index is checkpointed whenever a segment
+ * fills up: every live key and the location of its value is written to the
+ * file KVSEG_CHECKPOINT, as a kvseg_checkpoint_t header followed by a
+ * kvseg_hint_t and the key for each. kvseg_init then loads the checkpoint
+ * and replays only the segments written after it, so it reads at most about
+ * KVSEG_MAX_SIZE of records however large the store grows. A checkpoint which
+ * is missing or fails its checksum is ignored, and all segments replayed.
+ *
+ * Overwritten and deleted records are reclaimed by compaction: once the dead
+ * records of a full segment make up KVSEG_COMPACT_PERCENT of it, its live
+ * records are appended to the active segment again, synced, and the segment is
+ * removed, leaving a gap in the segment ids which kvseg_init skips. A
+ * tombstone is carried over only while its key is still deleted and an older
+ * segment may hold a record it must hide. Compaction happens within the put or
+ * delete which kills enough of a segment, so that call copies up to about
+ * KVSEG_MAX_SIZE * (100 - KVSEG_COMPACT_PERCENT) / 100 bytes.
+ *
+ * A KVSeg may be made synchronous, in which case every append is followed by
+ * an fdatasync of its segment, and the directory is fsynced whenever a new
+ * segment is created, so a record is on disk once kvseg_put or kvseg_del
+ * returns. A record whose sync fails is truncated away again.
+ *
+ * KVSeg does no locking of its own; the owning KVStore serializes access.
+ */
+
+/* The filetype to append to the filenames of segments. */
+#define KVSEG_FILETYPE ".seg"
+
+/* The size past which a new segment is started. */
+#define KVSEG_MAX_SIZE (4 * 1024 * 1024)
+
+/* The percentage of a full segment which must be dead records before it is
+ * compacted. */
+#define KVSEG_COMPACT_PERCENT 50
+
+/* The name of the checkpoint of the index. */
+#define KVSEG_CHECKPOINT "checkpoint"
+
+/* The suffix of the temporary file a checkpoint is written to before it is
+ * renamed into place. */
+#define KVSEG_TMPTYPE ".tmp"
+
+/* The VALLEN of a record which deletes its key. */
+#define KVSEG_TOMBSTONE -1
+
+/* The on-disk header of a single record. */
+typedef struct {
+  uint32_t crc;    /* CRC-32 of KEYLEN, VALLEN, the key and the value. */
+  uint32_t keylen; /* The length of the key following this header. */
+  int32_t vallen;  /* The length of the value following the key. */
+} kvrecord_t;
+
+/* The on-disk header of a checkpoint. */
+typedef struct {
+  uint32_t crc;   /* CRC-32 of the rest of the checkpoint. */
+  uint32_t nsegs; /* The number of segments whose records it reflects. */
+  uint32_t count; /* The number of kvseg_hint_t which follow. */
+} kvseg_checkpoint_t;
+
+/* The location of the value of a single key within a checkpoint, followed by
+ * the key, without a null terminator. */
+typedef struct {
+  uint32_t seg;    /* The segment which holds the value. */
+  uint32_t keylen; /* The length of the key following this hint. */
+  int32_t vallen;  /* The length of the value. */
+  uint32_t offset; /* The offset of the value within SEG. */
+} kvseg_hint_t;
+
+/* The location of the live value of a single key. */
+typedef struct kvseg_entry {
+  unsigned int seg;  /* The segment which holds the value. */
+  off_t offset;      /* The offset of the value within SEG. */
+  int vallen;        /* The length of the value. */
+  UT_hash_handle hh; /* Makes this structure hashable by KEY. */
+  char key[];        /* The null terminated key. */
+} kvseg_entry_t;
+
+/* A single segment file. */
+typedef struct {
+  int fd;     /* Its open file descriptor. */
+  off_t size; /* The length of its valid records. */
+  off_t dead; /* The length of those which are overwritten or deleted. */
+} kvseg_file_t;
+
+/* A KVSeg. */
+typedef struct {
+  const char *dirname;   /* The directory which holds the segments. */
+  kvseg_file_t *files;   /* All segments, by id. */
+  unsigned int nsegs;    /* The number of segments; the last is active. */
+  unsigned int capacity; /* The allocated length of FILES. */
+  off_t tail;            /* The append offset within the active segment. */
+  kvseg_entry_t *index;  /* The in-memory index of live keys. */
+  bool sync;             /* Whether every append is synced to disk. */
+} kvseg_t;
+
+int kvseg_init(kvseg_t *, const char *dirname, bool sync);
+
+int kvseg_get(kvseg_t *, char *key, char *value);
+int kvseg_put(kvseg_t *, char *key, char *value);
+int kvseg_del(kvseg_t *, char *key);
+bool kvseg_haskey(kvseg_t *, char *key);
+
+void kvseg_close(kvseg_t *);
+
+#endif
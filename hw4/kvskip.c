@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kvconstants.h"
+#include "kvskip.h"
+
+/* Returns a new node of HEIGHT levels for KEY, which may be NULL. */
+static kvskip_node_t *kvskip_new_node(const char *key, unsigned int height) {
+  size_t size = sizeof(kvskip_node_t) + height * sizeof(kvskip_node_t *);
+  kvskip_node_t *node = calloc(1, size + (key ? strlen(key) + 1 : 0));
+  if (!node)
+    fatal_malloc();
+  node->height = height;
+  if (key) {
+    node->key = (char *)node + size;
+    strcpy(node->key, key);
+  }
+  return node;
+}
+
+/* Returns the height of a new node of SKIP, advancing its xorshift
+ * generator. */
+static unsigned int kvskip_random_height(kvskip_t *skip) {
+  unsigned int height = 1;
+  uint64_t bits;
+  skip->seed ^= skip->seed << 13;
+  skip->seed ^= skip->seed >> 7;
+  skip->seed ^= skip->seed << 17;
+  for (bits = skip->seed; height < KVSKIP_MAX_HEIGHT && (bits & 3) == 0; bits >>= 2)
+    height++;
+  return height;
+}
+
+/* Finds the last node of SKIP on each level whose key sorts before KEY and
+ * records it in PREV. Returns the node which follows it on the bottom
+ * level, the first whose key does not sort before KEY, or NULL. */
+static kvskip_node_t *kvskip_find(kvskip_t *skip, const char *key, kvskip_node_t **prev) {
+  kvskip_node_t *node = skip->head;
+  for (int level = skip->height - 1; level >= 0; level--) {
+    while (node->next[level] && strcmp(node->next[level]->key, key) < 0)
+      node = node->next[level];
+    prev[level] = node;
+  }
+  return node->next[0];
+}
+
+/* Initializes SKIP to an empty set. */
+void kvskip_init(kvskip_t *skip) {
+  skip->head = kvskip_new_node(NULL, KVSKIP_MAX_HEIGHT);
+  skip->height = 1;
+  skip->count = 0;
+  skip->seed = (uintptr_t)skip | 1;
+}
+
+bool kvskip_insert(kvskip_t *skip, const char *key) {
+  kvskip_node_t *prev[KVSKIP_MAX_HEIGHT], *node;
+  unsigned int height;
+  node = kvskip_find(skip, key, prev);
+  if (node && !strcmp(node->key, key))
+    return false;
+  height = kvskip_random_height(skip);
+  for (; skip->height < height; skip->height++)
+    prev[skip->height] = skip->head;
+  node = kvskip_new_node(key, height);
+  for (unsigned int level = 0; level < height; level++) {
+    node->next[level] = prev[level]->next[level];
+    prev[level]->next[level] = node;
+  }
+  skip->count++;
+  return true;
+}
+
+bool kvskip_remove(kvskip_t *skip, const char *key) {
+  kvskip_node_t *prev[KVSKIP_MAX_HEIGHT], *node;
+  node = kvskip_find(skip, key, prev);
+  if (!node || strcmp(node->key, key))
+    return false;
+  for (unsigned int level = 0; level < node->height; level++)
+    prev[level]->next[level] = node->next[level];
+  while (skip->height > 1 && !skip->head->next[skip->height - 1])
+    skip->height--;
+  free(node);
+  skip->count--;
+  return true;
+}
+
+kvskip_node_t *kvskip_seek(kvskip_t *skip, const char *key, bool inclusive) {
+  kvskip_node_t *prev[KVSKIP_MAX_HEIGHT], *node;
+  node = kvskip_find(skip, key, prev);
+  if (node && !inclusive && !strcmp(node->key, key))
+    node = node->next[0];
+  return node;
+}
+
+/* Frees every node of SKIP. SKIP must be reinitialized before it is used
+ * again. */
+void kvskip_destroy(kvskip_t *skip) {
+  kvskip_node_t *node, *next;
+  for (node = skip->head; node; node = next) {
+    next = node->next[0];
+    free(node);
+  }
+  skip->head = NULL;
+  skip->count = 0;
+}
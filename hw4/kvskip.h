@@ -0,0 +1,54 @@
+#ifndef __KV_SKIP__
+#define __KV_SKIP__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* KVSkip is an ordered set of keys, kept as a skiplist, which a KVStore uses
+ * to visit its keys in order (see kvstore_scan).
+ *
+ * Every key is held by a node on the bottom level, which links all nodes in
+ * ascending order (by strcmp, so bytewise). Each node is also linked on
+ * every level below its height, which is picked at random when it is
+ * inserted: a node reaches each further level with probability 1/4, so a
+ * search, starting on the highest level and dropping down a level whenever
+ * the next node would overshoot, visits O(log n) nodes.
+ *
+ * KVSkip does no locking of its own; the owning KVStore serializes access.
+ */
+
+/* The highest level of a node, enough for 4^KVSKIP_MAX_HEIGHT keys. */
+#define KVSKIP_MAX_HEIGHT 16
+
+/* A single key of a skiplist. */
+typedef struct kvskip_node {
+  char *key;                  /* The null terminated key, stored after NEXT. */
+  unsigned int height;        /* The number of levels this node is linked on. */
+  struct kvskip_node *next[]; /* The next node on each level, or NULL. */
+} kvskip_node_t;
+
+/* A KVSkip. */
+typedef struct {
+  kvskip_node_t *head;  /* A node without a key, linked on every level. */
+  unsigned int height;  /* The highest level of any node. */
+  size_t count;         /* The number of keys. */
+  uint64_t seed;        /* The state of the generator of node heights. */
+} kvskip_t;
+
+void kvskip_init(kvskip_t *);
+
+/* Adds KEY to SKIP. Returns false if it was already present. */
+bool kvskip_insert(kvskip_t *, const char *key);
+
+/* Removes KEY from SKIP. Returns false if it was not present. */
+bool kvskip_remove(kvskip_t *, const char *key);
+
+/* Returns the node of the first key of SKIP which sorts after KEY (or is
+ * equal to it, if INCLUSIVE is set), or NULL if there is none. The keys
+ * which follow it are reached through NEXT[0]. */
+kvskip_node_t *kvskip_seek(kvskip_t *, const char *key, bool inclusive);
+
+void kvskip_destroy(kvskip_t *);
+
+#endif
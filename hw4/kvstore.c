@@ -2,6 +2,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
@@ -9,17 +10,320 @@
 #include "kvstore.h"
 #include "kvconstants.h"
 
+/* The longest path built within the directory of a store: an entry file of a
+ * shard, with the widest hash and chain position, while it is being written.
+ * The names of the segments and checkpoint of a shard are shorter. */
+#define KVSTORE_MAX_SUFFIX                                                                         \
+  sizeof("/" KVSTORE_SHARD_PREFIX "4294967295/18446744073709551615-4294967295" KVSTORE_FILETYPE    \
+         KVSTORE_TMPTYPE)
+
+/* Writes the name of the entry file at position CHAINPOS of the hash chain for
+ * HASHVAL within SHARD into FILENAME. */
+static void entry_filename(kvstore_shard_t *shard, uint64_t hashval, unsigned int chainpos,
+                           char *filename) {
+  sprintf(filename, "%s/%" PRIu64 "-%u%s", shard->dirname, hashval, chainpos, KVSTORE_FILETYPE);
+}
+
+/* Flushes the entries of directory DIRNAME (the files created, renamed and
+ * removed within it) to disk. Returns 0 if successful, else ERR_FILACCESS. */
+static int sync_dir(const char *dirname) {
+  int fd = open(dirname, O_RDONLY | O_DIRECTORY), ret;
+  if (fd < 0)
+    return ERR_FILACCESS;
+  ret = fsync(fd) < 0 ? ERR_FILACCESS : 0;
+  close(fd);
+  return ret;
+}
+
+/* Replaces the contents of FILENAME, within the directory DIRNAME, with the
+ * SIZE bytes at DATA, such that a crash at any point leaves either the old
+ * contents or the new ones, never a mix. The data is written to a temporary
+ * file beside FILENAME, which is then renamed over it. How durable the new
+ * contents are once this returns depends on the sync level of STORE. Returns
+ * 0 if successful, else ERR_FILACCESS. */
+static int write_atomic(kvstore_t *store, const char *dirname, const char *filename,
+                        const void *data, size_t size) {
+  char tmpname[MAX_FILENAME + sizeof(KVSTORE_TMPTYPE)];
+  size_t done = 0;
+  ssize_t written;
+  int fd;
+  sprintf(tmpname, "%s%s", filename, KVSTORE_TMPTYPE);
+  if ((fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+    return ERR_FILACCESS;
+  while (done < size && (written = write(fd, (const char *)data + done, size - done)) > 0)
+    done += written;
+  if (done < size || (store->sync != KVSTORE_SYNC_NONE && fdatasync(fd) < 0)) {
+    close(fd);
+    unlink(tmpname);
+    return ERR_FILACCESS;
+  }
+  if (close(fd) < 0 || rename(tmpname, filename) < 0) {
+    unlink(tmpname);
+    return ERR_FILACCESS;
+  }
+  if (store->sync == KVSTORE_SYNC_DIR)
+    return sync_dir(dirname);
+  return 0;
+}
+
+/* Returns the hash chain for HASHVAL within SHARD. If there is no such chain,
+ * an empty one is created if CREATE is set, else NULL is returned. */
+static kvstore_chain_t *index_chain(kvstore_shard_t *shard, uint64_t hashval, bool create) {
+  kvstore_chain_t *chain;
+  HASH_FIND(hh, shard->chains, &hashval, sizeof(uint64_t), chain);
+  if (chain || !create)
+    return chain;
+  chain = calloc(1, sizeof(kvstore_chain_t));
+  if (!chain)
+    fatal_malloc();
+  chain->hashval = hashval;
+  HASH_ADD(hh, shard->chains, hashval, sizeof(uint64_t), chain);
+  return chain;
+}
+
+/* Records in the index of SHARD that the entry for KEY is at position CHAINPOS
+ * of the hash chain for HASHVAL. Returns the new index entry. */
+static kvstore_key_t *index_add(kvstore_shard_t *shard, char *key, uint64_t hashval,
+                                unsigned int chainpos) {
+  kvstore_chain_t *chain = index_chain(shard, hashval, true);
+  size_t keylen = strlen(key);
+  kvstore_key_t *entry = malloc(sizeof(kvstore_key_t) + keylen + 1);
+  if (!entry)
+    fatal_malloc();
+  strcpy(entry->key, key);
+  entry->hashval = hashval;
+  entry->chainpos = chainpos;
+  HASH_ADD_KEYPTR(hh, shard->keys, entry->key, keylen, entry);
+
+  if (chainpos >= chain->capacity) {
+    unsigned int capacity = chain->capacity ? chain->capacity : 2;
+    while (chainpos >= capacity)
+      capacity *= 2;
+    chain->keys = realloc(chain->keys, capacity * sizeof(kvstore_key_t *));
+    if (!chain->keys)
+      fatal_malloc();
+    memset(chain->keys + chain->capacity, 0,
+           (capacity - chain->capacity) * sizeof(kvstore_key_t *));
+    chain->capacity = capacity;
+  }
+  chain->keys[chainpos] = entry;
+  if (chainpos >= chain->length)
+    chain->length = chainpos + 1;
+  return entry;
+}
+
+/* Frees the in-memory index of SHARD. */
+static void index_free(kvstore_shard_t *shard) {
+  kvstore_key_t *entry, *tmpentry;
+  kvstore_chain_t *chain, *tmpchain;
+  HASH_ITER(hh, shard->keys, entry, tmpentry) {
+    HASH_DEL(shard->keys, entry);
+    free(entry);
+  }
+  HASH_ITER(hh, shard->chains, chain, tmpchain) {
+    HASH_DEL(shard->chains, chain);
+    free(chain->keys);
+    free(chain);
+  }
+}
+
+/* Reads the entry file FILENAME into ENTRY, which must have room for the
+ * largest possible entry. Returns 0 if successful, else ERR_FILACCESS. */
+static int read_entry(char *filename, kventry_t *entry) {
+  ssize_t size = sizeof(kventry_t) + MAX_KEYLEN + MAX_VALLEN + 2, bytes_read;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return ERR_FILACCESS;
+  bytes_read = read(fd, entry, size);
+  close(fd);
+  if (bytes_read < (ssize_t)sizeof(kventry_t) || entry->length < 2 ||
+      bytes_read < (ssize_t)sizeof(kventry_t) + entry->length)
+    return ERR_FILACCESS;
+  entry->data[entry->length - 1] = '\0';
+  return 0;
+}
+
+/* Builds the in-memory index of SHARD from the entry files in its directory,
+ * reading the key of each. Returns 0 if successful, else a negative error
+ * code. */
+static int index_load(kvstore_shard_t *shard) {
+  char buf[sizeof(kventry_t) + MAX_KEYLEN + MAX_VALLEN + 2]
+      __attribute__((aligned(sizeof(int))));
+  kventry_t *entry = (kventry_t *)buf;
+  char filename[MAX_FILENAME];
+  struct dirent *dent;
+  uint64_t hashval;
+  unsigned int chainpos;
+  int len;
+  DIR *kvstoredir = opendir(shard->dirname);
+  if (kvstoredir == NULL)
+    return ERR_FILACCESS;
+  while ((dent = readdir(kvstoredir)) != NULL) {
+    if (sscanf(dent->d_name, "%" SCNu64 "-%u%n", &hashval, &chainpos, &len) != 2)
+      continue;
+    if (!strcmp(dent->d_name + len, KVSTORE_FILETYPE KVSTORE_TMPTYPE)) {
+      /* A write which never reached its rename; the entry is unchanged. */
+      if (snprintf(filename, sizeof(filename), "%s/%s", shard->dirname, dent->d_name) >=
+          (int)sizeof(filename)) {
+        closedir(kvstoredir);
+        return ERR_FILLEN;
+      }
+      unlink(filename);
+      continue;
+    }
+    if (strcmp(dent->d_name + len, KVSTORE_FILETYPE))
+      continue;
+    entry_filename(shard, hashval, chainpos, filename);
+    if (read_entry(filename, entry) < 0)
+      continue;
+    index_add(shard, entry->data, hashval, chainpos);
+  }
+  closedir(kvstoredir);
+  return 0;
+}
+
+/* Initializes the ordered index of SHARD, of STORE, with every key the shard
+ * holds. */
+static void order_load(kvstore_t *store, kvstore_shard_t *shard) {
+  kvstore_key_t *indexed, *next_key;
+  kvseg_entry_t *entry, *next_entry;
+  kvskip_init(&shard->order);
+  if (store->backend == KVSTORE_LOG) {
+    HASH_ITER(hh, shard->seg.index, entry, next_entry) {
+      kvskip_insert(&shard->order, entry->key);
+    }
+  } else {
+    HASH_ITER(hh, shard->keys, indexed, next_key) {
+      kvskip_insert(&shard->order, indexed->key);
+    }
+  }
+}
+
+/* Rebuilds the Bloom filter of SHARD, of STORE, from every key the shard
+ * holds. Must be called with the shard's write lock held, or before the
+ * store is shared. */
+static void bloom_load(kvstore_t *store, kvstore_shard_t *shard) {
+  kvstore_key_t *indexed, *next_key;
+  kvseg_entry_t *entry, *next_entry;
+  if (store->backend == KVSTORE_LOG) {
+    kvbloom_rebuild_begin(&shard->bloom, HASH_COUNT(shard->seg.index));
+    HASH_ITER(hh, shard->seg.index, entry, next_entry) {
+      kvbloom_add(&shard->bloom, kvhash_str(entry->key));
+    }
+  } else {
+    kvbloom_rebuild_begin(&shard->bloom, HASH_COUNT(shard->keys));
+    HASH_ITER(hh, shard->keys, indexed, next_key) {
+      kvbloom_add(&shard->bloom, kvhash_str(indexed->key));
+    }
+  }
+  kvbloom_rebuild_end(&shard->bloom);
+}
+
+/* Returns true if the Bloom filter of SHARD, of STORE, shows that the key
+ * with kvhash64 HASH is absent, without taking the shard's lock. */
+static bool bloom_excludes(kvstore_t *store, kvstore_shard_t *shard, uint64_t hash) {
+  return store->filtered && !kvbloom_check(&shard->bloom, hash);
+}
+
+/* Counts a lookup of SHARD, of STORE, which passed its Bloom filter but found
+ * no key. */
+static void bloom_missed(kvstore_t *store, kvstore_shard_t *shard) {
+  if (store->filtered)
+    __atomic_fetch_add(&shard->bloom.false_positives, 1, __ATOMIC_RELAXED);
+}
+
+/* Returns the shard of STORE which holds keys with kvhash64 HASH. */
+static kvstore_shard_t *kvstore_shard(kvstore_t *store, uint64_t hash) {
+  return &store->shards[hash % store->nshards];
+}
+
+/* Returns the number of shards of STORE, as recorded in its
+ * KVSTORE_SHARDS_FILE. If there is none, the store is recorded to have
+ * NSHARDS shards if CREATED is set (as its directory was just created), else
+ * it predates sharding and has a single one. Returns 0 on error. */
+static unsigned int kvstore_load_nshards(kvstore_t *store, unsigned int nshards, bool created) {
+  char filename[MAX_FILENAME], buf[16];
+  unsigned int recorded;
+  FILE *file;
+  if (snprintf(filename, sizeof(filename), "%s/%s", store->dirname, KVSTORE_SHARDS_FILE) >=
+      (int)sizeof(filename))
+    return 0;
+  if ((file = fopen(filename, "r")) != NULL) {
+    if (fscanf(file, "%u", &recorded) != 1 || recorded == 0 || recorded > KVSTORE_MAX_SHARDS)
+      recorded = 0;
+    fclose(file);
+    return recorded;
+  }
+  if (!created)
+    return 1;
+  sprintf(buf, "%u\n", nshards);
+  if (write_atomic(store, store->dirname, filename, buf, strlen(buf)) < 0)
+    return 0;
+  return nshards;
+}
+
 /* Initializes kvstore STORE. Uses DIRNAME as the directory in which to store
- * the entries of this store, creating the directory if necessary. Returns 0 if
+ * the entries of this store, creating the directory if necessary, BACKEND to
+ * determine how entries are laid out within it, and SYNC to determine how
+ * durable a write is once it returns. A new store is split into
+ * KVSTORE_DEFAULT_SHARDS shards, or as many as there are online CPUs if that
+ * is 0; an existing one keeps the number it was created with. Returns 0 if
  * successful, else a negative error code. */
-int kvstore_init(kvstore_t *store, char *dirname) {
+int kvstore_init(kvstore_t *store, char *dirname, kvstore_backend_t backend,
+                 kvstore_sync_t sync) {
   struct stat st;
+  bool created = false;
+  long nshards = KVSTORE_DEFAULT_SHARDS;
+  int ret;
+  /* Leave room for the names of the files and shards within DIRNAME. */
+  if (strlen(dirname) + KVSTORE_MAX_SUFFIX > MAX_FILENAME)
+    return ERR_FILLEN;
   if (stat(dirname, &st) == -1) {
     if (mkdir(dirname, 0700) == -1)
       return errno;
+    created = true;
   }
+  if (nshards == 0)
+    nshards = sysconf(_SC_NPROCESSORS_ONLN);
+  nshards = nshards < 1 ? 1 : min(nshards, KVSTORE_MAX_SHARDS);
   strcpy(store->dirname, dirname);
-  pthread_rwlock_init(&store->lock, NULL);
+  store->backend = backend;
+  store->sync = sync;
+  store->ordered = KVSTORE_ORDERED_INDEX;
+  store->filtered = KVSTORE_BLOOM_FILTER;
+  store->nshards = kvstore_load_nshards(store, nshards, created);
+  if (store->nshards == 0)
+    return ERR_FILACCESS;
+  store->shards = calloc(store->nshards, sizeof(kvstore_shard_t));
+  if (!store->shards)
+    fatal_malloc();
+  for (unsigned int i = 0; i < store->nshards; i++) {
+    kvstore_shard_t *shard = &store->shards[i];
+    /* A store with a single shard keeps its entries in DIRNAME itself. */
+    if (store->nshards == 1)
+      strcpy(shard->dirname, dirname);
+    else
+      sprintf(shard->dirname, "%s/" KVSTORE_SHARD_PREFIX "%u", dirname, i);
+    if (stat(shard->dirname, &st) == -1) {
+      if (mkdir(shard->dirname, 0700) == -1)
+        return errno;
+      if (sync == KVSTORE_SYNC_DIR && sync_dir(dirname) < 0)
+        return ERR_FILACCESS;
+    }
+    if (backend == KVSTORE_LOG)
+      ret = kvseg_init(&shard->seg, shard->dirname, sync != KVSTORE_SYNC_NONE);
+    else
+      ret = index_load(shard);
+    if (ret < 0)
+      return ret;
+    if (store->ordered)
+      order_load(store, shard);
+    if (store->filtered) {
+      kvbloom_init(&shard->bloom);
+      bloom_load(store, shard);
+    }
+    pthread_rwlock_init(&shard->lock, NULL);
+  }
   return 0;
 }
 
@@ -31,52 +335,76 @@ int kvstore_init(kvstore_t *store, char *dirname) {
  * Returns a negative error code if the entry is not found or an error
  * occurred.
  *
- * If VALUE is not NULL, the value of the entry will be placed into VALUE using
- * malloced memory which should be freed later. */
+ * If VALUE is not NULL, the value of the entry will be copied into VALUE. */
 int find_entry(kvstore_t *store, char *key, char *value) {
-  uint64_t hashval;
-  unsigned int counter = 0;
-  char currfile[MAX_FILENAME];
-  size_t keylen = strlen(key);
-  struct stat st;
-  FILE *file;
-  kventry_t header;
-  if (keylen > MAX_KEYLEN)
+  char buf[sizeof(kventry_t) + MAX_KEYLEN + MAX_VALLEN + 2]
+      __attribute__((aligned(sizeof(int))));
+  kventry_t *entry = (kventry_t *)buf;
+  char filename[MAX_FILENAME];
+  kvstore_shard_t *shard;
+  kvstore_key_t *indexed;
+  uint64_t hash;
+  int chainpos;
+  if (strlen(key) > MAX_KEYLEN)
     return ERR_KEYLEN;
-  if (stat(store->dirname, &st) == -1)
-    return ERR_FILACCESS;
-  hashval = strhash64(key);
-  pthread_rwlock_rdlock(&store->lock);
-  sprintf(currfile, "%s/%" PRIu64 "-%u%s", store->dirname, hashval, counter++, KVSTORE_FILETYPE);
-  while (stat(currfile, &st) != -1) {
-    if ((file = fopen(currfile, "r")) == NULL) {
-      pthread_rwlock_unlock(&store->lock);
+  hash = kvhash_str(key);
+  shard = kvstore_shard(store, hash);
+  if (bloom_excludes(store, shard, hash))
+    return ERR_NOKEY;
+  pthread_rwlock_rdlock(&shard->lock);
+  HASH_FIND_STR(shard->keys, key, indexed);
+  if (!indexed) {
+    bloom_missed(store, shard);
+    pthread_rwlock_unlock(&shard->lock);
+    return ERR_NOKEY;
+  }
+  chainpos = indexed->chainpos;
+  if (value != NULL) {
+    entry_filename(shard, indexed->hashval, chainpos, filename);
+    if (read_entry(filename, entry) < 0) {
+      pthread_rwlock_unlock(&shard->lock);
       return ERR_FILACCESS;
     }
-    fread(&header, sizeof(kventry_t), 1, file);
-    char entry_data[header.length + 1];
-    fread(entry_data, sizeof(char), header.length, file);
-    fclose(file);
-    if (strcmp(key, entry_data) == 0) {
-      if (value != NULL)
-        strcpy(value, entry_data + strlen(entry_data) + 1);
-      pthread_rwlock_unlock(&store->lock);
-      return counter - 1;
-    }
-    sprintf(currfile, "%s/%" PRIu64 "-%u%s", store->dirname, hashval, counter++, KVSTORE_FILETYPE);
+    strcpy(value, entry->data + strlen(entry->data) + 1);
   }
-  pthread_rwlock_unlock(&store->lock);
-  return ERR_NOKEY;
+  pthread_rwlock_unlock(&shard->lock);
+  return chainpos;
 }
 
+/* Looks up KEY within a KVSTORE_LOG STORE, placing its value into VALUE if
+ * VALUE is not NULL. Returns 0 if successful, else a negative error code. */
+static int find_segment_entry(kvstore_t *store, char *key, char *value) {
+  kvstore_shard_t *shard;
+  uint64_t hash;
+  int ret;
+  if (strlen(key) > MAX_KEYLEN)
+    return ERR_KEYLEN;
+  hash = kvhash_str(key);
+  shard = kvstore_shard(store, hash);
+  if (bloom_excludes(store, shard, hash))
+    return ERR_NOKEY;
+  pthread_rwlock_rdlock(&shard->lock);
+  ret = kvseg_get(&shard->seg, key, value);
+  if (ret == ERR_NOKEY)
+    bloom_missed(store, shard);
+  pthread_rwlock_unlock(&shard->lock);
+  return ret;
+}
 /* Returns true if STORE contains KEY, else false. */
-bool kvstore_haskey(kvstore_t *store, char *key) { return find_entry(store, key, NULL) >= 0; }
+bool kvstore_haskey(kvstore_t *store, char *key) {
+  if (store->backend == KVSTORE_LOG)
+    return find_segment_entry(store, key, NULL) >= 0;
+  return find_entry(store, key, NULL) >= 0;
+}
 
 /* Attempts to retrieve the entry denoted by KEY from STORE.
  * Returns 0 if successful, else a negative error code. The entry's value will
  * be placed into VALUE using malloc()d memory which should be free()d later. */
 int kvstore_get(kvstore_t *store, char *key, char *value) {
-  int ret = find_entry(store, key, value);
+  int ret;
+  if (store->backend == KVSTORE_LOG)
+    return find_segment_entry(store, key, value);
+  ret = find_entry(store, key, value);
   if (ret < 0)
     return ret;
   else
@@ -87,11 +415,15 @@ int kvstore_get(kvstore_t *store, char *key, char *value) {
  * Returns 0 if it can, else a negative error code indicating why it cannot. */
 int kvstore_put_check(kvstore_t *store, char *key, char *value) {
   struct stat st;
+  kvstore_shard_t *shard;
   if (strlen(key) > MAX_KEYLEN)
     return ERR_KEYLEN;
   if (strlen(value) > MAX_VALLEN)
     return ERR_VALLEN;
-  if (stat(store->dirname, &st) == -1)
+  shard = kvstore_shard(store, kvhash_str(key));
+  if (store->backend == KVSTORE_LOG)
+    return shard->seg.nsegs > 0 ? 0 : ERR_FILACCESS;
+  if (stat(shard->dirname, &st) == -1)
     return ERR_FILACCESS;
   return 0;
 }
@@ -101,31 +433,29 @@ int kvstore_put_check(kvstore_t *store, char *key, char *value) {
  * entries are stored. */
 int kvstore_put(kvstore_t *store, char *key, char *value) {
   uint64_t hashval;
-  int counter, check;
+  unsigned int chainpos;
+  int check;
   size_t keylen = strlen(key), vallen = strlen(value);
   char filename[MAX_FILENAME];
-  struct stat st;
-  FILE *file;
   kventry_t *entry;
+  kvstore_key_t *indexed;
+  kvstore_shard_t *shard;
+  uint64_t hash = kvhash_str(key);
   if ((check = kvstore_put_check(store, key, value)) < 0)
     return check;
-  hashval = strhash64(key);
-  counter = find_entry(store, key, NULL);
-  pthread_rwlock_wrlock(&store->lock);
-  if (counter >= 0) {
-    /* Entry already exists, just update it. */
-    sprintf(filename, "%s/%" PRIu64 "-%u%s", store->dirname, hashval, counter, KVSTORE_FILETYPE);
-  } else {
-    /* Search for the end of the hash chain to insert. */
-    counter = 0;
-    sprintf(filename, "%s/%" PRIu64 "-%u%s", store->dirname, hashval, counter++, KVSTORE_FILETYPE);
-    while (stat(filename, &st) != -1)
-      sprintf(filename, "%s/%" PRIu64 "-%u%s", store->dirname, hashval, counter++,
-              KVSTORE_FILETYPE);
-  }
-  if ((file = fopen(filename, "w")) == NULL) {
-    pthread_rwlock_unlock(&store->lock);
-    return ERR_FILACCESS;
+  shard = kvstore_shard(store, hash);
+  if (store->backend == KVSTORE_LOG) {
+    pthread_rwlock_wrlock(&shard->lock);
+    /* A new key is added to the filter before it can be found. */
+    if (store->filtered && !kvseg_haskey(&shard->seg, key))
+      kvbloom_add(&shard->bloom, hash);
+    check = kvseg_put(&shard->seg, key, value);
+    if (check == 0 && store->ordered)
+      kvskip_insert(&shard->order, key);
+    if (store->filtered && kvbloom_full(&shard->bloom))
+      bloom_load(store, shard);
+    pthread_rwlock_unlock(&shard->lock);
+    return check;
   }
   entry = malloc(sizeof(kventry_t) + keylen + vallen + 2);
   if (!entry)
@@ -133,11 +463,33 @@ int kvstore_put(kvstore_t *store, char *key, char *value) {
   entry->length = keylen + vallen + 2;
   strcpy(entry->data, key);
   strcpy(entry->data + keylen + 1, value);
-  fwrite(entry, sizeof(kventry_t) + entry->length, 1, file);
-  fclose(file);
-  pthread_rwlock_unlock(&store->lock);
+  pthread_rwlock_wrlock(&shard->lock);
+  HASH_FIND_STR(shard->keys, key, indexed);
+  if (indexed) {
+    /* Entry already exists, just update it. */
+    hashval = indexed->hashval;
+    chainpos = indexed->chainpos;
+  } else {
+    /* Insert at the end of the hash chain. */
+    kvstore_chain_t *chain;
+    hashval = strhash64(key);
+    chain = index_chain(shard, hashval, false);
+    chainpos = chain ? chain->length : 0;
+    if (store->filtered)
+      kvbloom_add(&shard->bloom, hash);
+  }
+  entry_filename(shard, hashval, chainpos, filename);
+  check = write_atomic(store, shard->dirname, filename, entry, sizeof(kventry_t) + entry->length);
+  if (check == 0 && !indexed) {
+    index_add(shard, key, hashval, chainpos);
+    if (store->ordered)
+      kvskip_insert(&shard->order, key);
+  }
+  if (store->filtered && kvbloom_full(&shard->bloom))
+    bloom_load(store, shard);
+  pthread_rwlock_unlock(&shard->lock);
   free(entry);
-  return 0;
+  return check;
 }
 
 /* Checks if STORE can successfully remove the given KEY.
@@ -146,7 +498,8 @@ int kvstore_del_check(kvstore_t *store, char *key) {
   struct stat st;
   if (strlen(key) > MAX_KEYLEN)
     return ERR_KEYLEN;
-  if (stat(store->dirname, &st) == -1)
+  if (store->backend == KVSTORE_FILES &&
+      stat(kvstore_shard(store, kvhash_str(key))->dirname, &st) == -1)
     return ERR_FILACCESS;
   if (!kvstore_haskey(store, key))
     return ERR_NOKEY;
@@ -158,57 +511,230 @@ int kvstore_del_check(kvstore_t *store, char *key) {
  * KEY will be reconnected within this function. */
 int kvstore_del(kvstore_t *store, char *key) {
   char delfile[MAX_FILENAME];
-  int chainpos;
-  uint64_t hashval;
-  unsigned int counter;
-  char currfile[MAX_FILENAME];
-  struct stat st;
-  chainpos = find_entry(store, key, NULL);
-  if (chainpos < 0)
-    return chainpos;
-  counter = chainpos;
-  hashval = strhash64(key);
-  pthread_rwlock_wrlock(&store->lock);
-  sprintf(delfile, "%s/%" PRIu64 "-%u%s", store->dirname, hashval, chainpos, KVSTORE_FILETYPE);
-  sprintf(currfile, "%s/%" PRIu64 "-%u%s", store->dirname, hashval, ++counter, KVSTORE_FILETYPE);
-  while (stat(currfile, &st) != -1) {
-    sprintf(currfile, "%s/%" PRIu64 "-%u%s", store->dirname, hashval, ++counter, KVSTORE_FILETYPE);
-  }
-  if (counter == chainpos + 1) {
+  char lastfile[MAX_FILENAME];
+  kvstore_key_t *indexed, *last;
+  kvstore_chain_t *chain;
+  kvstore_shard_t *shard;
+  uint64_t hash;
+  int ret;
+  if (strlen(key) > MAX_KEYLEN)
+    return ERR_KEYLEN;
+  hash = kvhash_str(key);
+  shard = kvstore_shard(store, hash);
+  if (bloom_excludes(store, shard, hash))
+    return ERR_NOKEY;
+  if (store->backend == KVSTORE_LOG) {
+    pthread_rwlock_wrlock(&shard->lock);
+    ret = kvseg_del(&shard->seg, key);
+    if (ret == 0 && store->ordered)
+      kvskip_remove(&shard->order, key);
+    pthread_rwlock_unlock(&shard->lock);
+    return ret;
+  }
+  pthread_rwlock_wrlock(&shard->lock);
+  HASH_FIND_STR(shard->keys, key, indexed);
+  if (!indexed) {
+    pthread_rwlock_unlock(&shard->lock);
+    return ERR_NOKEY;
+  }
+  chain = index_chain(shard, indexed->hashval, false);
+  entry_filename(shard, indexed->hashval, indexed->chainpos, delfile);
+  if (indexed->chainpos == chain->length - 1) {
     /* There were no elements in the chain after the element to be deleted. */
     if (remove(delfile) == -1) {
-      pthread_rwlock_unlock(&store->lock);
+      pthread_rwlock_unlock(&shard->lock);
       return errno;
     }
   } else {
     /* There were elements in the chain after the element to be deleted.
        Take the last element in the chain and swap it into the deletion
        location. */
-    sprintf(currfile, "%s/%" PRIu64 "-%u%s", store->dirname, hashval, counter - 1,
-            KVSTORE_FILETYPE);
-    if (rename(currfile, delfile) == -1) {
-      pthread_rwlock_unlock(&store->lock);
+    entry_filename(shard, indexed->hashval, chain->length - 1, lastfile);
+    if (rename(lastfile, delfile) == -1) {
+      pthread_rwlock_unlock(&shard->lock);
       return errno;
     }
+    last = chain->keys[chain->length - 1];
+    if (last)
+      last->chainpos = indexed->chainpos;
+    chain->keys[indexed->chainpos] = last;
   }
-  pthread_rwlock_unlock(&store->lock);
-  return 0;
+  chain->keys[--chain->length] = NULL;
+  if (chain->length == 0) {
+    HASH_DEL(shard->chains, chain);
+    free(chain->keys);
+    free(chain);
+  }
+  if (store->ordered)
+    kvskip_remove(&shard->order, key);
+  HASH_DEL(shard->keys, indexed);
+  free(indexed);
+  ret = store->sync == KVSTORE_SYNC_DIR ? sync_dir(shard->dirname) : 0;
+  pthread_rwlock_unlock(&shard->lock);
+  return ret;
 }
 
-/* Deletes all current entries in STORE and removes the store directory.
- * You will need to reinitialize STORE following this action to continue
- * using it. */
-int kvstore_clean(kvstore_t *store) {
+/* The keys of one shard which kvstore_scan has read but not yet visited. */
+typedef struct {
+  char *keys[KVSTORE_SCAN_BATCH]; /* The keys read, in order. */
+  unsigned int count;             /* The number of KEYS. */
+  unsigned int pos;               /* The next of KEYS to visit. */
+  bool done;                      /* Whether the shard has no more keys to read. */
+} scan_cursor_t;
+
+/* Returns true if KEY starts with PREFIX. */
+static bool has_prefix(const char *key, const char *prefix) {
+  return !strncmp(key, prefix, strlen(prefix));
+}
+
+/* Reads into CURSOR the first KVSTORE_SCAN_BATCH keys of SHARD which sort
+ * after AFTER (or are equal to it, if INCLUSIVE is set) and start with
+ * PREFIX, in place of the keys it held, which must have been freed. */
+static void scan_fill(kvstore_shard_t *shard, scan_cursor_t *cursor, const char *after,
+                      bool inclusive, const char *prefix) {
+  kvskip_node_t *node;
+  cursor->count = cursor->pos = 0;
+  pthread_rwlock_rdlock(&shard->lock);
+  node = kvskip_seek(&shard->order, after, inclusive);
+  for (; node && cursor->count < KVSTORE_SCAN_BATCH && has_prefix(node->key, prefix);
+       node = node->next[0]) {
+    if (!(cursor->keys[cursor->count++] = strdup(node->key)))
+      fatal_malloc();
+  }
+  cursor->done = !node || !has_prefix(node->key, prefix);
+  pthread_rwlock_unlock(&shard->lock);
+}
+
+/* Visits the entries of STORE whose keys start with PREFIX and sort after
+ * AFTER (which, if empty, every key does), in order of their keys, calling FN
+ * with ARG for each until it returns false. Returns 1 if FN ended the scan, 0
+ * if every such entry was visited, or a negative error code: ERR_INVLDMSG if
+ * STORE does not keep its keys in order. */
+int kvstore_scan(kvstore_t *store, const char *after, const char *prefix, kvstore_scan_fn fn,
+                 void *arg) {
+  char value[MAX_VALLEN + 1], *key;
+  bool inclusive = strcmp(after, prefix) < 0;
+  scan_cursor_t *cursors, *cursor;
+  unsigned int i, best;
+  int ret = 0, found;
+  if (!store->ordered)
+    return ERR_INVLDMSG;
+  cursors = calloc(store->nshards, sizeof(scan_cursor_t));
+  if (!cursors)
+    fatal_malloc();
+  /* Keys before PREFIX cannot start with it, so the scan starts at PREFIX. */
+  for (i = 0; i < store->nshards; i++)
+    scan_fill(&store->shards[i], &cursors[i], inclusive ? prefix : after, inclusive, prefix);
+  while (ret == 0) {
+    best = store->nshards;
+    for (i = 0; i < store->nshards; i++) {
+      cursor = &cursors[i];
+      if (cursor->pos == cursor->count && !cursor->done) {
+        /* Read on from the last key read, which is freed last. */
+        key = cursor->keys[cursor->count - 1];
+        for (unsigned int k = 0; k < cursor->count - 1; k++)
+          free(cursor->keys[k]);
+        scan_fill(&store->shards[i], cursor, key, false, prefix);
+        free(key);
+      }
+      if (cursor->pos < cursor->count &&
+          (best == store->nshards ||
+           strcmp(cursor->keys[cursor->pos], cursors[best].keys[cursors[best].pos]) < 0))
+        best = i;
+    }
+    if (best == store->nshards)
+      break;
+    /* An entry deleted since its key was read is passed over. */
+    key = cursors[best].keys[cursors[best].pos++];
+    found = kvstore_get(store, key, value);
+    if (found == 0 && !fn(arg, key, value))
+      ret = 1;
+    else if (found < 0 && found != ERR_NOKEY)
+      ret = found;
+  }
+  for (i = 0; i < store->nshards; i++) {
+    for (unsigned int k = 0; k < cursors[i].count; k++)
+      free(cursors[i].keys[k]);
+  }
+  free(cursors);
+  return ret;
+}
+
+/* Prints the size and false positive rate of the Bloom filters of STORE as
+ * text metrics, each named NAME_counter. The rate is both estimated from the
+ * bits set and counted: the fraction of the lookups of absent keys which the
+ * filters let pass. */
+void kvstore_print(kvstore_t *store, FILE *out, const char *name) {
+  unsigned long negatives = 0, false_positives = 0;
+  size_t bytes = 0;
+  double fpr = 0;
+  if (!store->filtered)
+    return;
+  for (unsigned int i = 0; i < store->nshards; i++) {
+    kvstore_shard_t *shard = &store->shards[i];
+    pthread_rwlock_rdlock(&shard->lock);
+    bytes += kvbloom_size(&shard->bloom);
+    fpr += kvbloom_fpr(&shard->bloom) / store->nshards;
+    negatives += __atomic_load_n(&shard->bloom.negatives, __ATOMIC_RELAXED);
+    false_positives += __atomic_load_n(&shard->bloom.false_positives, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&shard->lock);
+  }
+  fprintf(out, "%s_bloom_bytes %zu\n", name, bytes);
+  fprintf(out, "%s_bloom_estimated_fpr %.6f\n", name, fpr);
+  fprintf(out, "%s_bloom_negatives %lu\n", name, negatives);
+  fprintf(out, "%s_bloom_false_positives %lu\n", name, false_positives);
+  fprintf(out, "%s_bloom_fpr %.6f\n", name,
+          false_positives ? (double)false_positives / (false_positives + negatives) : 0.0);
+}
+
+/* Removes every file within the directory DIRNAME, then the directory. */
+static void remove_dir(char *dirname) {
   struct dirent *dent;
   char filename[MAX_FILENAME];
-  DIR *kvstoredir = opendir(store->dirname);
-  if (kvstoredir == NULL)
-    return 0;
-  while ((dent = readdir(kvstoredir)) != NULL) {
-    sprintf(filename, "%s/%s", store->dirname, dent->d_name);
-    remove(filename);
+  DIR *dir = opendir(dirname);
+  if (dir == NULL)
+    return;
+  while ((dent = readdir(dir)) != NULL) {
+    if (snprintf(filename, sizeof(filename), "%s/%s", dirname, dent->d_name) <
+        (int)sizeof(filename))
+      remove(filename);
   }
-  closedir(kvstoredir);
-  remove(store->dirname);
+  closedir(dir);
+  remove(dirname);
+}
+
+/* Deletes all current entries in STORE and removes the store directory,
+ * freeing STORE. You will need to reinitialize STORE following this action to
+ * continue using it. */
+int kvstore_destroy(kvstore_t *store) {
+  for (unsigned int i = 0; i < store->nshards; i++) {
+    kvstore_shard_t *shard = &store->shards[i];
+    if (store->backend == KVSTORE_LOG)
+      kvseg_close(&shard->seg);
+    else
+      index_free(shard);
+    if (store->ordered)
+      kvskip_destroy(&shard->order);
+    if (store->filtered)
+      kvbloom_destroy(&shard->bloom);
+    pthread_rwlock_destroy(&shard->lock);
+    if (store->nshards > 1)
+      remove_dir(shard->dirname);
+  }
+  free(store->shards);
+  store->shards = NULL;
+  store->nshards = 0;
+  remove_dir(store->dirname);
   return 0;
 }
+
+/* Deletes all current entries in STORE, leaving it empty but usable: the
+ * store directory is removed and created afresh, with a fresh active segment
+ * in each shard of a KVSTORE_LOG store. Returns 0 if successful, else a
+ * negative error code. */
+int kvstore_clean(kvstore_t *store) {
+  char dirname[MAX_FILENAME];
+  strcpy(dirname, store->dirname);
+  kvstore_destroy(store);
+  return kvstore_init(store, dirname, store->backend, store->sync);
+}
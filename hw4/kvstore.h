@@ -2,8 +2,13 @@
 #define __KV_STORE__
 
 #include <stdbool.h>
+#include <stdio.h>
 #include <pthread.h>
 #include "kvconstants.h"
+#include "kvseg.h"
+#include "kvskip.h"
+#include "kvbloom.h"
+#include "kvhash.h"
 
 /* KVStore defines the persistent storage used by a server to store <key, value>
  *entries.
@@ -33,6 +38,57 @@
  * that is, you may never have a chain which has entries with a chainpos of 0
  * and 2 but not 1.
  *
+ * An entry file is never modified in place. kvstore_put writes the new entry
+ * to a temporary file beside it, named like the entry with KVSTORE_TMPTYPE
+ * appended, and renames that over the entry, so a crash leaves either the old
+ * entry or the new one, never a torn mix; kvstore_init removes temporary
+ * files left behind. How durable a write is once it returns is chosen at
+ * kvstore_init (see kvstore_sync_t); main/syncbench.c measures what each
+ * level costs.
+ *
+ * To avoid probing the file system along a hash chain on every access, the
+ * location of every entry is also kept in memory: an index maps each key to
+ * its hash and chain position, and a table of chains records which key sits
+ * at each position. Both are populated by a single scan of the directory in
+ * kvstore_init and kept up to date by kvstore_put and kvstore_del.
+ *
+ * Alternatively, a KVStore may be initialized with the KVSTORE_LOG backend, in
+ * which case entries are instead appended to a small number of segment files
+ * and located through an in-memory index (see kvseg.h). This makes a lookup a
+ * single pread and an update a single append, rather than a walk over the
+ * hash chain. The backend is chosen at kvstore_init, and a directory must
+ * always be reopened with the backend that created it.
+ *
+ * So that writers to different keys do not contend, a store is split into
+ * shards by the kvhash64 of each key (see kvhash.h). Each shard has its own
+ * lock and keeps its entries, with either backend, in a subdirectory named
+ * KVSTORE_SHARD_PREFIX followed by its number, so a write only blocks the
+ * reads and writes of its own shard. The number of shards is fixed when the
+ * directory is created and recorded in its KVSTORE_SHARDS_FILE. A store with
+ * a single shard keeps its entries in the directory itself, as does one
+ * created before stores were sharded.
+ *
+ * Neither backend keeps keys in any order, so unless KVSTORE_ORDERED_INDEX is
+ * turned off, each shard also keeps its keys in a skiplist (see kvskip.h),
+ * populated in kvstore_init and kept up to date, under the shard's lock, by
+ * kvstore_put and kvstore_del. kvstore_scan merges the skiplists of all
+ * shards to visit the entries of a store in order of their keys, reading
+ * KVSTORE_SCAN_BATCH keys of a shard at a time, so that it holds no lock
+ * while the entries are handed out and never copies more than a few keys of
+ * each shard, however many it visits. A scan is not a snapshot: an entry
+ * written during it is visited only if its key has not yet been passed.
+ *
+ * Unless KVSTORE_BLOOM_FILTER is turned off, each shard also keeps a Bloom
+ * filter of its keys (see kvbloom.h), so that a lookup or deletion of an
+ * absent key is mostly answered without taking the shard's lock, and so
+ * without waiting for a write to the shard, which holds the lock while it
+ * writes (and perhaps syncs) an entry. Like the indexes, the filters are
+ * rebuilt from the keys by kvstore_init rather than persisted, so they can
+ * never be stale; a key is added to its filter by kvstore_put before it can
+ * be found, and the filter is rebuilt, under the shard's lock, once as many
+ * keys have been added as it is sized for. Their size and false positive
+ * rate are reported by kvstore_print.
+ *
  * All state is stored in persistent file storage, so it is valid to initialize
  * a KVStore using a directory name which was previously used for a KVStore,
  * and the new store will be an exact clone of the old store.
@@ -41,11 +97,101 @@
 /* The filetype to append to the filenames of entries within the log. */
 #define KVSTORE_FILETYPE ".entry"
 
+/* The suffix of the temporary file an entry is written to before it is
+ * renamed into place. */
+#define KVSTORE_TMPTYPE ".tmp"
+
+/* The file recording the number of shards of a store. */
+#define KVSTORE_SHARDS_FILE "shards"
+
+/* The prefix of the name of each shard's subdirectory. */
+#define KVSTORE_SHARD_PREFIX "shard-"
+
+/* The number of shards of a new store, or 0 for one per online CPU. */
+#ifndef KVSTORE_DEFAULT_SHARDS
+#define KVSTORE_DEFAULT_SHARDS 0
+#endif
+
+/* The largest number of shards of a store. */
+#define KVSTORE_MAX_SHARDS 64
+
+/* Whether shards keep their keys in order, which kvstore_scan requires. */
+#ifndef KVSTORE_ORDERED_INDEX
+#define KVSTORE_ORDERED_INDEX 1
+#endif
+
+/* Whether shards keep a Bloom filter of their keys. */
+#ifndef KVSTORE_BLOOM_FILTER
+#define KVSTORE_BLOOM_FILTER 1
+#endif
+
+/* The number of keys of a shard kvstore_scan reads under its lock at once. */
+#define KVSTORE_SCAN_BATCH 32
+
+/* The storage backends a KVStore can use. */
+typedef enum {
+  KVSTORE_FILES, /* One file per entry, as described above. */
+  KVSTORE_LOG    /* Append-only segment files plus an in-memory index. */
+} kvstore_backend_t;
+
+/* The backend used by TPCFollowers. */
+#ifndef KVSTORE_DEFAULT_BACKEND
+#define KVSTORE_DEFAULT_BACKEND KVSTORE_LOG
+#endif
+
+/* How durable an entry is once kvstore_put or kvstore_del returns. Entries
+ * are never torn at any level. */
+typedef enum {
+  KVSTORE_SYNC_NONE, /* Writes are left to the page cache. */
+  KVSTORE_SYNC_DATA, /* Every entry file (or append to a segment) is fdatasynced. */
+  KVSTORE_SYNC_DIR,  /* As above, and the directory is fsynced after every rename
+                        or removal, so the entry survives a power failure. */
+} kvstore_sync_t;
+
+/* The sync level used by TPCFollowers. Off by default, as a sync per write
+ * costs far more than the rest of a commit (see main/syncbench.c). */
+#ifndef KVSTORE_DEFAULT_SYNC
+#define KVSTORE_DEFAULT_SYNC KVSTORE_SYNC_NONE
+#endif
+
+/* The location of a single entry of a KVSTORE_FILES store. */
+typedef struct kvstore_key {
+  uint64_t hashval;      /* The hash of KEY. */
+  unsigned int chainpos; /* The position of the entry within its hash chain. */
+  UT_hash_handle hh;     /* Makes this structure hashable by KEY. */
+  char key[];            /* The null terminated key. */
+} kvstore_key_t;
+
+/* A single hash chain of a KVSTORE_FILES store. */
+typedef struct kvstore_chain {
+  uint64_t hashval;      /* The hash shared by all entries in this chain. */
+  unsigned int length;   /* The number of entries in this chain. */
+  unsigned int capacity; /* The allocated length of KEYS. */
+  kvstore_key_t **keys;  /* The entry at each position of this chain. */
+  UT_hash_handle hh;     /* Makes this structure hashable by HASHVAL. */
+} kvstore_chain_t;
+
+/* One shard of a KVStore. */
+typedef struct {
+  char dirname[MAX_FILENAME]; /* The directory holding the entries of this shard. */
+  kvstore_key_t *keys;        /* The entries of a KVSTORE_FILES shard, by key. */
+  kvstore_chain_t *chains;    /* The hash chains of a KVSTORE_FILES shard, by hash. */
+  kvseg_t seg;                /* The segments of a KVSTORE_LOG shard. */
+  kvskip_t order;             /* The keys of this shard in order, if the store is ordered. */
+  kvbloom_t bloom;            /* A filter of the keys of this shard, if the store is filtered. */
+  pthread_rwlock_t lock;      /* The lock used to make this shard thread-safe. */
+} kvstore_shard_t;
+
 /* A KVStore. */
 typedef struct {
   char dirname[MAX_FILENAME]; /* The name of the directory used to store its
                                  entries. */
-  pthread_rwlock_t lock;      /* The lock used to make KVStore's functions thread-safe. */
+  kvstore_backend_t backend;  /* The backend used to store entries. */
+  kvstore_sync_t sync;        /* How durably entries are written. */
+  bool ordered;               /* Whether shards keep their keys in order. */
+  bool filtered;              /* Whether shards keep a Bloom filter of their keys. */
+  unsigned int nshards;       /* The number of shards. */
+  kvstore_shard_t *shards;    /* The shards, which keys are spread over by hash. */
 } kvstore_t;
 
 /* A single kvstore entry.
@@ -57,7 +203,8 @@ typedef struct {
   char data[0]; /* Described above. */
 } kventry_t;
 
-int kvstore_init(kvstore_t *, char *dirname);
+int kvstore_init(kvstore_t *, char *dirname, kvstore_backend_t backend,
+                 kvstore_sync_t sync);
 
 int kvstore_get(kvstore_t *, char *key, char *value);
 
@@ -69,6 +216,16 @@ int kvstore_del_check(kvstore_t *, char *key);
 
 bool kvstore_haskey(kvstore_t *, char *key);
 
+/* Called by kvstore_scan with ARG for each entry visited. Returns false to end
+ * the scan at this entry. */
+typedef bool (*kvstore_scan_fn)(void *arg, const char *key, const char *value);
+
+int kvstore_scan(kvstore_t *, const char *after, const char *prefix, kvstore_scan_fn fn,
+                 void *arg);
+
+void kvstore_print(kvstore_t *, FILE *out, const char *name);
+
 int kvstore_clean(kvstore_t *);
+int kvstore_destroy(kvstore_t *);
 
 #endif
@@ -1,148 +1,374 @@
 #include <errno.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <fcntl.h>
 #include <stdbool.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 
 #include "kvconstants.h"
 #include "libhttp.h"
 
-#define FULLMSG_MAX_SIZE (HTTP_MSG_MAX_SIZE + 32)
 #define METHOD_MAX_SIZE 6 // "DELETE"
 
+/* The maximum length of the size line of a chunk, or of a trailer line. */
+#define CHUNK_LINE_MAX_SIZE 128
+
 #define min(a, b) (((a) < (b)) ? (a) : (b))
 
 static char *http_get_response_message(int status_code);
 static http_method_t http_method_from_string(char *method_buf);
+static bool http_wait(int fd, short events);
 
-bool http_request_receive(http_request_t *req, int fd) {
-  char read_buffer[FULLMSG_MAX_SIZE + 1];
-  int bytes_read = read(fd, read_buffer, FULLMSG_MAX_SIZE - 1);
-  if (bytes_read <= 0)
-    goto error;
-  read_buffer[bytes_read] = '\0'; /* Always null-terminate. */
+void http_parser_init(http_parser_t *parser) { memset(parser, 0, sizeof(*parser)); }
 
+/* Parses the request line of LENGTH bytes at LINE, without its line ending,
+ * into PARSER. Returns false if it is malformed. */
+static bool http_parse_request_line(http_parser_t *parser, const char *line, size_t length) {
+  const char *method_end = memchr(line, ' ', length), *path, *path_end, *end = line + length;
   char method_buf[METHOD_MAX_SIZE + 1];
-
-  char *read_init, *read_end;
-  size_t read_size;
+  size_t method_size;
 
   /* Read in the HTTP method: "[A-Z]*" */
-  read_init = read_end = read_buffer;
-  read_end = strchr(read_init, ' ');
-  if (!read_end)
-    goto error;
-  read_size = min(read_end - read_init, METHOD_MAX_SIZE);
-  memcpy(method_buf, read_init, read_size);
-  method_buf[read_size] = '\0';
-  req->method = http_method_from_string(method_buf);
-  if (req->method == INVALID)
-    goto error;
-  read_end++;
+  if (!method_end)
+    return false;
+  method_size = min(method_end - line, METHOD_MAX_SIZE);
+  memcpy(method_buf, line, method_size);
+  method_buf[method_size] = '\0';
+  parser->method = http_method_from_string(method_buf);
+  if (parser->method == INVALID)
+    return false;
 
   /* Read in the path. */
-  if (*read_end != '/')
-    goto error;
-  read_init = read_end;
-  while (*read_end != ' ' && *read_end != '\n') {
-    if (*read_end == '\0')
-      goto error;
-    read_end++;
-  }
-  read_size = min(read_end - read_init, HTTP_MSG_MAX_SIZE);
-  if (read_size == 0)
-    goto error;
-  memcpy(req->path, read_init, read_size);
-  req->path[read_size] = '\0';
+  path = method_end + 1;
+  if (path == end || *path != '/')
+    return false;
+  path_end = memchr(path, ' ', end - path);
+  if (!path_end)
+    path_end = end;
+  if (path_end - path > HTTP_MSG_MAX_SIZE)
+    return false;
+  parser->path_offset = path - line;
+  parser->path_length = path_end - path;
 
+  /* Read in the HTTP version, which decides whether the connection is
+   * persistent unless a Connection header says otherwise. */
+  parser->keep_alive = end - path_end > 8 && !memcmp(path_end + 1, "HTTP/1.1", 8);
   return true;
+}
 
-error:
-  return false;
+/* Parses the status line of LENGTH bytes at LINE, without its line ending,
+ * into PARSER. Returns false if it is malformed. */
+static bool http_parse_status_line(http_parser_t *parser, const char *line, size_t length) {
+  /* "HTTP/1.[01] [0-9]{3} <message>" */
+  if (length < 12 || (memcmp(line, "HTTP/1.1 ", 9) && memcmp(line, "HTTP/1.0 ", 9)))
+    return false;
+  parser->status = 0;
+  for (int i = 9; i < 12; i++) {
+    if (line[i] < '0' || line[i] > '9')
+      return false;
+    parser->status = parser->status * 10 + line[i] - '0';
+  }
+  if (length > 12 && line[12] != ' ')
+    return false;
+  return http_get_response_message(parser->status) != NULL;
 }
 
-bool http_response_receive(http_response_t *res, int fd) {
-  char read_buffer[FULLMSG_MAX_SIZE + 1];
-  int bytes_read = read(fd, read_buffer, FULLMSG_MAX_SIZE - 1);
-  if (bytes_read <= 0)
-    goto error;
-  read_buffer[bytes_read] = '\0'; /* Always null-terminate. */
-
-  char *read_init, *read_end, *read_limit;
-  size_t read_size;
-  size_t content_length = -1;
-  int status = -1;
-
-  /* Read in HTTP version: "HTTP/1.[01]" */
-  read_init = read_end = read_buffer;
-  read_end = strchr(read_init, ' ');
-  if (!read_end || read_init + 8 != read_end)
-    goto error;
-  if (strncmp(read_init, "HTTP/1.1", 8) && strncmp(read_init, "HTTP/1.0", 8))
-    goto error;
-  read_end++;
-  read_init = read_end;
-
-  /* Read in the response status: "[0-9]{3}" */
-  status = strtol(read_init, &read_end, 10);
-  if (!status || read_init + 3 != read_end || *read_end != ' ')
-    goto error;
-  res->status = status;
-  read_end++;
-  read_init = read_end;
-
-  /* Read in respone status text until \r\n */
-  read_end = strstr(read_init, "\r\n");
-  if (!read_end) {
-    read_end = strstr(read_init, "\n");
-    if (!read_end) {
-      goto error;
-    }
+/* Returns true if the header line of LENGTH bytes at LINE is named NAME,
+ * pointing VALUE at its value, without leading spaces. */
+static bool http_header_is(const char *line, size_t length, const char *name, strview_t *value) {
+  size_t name_length = strlen(name);
+  if (length <= name_length || line[name_length] != ':' || strncasecmp(line, name, name_length))
+    return false;
+  value->data = line + name_length + 1;
+  value->length = length - name_length - 1;
+  while (value->length > 0 && *value->data == ' ') {
+    value->data++;
+    value->length--;
   }
-  if (strncmp(read_init, http_get_response_message(res->status), read_end - read_init))
-    goto error;
-
-  /* Loop through headers until Content-Length, or bust. */
-  while (strncmp(read_end, "\n\n", 2) && strncmp(read_end, "\r\n\r\n", 4)) {
-    read_end += 2;
-    read_init = read_end;
-    read_limit = strstr(read_init, "\r\n");
-    if (!read_limit) {
-      read_limit = strstr(read_init, "\n");
-      if (!read_limit) {
-        goto error;
-      }
-    }
-    read_end = strstr(read_init, ": ");
-    if (!read_end || read_end > read_limit)
-      goto error;                                                      /* Malformed header */
-    if (!strncmp(read_init, "Content-Length", read_end - read_init)) { /* Found it! */
-      read_init = read_end + 2;
-      content_length = strtol(read_init, &read_end, 10);
-      while (*read_end == ' ')
-        read_end++;
-      if (read_end != read_limit)
-        goto error;
+  return true;
+}
+
+/* Parses the header line of LENGTH bytes at LINE, without its line ending,
+ * into PARSER. DATA is the start of the message. Returns false if it is
+ * malformed. */
+static bool http_parse_header(http_parser_t *parser, const char *data, const char *line,
+                              size_t length) {
+  strview_t value;
+  if (!memchr(line, ':', length))
+    return false;
+  if (http_header_is(line, length, "Connection", &value)) {
+    if (value.length >= 5 && !strncasecmp(value.data, "close", 5))
+      parser->keep_alive = false;
+    else if (value.length >= 10 && !strncasecmp(value.data, "keep-alive", 10))
+      parser->keep_alive = true;
+  } else if (http_header_is(line, length, "Upgrade", &value)) {
+    parser->upgrade_offset = value.data - data;
+    parser->upgrade_length = value.length;
+  } else if (http_header_is(line, length, "Content-Length", &value)) {
+    parser->content_length = 0;
+    for (size_t i = 0; i < value.length && value.data[i] != ' ' && value.data[i] != '\t'; i++) {
+      if (value.data[i] < '0' || value.data[i] > '9')
+        return false;
+      parser->content_length = parser->content_length * 10 + value.data[i] - '0';
+      if (parser->content_length > HTTP_STREAM_MAX_SIZE)
+        return false;
     }
-    read_end = read_limit;
+  } else if (http_header_is(line, length, "Transfer-Encoding", &value)) {
+    /* Chunked is the only transfer coding we support. */
+    if (value.length < 7 || strncasecmp(value.data, "chunked", 7))
+      return false;
+    parser->chunked = true;
   }
-  read_end += 4;
-  read_init = read_end;
+  return true;
+}
 
-  /* Read body */
-  read_size = min(content_length, HTTP_MSG_MAX_SIZE);
-  memcpy(res->body, read_init, read_size);
-  res->body[read_size] = '\0';
+/* Returns true if the body of the message parsed by PARSER is streamed rather
+ * than received whole (see libhttp.h). */
+static bool http_streamed(http_parser_t *parser) {
+  return parser->chunked || parser->content_length > HTTP_BODY_MAX_SIZE;
+}
 
-  return true;
+/* Continues parsing the message at the start of the LENGTH bytes at DATA with
+ * PARSER, as a response if RESPONSE is set. Returns the length of the message
+ * (or of its headers, if its body is streamed) once DATA holds all of it, 0 if
+ * it does not yet, or -1 if it is malformed. */
+static ssize_t http_parse(http_parser_t *parser, bool response, const char *data,
+                          size_t length) {
+  const char *line, *line_end;
+  size_t line_length;
+  bool valid = true;
+
+  while (parser->headers_length == 0) {
+    line = data + parser->offset;
+    line_end = memchr(line, '\n', length - parser->offset);
+    if (!line_end)
+      return length < HTTP_HEADERS_MAX_SIZE ? 0 : -1;
+    if (line_end + 1 - data > HTTP_HEADERS_MAX_SIZE)
+      return -1;
+    line_length = line_end - line;
+    if (line_length > 0 && line[line_length - 1] == '\r')
+      line_length--;
+
+    if (parser->offset == 0)
+      valid = response ? http_parse_status_line(parser, line, line_length)
+                       : http_parse_request_line(parser, line, line_length);
+    else if (line_length == 0)
+      parser->headers_length = line_end + 1 - data;
+    else
+      valid = http_parse_header(parser, data, line, line_length);
+    if (!valid)
+      return -1;
+    parser->offset = line_end + 1 - data;
+  }
 
-error:
+  if (http_streamed(parser))
+    return parser->headers_length;
+  if (length < parser->headers_length + parser->content_length)
+    return 0;
+  return parser->headers_length + parser->content_length;
+}
+
+ssize_t http_request_parse(http_parser_t *parser, http_request_t *req, const char *data,
+                           size_t length) {
+  ssize_t ret = http_parse(parser, false, data, length);
+  if (ret == 0)
+    return 0;
+  if (ret > 0) {
+    req->method = parser->method;
+    req->path.data = data + parser->path_offset;
+    req->path.length = parser->path_length;
+    req->upgrade.data = data + parser->upgrade_offset;
+    req->upgrade.length = parser->upgrade_length;
+    req->body.data = data + parser->headers_length;
+    req->body.length = parser->content_length;
+    req->keep_alive = parser->keep_alive;
+    req->streamed = http_streamed(parser);
+    req->chunked = parser->chunked;
+    req->content_length = parser->content_length;
+    if (req->streamed)
+      req->body.length = length - parser->headers_length;
+  }
+  http_parser_init(parser);
+  return ret;
+}
+
+ssize_t http_response_parse(http_parser_t *parser, http_response_t *res, const char *data,
+                            size_t length) {
+  ssize_t ret = http_parse(parser, true, data, length);
+  if (ret == 0)
+    return 0;
+  if (ret > 0) {
+    res->status = parser->status;
+    res->body.data = data + parser->headers_length;
+    res->body.length = parser->content_length;
+    res->streamed = http_streamed(parser);
+    res->chunked = parser->chunked;
+    res->content_length = parser->content_length;
+    if (res->streamed)
+      res->body.length = length - parser->headers_length;
+  }
+  http_parser_init(parser);
+  return ret;
+}
+
+bool http_request_receive(http_request_t *req, int fd, char *buf, size_t size) {
+  http_parser_t parser;
+  size_t length = 0;
+  ssize_t bytes_read, ret = 0;
+  http_parser_init(&parser);
+  while (ret == 0 && length < size) {
+    bytes_read = read(fd, buf + length, size - length);
+    if (bytes_read <= 0)
+      return false;
+    length += bytes_read;
+    ret = http_request_parse(&parser, req, buf, length);
+  }
+  return ret > 0;
+}
+
+bool http_response_receive(http_response_t *res, int fd, char *buf, size_t size) {
+  http_parser_t parser;
+  size_t length = 0;
+  ssize_t bytes_read, ret = 0;
+  http_parser_init(&parser);
+  while (ret == 0 && length < size) {
+    bytes_read = read(fd, buf + length, size - length);
+    if (bytes_read <= 0)
+      return false;
+    length += bytes_read;
+    ret = http_response_parse(&parser, res, buf, length);
+  }
+  return ret > 0;
+}
+
+void http_body_init(http_body_t *body, int fd, strview_t received, bool chunked,
+                    size_t content_length) {
+  body->fd = fd;
+  body->received = received;
+  body->consumed = 0;
+  body->chunked = chunked;
+  body->started = false;
+  body->remaining = chunked ? 0 : content_length;
+  body->length = 0;
+  body->done = !chunked && content_length == 0;
+}
+
+/* Reads up to SIZE raw bytes of BODY into BUF: what is left of the bytes it
+ * received along with the headers, else whatever has arrived on its
+ * connection, waiting for some if need be. The bytes are left to be read
+ * again if FLAGS holds MSG_PEEK. Returns the number of bytes read, or -1 if
+ * the connection failed or was closed. */
+static ssize_t http_body_raw(http_body_t *body, char *buf, size_t size, int flags) {
+  size_t available = body->received.length - body->consumed;
+  ssize_t bytes_read;
+  if (available > 0) {
+    size = min(size, available);
+    memcpy(buf, body->received.data + body->consumed, size);
+    if (!(flags & MSG_PEEK))
+      body->consumed += size;
+    return size;
+  }
+  if (body->fd < 0)
+    return -1;
+  while ((bytes_read = recv(body->fd, buf, size, flags)) < 0) {
+    if (errno == EINTR)
+      continue;
+    if ((errno != EAGAIN && errno != EWOULDBLOCK) || !http_wait(body->fd, POLLIN))
+      return -1;
+  }
+  return bytes_read > 0 ? bytes_read : -1;
+}
+
+/* Reads the next line of the chunk framing of BODY into the SIZE bytes at
+ * LINE, as a null terminated string without its line ending. The line is
+ * looked for in a peek at what has arrived, so that nothing after it is read.
+ * Returns false if it cannot be read or is too long. */
+static bool http_body_line(http_body_t *body, char *line, size_t size) {
+  size_t length = 0;
+  ssize_t peeked;
+  char *end;
+  while (length < size - 1) {
+    peeked = http_body_raw(body, line + length, size - 1 - length, MSG_PEEK);
+    if (peeked < 0)
+      return false;
+    end = memchr(line + length, '\n', peeked);
+    if (end)
+      peeked = end + 1 - (line + length);
+    if (http_body_raw(body, line + length, peeked, 0) != peeked)
+      return false;
+    length += peeked;
+    if (end) {
+      length -= 1 + (length > 1 && line[length - 2] == '\r');
+      line[length] = '\0';
+      return true;
+    }
+  }
   return false;
 }
 
+/* Starts the next chunk of the chunked BODY: reads the end of the last one,
+ * if any, and the size line of the next. At the last chunk, reads the
+ * trailers and marks BODY done. Returns false if the framing is malformed. */
+static bool http_body_next_chunk(http_body_t *body) {
+  char line[CHUNK_LINE_MAX_SIZE], *end;
+  unsigned long size;
+  if (body->started && (!http_body_line(body, line, sizeof(line)) || line[0] != '\0'))
+    return false;
+  body->started = true;
+  if (!http_body_line(body, line, sizeof(line)))
+    return false;
+  errno = 0;
+  size = strtoul(line, &end, 16);
+  /* Chunk extensions follow a semicolon, and are ignored. */
+  if (end == line || (*end != '\0' && *end != ';' && *end != ' ') || errno || line[0] == '-')
+    return false;
+  if (size > HTTP_STREAM_MAX_SIZE - body->length)
+    return false;
+  body->remaining = size;
+  if (size > 0)
+    return true;
+  do {
+    if (!http_body_line(body, line, sizeof(line)))
+      return false;
+  } while (line[0] != '\0');
+  body->done = true;
+  return true;
+}
+
+ssize_t http_body_read(http_body_t *body, char *buf, size_t size) {
+  ssize_t bytes_read;
+  if (body->done)
+    return 0;
+  if (body->chunked && body->remaining == 0 && !http_body_next_chunk(body))
+    return -1;
+  if (body->done)
+    return 0;
+  bytes_read = http_body_raw(body, buf, min(size, body->remaining), 0);
+  if (bytes_read < 0)
+    return -1;
+  body->remaining -= bytes_read;
+  body->length += bytes_read;
+  if (!body->chunked && body->remaining == 0)
+    body->done = true;
+  return bytes_read;
+}
+
+ssize_t http_body_copy(http_body_t *body, int fd) {
+  char buf[HTTP_STREAM_BUFFER_SIZE];
+  ssize_t bytes_read;
+  while ((bytes_read = http_body_read(body, buf, sizeof(buf))) > 0) {
+    if (http_write(fd, buf, bytes_read) < 0)
+      return -1;
+  }
+  return bytes_read < 0 ? -1 : (ssize_t)body->length;
+}
+
 static http_method_t http_method_from_string(char *method_buf) {
   if (!strcmp(method_buf, "GET"))
     return GET;
@@ -155,7 +381,7 @@ static http_method_t http_method_from_string(char *method_buf) {
   return INVALID;
 }
 
-static char *http_method_to_string(http_method_t method) {
+char *http_method_to_string(http_method_t method) {
   switch (method) {
   case GET:
     return "GET";
@@ -182,6 +408,8 @@ static char *http_get_response_message(int status_code) {
     return "Accepted";
   case 204:
     return "No Content";
+  case 206:
+    return "Partial Content";
   case 301:
     return "Moved Permanently";
   case 302:
@@ -198,6 +426,8 @@ static char *http_get_response_message(int status_code) {
     return "Not Found";
   case 405:
     return "Method Not Allowed";
+  case 413:
+    return "Payload Too Large";
   case 500:
     return "Internal Server Error";
   default:
@@ -242,20 +472,123 @@ void http_outbound_add_data(http_outbound_t *msg, char *data, size_t size) {
   msg->end += size;
 }
 
-int http_outbound_send(http_outbound_t *msg) {
-  msg->body[msg->end] = '\0';
+/* Waits up to TIMEOUT seconds for FD to become ready for EVENTS. Returns
+ * false if it did not. */
+static bool http_wait(int fd, short events) {
+  struct pollfd pfd = {.fd = fd, .events = events};
+  int ready;
+  while ((ready = poll(&pfd, 1, TIMEOUT * 1000)) < 0 && errno == EINTR)
+    ;
+  return ready > 0;
+}
 
-  char *send = msg->body;
-  int bytes_left = msg->end;
+int http_write(int fd, const char *data, size_t size) {
+  ssize_t bytes_sent;
+  while (size > 0) {
+    bytes_sent = write(fd, data, size);
+    if (bytes_sent < 0) {
+      if (errno == EINTR)
+        continue;
+      if ((errno != EAGAIN && errno != EWOULDBLOCK) || !http_wait(fd, POLLOUT))
+        return -1;
+      continue;
+    }
+    size -= bytes_sent;
+    data += bytes_sent;
+  }
+  return 0;
+}
 
+int http_sendfile(int sockfd, int fd, off_t offset, size_t length) {
   ssize_t bytes_sent;
-  while (bytes_left > 0) {
-    bytes_sent = write(msg->fd, send, bytes_left);
-    if (bytes_sent < 0)
-      return bytes_sent;
-    bytes_left -= bytes_sent;
-    send += bytes_sent;
+  while (length > 0) {
+    bytes_sent = sendfile(sockfd, fd, &offset, length);
+    if (bytes_sent < 0) {
+      if (errno == EINTR)
+        continue;
+      if ((errno != EAGAIN && errno != EWOULDBLOCK) || !http_wait(sockfd, POLLOUT))
+        return -1;
+      continue;
+    }
+    /* The file is shorter than it should be. */
+    if (bytes_sent == 0)
+      return -1;
+    length -= bytes_sent;
   }
+  return 0;
+}
 
+int http_outbound_send(http_outbound_t *msg) {
+  msg->body[msg->end] = '\0';
+  if (http_write(msg->fd, msg->body, msg->end) < 0)
+    return -1;
   return msg->end;
 }
+
+void http_outbound_encode(http_outbound_t *msg, http_buffer_t *out) {
+  http_buffer_append(out, msg->body, msg->end);
+}
+
+bool http_encode_headers(http_buffer_t *out, int status_code, char *content_type, size_t size) {
+  char *status = http_get_response_message(status_code), headers[256];
+  int length;
+  if (!status || (content_type && strlen(content_type) > 128))
+    return false;
+  length = sprintf(headers, "HTTP/1.1 %d %s\r\n", status_code, status);
+  if (content_type)
+    length += sprintf(headers + length, "Content-Type: %s\r\n", content_type);
+  length += sprintf(headers + length, "Content-Length: %zu\r\n\r\n", size);
+  http_buffer_append(out, headers, length);
+  return true;
+}
+
+bool http_encode_response(http_buffer_t *out, int status_code, char *content_type, char *body,
+                          size_t size) {
+  if (!http_encode_headers(out, status_code, content_type, size))
+    return false;
+  http_buffer_append(out, body, size);
+  return true;
+}
+
+void http_buffer_init(http_buffer_t *buf) {
+  buf->data = NULL;
+  buf->length = buf->capacity = 0;
+}
+
+void http_buffer_append_string(http_buffer_t *buf, const char *str) {
+  http_buffer_append(buf, str, strlen(str));
+}
+
+void http_buffer_append(http_buffer_t *buf, const char *data, size_t size) {
+  if (buf->length + size > buf->capacity) {
+    buf->capacity = buf->capacity ? buf->capacity : 256;
+    while (buf->length + size > buf->capacity)
+      buf->capacity *= 2;
+    buf->data = realloc(buf->data, buf->capacity);
+    if (!buf->data)
+      fatal_malloc();
+  }
+  memcpy(buf->data + buf->length, data, size);
+  buf->length += size;
+}
+
+/* Removes the first SIZE bytes from BUF. */
+void http_buffer_consume(http_buffer_t *buf, size_t size) {
+  if (size >= buf->length) {
+    buf->length = 0;
+    return;
+  }
+  memmove(buf->data, buf->data + size, buf->length - size);
+  buf->length -= size;
+}
+
+void http_buffer_free(http_buffer_t *buf) {
+  free(buf->data);
+  http_buffer_init(buf);
+}
+
+int http_buffer_send(http_buffer_t *buf, int fd) {
+  int ret = http_write(fd, buf->data, buf->length);
+  buf->length = 0;
+  return ret;
+}
@@ -6,6 +6,7 @@
 #define LIBHTTP_H
 
 #include <stddef.h>
+#include <sys/types.h>
 #include "kvconstants.h"
 
 typedef enum {
@@ -17,23 +18,158 @@ typedef enum {
   /* NOTE: There are other methods, but these are the only ones we care about. */
 } http_method_t;
 
+/*--- BUFFERS ---*/
+
+/* A growable buffer of bytes which have been received on a connection but not
+ * yet parsed, or which are waiting to be sent on it. */
+typedef struct {
+  char *data;
+  size_t length;
+  size_t capacity;
+} http_buffer_t;
+
+void http_buffer_init(http_buffer_t *);
+void http_buffer_append(http_buffer_t *, const char *data, size_t size);
+void http_buffer_append_string(http_buffer_t *, const char *str);
+void http_buffer_consume(http_buffer_t *, size_t size);
+void http_buffer_free(http_buffer_t *);
+
+/* Writes all of BUF to SOCKFD and empties BUF. Returns 0, or -1 on error. */
+int http_buffer_send(http_buffer_t *buf, int sockfd);
+
+/* Writes all SIZE bytes at DATA to FD, waiting up to TIMEOUT seconds at a
+ * time for a non-blocking socket to accept more. Returns 0, or -1 on
+ * error. */
+int http_write(int fd, const char *data, size_t size);
+
 /*--- RECIEVING AND PARSING ---*/
 
+/* The maximum length of the start line and headers of a message. */
+#define HTTP_HEADERS_MAX_SIZE (HTTP_MSG_MAX_SIZE + 1024)
+
+/* The maximum length of the body of a message, which is largest for a batch
+ * request. */
+#define HTTP_BODY_MAX_SIZE MAX_BATCHLEN
+
+/* The maximum length of a whole message, and so the size a receive buffer
+ * needs to be. */
+#define HTTP_RECV_MAX_SIZE (HTTP_HEADERS_MAX_SIZE + HTTP_BODY_MAX_SIZE)
+
+/* The maximum length of the body of a message which is streamed rather than
+ * received whole (see below). */
+#define HTTP_STREAM_MAX_SIZE MAX_BLOBLEN
+
+/* The size of the buffer a streamed body is copied through. */
+#define HTTP_STREAM_BUFFER_SIZE (64 * 1024)
+
+/* A message whose body is longer than HTTP_BODY_MAX_SIZE, or sent in chunked
+ * transfer coding, is streamed: it is parsed as soon as its headers are
+ * complete, and its body, of up to HTTP_STREAM_MAX_SIZE bytes, is then read
+ * from the connection a piece at a time with an http_body_t (see below).
+ * Shorter bodies are received whole, along with the headers. */
+
+/* A parsed request. PATH, UPGRADE and BODY point into the buffer it was parsed
+ * from. */
 typedef struct {
   http_method_t method;
-  char path[HTTP_MSG_MAX_SIZE + 1];
+  strview_t path;        /* The path, including the query string. */
+  strview_t upgrade;     /* The value of the Upgrade header, if any. */
+  strview_t body;        /* The content of the request, if any, or if STREAMED is
+                            set, the bytes received after its headers. */
+  bool keep_alive;       /* Whether the client wants to reuse the connection. */
+  bool streamed;         /* Whether the body is yet to be read (see above). */
+  bool chunked;          /* Whether the body is in chunked transfer coding. */
+  size_t content_length; /* The length of the body, unless it is CHUNKED. */
 } http_request_t;
 
+/* A parsed response. BODY points into the buffer it was parsed from, and the
+ * other fields are as in a request. */
 typedef struct {
   int status;
-  char body[HTTP_MSG_MAX_SIZE + 1];
+  strview_t body;
+  bool streamed;
+  bool chunked;
+  size_t content_length;
 } http_response_t;
 
-bool http_request_receive(http_request_t *, int sockfd);
-bool http_response_receive(http_response_t *, int sockfd);
+/* The state of an incremental parse of a single message from the start of a
+ * buffer. Since more data may only be appended to the buffer, each line of
+ * the message is parsed exactly once, as soon as it is complete, however many
+ * reads it arrives in. Positions are kept as offsets, so the buffer may move
+ * between calls. */
+typedef struct {
+  size_t offset;         /* The offset of the first line not yet parsed. */
+  size_t headers_length; /* The length of all headers, once they are complete. */
+  size_t content_length; /* The length of the body, per the headers. */
+  http_method_t method;  /* The method of a request. */
+  int status;            /* The status code of a response. */
+  size_t path_offset;    /* Where the path of a request starts. */
+  size_t path_length;    /* The length of the path of a request. */
+  size_t upgrade_offset; /* Where the value of the Upgrade header starts. */
+  size_t upgrade_length; /* The length of the value of the Upgrade header. */
+  bool keep_alive;       /* Whether the connection is persistent. */
+  bool chunked;          /* Whether the body is in chunked transfer coding. */
+} http_parser_t;
+
+void http_parser_init(http_parser_t *);
+
+/* Continues parsing the request or response at the start of the LENGTH bytes
+ * at DATA with PARSER. Returns the length of the message once DATA holds all
+ * of it (or, if its body is streamed, the length of its headers), filling in
+ * REQ or RES with views into DATA; 0 if DATA does not yet hold all of it; or
+ * -1 if it is malformed. PARSER is reset for the next message unless 0 is
+ * returned. */
+ssize_t http_request_parse(http_parser_t *parser, http_request_t *req, const char *data,
+                           size_t length);
+ssize_t http_response_parse(http_parser_t *parser, http_response_t *res, const char *data,
+                            size_t length);
+
+/* Reads from SOCKFD into the SIZE bytes at BUF until they hold a whole
+ * request or response (or the headers of one whose body is streamed), and
+ * parses it into REQ or RES. Any bytes following the message are discarded.
+ * Returns false if there is an error. */
+bool http_request_receive(http_request_t *req, int sockfd, char *buf, size_t size);
+bool http_response_receive(http_response_t *res, int sockfd, char *buf, size_t size);
+
+/* The body of a received message, which is read in order, a piece at a time.
+ * Its first bytes may already have been received along with the headers, in
+ * which case they are read from there, and the rest from its connection; no
+ * byte past the end of the body is ever read from the connection, so a
+ * message which follows it on the same connection is left for the next
+ * receive. */
+typedef struct {
+  int fd;             /* The connection the rest of the body arrives on, or -1. */
+  strview_t received; /* The bytes received after the headers. */
+  size_t consumed;    /* The bytes of RECEIVED which have been read as part of the body. */
+  bool chunked;       /* Whether the body is in chunked transfer coding. */
+  bool started;       /* Whether the first chunk has been started, if CHUNKED. */
+  size_t remaining;   /* The bytes left of the body, or of its current chunk if CHUNKED. */
+  size_t length;      /* The bytes of content read so far. */
+  bool done;          /* Whether all of the body has been read. */
+} http_body_t;
+
+/* Initializes BODY to read the body of a message of CONTENT_LENGTH bytes, or
+ * in chunked transfer coding if CHUNKED is set, whose first bytes are
+ * RECEIVED, from FD. */
+void http_body_init(http_body_t *body, int fd, strview_t received, bool chunked,
+                    size_t content_length);
+
+/* Reads up to SIZE bytes of the content of BODY into BUF, waiting up to
+ * TIMEOUT seconds at a time for more to arrive. Returns the number of bytes
+ * read, 0 once all of it has been, or -1 if the connection failed or the body
+ * is malformed or longer than HTTP_STREAM_MAX_SIZE. */
+ssize_t http_body_read(http_body_t *body, char *buf, size_t size);
+
+/* Reads the rest of the content of BODY and writes it to FD, through a buffer
+ * of HTTP_STREAM_BUFFER_SIZE bytes. Returns the number of bytes written, or
+ * -1 on error. */
+ssize_t http_body_copy(http_body_t *body, int fd);
 
 /*--- SENDING ---*/
 
+/* Returns the name of METHOD, or NULL if it is INVALID. */
+char *http_method_to_string(http_method_t method);
+
 /* Represents an under-construction, outbound HTTP message. */
 typedef struct {
   int fd;
@@ -59,4 +195,24 @@ void http_outbound_add_data(http_outbound_t *, char *data, size_t size);
  */
 int http_outbound_send(http_outbound_t *);
 
+/* Appends the message to OUT instead of sending it. */
+void http_outbound_encode(http_outbound_t *, http_buffer_t *out);
+
+/* Appends a complete response with status STATUS_CODE whose content is the
+ * SIZE bytes at BODY, of type CONTENT_TYPE, to OUT. Unlike an http_outbound
+ * message, BODY may be of any size, and is copied only once, straight into
+ * OUT. Returns false on error. */
+bool http_encode_response(http_buffer_t *out, int status_code, char *content_type, char *body,
+                          size_t size);
+
+/* Appends the status line and headers of a response with status STATUS_CODE
+ * whose content is SIZE bytes of type CONTENT_TYPE (if it is not NULL) to
+ * OUT, for the content to be sent after them. Returns false on error. */
+bool http_encode_headers(http_buffer_t *out, int status_code, char *content_type, size_t size);
+
+/* Sends the LENGTH bytes at OFFSET of the file FD on SOCKFD, without copying
+ * them through user space, waiting as http_write does. Returns 0, or -1 on
+ * error. */
+int http_sendfile(int sockfd, int fd, off_t offset, size_t length);
+
 #endif
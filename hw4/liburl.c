@@ -8,97 +8,61 @@
 #include "kvconstants.h"
 #include "liburl.h"
 
-void zero_params(url_params_t *params) {
-  memset(params->path, 0, PATH_MAX_SIZE + 1);
-  memset(params->key, 0, MAX_KEYLEN + 1);
-  memset(params->val, 0, MAX_VALLEN + 1);
-}
-
-struct param {
-  char *ptr;
-  int max_size;
-};
-
-static bool get_param_ptr(struct param *p, url_params_t *params, char *key, int keylen) {
-  if (!strncmp(key, "key", keylen)) {
-    p->ptr = params->key;
-    p->max_size = MAX_KEYLEN;
-    return true;
-  }
-  if (!strncmp(key, "val", keylen)) {
-    p->ptr = params->val;
-    p->max_size = MAX_VALLEN;
+bool url_decode(url_views_t *views, const char *url, size_t length) {
+  const char *end = url + length, *query, *param_end, *key_end;
+  memset(views, 0, sizeof(*views));
+  if (length == 0)
     return true;
-  }
-  return false;
-}
 
-bool url_decode(url_params_t *params, char *url) {
-  char *read_end;
-  size_t read_size;
-
-  /* Write path to url_params struct */
-  read_end = strchr(url, '?');
-  if (read_end == NULL) { /* No params found. */
-    read_size = strlen(url) - 1;
-  } else {
-    read_size = read_end - url - 1;
-  }
-  read_size = min(read_size, PATH_MAX_SIZE);
-  if (read_size > 0) {
-    memcpy(params->path, url + 1, read_size);
-    params->path[read_size] = '\0';
-  }
-  if (read_end == NULL) {
-    goto end; /* No params to parse. */
-  } else {
-    url = read_end + 1;
-  }
+  /* The path runs from after the leading slash up to the query string. */
+  query = memchr(url, '?', length);
+  views->path.data = url + 1;
+  views->path.length = (query ? query : end) - url - 1;
+  if (!query)
+    return true; /* No params to parse. */
 
   /* Loop through parameters, pulling only those that we support (i.e., key,
-   * val) */
-  struct param param;
-  bool found_param = false;
-  char *key_end;
-  while (*read_end != '\0') {
-    key_end = strchr(url, '=');
-    if (key_end == NULL)
-      break;
-    read_end = strchr(url, '&');
-    if (read_end == NULL)
-      read_end = url + strlen(url);
-
-    found_param = get_param_ptr(&param, params, url, key_end - url);
-    if (!found_param) {
-      if (*url == '\0')
-        goto end;
-      url = read_end + 1;
+   * val, txn, prefix, limit). A later parameter of the same name overrides an earlier one. */
+  for (url = query + 1; url < end; url = param_end + 1) {
+    param_end = memchr(url, '&', end - url);
+    if (!param_end)
+      param_end = end;
+    key_end = memchr(url, '=', param_end - url);
+    if (!key_end)
       continue;
+    if (key_end - url == 3 && !memcmp(url, "key", 3)) {
+      views->key.data = key_end + 1;
+      views->key.length = param_end - key_end - 1;
+    } else if (key_end - url == 3 && !memcmp(url, "val", 3)) {
+      views->val.data = key_end + 1;
+      views->val.length = param_end - key_end - 1;
+    } else if (key_end - url == 3 && !memcmp(url, "txn", 3)) {
+      views->txn.data = key_end + 1;
+      views->txn.length = param_end - key_end - 1;
+    } else if (key_end - url == 6 && !memcmp(url, "prefix", 6)) {
+      views->prefix.data = key_end + 1;
+      views->prefix.length = param_end - key_end - 1;
+    } else if (key_end - url == 5 && !memcmp(url, "limit", 5)) {
+      views->limit.data = key_end + 1;
+      views->limit.length = param_end - key_end - 1;
     }
-
-    read_size = min(read_end - key_end - 1, param.max_size);
-    memcpy(param.ptr, key_end + 1, read_size);
-    param.ptr[read_size] = '\0';
-
-    url = read_end + 1;
   }
-
-end:
   return true;
 }
 
-void url_encode(char *url, url_params_t *params) {
-  char buf[HTTP_MSG_MAX_SIZE];
-  int end = 0;
-  if (params->path)
-    end += sprintf(buf + end, "/%s?", params->path);
-  else
-    end += sprintf(buf + end, "/?");
-  if (params->key)
-    end += sprintf(buf + end, "key=%s&", params->key);
-  if (params->val)
-    end += sprintf(buf + end, "val=%s&", params->val);
-  buf[end - 1] = '\0';
-
-  strcpy(url, buf);
+void url_encode(http_buffer_t *out, const url_views_t *params) {
+  const strview_t *values[] = {&params->key, &params->val, &params->txn, &params->prefix,
+                               &params->limit};
+  static const char *names[] = {"key=", "val=", "txn=", "prefix=", "limit="};
+  char separator = '?';
+  http_buffer_append(out, "/", 1);
+  http_buffer_append(out, params->path.data, params->path.length);
+  for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+    if (values[i]->length == 0)
+      continue;
+    http_buffer_append(out, &separator, 1);
+    http_buffer_append_string(out, names[i]);
+    http_buffer_append(out, values[i]->data, values[i]->length);
+    separator = '&';
+  }
 }
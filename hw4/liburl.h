@@ -7,24 +7,27 @@
 
 #include <stdlib.h>
 #include "kvconstants.h"
+#include "libhttp.h"
 
 /*
- * URL path plus accepted query parameters from an HTTP request to our servers.
+ * The URL path (without its leading slash) and accepted query parameters of
+ * an HTTP request, as views into the URL they were decoded from.
  */
 typedef struct {
-  char path[PATH_MAX_SIZE + 1];
-  char key[MAX_KEYLEN + 1];
-  char val[MAX_VALLEN + 1];
-} url_params_t;
+  strview_t path;
+  strview_t key;
+  strview_t val;
+  strview_t txn;
+  strview_t prefix;
+  strview_t limit;
+} url_views_t;
 
-/* Helper method to zero out all fields in a url_params_t struct */
-void zero_params(url_params_t *params);
+/* Unmarshalls the valid paramters within the LENGTH bytes at URL into VIEWS,
+ * without copying them. */
+bool url_decode(url_views_t *views, const char *url, size_t length);
 
-/* Unmarshalls the valid paramters within URLSTR into PARAMS. */
-bool url_decode(url_params_t *params, char *url);
-
-/* Marshalls the non-null params from PARAMS into an HTTP-compatible URL string
- */
-void url_encode(char *url, url_params_t *params);
+/* Marshalls the path and the non-empty params of PARAMS into an
+ * HTTP-compatible URL, appended straight to OUT. */
+void url_encode(http_buffer_t *out, const url_views_t *params);
 
 #endif
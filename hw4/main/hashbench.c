@@ -0,0 +1,96 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "histogram.h"
+#include "kvconstants.h"
+#include "kvhash.h"
+
+/* Measures the cost of hashing a key with kvhash64 (kvhash.h) against the
+ * MD5 based strhash64 it replaced for indexing, and against HASH_JEN, the
+ * function uthash used before, for keys of several lengths. Also checks that
+ * kvhash64 spreads similar keys evenly over hash table buckets. */
+
+const char *USAGE = "Usage: hashbench [iterations (default=1000000)]";
+
+/* The lengths of the keys hashed, up to MAX_KEYLEN. */
+static const size_t lengths[] = {8, 16, 32, 64, 256, MAX_KEYLEN};
+#define NLENGTHS (int)(sizeof(lengths) / sizeof(lengths[0]))
+
+/* The number of buckets (a power of two) keys are spread over by spread. */
+#define SPREAD_BUCKETS (1 << 16)
+
+static volatile uint64_t sink;
+
+static uint64_t md5_hash(const char *key, size_t length) { return strhash64(key); }
+
+static uint64_t jen_hash(const char *key, size_t length) {
+  unsigned hashv, bkt;
+  HASH_JEN(key, length, 1, hashv, bkt);
+  (void)bkt;
+  return hashv;
+}
+
+static uint64_t fast_hash(const char *key, size_t length) { return kvhash64(key, length); }
+
+/* Returns the nanoseconds HASH takes per key of LENGTH bytes, averaged over
+ * ITERATIONS keys which differ in their first bytes. */
+static double bench(uint64_t (*hash)(const char *, size_t), size_t length, long iterations) {
+  char key[MAX_KEYLEN + 1];
+  uint64_t start, elapsed, acc = 0;
+  memset(key, 'k', length);
+  key[length] = '\0';
+  start = histogram_now();
+  for (long i = 0; i < iterations; i++) {
+    /* Keys hold no null bytes, since strhash64 stops at the first. */
+    for (size_t j = 0; j < 8 && j < length; j++)
+      key[j] = 'a' + ((i >> (4 * j)) & 15);
+    acc += hash(key, length);
+  }
+  elapsed = histogram_now() - start;
+  sink = acc;
+  return (double)elapsed * 1000 / iterations;
+}
+
+/* Hashes COUNT keys of the form "key<n>" into SPREAD_BUCKETS buckets by the
+ * low bits of HASH, as uthash does, and returns the chi-squared statistic of
+ * the bucket counts divided by its degrees of freedom; close to 1 means the
+ * keys are spread as evenly as if at random. */
+static double spread(uint64_t (*hash)(const char *, size_t), long count) {
+  static unsigned int buckets[SPREAD_BUCKETS];
+  char key[32];
+  double expected = (double)count / SPREAD_BUCKETS, chi = 0, diff;
+  int length;
+  memset(buckets, 0, sizeof(buckets));
+  for (long i = 0; i < count; i++) {
+    length = sprintf(key, "key%ld", i);
+    buckets[hash(key, length) & (SPREAD_BUCKETS - 1)]++;
+  }
+  for (int i = 0; i < SPREAD_BUCKETS; i++) {
+    diff = buckets[i] - expected;
+    chi += diff * diff / expected;
+  }
+  return chi / (SPREAD_BUCKETS - 1);
+}
+
+int main(int argc, char **argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 1000000;
+  double md5, jen, fast;
+
+  if (argc > 2 || iterations <= 0) {
+    fprintf(stderr, "%s\n", USAGE);
+    return 1;
+  }
+  printf("%8s %14s %14s %14s %8s\n", "key size", "strhash64 ns", "HASH_JEN ns", "kvhash64 ns",
+         "speedup");
+  for (int i = 0; i < NLENGTHS; i++) {
+    md5 = bench(md5_hash, lengths[i], iterations / 4);
+    jen = bench(jen_hash, lengths[i], iterations);
+    fast = bench(fast_hash, lengths[i], iterations);
+    printf("%8zu %14.1f %14.1f %14.1f %7.1fx\n", lengths[i], md5, jen, fast, md5 / fast);
+  }
+  printf("\n%-28s %14s\n", "bucket spread (1 = random)", "chi2/df");
+  printf("%-28s %14.3f\n", "HASH_JEN", spread(jen_hash, iterations));
+  printf("%-28s %14.3f\n", "kvhash64", spread(fast_hash, iterations));
+  return 0;
+}
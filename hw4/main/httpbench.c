@@ -0,0 +1,627 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include "histogram.h"
+#include "kvmessage.h"
+#include "libhttp.h"
+#include "liburl.h"
+
+/* Fuzzes the incremental request parser (http_request_parse and
+ * kvrequest_parse) and measures its throughput against the single-read,
+ * copying parser it replaced. Also compares the cost, in time and bytes, of a
+ * transaction between leader and follower over HTTP and binary frames, and
+ * the bytes copied (or zeroed) in memory to send and receive one request
+ * through the fixed-size structs requests used to be held in and through a
+ * kvrequest_t and its arena.
+ *
+ * Fuzzing mutates sample requests (HTTP and framed) at random and checks that
+ * parsing each result never reads out of bounds (build with
+ * -fsanitize=address to be sure), and gives the same outcome whether the
+ * request arrives at once or in random pieces. Unmutated samples must also
+ * parse as they did with the old parser. */
+
+const char *USAGE = "Usage: httpbench [iterations (default=200000)] [fuzz_cases (default=200000)]";
+
+static const char *samples[] = {
+    "GET /?key=apple HTTP/1.1\r\n\r\n",
+    "PUT /?key=apple&val=banana HTTP/1.1\r\n\r\n",
+    "DELETE /?key=apple HTTP/1.1\r\nConnection: close\r\n\r\n",
+    "POST /commit HTTP/1.1\r\n\r\n",
+    "POST /abort HTTP/1.1\r\n\r\n",
+    "POST /register?key=127.0.0.1&val=16201 HTTP/1.1\r\n\r\n",
+    "GET /metrics HTTP/1.1\r\n\r\n",
+    "GET / HTTP/1.0\r\n\r\n",
+    "GET /?key=somewhat-longer-key-0123456789 HTTP/1.1\r\nHost: 127.0.0.1:16200\r\n"
+    "User-Agent: curl/7.81.0\r\nAccept: */*\r\n\r\n",
+    "PUT /?key=k&val=vvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvv"
+    "vvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvvv "
+    "HTTP/1.1\r\nHost: 127.0.0.1:16200\r\nConnection: keep-alive\r\n\r\n",
+};
+#define NSAMPLES (int)(sizeof(samples) / sizeof(samples[0]))
+
+/* The parser which read a whole request with a single read, and the
+ * encoder which built one in a URL buffer and an http_outbound_t, both
+ * through fixed-size structs, kept for comparison. The parser is given the
+ * bytes that read would have returned. Both add the bytes they copy or zero
+ * to legacy_copied. */
+
+#define LEGACY_FULLMSG_MAX_SIZE (HTTP_MSG_MAX_SIZE + 32)
+#define LEGACY_METHOD_MAX_SIZE 6
+
+typedef struct {
+  http_method_t method;
+  char path[HTTP_MSG_MAX_SIZE + 1];
+  bool keep_alive;
+} legacy_request_t;
+
+typedef struct {
+  char path[PATH_MAX_SIZE + 1];
+  char key[MAX_KEYLEN + 1];
+  char val[MAX_VALLEN + 1];
+  char txn[MAX_TXNLEN + 1];
+  char prefix[MAX_KEYLEN + 1];
+  char limit[MAX_LIMITLEN + 1];
+} legacy_params_t;
+
+typedef struct {
+  msgtype_t type;
+  char key[MAX_KEYLEN + 1];
+  char val[MAX_VALLEN + 1];
+  bool keep_alive;
+} legacy_kvrequest_t;
+
+static size_t legacy_copied;
+
+static http_method_t legacy_method_from_string(char *method_buf) {
+  if (!strcmp(method_buf, "GET"))
+    return GET;
+  if (!strcmp(method_buf, "POST"))
+    return POST;
+  if (!strcmp(method_buf, "PUT"))
+    return PUT;
+  if (!strcmp(method_buf, "DELETE"))
+    return DELETE;
+  return INVALID;
+}
+
+static bool legacy_http_request_parse(legacy_request_t *req, const char *data, size_t length) {
+  char read_buffer[LEGACY_FULLMSG_MAX_SIZE + 1];
+  int bytes_read = min(length, LEGACY_FULLMSG_MAX_SIZE - 1);
+  if (bytes_read <= 0)
+    goto error;
+  memcpy(read_buffer, data, bytes_read);
+  read_buffer[bytes_read] = '\0'; /* Always null-terminate. */
+  legacy_copied += bytes_read + 1;
+
+  char method_buf[LEGACY_METHOD_MAX_SIZE + 1];
+
+  char *read_init, *read_end;
+  size_t read_size;
+
+  read_init = read_end = read_buffer;
+  read_end = strchr(read_init, ' ');
+  if (!read_end)
+    goto error;
+  read_size = min(read_end - read_init, LEGACY_METHOD_MAX_SIZE);
+  memcpy(method_buf, read_init, read_size);
+  method_buf[read_size] = '\0';
+  req->method = legacy_method_from_string(method_buf);
+  if (req->method == INVALID)
+    goto error;
+  read_end++;
+
+  if (*read_end != '/')
+    goto error;
+  read_init = read_end;
+  while (*read_end != ' ' && *read_end != '\n') {
+    if (*read_end == '\0')
+      goto error;
+    read_end++;
+  }
+  read_size = min(read_end - read_init, HTTP_MSG_MAX_SIZE);
+  if (read_size == 0)
+    goto error;
+  memcpy(req->path, read_init, read_size);
+  req->path[read_size] = '\0';
+  legacy_copied += read_size + 1;
+
+  req->keep_alive = *read_end == ' ' && !strncmp(read_end + 1, "HTTP/1.1", 8);
+  read_end = strchr(read_end, '\n');
+  while (read_end && read_end[1] != '\r' && read_end[1] != '\n' && read_end[1] != '\0') {
+    read_init = read_end + 1;
+    if (!strncasecmp(read_init, "Connection:", 11)) {
+      read_init += 11;
+      while (*read_init == ' ')
+        read_init++;
+      if (!strncasecmp(read_init, "close", 5))
+        req->keep_alive = false;
+      else if (!strncasecmp(read_init, "keep-alive", 10))
+        req->keep_alive = true;
+    }
+    read_end = strchr(read_init, '\n');
+  }
+  return true;
+
+error:
+  return false;
+}
+
+static bool legacy_url_decode(legacy_params_t *params, char *url) {
+  char *read_end, *key_end, *ptr;
+  size_t read_size, max_size;
+
+  read_end = strchr(url, '?');
+  read_size = read_end ? read_end - url - 1 : strlen(url) - 1;
+  read_size = min(read_size, PATH_MAX_SIZE);
+  if (read_size > 0) {
+    memcpy(params->path, url + 1, read_size);
+    params->path[read_size] = '\0';
+    legacy_copied += read_size + 1;
+  }
+  if (read_end == NULL)
+    return true;
+  url = read_end + 1;
+
+  while (*read_end != '\0') {
+    key_end = strchr(url, '=');
+    if (key_end == NULL)
+      break;
+    read_end = strchr(url, '&');
+    if (read_end == NULL)
+      read_end = url + strlen(url);
+    if (!strncmp(url, "key", key_end - url)) {
+      ptr = params->key;
+      max_size = MAX_KEYLEN;
+    } else if (!strncmp(url, "val", key_end - url)) {
+      ptr = params->val;
+      max_size = MAX_VALLEN;
+    } else {
+      if (*url == '\0')
+        return true;
+      url = read_end + 1;
+      continue;
+    }
+    read_size = min(read_end - key_end - 1, max_size);
+    memcpy(ptr, key_end + 1, read_size);
+    ptr[read_size] = '\0';
+    legacy_copied += read_size + 1;
+    url = read_end + 1;
+  }
+  return true;
+}
+
+static void legacy_zero_params(legacy_params_t *params) {
+  memset(params, 0, sizeof(*params));
+  legacy_copied += sizeof(*params);
+}
+
+static bool legacy_kvrequest_parse(legacy_kvrequest_t *kvreq, const char *data, size_t length) {
+  legacy_request_t req;
+  legacy_params_t params;
+  kvreq->type = EMPTY;
+  legacy_zero_params(&params);
+  if (!legacy_http_request_parse(&req, data, length) || !legacy_url_decode(&params, req.path))
+    return false;
+  switch (req.method) {
+  case GET:
+    if (!strcmp(params.path, METRICS_PATH))
+      kvreq->type = METRICS;
+    else
+      kvreq->type = is_empty_str(params.key) ? INDEX : GETREQ;
+    break;
+  case PUT:
+    if (is_empty_str(params.key) || is_empty_str(params.val))
+      return false;
+    kvreq->type = PUTREQ;
+    break;
+  case DELETE:
+    if (is_empty_str(params.key))
+      return false;
+    kvreq->type = DELREQ;
+    break;
+  case POST:
+    if (is_empty_str(params.path))
+      return false;
+    if (!strcmp(params.path, REGISTER_PATH)) {
+      if (is_empty_str(params.key) || is_empty_str(params.val))
+        return false;
+      kvreq->type = REGISTER;
+    } else if (!strcmp(params.path, COMMIT_PATH)) {
+      kvreq->type = COMMIT;
+    } else if (!strcmp(params.path, ABORT_PATH)) {
+      kvreq->type = ABORT;
+    }
+    break;
+  default:
+    return false;
+  }
+  strcpy(kvreq->key, params.key);
+  strcpy(kvreq->val, params.val);
+  legacy_copied += strlen(params.key) + strlen(params.val) + 2;
+  kvreq->keep_alive = req.keep_alive;
+  return true;
+}
+
+static void legacy_kvrequest_clear(legacy_kvrequest_t *kvreq) {
+  kvreq->type = EMPTY;
+  kvreq->keep_alive = false;
+  memset(kvreq->key, 0, MAX_KEYLEN + 1);
+  memset(kvreq->val, 0, MAX_VALLEN + 1);
+  legacy_copied += MAX_KEYLEN + MAX_VALLEN + 2;
+}
+
+static void legacy_url_encode(char *url, legacy_params_t *params) {
+  char buf[HTTP_MSG_MAX_SIZE];
+  int end = 0;
+  end += sprintf(buf + end, "/%s?", params->path);
+  end += sprintf(buf + end, "key=%s&", params->key);
+  end += sprintf(buf + end, "val=%s&", params->val);
+  buf[end - 1] = '\0';
+  strcpy(url, buf);
+  legacy_copied += end * 2;
+}
+
+/* Appends the PUT request KVREQ to OUT. */
+static void legacy_kvrequest_encode(legacy_kvrequest_t *kvreq, http_buffer_t *out) {
+  legacy_params_t params;
+  char url[HTTP_MSG_MAX_SIZE + 1];
+  http_outbound_t msg;
+  strcpy(params.path, "");
+  strcpy(params.key, kvreq->key);
+  strcpy(params.val, kvreq->val);
+  legacy_copied += strlen(kvreq->key) + strlen(kvreq->val) + 3;
+  legacy_url_encode(url, &params);
+  http_outbound_init_request(&msg, -1, PUT, url);
+  http_outbound_end_headers(&msg);
+  http_outbound_encode(&msg, out);
+  legacy_copied += msg.end * 2;
+}
+
+/* The outcome of parsing one request with the new parser. */
+typedef struct {
+  ssize_t length;
+  kvrequest_t req;
+  kvarena_t arena;
+} outcome_t;
+
+static bool outcome_equals(outcome_t *a, outcome_t *b) {
+  if (a->length != b->length)
+    return false;
+  if (a->length <= 0)
+    return true;
+  return a->req.type == b->req.type && a->req.keep_alive == b->req.keep_alive &&
+         !strcmp(a->req.key, b->req.key) && !strcmp(a->req.val, b->req.val);
+}
+
+/* Returns true if A is what the old parser made of the same request: REQ if
+ * it PARSED it, else an error. */
+static bool outcome_equals_legacy(outcome_t *a, bool parsed, legacy_kvrequest_t *req) {
+  if (!parsed || a->length <= 0)
+    return parsed == (a->length >= 0);
+  return a->req.type == req->type && a->req.keep_alive == req->keep_alive &&
+         !strcmp(a->req.key, req->key) && !strcmp(a->req.val, req->val);
+}
+
+/* Parses the LENGTH bytes at DATA at once. */
+static void parse_whole(outcome_t *out, const char *data, size_t length) {
+  http_parser_t parser;
+  http_parser_init(&parser);
+  out->req.arena = &out->arena;
+  out->length = kvrequest_parse(&out->req, &parser, data, length);
+}
+
+/* Parses the LENGTH bytes at DATA as they would arrive in random pieces. */
+static void parse_pieces(outcome_t *out, const char *data, size_t length) {
+  http_parser_t parser;
+  size_t available = 0, piece;
+  http_parser_init(&parser);
+  out->req.arena = &out->arena;
+  do {
+    piece = 1 + rand() % 16;
+    available = min(length, available + piece);
+    out->length = kvrequest_parse(&out->req, &parser, data, available);
+  } while (out->length == 0 && available < length);
+}
+
+/* The binary frames of the samples which a leader may send its followers. */
+static http_buffer_t frames[NSAMPLES];
+
+static void frames_init(void) {
+  kvrequest_t req;
+  kvarena_t arena;
+  http_parser_t parser;
+  http_parser_init(&parser);
+  req.arena = &arena;
+  for (int i = 0; i < NSAMPLES; i++) {
+    http_buffer_init(&frames[i]);
+    if (kvrequest_parse(&req, &parser, samples[i], strlen(samples[i])) > 0)
+      kvrequest_encode_frame(&req, &frames[i]);
+  }
+}
+
+/* Writes a random mutation of a sample request (or of its frame, if BINARY is
+ * set) to BUF, returning its length. */
+static size_t mutate(char *buf, size_t size, bool binary) {
+  int i = rand() % NSAMPLES;
+  const char *sample = binary ? frames[i].data : samples[i];
+  size_t length = binary ? frames[i].length : strlen(sample), pos;
+  static const char interesting[] = " \r\n:?&=/%\0";
+  memcpy(buf, sample, length);
+  for (int n = rand() % 4; n > 0 && length > 0; n--) {
+    pos = rand() % length;
+    switch (rand() % 5) {
+    case 0: /* Replace a byte. */
+      buf[pos] = rand() % 2 ? rand() % 256 : interesting[rand() % (sizeof(interesting) - 1)];
+      break;
+    case 1: /* Insert a byte. */
+      if (length < size) {
+        memmove(buf + pos + 1, buf + pos, length - pos);
+        buf[pos] = interesting[rand() % (sizeof(interesting) - 1)];
+        length++;
+      }
+      break;
+    case 2: /* Delete a byte. */
+      memmove(buf + pos, buf + pos + 1, length - pos - 1);
+      length--;
+      break;
+    case 3: /* Truncate. */
+      length = pos;
+      break;
+    default: /* Repeat a chunk. */
+      if (length * 2 <= size) {
+        memcpy(buf + length, buf + pos, length - pos);
+        length += length - pos;
+      }
+    }
+  }
+  return length;
+}
+
+static int fuzz(long cases) {
+  char buf[4096];
+  static outcome_t whole, pieces;
+  legacy_kvrequest_t legacy;
+  long failures = 0, complete = 0, invalid = 0;
+  size_t length;
+  char *data;
+
+  /* Unmutated samples parse as they did before. */
+  for (int i = 0; i < NSAMPLES; i++) {
+    parse_whole(&whole, samples[i], strlen(samples[i]));
+    if (!outcome_equals_legacy(
+            &whole, legacy_kvrequest_parse(&legacy, samples[i], strlen(samples[i])), &legacy)) {
+      printf("sample %d parses differently from the old parser\n", i);
+      failures++;
+    }
+  }
+
+  for (long i = 0; i < cases; i++) {
+    length = mutate(buf, sizeof(buf), i % 4 == 0);
+    /* An exactly sized copy, so that overreads are caught by the sanitizer. */
+    data = malloc(length ? length : 1);
+    memcpy(data, buf, length);
+    parse_whole(&whole, data, length);
+    parse_pieces(&pieces, data, length);
+    if (!outcome_equals(&whole, &pieces)) {
+      printf("case %ld parses differently in pieces (%zd, %zd):", i, whole.length, pieces.length);
+      for (size_t j = 0; j < length; j++)
+        printf(" %02x", (unsigned char)data[j]);
+      printf("\n");
+      failures++;
+    }
+    complete += whole.length > 0;
+    invalid += whole.length < 0;
+    free(data);
+  }
+  printf("fuzz: %ld cases, %ld complete, %ld invalid, %ld incomplete, %ld failures\n", cases,
+         complete, invalid, cases - complete - invalid, failures);
+  return failures > 0;
+}
+
+/* Parses every sample ITERATIONS times with the old parser or the new one
+ * (whole, or in PIECE byte pieces if PIECE is nonzero), returning requests
+ * per second. */
+static double throughput(long iterations, bool old, size_t piece) {
+  kvrequest_t req;
+  legacy_kvrequest_t legacy;
+  kvarena_t arena;
+  http_parser_t parser;
+  uint64_t start = histogram_now(), elapsed;
+  size_t lengths[NSAMPLES], available;
+  long parsed = 0;
+  for (int i = 0; i < NSAMPLES; i++)
+    lengths[i] = strlen(samples[i]);
+  http_parser_init(&parser);
+  req.arena = &arena;
+  for (long n = 0; n < iterations; n++) {
+    for (int i = 0; i < NSAMPLES; i++) {
+      if (old) {
+        parsed += legacy_kvrequest_parse(&legacy, samples[i], lengths[i]);
+      } else if (!piece) {
+        parsed += kvrequest_parse(&req, &parser, samples[i], lengths[i]) > 0;
+      } else {
+        available = 0;
+        do {
+          available = min(lengths[i], available + piece);
+        } while (kvrequest_parse(&req, &parser, samples[i], available) == 0);
+        parsed++;
+      }
+    }
+  }
+  elapsed = histogram_now() - start;
+  return (double)parsed * 1000000 / (elapsed ? elapsed : 1);
+}
+
+/* Runs ITERATIONS transactions (a PUT which is voted on, then committed)
+ * through the encoding and parsing a leader and follower do, with binary
+ * frames if BINARY is set and HTTP otherwise. Returns transactions per second,
+ * setting BYTES to the number of bytes one transaction sends. */
+static double transactions(long iterations, bool binary, size_t *bytes) {
+  kvrequest_t put, commit, req;
+  kvarena_t arena;
+  kvresponse_t vote, ack, res;
+  kvrequest_t *reqs[] = {&put, &commit};
+  kvresponse_t *ress[] = {&vote, &ack};
+  http_buffer_t wire;
+  http_parser_t parser;
+  uint64_t start, elapsed;
+
+  kvrequest_clear(&put);
+  put.type = PUTREQ;
+  put.key = "somewhat-longer-key-0123456789";
+  put.val = "value-0123456789";
+  req.arena = &arena;
+  kvrequest_clear(&commit);
+  commit.type = COMMIT;
+  kvresponse_clear(&vote);
+  vote.type = VOTE;
+  strcpy(vote.body, MSG_COMMIT);
+  kvresponse_clear(&ack);
+  ack.type = ACK;
+
+  http_buffer_init(&wire);
+  http_parser_init(&parser);
+  *bytes = 0;
+  start = histogram_now();
+  for (long n = 0; n < iterations; n++) {
+    for (int i = 0; i < 2; i++) {
+      wire.length = 0;
+      if (binary)
+        kvrequest_encode_frame(reqs[i], &wire);
+      else
+        kvrequest_encode(reqs[i], &wire);
+      if (kvrequest_parse(&req, &parser, wire.data, wire.length) <= 0 || req.type != reqs[i]->type)
+        fatal("request did not survive the round trip", 1);
+      *bytes += n == 0 ? wire.length : 0;
+
+      wire.length = 0;
+      if (binary)
+        kvresponse_encode_frame(ress[i], &wire);
+      else
+        kvresponse_encode(ress[i], &wire);
+      if (kvresponse_parse(&res, &parser, wire.data, wire.length) <= 0 || res.type != ress[i]->type)
+        fatal("response did not survive the round trip", 1);
+      *bytes += n == 0 ? wire.length : 0;
+    }
+  }
+  elapsed = histogram_now() - start;
+  http_buffer_free(&wire);
+  return (double)iterations * 1000000 / (elapsed ? elapsed : 1);
+}
+
+/* Parses ITERATIONS batches of every sample sent back to back (pipelined)
+ * with the new parser, returning requests per second. */
+static double pipelined(long iterations) {
+  http_buffer_t batch;
+  kvrequest_t req;
+  kvarena_t arena;
+  http_parser_t parser;
+  uint64_t start, elapsed;
+  size_t offset;
+  ssize_t length;
+  long parsed = 0;
+  http_buffer_init(&batch);
+  for (int i = 0; i < NSAMPLES; i++)
+    http_buffer_append(&batch, samples[i], strlen(samples[i]));
+  http_parser_init(&parser);
+  req.arena = &arena;
+  start = histogram_now();
+  for (long n = 0; n < iterations; n++) {
+    for (offset = 0; offset < batch.length; offset += length) {
+      length = kvrequest_parse(&req, &parser, batch.data + offset, batch.length - offset);
+      if (length <= 0)
+        break;
+      parsed++;
+    }
+  }
+  elapsed = histogram_now() - start;
+  http_buffer_free(&batch);
+  return (double)parsed * 1000000 / (elapsed ? elapsed : 1);
+}
+
+/* Runs ITERATIONS round trips of a PUT with a VALLEN byte value, built by
+ * the sender, encoded, parsed and handed to the receiver through the old
+ * fixed-size structs if OLD is set and through a kvrequest_t and its arena
+ * otherwise. Returns requests per second, setting BYTES to the number of bytes
+ * one round trip copies or zeroes in memory, the request on the wire
+ * included. */
+static double copies(long iterations, bool old, size_t vallen, size_t *bytes) {
+  static char value[MAX_VALLEN + 1];
+  const char *key = "somewhat-longer-key-0123456789";
+  legacy_kvrequest_t legacy, received;
+  kvrequest_t put, req;
+  kvarena_t arena;
+  http_buffer_t wire;
+  http_parser_t parser;
+  uint64_t start, elapsed;
+
+  memset(value, 'v', vallen);
+  value[vallen] = '\0';
+  http_buffer_init(&wire);
+  http_parser_init(&parser);
+  req.arena = &arena;
+  *bytes = 0;
+  start = histogram_now();
+  for (long n = 0; n < iterations; n++) {
+    wire.length = 0;
+    legacy_copied = 0;
+    if (old) {
+      legacy_kvrequest_clear(&legacy);
+      legacy.type = PUTREQ;
+      strcpy(legacy.key, key);
+      strcpy(legacy.val, value);
+      legacy_copied += strlen(key) + vallen + 2;
+      legacy_kvrequest_encode(&legacy, &wire);
+      if (!legacy_kvrequest_parse(&received, wire.data, wire.length) || received.type != PUTREQ)
+        fatal("request did not survive the round trip", 1);
+    } else {
+      kvrequest_clear(&put);
+      put.type = PUTREQ;
+      put.key = (char *)key;
+      put.val = value;
+      kvrequest_encode(&put, &wire);
+      if (kvrequest_parse(&req, &parser, wire.data, wire.length) <= 0 || req.type != PUTREQ)
+        fatal("request did not survive the round trip", 1);
+      legacy_copied = wire.length + arena.used;
+    }
+    *bytes = legacy_copied;
+  }
+  elapsed = histogram_now() - start;
+  http_buffer_free(&wire);
+  return (double)iterations * 1000000 / (elapsed ? elapsed : 1);
+}
+
+int main(int argc, char **argv) {
+  long iterations = argc > 1 ? atol(argv[1]) : 200000;
+  long cases = argc > 2 ? atol(argv[2]) : 200000;
+  size_t bytes;
+  int ret;
+  if (argc > 3 || iterations <= 0 || cases < 0) {
+    fprintf(stderr, "%s\n", USAGE);
+    return 1;
+  }
+  srand(42);
+  frames_init();
+  ret = fuzz(cases);
+  iterations /= NSAMPLES;
+  printf("%-28s %14s\n", "parser", "requests/s");
+  printf("%-28s %14.0f\n", "old (single read, copying)", throughput(iterations, true, 0));
+  printf("%-28s %14.0f\n", "new (whole)", throughput(iterations, false, 0));
+  printf("%-28s %14.0f\n", "new (16 byte reads)", throughput(iterations, false, 16));
+  printf("%-28s %14.0f\n", "new (pipelined)", pipelined(iterations));
+  printf("\n%-28s %14s %14s\n", "leader-follower framing", "transactions/s", "bytes/txn");
+  printf("%-28s %14.0f", "http", transactions(iterations, false, &bytes));
+  printf(" %14zu\n", bytes);
+  printf("%-28s %14.0f", "binary", transactions(iterations, true, &bytes));
+  printf(" %14zu\n", bytes);
+  printf("\n%-28s %14s %14s\n", "request copies", "requests/s", "bytes/request");
+  for (size_t vallen = 16; vallen <= MAX_VALLEN; vallen *= 64) {
+    printf("old (fixed structs, %4zu B) %14.0f", vallen, copies(iterations, true, vallen, &bytes));
+    printf(" %14zu\n", bytes);
+    printf("new (arena, %4zu B)         %14.0f", vallen, copies(iterations, false, vallen, &bytes));
+    printf(" %14zu\n", bytes);
+  }
+  return ret;
+}
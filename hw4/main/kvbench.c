@@ -0,0 +1,271 @@
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "histogram.h"
+#include "kvconstants.h"
+#include "kvmessage.h"
+#include "socket_server.h"
+
+/* Measures the throughput and latency of a running TPC cluster (see
+ * main/tpcsystem) as seen by its clients, through the leader at the given
+ * port of this host.
+ *
+ * Each thread holds one connection to the leader and sends it a GET, PUT or
+ * DEL in the given proportions (what is left after gets and dels is PUTs).
+ * Keys are picked from a fixed set, either uniformly or, if zipf_theta is
+ * positive, from a zipfian distribution of that skew, which must be below 1
+ * (0.99 makes a few keys very hot, as in YCSB). Every key is put once before
+ * the run starts, so GETs only miss keys a DEL removed, which are counted as
+ * misses rather than errors. A DEL of an absent key is aborted, and the leader
+ * does not say why, so it counts as an error.
+ *
+ * By default each thread sends its next request as soon as the previous one
+ * is answered (closed loop), which measures the most the cluster sustains.
+ * If rate is given, requests instead arrive at that many per second in total,
+ * as a Poisson process (open loop), and the latency of each is measured from
+ * when it was due to be sent rather than when it was; a thread which falls
+ * behind its schedule thus reports the wait of the requests it delayed,
+ * rather than omitting it. */
+
+const char *USAGE =
+    "Usage: kvbench [port (default=16200)] [ops (default=20000)] [threads (default=8)]\n"
+    "               [get_pct (default=80)] [del_pct (default=5)] [keys (default=1000)]\n"
+    "               [zipf_theta (0 <= theta < 1, default=0.99, 0=uniform)]\n"
+    "               [value_size (default=100)] [rate (default=0, closed loop)]";
+
+/* The seconds to wait for a response before counting the request as failed. */
+#define KVBENCH_TIMEOUT 10
+
+/* The parameters of a run, and its results, shared by all of its threads. */
+typedef struct {
+  struct sockaddr_in addr;
+  long ops_per_thread;
+  int get_pct, del_pct;
+  long keys;
+  double theta, zeta, alpha, eta; /* The zipfian distribution, if THETA > 0. */
+  char value[MAX_VALLEN + 1];
+  double rate_per_thread;         /* Requests per second, or 0 for closed loop. */
+  uint64_t begin;                 /* The histogram_now of the start of the run. */
+  histogram_t latency[3];         /* For GETREQ, PUTREQ and DELREQ. */
+  unsigned long count[3], misses[3], errors[3];
+} run_t;
+
+static const msgtype_t op_types[] = {GETREQ, PUTREQ, DELREQ};
+static const char *op_names[] = {"get", "put", "del"};
+
+/* The state of a single thread. */
+typedef struct {
+  run_t *run;
+  int sockfd;
+  uint64_t seed;  /* The state of the thread's xorshift generator. */
+  long first_key; /* The keys it puts before the run, FIRST_KEY to LAST_KEY. */
+  long last_key;
+} worker_t;
+
+/* Returns a random number in [0, 1) from WORKER's generator. */
+static double next_random(worker_t *worker) {
+  worker->seed ^= worker->seed << 13;
+  worker->seed ^= worker->seed >> 7;
+  worker->seed ^= worker->seed << 17;
+  return (worker->seed >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Precomputes the zipfian distribution of RUN over its keys, following Gray
+ * et al., "Quickly Generating Billion-Record Synthetic Databases". */
+static void zipf_init(run_t *run) {
+  double zeta2 = 0;
+  run->zeta = 0;
+  for (long i = 1; i <= run->keys; i++)
+    run->zeta += 1 / pow(i, run->theta);
+  for (long i = 1; i <= 2; i++)
+    zeta2 += 1 / pow(i, run->theta);
+  run->alpha = 1 / (1 - run->theta);
+  run->eta = (1 - pow(2.0 / run->keys, 1 - run->theta)) / (1 - zeta2 / run->zeta);
+}
+
+/* Returns the index of the next key WORKER sends, where 0 is the hottest. */
+static long next_key(worker_t *worker) {
+  run_t *run = worker->run;
+  double u = next_random(worker), uz;
+  long key;
+  if (run->theta <= 0)
+    return u * run->keys;
+  uz = u * run->zeta;
+  if (uz < 1)
+    return 0;
+  if (uz < 1 + pow(0.5, run->theta))
+    return 1;
+  key = run->keys * pow(run->eta * u - run->eta + 1, run->alpha);
+  return key < run->keys ? key : run->keys - 1;
+}
+
+/* Sends REQ on WORKER's connection, reconnecting first if it was lost, and
+ * receives the response into RES. Returns false if either fails, in which
+ * case the connection is closed. */
+static bool send_request(worker_t *worker, kvrequest_t *req, kvresponse_t *res) {
+  if (worker->sockfd < 0)
+    worker->sockfd = connect_to_addr(&worker->run->addr, KVBENCH_TIMEOUT);
+  if (worker->sockfd < 0)
+    return false;
+  if (kvrequest_send(req, worker->sockfd) >= 0 && kvresponse_receive(res, worker->sockfd))
+    return true;
+  close(worker->sockfd);
+  worker->sockfd = -1;
+  return false;
+}
+
+/* Sleeps until the histogram_now TIME. */
+static void sleep_until(uint64_t time) {
+  uint64_t now = histogram_now();
+  struct timespec wait;
+  if (time <= now)
+    return;
+  wait.tv_sec = (time - now) / 1000000;
+  wait.tv_nsec = (time - now) % 1000000 * 1000;
+  nanosleep(&wait, NULL);
+}
+
+/* Puts every key of WORKER's share of the set, so that the run starts with
+ * all of them present. Returns false if any put fails. */
+static void *load(void *worker_) {
+  worker_t *worker = worker_;
+  kvrequest_t req;
+  kvresponse_t res;
+  char key[32];
+  for (long i = worker->first_key; i < worker->last_key; i++) {
+    kvrequest_clear(&req);
+    req.type = PUTREQ;
+    sprintf(key, "kvbench%ld", i);
+    req.key = key;
+    req.val = worker->run->value;
+    if (!send_request(worker, &req, &res) || res.type != SUCCESS)
+      return (void *)false;
+  }
+  return (void *)true;
+}
+
+static void *work(void *worker_) {
+  worker_t *worker = worker_;
+  run_t *run = worker->run;
+  kvrequest_t req;
+  kvresponse_t res;
+  char key[32];
+  uint64_t due = run->begin, start;
+  double pick;
+  int op;
+
+  for (long i = 0; i < run->ops_per_thread; i++) {
+    pick = next_random(worker) * 100;
+    op = pick < run->get_pct ? 0 : pick < run->get_pct + run->del_pct ? 2 : 1;
+    kvrequest_clear(&req);
+    req.type = op_types[op];
+    sprintf(key, "kvbench%ld", next_key(worker));
+    req.key = key;
+    if (req.type == PUTREQ)
+      req.val = run->value;
+    if (run->rate_per_thread > 0) {
+      due += -log(1 - next_random(worker)) * 1000000 / run->rate_per_thread;
+      sleep_until(due);
+      start = due;
+    } else {
+      start = histogram_now();
+    }
+    if (!send_request(worker, &req, &res) || res.type == EMPTY) {
+      __atomic_fetch_add(&run->errors[op], 1, __ATOMIC_RELAXED);
+      continue;
+    }
+    histogram_record(&run->latency[op], histogram_now() - start);
+    __atomic_fetch_add(&run->count[op], 1, __ATOMIC_RELAXED);
+    if (res.type == ERROR && !strcmp(res.body, ERRMSG_NO_KEY))
+      __atomic_fetch_add(&run->misses[op], 1, __ATOMIC_RELAXED);
+    else if (res.type == ERROR)
+      __atomic_fetch_add(&run->errors[op], 1, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  int port = argc > 1 ? atoi(argv[1]) : 16200;
+  long ops = argc > 2 ? atol(argv[2]) : 20000;
+  int threads = argc > 3 ? atoi(argv[3]) : 8;
+  long value_size = argc > 8 ? atol(argv[8]) : 100;
+  double rate = argc > 9 ? atof(argv[9]) : 0;
+  static run_t run;
+  worker_t workers[threads > 0 ? threads : 1];
+  pthread_t tids[threads > 0 ? threads : 1];
+  uint64_t elapsed;
+  unsigned long total = 0;
+  void *loaded;
+  bool ok = true;
+
+  run.get_pct = argc > 4 ? atoi(argv[4]) : 80;
+  run.del_pct = argc > 5 ? atoi(argv[5]) : 5;
+  run.keys = argc > 6 ? atol(argv[6]) : 1000;
+  run.theta = argc > 7 ? atof(argv[7]) : 0.99;
+  if (argc > 10 || port <= 0 || ops <= 0 || threads <= 0 || run.get_pct < 0 ||
+      run.del_pct < 0 || run.get_pct + run.del_pct > 100 || run.keys <= 0 || run.theta < 0 ||
+      run.theta >= 1 || value_size <= 0 || value_size > MAX_VALLEN || rate < 0) {
+    fprintf(stderr, "%s\n", USAGE);
+    return 1;
+  }
+  if (!resolve_host("127.0.0.1", port, &run.addr)) {
+    fprintf(stderr, "kvbench: unable to resolve 127.0.0.1\n");
+    return 1;
+  }
+  run.ops_per_thread = ops / threads;
+  run.rate_per_thread = rate / threads;
+  memset(run.value, 'v', value_size);
+  if (run.theta > 0)
+    zipf_init(&run);
+  for (int op = 0; op < 3; op++)
+    histogram_init(&run.latency[op]);
+
+  for (int i = 0; i < threads; i++) {
+    workers[i].run = &run;
+    workers[i].sockfd = -1;
+    workers[i].seed = (uint64_t)(i + 1) * 0x9e3779b97f4a7c15ULL;
+    workers[i].first_key = run.keys * i / threads;
+    workers[i].last_key = run.keys * (i + 1) / threads;
+    pthread_create(&tids[i], NULL, load, &workers[i]);
+  }
+  for (int i = 0; i < threads; i++) {
+    pthread_join(tids[i], &loaded);
+    ok = ok && loaded;
+  }
+  if (!ok) {
+    fprintf(stderr, "kvbench: unable to put the keys through port %d\n", port);
+    return 1;
+  }
+
+  run.begin = histogram_now();
+  for (int i = 0; i < threads; i++)
+    pthread_create(&tids[i], NULL, work, &workers[i]);
+  for (int i = 0; i < threads; i++)
+    pthread_join(tids[i], NULL);
+  elapsed = histogram_now() - run.begin;
+  for (int i = 0; i < threads; i++)
+    if (workers[i].sockfd >= 0)
+      close(workers[i].sockfd);
+
+  printf("%-4s %10s %12s %10s %10s %10s %10s %10s\n", "op", "ops", "ops/s", "misses", "errors",
+         "p50 us", "p99 us", "p999 us");
+  for (int op = 0; op < 3; op++) {
+    total += run.count[op];
+    printf("%-4s %10lu %12.0f %10lu %10lu %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
+           op_names[op], run.count[op], (double)run.count[op] * 1000000 / (elapsed ? elapsed : 1),
+           run.misses[op], run.errors[op], histogram_percentile(&run.latency[op], 50),
+           histogram_percentile(&run.latency[op], 99),
+           histogram_percentile(&run.latency[op], 99.9));
+  }
+  printf("%-4s %10lu %12.0f", "all", total, (double)total * 1000000 / (elapsed ? elapsed : 1));
+  if (rate > 0)
+    printf(" (offered %.0f)", rate);
+  printf("\n");
+  return 0;
+}
@@ -0,0 +1,79 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "histogram.h"
+#include "kvconstants.h"
+#include "kvstore.h"
+
+/* Measures the cost of each durability level of a KVStore (kvstore.h) by
+ * timing puts to a fresh store with either backend. Puts cycle over a fixed
+ * set of keys, so most of them replace an existing entry. The store is
+ * created within the given directory, which should be on the disk being
+ * measured; on a tmpfs, which /tmp may be, syncs cost nothing. */
+
+const char *USAGE = "Usage: syncbench [puts (default=2000)] [dirname (default=.)]";
+
+/* The number of distinct keys written. */
+#define SYNCBENCH_KEYS 256
+
+static const char *backend_names[] = {"files", "log"};
+static const char *sync_names[] = {"none", "fdatasync", "dir fsync"};
+
+/* Puts PUTS entries into a new store within PARENT using BACKEND and SYNC,
+ * and prints the throughput and latency percentiles. Returns 0 if
+ * successful, else a negative error code. */
+static int bench(const char *parent, kvstore_backend_t backend, kvstore_sync_t sync, long puts) {
+  char dirname[MAX_FILENAME], key[32], value[MAX_VALLEN + 1];
+  kvstore_t store;
+  histogram_t latency;
+  uint64_t start, begin, elapsed;
+  int ret = 0;
+
+  sprintf(dirname, "%s/syncbench-XXXXXX", parent);
+  if (mkdtemp(dirname) == NULL)
+    return ERR_FILACCESS;
+  if ((ret = kvstore_init(&store, dirname, backend, sync)) < 0)
+    return ret;
+  histogram_init(&latency);
+  memset(value, 'v', 100);
+  value[100] = '\0';
+  begin = histogram_now();
+  for (long i = 0; i < puts && ret == 0; i++) {
+    sprintf(key, "key%ld", i % SYNCBENCH_KEYS);
+    start = histogram_now();
+    ret = kvstore_put(&store, key, value);
+    histogram_record(&latency, histogram_now() - start);
+  }
+  elapsed = histogram_now() - begin;
+  kvstore_destroy(&store);
+  if (ret < 0)
+    return ret;
+  printf("%-8s %-10s %12.0f %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n", backend_names[backend],
+         sync_names[sync], (double)puts * 1000000 / (elapsed ? elapsed : 1),
+         histogram_percentile(&latency, 50), histogram_percentile(&latency, 99),
+         histogram_percentile(&latency, 99.9));
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  long puts = argc > 1 ? atol(argv[1]) : 2000;
+  const char *parent = argc > 2 ? argv[2] : ".";
+
+  if (argc > 3 || puts <= 0) {
+    fprintf(stderr, "%s\n", USAGE);
+    return 1;
+  }
+  printf("%-8s %-10s %12s %10s %10s %10s\n", "backend", "sync", "puts/s", "p50 us", "p99 us",
+         "p999 us");
+  for (int backend = KVSTORE_FILES; backend <= KVSTORE_LOG; backend++) {
+    for (int sync = KVSTORE_SYNC_NONE; sync <= KVSTORE_SYNC_DIR; sync++) {
+      if (bench(parent, backend, sync, puts) < 0) {
+        fprintf(stderr, "syncbench: unable to write to %s\n", parent);
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
@@ -47,11 +47,17 @@ int main(int argc, char **argv) {
   server_t server;
   server.leader = 0;
   server.max_threads = 3;
+  server.reactor = SERVER_DEFAULT_REACTOR;
 
   char follower_name[20];
   sprintf(follower_name, "follower-port%d", follower_port);
 
-  tpcfollower_init(&follower, follower_name, 2, follower_hostname, follower_port);
+  if (tpcfollower_init(&follower, follower_name, 2, follower_hostname, follower_port) < 0) {
+    printf("Error recovering follower state from %s\n", follower_name);
+    return 1;
+  }
+  printf("Follower ready in %.1f ms, with %u pending votes\n", follower.startup_us / 1000.0,
+         follower.npending);
   /* Need to send registration to the leader.*/
   int ret, sockfd = connect_to(leader_hostname, leader_port, 0);
   if (sockfd < 0) {
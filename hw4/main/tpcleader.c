@@ -6,15 +6,16 @@
 #include "tpcleader.h"
 
 const char *USAGE = "Usage: tpcleader [port (default=16200)] [followers "
-                    "(default=1)] [redundancy (default=1)]\n\t";
+                    "(default=1)] [redundancy (default=1)] [vnodes (default=1)]\n\t";
 
 int main(int argc, char **argv) {
   int port = 16200;
   int followers = 1;
   int redundancy = 1;
+  int vnodes = TPCLEADER_DEFAULT_VNODES;
   server_t server;
 
-  if (argc > 4) {
+  if (argc > 5) {
     printf("%s\n", USAGE);
     return 1;
   }
@@ -27,10 +28,19 @@ int main(int argc, char **argv) {
   if (argc > 3) {
     redundancy = atoi(argv[3]);
   }
+  if (argc > 4) {
+    vnodes = atoi(argv[4]);
+    if (vnodes < 1) {
+      printf("%s\n", USAGE);
+      return 1;
+    }
+  }
 
   server.leader = 1;
   server.max_threads = 3;
+  server.reactor = SERVER_DEFAULT_REACTOR;
   tpcleader_init(&server.tpcleader, followers, redundancy);
+  server.tpcleader.vnodes = vnodes;
   printf("TPCLeader server started listening on port %d...\n", port);
   server_run("127.0.0.1", port, &server);
 }
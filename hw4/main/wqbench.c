@@ -0,0 +1,137 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "histogram.h"
+#include "utlist.h"
+#include "wq.h"
+
+/* Measures the throughput of the work queue (wq.h) against the mutex and
+ * linked list queue it replaced, with 1 to MAX_THREADS producer threads
+ * pushing to as many consumer threads. */
+
+const char *USAGE = "Usage: wqbench [items (default=200000)] [max_threads (default=64)]";
+
+/* The mutex and linked list work queue, kept for comparison. */
+typedef struct list_item {
+  void *item;
+  struct list_item *next;
+  struct list_item *prev;
+} list_item_t;
+
+typedef struct {
+  int size;
+  pthread_mutex_t mutex;
+  pthread_cond_t condvar;
+  list_item_t *head;
+} list_wq_t;
+
+static void list_wq_init(list_wq_t *wq) {
+  pthread_mutex_init(&wq->mutex, NULL);
+  pthread_cond_init(&wq->condvar, NULL);
+  wq->size = 0;
+  wq->head = NULL;
+}
+
+static void *list_wq_pop(list_wq_t *wq) {
+  void *job;
+  list_item_t *wq_item;
+
+  pthread_mutex_lock(&wq->mutex);
+  while (wq->size == 0)
+    pthread_cond_wait(&wq->condvar, &wq->mutex);
+  wq_item = wq->head;
+  job = wq->head->item;
+  wq->size--;
+  DL_DELETE(wq->head, wq->head);
+  pthread_mutex_unlock(&wq->mutex);
+
+  free(wq_item);
+  return job;
+}
+
+static void list_wq_push(list_wq_t *wq, void *item) {
+  pthread_mutex_lock(&wq->mutex);
+  list_item_t *wq_item = calloc(1, sizeof(list_item_t));
+  wq_item->item = item;
+  DL_APPEND(wq->head, wq_item);
+  wq->size++;
+  pthread_cond_broadcast(&wq->condvar);
+  pthread_mutex_unlock(&wq->mutex);
+}
+
+/* One run of the benchmark, shared by all of its threads. */
+typedef struct {
+  void *queue;
+  void (*push)(void *, void *);
+  void *(*pop)(void *);
+  long items_per_producer;
+} run_t;
+
+static void ring_push(void *wq, void *item) { wq_push(wq, item); }
+static void *ring_pop(void *wq) { return wq_pop(wq); }
+static void list_push(void *wq, void *item) { list_wq_push(wq, item); }
+static void *list_pop(void *wq) { return list_wq_pop(wq); }
+
+static void *produce(void *run_) {
+  run_t *run = run_;
+  for (long i = 1; i <= run->items_per_producer; i++)
+    run->push(run->queue, (void *)(intptr_t)i);
+  return NULL;
+}
+
+/* Pops items until it receives NULL, which marks the end of the run. */
+static void *consume(void *run_) {
+  run_t *run = run_;
+  while (run->pop(run->queue))
+    ;
+  return NULL;
+}
+
+/* Runs THREADS producers and consumers over RUN, returning items per second. */
+static double bench(run_t *run, int threads) {
+  pthread_t producers[threads], consumers[threads];
+  uint64_t start = histogram_now(), elapsed;
+  for (int i = 0; i < threads; i++) {
+    pthread_create(&consumers[i], NULL, consume, run);
+    pthread_create(&producers[i], NULL, produce, run);
+  }
+  for (int i = 0; i < threads; i++)
+    pthread_join(producers[i], NULL);
+  for (int i = 0; i < threads; i++)
+    run->push(run->queue, NULL);
+  for (int i = 0; i < threads; i++)
+    pthread_join(consumers[i], NULL);
+  elapsed = histogram_now() - start;
+  return (double)run->items_per_producer * threads * 1000000 / (elapsed ? elapsed : 1);
+}
+
+int main(int argc, char **argv) {
+  long items = argc > 1 ? atol(argv[1]) : 200000;
+  int max_threads = argc > 2 ? atoi(argv[2]) : 64;
+  static wq_t ring;
+  list_wq_t list;
+  run_t run;
+  double ring_rate, list_rate;
+
+  if (argc > 3 || items <= 0 || max_threads <= 0) {
+    fprintf(stderr, "%s\n", USAGE);
+    return 1;
+  }
+  printf("%8s %14s %14s %8s\n", "threads", "wq items/s", "list items/s", "speedup");
+  for (int threads = 1; threads <= max_threads; threads *= 2) {
+    run.items_per_producer = items / threads > 0 ? items / threads : 1;
+    wq_init(&ring);
+    run.queue = &ring;
+    run.push = ring_push;
+    run.pop = ring_pop;
+    ring_rate = bench(&run, threads);
+    list_wq_init(&list);
+    run.queue = &list;
+    run.push = list_push;
+    run.pop = list_pop;
+    list_rate = bench(&run, threads);
+    printf("%8d %14.0f %14.0f %7.2fx\n", threads, ring_rate, list_rate, ring_rate / list_rate);
+  }
+  return 0;
+}
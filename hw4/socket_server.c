@@ -4,11 +4,13 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -17,8 +19,285 @@
 #include "tpcleader.h"
 #include "kvconstants.h"
 #include "socket_server.h"
+#include "stats.h"
+#include "utlist.h"
 #include "wq.h"
 
+/* Waits up to KEEPALIVE_TIMEOUT seconds for another request on the persistent
+ * connection SOCKFD. Returns false if the client closed it or stayed idle. */
+static bool await_request(int sockfd) {
+  struct pollfd pfd = {.fd = sockfd, .events = POLLIN};
+  char c;
+  if (poll(&pfd, 1, KEEPALIVE_TIMEOUT * 1000) <= 0)
+    return false;
+  return recv(sockfd, &c, 1, MSG_PEEK) > 0;
+}
+
+/* The stage a connection served by the event loop is at. */
+typedef enum {
+  CONN_READING,    /* Waiting for the rest of a request. */
+  CONN_PROCESSING, /* Queued for or being handled by a worker. */
+  CONN_WRITING,    /* Waiting to send the rest of the responses. */
+} conn_state_t;
+
+/* A connection served by the event loop. */
+typedef struct conn {
+  int fd;               /* The socket of this connection. */
+  conn_state_t state;   /* What this connection is waiting for. */
+  bool keep_alive;      /* Whether to wait for another request once OUT is sent. */
+  bool closed;          /* Whether the client has closed its end. */
+  time_t last_active;   /* When this connection last started waiting for a request. */
+  http_buffer_t in;     /* Received bytes which have not been handled yet. */
+  http_buffer_t out;    /* Response bytes which have not been sent yet. */
+  http_parser_t parser; /* The parse of the request at the start of IN. */
+  http_request_t req;   /* The request at the start of IN, once complete. */
+  ssize_t req_length;   /* The length of REQ, or -1 if it is invalid. */
+  uint64_t parse_us;    /* The time spent parsing REQ so far. */
+  kvarena_t arena;      /* The key and value of the request being handled. */
+  struct conn *prev;    /* The previous connection in the server's list. */
+  struct conn *next;    /* The next connection in the server's list. */
+} conn_t;
+
+/* Sets the state of CONN. The list lock is held so that the event loop may
+ * check the state of any connection while looking for idle ones. */
+static void conn_set_state(server_t *server, conn_t *conn, conn_state_t state) {
+  pthread_mutex_lock(&server->conns_lock);
+  conn->state = state;
+  if (state == CONN_READING)
+    conn->last_active = time(NULL);
+  pthread_mutex_unlock(&server->conns_lock);
+}
+
+/* Closes and frees CONN, which must already be removed from the list. */
+static void conn_free(conn_t *conn) {
+  close(conn->fd);
+  http_buffer_free(&conn->in);
+  http_buffer_free(&conn->out);
+  free(conn);
+}
+
+/* Removes CONN from the list of SERVER and closes it. */
+static void conn_close(server_t *server, conn_t *conn) {
+  pthread_mutex_lock(&server->conns_lock);
+  DL_DELETE(server->conns, conn);
+  pthread_mutex_unlock(&server->conns_lock);
+  conn_free(conn);
+}
+
+/* Asks the event loop to report EVENTS on CONN, once. */
+static void conn_watch(server_t *server, conn_t *conn, uint32_t events) {
+  struct epoll_event ev = {.events = events | EPOLLET | EPOLLONESHOT, .data.ptr = conn};
+  epoll_ctl(server->epollfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+/* Reads everything that has arrived on CONN, up to SERVER_MAX_BUFFERED
+ * bytes. Returns false if the connection failed. */
+static bool conn_read(conn_t *conn) {
+  char buf[4096];
+  ssize_t bytes_read;
+  while (conn->in.length < SERVER_MAX_BUFFERED) {
+    bytes_read = read(conn->fd, buf, sizeof(buf));
+    if (bytes_read > 0) {
+      http_buffer_append(&conn->in, buf, bytes_read);
+    } else if (bytes_read == 0) {
+      conn->closed = true;
+      break;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      break;
+    } else if (errno != EINTR) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Returns true if CONN has received a whole request (or an invalid one).
+ * Parsing of an HTTP request resumes where the last call left off; a binary
+ * frame is only measured here, and parsed by the worker. */
+static bool conn_has_request(conn_t *conn) {
+  uint64_t start = histogram_now();
+  if (kvframe_detect(conn->in.data, conn->in.length))
+    conn->req_length = kvframe_length(conn->in.data, conn->in.length);
+  else
+    conn->req_length =
+        http_request_parse(&conn->parser, &conn->req, conn->in.data, conn->in.length);
+  conn->parse_us += histogram_now() - start;
+  return conn->req_length != 0;
+}
+
+/* Sends as much of the pending output of CONN as the socket accepts. Once it
+ * is all sent, CONN goes back to waiting for a request, unless it is to be
+ * closed; otherwise the event loop waits to send the rest. */
+static void conn_send(server_t *server, conn_t *conn) {
+  uint64_t start = histogram_now();
+  ssize_t bytes_sent;
+  while (conn->out.length > 0) {
+    bytes_sent = write(conn->fd, conn->out.data, conn->out.length);
+    if (bytes_sent < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        stats_record(STATS_SEND, histogram_now() - start);
+        conn_set_state(server, conn, CONN_WRITING);
+        conn_watch(server, conn, EPOLLOUT);
+        return;
+      }
+      if (errno == EINTR)
+        continue;
+      conn_close(server, conn);
+      return;
+    }
+    http_buffer_consume(&conn->out, bytes_sent);
+  }
+  stats_record(STATS_SEND, histogram_now() - start);
+  if (!conn->keep_alive || conn->closed) {
+    conn_close(server, conn);
+    return;
+  }
+  conn_set_state(server, conn, CONN_READING);
+  conn_watch(server, conn, EPOLLIN | EPOLLRDHUP);
+}
+
+/* Answers CONN, which has buffered SERVER_MAX_BUFFERED bytes without
+ * receiving a whole request, with an error, then closes it. Waiting for more
+ * would be no use: the rest is left unread, so the event loop would only be
+ * woken for it again at once. */
+static void conn_reject(server_t *server, conn_t *conn) {
+  char *body = ERRMSG_INVALID_REQUEST;
+  conn->keep_alive = false;
+  http_encode_response(&conn->out, 413, NULL, body, strlen(body));
+  conn_send(server, conn);
+}
+
+/* Handles every whole request CONN has received, in order, for SERVER, then
+ * starts sending the responses. Runs on a worker thread. */
+static void conn_process(server_t *server, conn_t *conn) {
+  kvrequest_t req;
+  size_t handled = 0;
+  ssize_t length = conn->req_length;
+  uint64_t start = histogram_now();
+  req.arena = &conn->arena;
+  if (kvframe_detect(conn->in.data, conn->in.length))
+    length = kvrequest_parse(&req, &conn->parser, conn->in.data, conn->in.length);
+  else if (length > 0)
+    kvrequest_decode(&req, &conn->req);
+  else
+    req.binary = false;
+  stats_record(STATS_PARSE, conn->parse_us + histogram_now() - start);
+  conn->parse_us = 0;
+  while (length != 0) {
+    if (length < 0)
+      req.type = EMPTY;
+    /* A large value (see kvmessage.h) is read from the connection itself. */
+    req.sockfd = req.body.fd = conn->fd;
+    if (server->leader)
+      conn->keep_alive = tpcleader_handle_request(&server->tpcleader, &req, &conn->out);
+    else
+      conn->keep_alive = tpcfollower_handle_request(&server->tpcfollower, &req, &conn->out);
+    if (length < 0 || !conn->keep_alive) {
+      conn->keep_alive = false;
+      break;
+    }
+    handled += length + (req.large ? req.body.consumed : 0);
+    start = histogram_now();
+    length = kvrequest_parse(&req, &conn->parser, conn->in.data + handled,
+                             conn->in.length - handled);
+    if (length != 0)
+      stats_record(STATS_PARSE, histogram_now() - start);
+  }
+  /* Any partial request left over is parsed relative to its own start. */
+  http_buffer_consume(&conn->in, handled);
+  conn_send(server, conn);
+}
+
+/* Accepts all pending connections on the listening socket of SERVER. */
+static void server_accept(server_t *server) {
+  struct epoll_event ev;
+  conn_t *conn;
+  int fd;
+  while ((fd = accept(server->sockfd, NULL, NULL)) >= 0) {
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+      close(fd);
+      continue;
+    }
+    conn = calloc(1, sizeof(conn_t));
+    if (!conn)
+      fatal_malloc();
+    conn->fd = fd;
+    conn->keep_alive = true;
+    conn->state = CONN_READING;
+    conn->last_active = time(NULL);
+    http_buffer_init(&conn->in);
+    http_buffer_init(&conn->out);
+    http_parser_init(&conn->parser);
+    pthread_mutex_lock(&server->conns_lock);
+    DL_APPEND(server->conns, conn);
+    pthread_mutex_unlock(&server->conns_lock);
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    if (epoll_ctl(server->epollfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+      conn_close(server, conn);
+  }
+}
+
+/* Closes every connection of SERVER which has been waiting for a request for
+ * KEEPALIVE_TIMEOUT seconds or more. */
+static void server_close_idle(server_t *server) {
+  time_t now = time(NULL);
+  conn_t *conn, *tmp;
+  pthread_mutex_lock(&server->conns_lock);
+  DL_FOREACH_SAFE(server->conns, conn, tmp) {
+    if (conn->state == CONN_READING && now - conn->last_active >= KEEPALIVE_TIMEOUT) {
+      DL_DELETE(server->conns, conn);
+      conn_free(conn);
+    }
+  }
+  pthread_mutex_unlock(&server->conns_lock);
+}
+
+/* Runs the event loop of SERVER until server_stop is called. */
+static void server_loop(server_t *server) {
+  struct epoll_event events[SERVER_MAX_EVENTS];
+  struct epoll_event ev = {.events = EPOLLIN | EPOLLET, .data.ptr = NULL};
+  time_t last_sweep = time(NULL);
+  conn_t *conn;
+  int nevents;
+
+  server->epollfd = epoll_create1(0);
+  if (server->epollfd < 0 ||
+      fcntl(server->sockfd, F_SETFL, fcntl(server->sockfd, F_GETFL) | O_NONBLOCK) < 0 ||
+      epoll_ctl(server->epollfd, EPOLL_CTL_ADD, server->sockfd, &ev) < 0) {
+    fprintf(stderr, "Failed to start event loop: error %d: %s\n", errno, strerror(errno));
+    exit(errno);
+  }
+
+  while (server->listening) {
+    nevents = epoll_wait(server->epollfd, events, SERVER_MAX_EVENTS, 1000);
+    for (int i = 0; i < nevents; i++) {
+      conn = events[i].data.ptr;
+      if (!conn) {
+        server_accept(server);
+      } else if (conn->state == CONN_WRITING) {
+        conn_send(server, conn);
+      } else if (!conn_read(conn)) {
+        conn_close(server, conn);
+      } else if (conn_has_request(conn)) {
+        conn_set_state(server, conn, CONN_PROCESSING);
+        wq_push(&server->wq, conn);
+      } else if (conn->closed) {
+        conn_close(server, conn);
+      } else if (conn->in.length >= SERVER_MAX_BUFFERED) {
+        conn_reject(server, conn);
+      } else {
+        conn_watch(server, conn, EPOLLIN | EPOLLRDHUP);
+      }
+    }
+    if (time(NULL) != last_sweep) {
+      server_close_idle(server);
+      last_sweep = time(NULL);
+    }
+  }
+  close(server->epollfd);
+}
+
 /* Handles requests for SERVER. */
 static void *handle(void *server_) {
   /* (Valgrind) Detach so thread frees its memory on completion, since we won't
@@ -26,7 +305,10 @@ static void *handle(void *server_) {
   pthread_detach(pthread_self());
   server_t *server = (server_t *)server_;
   int sockfd;
-  if (server->leader) {
+  if (server->reactor) {
+    while (server->listening)
+      conn_process(server, wq_pop(&server->wq));
+  } else if (server->leader) {
     tpcleader_t *tpcleader = &server->tpcleader;
     while (server->listening) {
       sockfd = (intptr_t)wq_pop(&server->wq);
@@ -37,7 +319,8 @@ static void *handle(void *server_) {
     tpcfollower_t *tpcfollower = &server->tpcfollower;
     while (server->listening) {
       sockfd = (intptr_t)wq_pop(&server->wq);
-      tpcfollower_handle(tpcfollower, sockfd);
+      while (tpcfollower_handle(tpcfollower, sockfd) && server->listening && await_request(sockfd))
+        ;
       close(sockfd);
     }
   }
@@ -48,25 +331,38 @@ static void *handle(void *server_) {
  * Returns a socket fd which should be closed, else -1 if unsuccessful. */
 int connect_to(const char *host, int port, int timeout) {
   struct sockaddr_in addr;
-  struct hostent *ent;
-  int sockfd;
+  if (!resolve_host(host, port, &addr))
+    return -1;
+  return connect_to_addr(&addr, timeout);
+}
 
-  sockfd = socket(AF_INET, SOCK_STREAM, 0);
-  ent = gethostbyname(host);
-  if (ent == NULL) {
+/* Resolves HOST:PORT into ADDR. Returns false if HOST could not be found. */
+bool resolve_host(const char *host, int port, struct sockaddr_in *addr) {
+  struct hostent *ent = gethostbyname(host);
+  if (ent == NULL)
+    return false;
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  memcpy(&addr->sin_addr.s_addr, ent->h_addr, ent->h_length);
+  addr->sin_port = htons(port);
+  return true;
+}
+
+/* Connects to the address ADDR using a TIMEOUT second timeout. Returns a
+ * socket fd which should be closed, else -1 if unsuccessful. */
+int connect_to_addr(struct sockaddr_in *addr, int timeout) {
+  int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+  if (sockfd < 0)
     return -1;
-  }
-  memset(&addr, 0, sizeof(addr));
-  addr.sin_family = AF_INET;
-  memcpy(&addr.sin_addr.s_addr, ent->h_addr, ent->h_length);
-  addr.sin_port = htons(port);
   if (timeout > 0) {
     struct timeval t;
     t.tv_sec = timeout;
     t.tv_usec = 0;
     setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (char *)&t, sizeof(t));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, (char *)&t, sizeof(t));
   }
-  if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+  if (connect(sockfd, (struct sockaddr *)addr, sizeof(*addr)) < 0) {
+    close(sockfd);
     return -1;
   }
   return sockfd;
@@ -83,6 +379,12 @@ int server_run(const char *hostname, int port, server_t *server) {
   struct sockaddr_in client_address;
   size_t client_address_length = sizeof(client_address);
   wq_init(&server->wq);
+  server->wq.timed = true;
+  pthread_mutex_init(&server->conns_lock, NULL);
+  server->conns = NULL;
+  /* Writing to a connection the peer has already closed must fail rather than
+   * kill the server. */
+  signal(SIGPIPE, SIG_IGN);
   server->listening = 1;
   server->port = port;
   server->hostname = (char *)malloc(strlen(hostname) + 1);
@@ -119,6 +421,8 @@ int server_run(const char *hostname, int port, server_t *server) {
     pthread_create(&workers[i], NULL, handle, server);
   }
 
+  if (server->reactor)
+    server_loop(server);
   while (server->listening) {
     client_sock =
         accept(sock_fd, (struct sockaddr *)&client_address, (socklen_t *)&client_address_length);
@@ -8,7 +8,9 @@
 /* Socket Server defines helper functions for communicating over sockets.
  *
  * connect_to can be used to make a request to a listening host. You will not
- * need to modify this, but you will likely want to utilize it.
+ * need to modify this, but you will likely want to utilize it. To connect to
+ * the same host repeatedly, resolve it once with resolve_host and use
+ * connect_to_addr instead.
  *
  * server_run can be used to start a server (containing a TPCLeader or
  * TPCFollower) listening on a given port. See the comment above server_run for
@@ -16,23 +18,59 @@
  *
  * The server struct stores extra information on top of the stored TPCLeader or
  * TPCFollower.
+ *
+ * Connections to a TPCFollower are persistent: after each response, its
+ * worker waits up to KEEPALIVE_TIMEOUT seconds for another request on the
+ * same connection, unless the client asked for the connection to be closed.
+ *
+ * If SERVER->reactor is set, server_run instead serves all connections from a
+ * single edge-triggered epoll event loop, and worker threads only ever
+ * process complete requests. The event loop reads whatever has arrived on a
+ * connection into a buffer, and hands the connection to a worker once the
+ * buffer holds a whole request (an HTTP request, or a binary frame from a
+ * leader; see kvmessage.h). The worker handles every complete request in
+ * the buffer (so requests may be pipelined), appends the responses to an
+ * output buffer and sends as much of it as the socket accepts; the event loop
+ * sends the rest once the socket becomes writable, then waits for the next
+ * request. Idle and slow connections thus cost a buffer rather than a thread,
+ * and are closed once they have not completed a request for KEEPALIVE_TIMEOUT
+ * seconds.
  */
 
+/* Whether servers use the event loop by default. */
+#ifndef SERVER_DEFAULT_REACTOR
+#define SERVER_DEFAULT_REACTOR 1
+#endif
+
+/* The maximum number of received bytes buffered for one connection. */
+#define SERVER_MAX_BUFFERED (64 * 1024)
+
+/* The maximum number of events handled per wakeup of the event loop. */
+#define SERVER_MAX_EVENTS 256
+
+struct conn;
+
 typedef struct server {
-  int leader;      /* If this server represents a TPC Leader. */
-  int listening;   /* If this server is currently listening. */
-  int sockfd;      /* The socket fd this server is operating on. */
-  int max_threads; /* The maximum number of concurrent jobs that can run. */
-  int port;        /* The port this server will listen on. */
-  char *hostname;  /* The hostname this server will listen on. */
-  wq_t wq;         /* The work queue this server will use to process jobs. */
-  union {          /* The tpcfollower OR tpcleader this server represents. */
+  int leader;                 /* If this server represents a TPC Leader. */
+  int listening;              /* If this server is currently listening. */
+  int sockfd;                 /* The socket fd this server is operating on. */
+  int max_threads;            /* The maximum number of concurrent jobs that can run. */
+  int port;                   /* The port this server will listen on. */
+  char *hostname;             /* The hostname this server will listen on. */
+  wq_t wq;                    /* The work queue this server will use to process jobs. */
+  int reactor;                /* If this server runs an event loop (see above). */
+  int epollfd;                /* The epoll instance of the event loop. */
+  pthread_mutex_t conns_lock; /* A lock used to protect the list of connections. */
+  struct conn *conns;         /* The connections served by the event loop. */
+  union {                     /* The tpcfollower OR tpcleader this server represents. */
     tpcfollower_t tpcfollower;
     tpcleader_t tpcleader;
   };
 } server_t;
 
 int connect_to(const char *host, int port, int timeout);
+bool resolve_host(const char *host, int port, struct sockaddr_in *addr);
+int connect_to_addr(struct sockaddr_in *addr, int timeout);
 int server_run(const char *hostname, int port, server_t *server);
 void server_stop(server_t *server);
 
@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kvconstants.h"
+#include "stats.h"
+
+/* The histograms of a single thread. */
+typedef struct stats_thread {
+  histogram_t kinds[STATS_KINDS];
+  struct stats_thread *next; /* The thread which started recording before this one. */
+} stats_thread_t;
+
+/* The names of each kind, as the label of its stage. */
+static const char *stats_names[] = {"wq_wait",   "parse",       "store_get",  "store_put",
+                                    "store_del", "log_append",  "tpc_prepare", "tpc_commit",
+                                    "tpc_abort", "send"};
+
+/* Every thread which has recorded, most recent first. */
+static stats_thread_t *stats_threads;
+
+/* The histograms of the calling thread, once it has recorded. */
+static __thread stats_thread_t *stats_local;
+
+/* Returns the histograms of the calling thread, allocating them if needed. */
+static stats_thread_t *stats_thread(void) {
+  stats_thread_t *local = stats_local;
+  if (local)
+    return local;
+  local = calloc(1, sizeof(stats_thread_t));
+  if (!local)
+    fatal_malloc();
+  for (int i = 0; i < STATS_KINDS; i++)
+    histogram_init(&local->kinds[i]);
+  local->next = __atomic_load_n(&stats_threads, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&stats_threads, &local->next, local, true, __ATOMIC_RELEASE,
+                                      __ATOMIC_RELAXED))
+    ;
+  stats_local = local;
+  return local;
+}
+
+void stats_record(stats_kind_t kind, uint64_t value) {
+  histogram_record(&stats_thread()->kinds[kind], value);
+}
+
+void stats_print(FILE *out, const char *name) {
+  stats_thread_t *thread;
+  histogram_t merged;
+  char metric[64], labels[32];
+  unsigned int threads = 0;
+  for (thread = __atomic_load_n(&stats_threads, __ATOMIC_ACQUIRE); thread; thread = thread->next)
+    threads++;
+  fprintf(out, "%s_stats_threads %u\n", name, threads);
+  for (int kind = 0; kind < STATS_KINDS; kind++) {
+    histogram_init(&merged);
+    for (thread = __atomic_load_n(&stats_threads, __ATOMIC_ACQUIRE); thread;
+         thread = thread->next)
+      histogram_merge(&merged, &thread->kinds[kind]);
+    if (merged.count == 0)
+      continue;
+    if (kind == STATS_WQ_DEPTH) {
+      snprintf(metric, sizeof(metric), "%s_wq_depth", name);
+      labels[0] = '\0';
+    } else {
+      snprintf(metric, sizeof(metric), "%s_stage_latency_us", name);
+      snprintf(labels, sizeof(labels), "stage=\"%s\"", stats_names[kind]);
+    }
+    histogram_print(&merged, out, metric, labels);
+  }
+}
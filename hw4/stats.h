@@ -0,0 +1,44 @@
+#ifndef __STATS__
+#define __STATS__
+
+#include <stdint.h>
+#include <stdio.h>
+#include "histogram.h"
+
+/* Stats records how long the requests of a server spend in each stage of
+ * their handling, and how deep its work queue gets, so that the bottleneck of
+ * a loaded server can be read off its /metrics.
+ *
+ * Every thread records into histograms of its own, which it allocates the
+ * first time it records anything and links into a list shared by the process.
+ * Recording thus takes no lock, and threads do not contend for the cache
+ * lines of a shared histogram; stats_print merges the histograms of all
+ * threads. Threads are expected to live as long as the process, as the
+ * workers of a server do, so the histograms of a thread are never freed.
+ */
+
+/* What is recorded. All but STATS_WQ_DEPTH are latencies in microseconds. */
+typedef enum {
+  STATS_WQ_WAIT,     /* From the push of a job onto a server's work queue to its pop. */
+  STATS_PARSE,       /* Parsing and decoding a request, excluding reading it. */
+  STATS_STORE_GET,   /* A kvstore_get which missed the cache. */
+  STATS_STORE_PUT,   /* A kvstore_put. */
+  STATS_STORE_DEL,   /* A kvstore_del. */
+  STATS_LOG_APPEND,  /* Appending an entry to a TPCLog, until it is durable. */
+  STATS_TPC_PREPARE, /* A follower preparing its vote, including waiting for locks. */
+  STATS_TPC_COMMIT,  /* A follower logging and applying a commit. */
+  STATS_TPC_ABORT,   /* A follower logging an abort. */
+  STATS_SEND,        /* Writing a response to its socket. */
+  STATS_WQ_DEPTH,    /* The jobs already in a server's work queue when one is pushed. */
+  STATS_KINDS
+} stats_kind_t;
+
+/* Records VALUE as one more sample of KIND for the calling thread. */
+void stats_record(stats_kind_t kind, uint64_t value);
+
+/* Prints the histograms of every kind with samples, merged over all threads,
+ * as text metrics prefixed by NAME (see histogram_print), along with the
+ * number of threads which recorded any. */
+void stats_print(FILE *out, const char *name);
+
+#endif
@@ -1,16 +1,24 @@
 #include <string.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <errno.h>
 #include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 #include "kvconstants.h"
+#include "histogram.h"
+#include "kvblob.h"
+#include "kvcache.h"
 #include "kvstore.h"
 #include "kvmessage.h"
 #include "tpcfollower.h"
 #include "index.h"
 #include "tpclog.h"
 #include "socket_server.h"
+#include "stats.h"
+#include "utlist.h"
 
 /* Initializes a tpcfollower. Will return 0 if successful, or a negative error
  * code if not. DIRNAME is the directory which should be used to store entries
@@ -18,11 +26,18 @@
  * made available for requests. */
 int tpcfollower_init(tpcfollower_t *server, char *dirname, unsigned int max_threads,
                      const char *hostname, int port) {
+  uint64_t start = histogram_now();
   int ret;
-  ret = kvstore_init(&server->store, dirname);
+  ret = kvstore_init(&server->store, dirname, KVSTORE_DEFAULT_BACKEND, KVSTORE_DEFAULT_SYNC);
   if (ret < 0)
     return ret;
-  ret = tpclog_init(&server->log, dirname);
+  ret = tpclog_init(&server->log, dirname, TPCLOG_DEFAULT_SYNC);
+  if (ret < 0)
+    return ret;
+  ret = kvblob_init(&server->blobs, dirname, server->log.sync != TPCLOG_SYNC_NONE);
+  if (ret < 0)
+    return ret;
+  ret = kvcache_init(&server->cache, TPCFOLLOWER_CACHE_SIZE, true);
   if (ret < 0)
     return ret;
   strcpy(server->hostname, hostname);
@@ -30,22 +45,42 @@ int tpcfollower_init(tpcfollower_t *server, char *dirname, unsigned int max_thre
   server->max_threads = max_threads;
 
   server->state = TPC_INIT;
+  server->pending = NULL;
+  server->npending = 0;
+  server->locks = NULL;
+  server->pins = NULL;
+  server->decided = NULL;
+  server->lock_waits = server->lock_timeouts = 0;
+  pthread_mutex_init(&server->pending_lock, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&server->changed, &attr);
+  pthread_condattr_destroy(&attr);
 
   /* Rebuild TPC state. */
-  tpcfollower_rebuild_state(server);
+  ret = tpcfollower_rebuild_state(server);
+  if (ret < 0)
+    return ret;
+  server->startup_us = histogram_now() - start;
   return 0;
 }
 
 /* Sends a message to register SERVER with a TPCLeader over a socket located at
- * SOCKFD which has previously been connected. Does not close the socket when
- * done. Returns false if an error was encountered.
+ * SOCKFD which has previously been connected, offering to receive the
+ * leader's requests as binary frames (see kvmessage.h). Does not close the
+ * socket when done. Returns false if an error was encountered.
  */
 bool tpcfollower_register_leader(tpcfollower_t *server, int sockfd) {
   kvrequest_t register_req;
+  char port[12];
 
+  kvrequest_clear(&register_req);
   register_req.type = REGISTER;
-  strcpy(register_req.key, server->hostname);
-  sprintf(register_req.val, "%d", server->port);
+  register_req.accepts_binary = true;
+  register_req.key = server->hostname;
+  sprintf(port, "%d", server->port);
+  register_req.val = port;
 
   kvrequest_send(&register_req, sockfd);
 
@@ -55,17 +90,33 @@ bool tpcfollower_register_leader(tpcfollower_t *server, int sockfd) {
   return res.type == SUCCESS;
 }
 
-/* Attempts to get KEY from SERVER. Returns 0 if successful, else a negative
- * error code.  If successful, VALUE will point to a string which should later
- * be free()d.  */
-int tpcfollower_get(tpcfollower_t *server, char *key, char *value) {
+/* Attempts to get KEY, whose kvhash64 is HASH, from SERVER, from its cache if
+ * possible. Returns 0 if successful, else a negative error code (ERR_STREAMED
+ * if the value is large, and must be read from its blob).  If successful, the
+ * value is copied into VALUE. */
+static int tpcfollower_get_hashed(tpcfollower_t *server, char *key, uint64_t hash, char *value) {
   int ret;
+  uint64_t ticket, start;
   if (strlen(key) > MAX_KEYLEN)
     return ERR_KEYLEN;
+  if (kvcache_get(&server->cache, key, hash, value, &ticket))
+    return 0;
+  start = histogram_now();
   ret = kvstore_get(&server->store, key, value);
+  stats_record(STATS_STORE_GET, histogram_now() - start);
+  if (ret == 0)
+    kvcache_fill(&server->cache, key, hash, value, ticket);
+  else if (ret == ERR_NOKEY && kvblob_exists(&server->blobs, key))
+    ret = ERR_STREAMED;
   return ret;
 }
 
+/* Attempts to get KEY from SERVER. Returns 0 if successful, else a negative
+ * error code.  If successful, the value is copied into VALUE. */
+int tpcfollower_get(tpcfollower_t *server, char *key, char *value) {
+  return tpcfollower_get_hashed(server, key, kvhash_str(key), value);
+}
+
 /* Checks if the given KEY, VALUE pair can be inserted into this server's
  * store. Returns 0 if it can, else a negative error code. */
 int tpcfollower_put_check(tpcfollower_t *server, char *key, char *value) {
@@ -79,23 +130,54 @@ int tpcfollower_put_check(tpcfollower_t *server, char *key, char *value) {
   return 0;
 }
 
-/* Inserts the given KEY, VALUE pair into this server's store
- * Returns 0 if successful, else a negative error code. */
+/* Inserts the given KEY, VALUE pair into this server's store, in place of
+ * any large value of KEY. Returns 0 if successful, else a negative error
+ * code. */
 int tpcfollower_put(tpcfollower_t *server, char *key, char *value) {
+  uint64_t start;
   int ret;
   if ((ret = tpcfollower_put_check(server, key, value)) < 0)
     return ret;
+  start = histogram_now();
   ret = kvstore_put(&server->store, key, value);
+  stats_record(STATS_STORE_PUT, histogram_now() - start);
+  if (ret == 0)
+    kvcache_put(&server->cache, key, kvhash_str(key), value);
+  else
+    kvcache_del(&server->cache, key, kvhash_str(key));
+  if (ret == 0)
+    kvblob_del(&server->blobs, key);
   return ret;
 }
 
+/* Checks if a large value of KEY can be stored by this server. Returns 0 if
+ * it can, else a negative error code. */
+static int tpcfollower_put_blob_check(tpcfollower_t *server, char *key) {
+  if (strlen(key) > MAX_KEYLEN || strlen(key) == 0)
+    return ERR_KEYLEN;
+  return kvblob_check(&server->blobs, key);
+}
+
+/* Inserts the large value of KEY held in the spool of transaction TXID into
+ * this server's blobs, in place of any value of KEY in its store. Returns 0 if
+ * successful, else a negative error code. */
+static int tpcfollower_put_blob(tpcfollower_t *server, uint64_t txid, char *key) {
+  int ret = kvblob_commit(&server->blobs, txid, key);
+  if (ret < 0)
+    return ret;
+  if (kvstore_del(&server->store, key) == 0)
+    kvcache_del(&server->cache, key, kvhash_str(key));
+  return 0;
+}
+
 /* Checks if the given KEY can be deleted from this server's store.
  * Returns 0 if it can, else a negative error code. */
 int tpcfollower_del_check(tpcfollower_t *server, char *key) {
   int check;
   if (strlen(key) > MAX_KEYLEN || strlen(key) == 0)
     return ERR_KEYLEN;
-  if ((check = kvstore_del_check(&server->store, key)) < 0)
+  check = kvstore_del_check(&server->store, key);
+  if (check < 0 && !(check == ERR_NOKEY && kvblob_exists(&server->blobs, key)))
     return check;
   return 0;
 }
@@ -103,42 +185,420 @@ int tpcfollower_del_check(tpcfollower_t *server, char *key) {
 /* Removes the given KEY from this server's store. Returns
  * 0 if successful, else a negative error code. */
 int tpcfollower_del(tpcfollower_t *server, char *key) {
+  uint64_t start;
   int ret;
   if ((ret = tpcfollower_del_check(server, key)) < 0)
     return ret;
+  start = histogram_now();
   ret = kvstore_del(&server->store, key);
+  stats_record(STATS_STORE_DEL, histogram_now() - start);
+  kvcache_del(&server->cache, key, kvhash_str(key));
+  if (kvblob_del(&server->blobs, key) == 0 && ret == ERR_NOKEY)
+    ret = 0;
   return ret;
 }
 
-void commit_all(tpcfollower_t *server) {
-    char *val;
-    logentry_t curr;
-    tpclog_iterate_begin(&server->log);
-    while (tpclog_iterate_has_next(&server->log)) {
-        if (tpclog_iterate_next(&server->log, &curr) != NULL) {
-            if (curr.type == PUTREQ) {
-                val = curr.data + strlen(curr.data) + 1;
-                tpcfollower_put(server, curr.data, val);
-            } else if (curr.type == DELREQ) {
-                tpcfollower_del(server, curr.data);
-            }
-        }
+/* Checks if every operation of BATCH can be applied to this server's store,
+ * as it is before the batch. Returns 0 if they can, else the negative error
+ * code of the first which cannot. */
+int tpcfollower_batch_check(tpcfollower_t *server, strview_t batch) {
+  char key[MAX_KEYLEN + 1], value[MAX_VALLEN + 1];
+  kvbatch_op_t op;
+  size_t offset = 0;
+  int ret;
+  while ((ret = kvbatch_next(batch, &offset, &op)) > 0) {
+    strview_copy(key, op.key, MAX_KEYLEN);
+    strview_copy(value, op.val, MAX_VALLEN);
+    if (op.type == PUTREQ)
+      ret = tpcfollower_put_check(server, key, value);
+    else
+      ret = tpcfollower_del_check(server, key);
+    if (ret < 0)
+      return ret;
+  }
+  return ret < 0 ? ERR_INVLDMSG : 0;
+}
+
+/* Applies every operation of BATCH to this server's store, in order. */
+void tpcfollower_batch_apply(tpcfollower_t *server, strview_t batch) {
+  char key[MAX_KEYLEN + 1], value[MAX_VALLEN + 1];
+  kvbatch_op_t op;
+  size_t offset = 0;
+  while (kvbatch_next(batch, &offset, &op) > 0) {
+    strview_copy(key, op.key, MAX_KEYLEN);
+    strview_copy(value, op.val, MAX_VALLEN);
+    if (op.type == PUTREQ)
+      tpcfollower_put(server, key, value);
+    else
+      tpcfollower_del(server, key);
+  }
+}
+
+/* Returns a new vote of type TYPE in transaction TXID, whose DATA (as laid out
+ * in a logentry_t, without the final null terminator) is the LENGTH bytes at
+ * DATA. */
+static tpcfollower_vote_t *tpcfollower_new_vote(uint64_t txid, msgtype_t type, const char *data,
+                                                size_t length) {
+  tpcfollower_vote_t *vote = malloc(sizeof(tpcfollower_vote_t) + length + 1);
+  if (!vote)
+    fatal_malloc();
+  vote->txid = txid;
+  vote->type = type;
+  vote->length = length + 1;
+  memcpy(vote->data, data, length);
+  vote->data[length] = '\0';
+  return vote;
+}
+
+/* Returns a new vote for the PUTREQ, DELREQ or BATCH request REQ, whose value
+ * is not large. */
+static tpcfollower_vote_t *tpcfollower_request_vote(kvrequest_t *req) {
+  char data[MAX_KEYLEN + MAX_VALLEN + 2];
+  size_t keylen = strlen(req->key);
+  if (req->type == BATCH)
+    return tpcfollower_new_vote(req->txid, BATCH, req->batch.data, req->batch.length);
+  if (req->type == DELREQ)
+    return tpcfollower_new_vote(req->txid, DELREQ, req->key, keylen);
+  memcpy(data, req->key, keylen + 1);
+  strcpy(data + keylen + 1, req->val);
+  return tpcfollower_new_vote(req->txid, PUTREQ, data, keylen + 1 + strlen(req->val));
+}
+
+/* Reads the key at *OFFSET of those VOTE writes into KEY, and advances *OFFSET
+ * past it. Returns false once there are no more keys. */
+static bool tpcfollower_vote_key(tpcfollower_vote_t *vote, size_t *offset, strview_t *key) {
+  strview_t batch = {vote->data, vote->length - 1};
+  kvbatch_op_t op;
+  if (vote->type == BATCH) {
+    if (kvbatch_next(batch, offset, &op) <= 0)
+      return false;
+    *key = op.key;
+    return true;
+  }
+  /* A PUTREQ, DELREQ or PUTBLOB vote starts with its only key. */
+  if (*offset > 0)
+    return false;
+  key->data = vote->data;
+  key->length = strlen(vote->data);
+  *offset = 1;
+  return true;
+}
+
+/* Checks if VOTE can be applied to this server's store. Returns 0 if it can,
+ * else a negative error code. */
+static int tpcfollower_vote_check(tpcfollower_t *server, tpcfollower_vote_t *vote) {
+  strview_t batch = {vote->data, vote->length - 1};
+  if (vote->type == PUTREQ)
+    return tpcfollower_put_check(server, vote->data, vote->data + strlen(vote->data) + 1);
+  if (vote->type == DELREQ)
+    return tpcfollower_del_check(server, vote->data);
+  if (vote->type == PUTBLOB)
+    return tpcfollower_put_blob_check(server, vote->data);
+  return tpcfollower_batch_check(server, batch);
+}
+
+/* Appends VOTE to the log of SERVER. Returns 0 if successful, else a negative
+ * error code. */
+static int tpcfollower_vote_log(tpcfollower_t *server, tpcfollower_vote_t *vote) {
+  if (vote->type == BATCH)
+    return tpclog_log_batch(&server->log, vote->txid, vote->data, vote->length - 1);
+  return tpclog_log(&server->log, vote->txid, vote->type, vote->data,
+                    vote->data + strlen(vote->data) + 1);
+}
+
+/* Applies VOTE to the store of SERVER. */
+static void tpcfollower_apply(tpcfollower_t *server, tpcfollower_vote_t *vote) {
+  if (vote->type == PUTREQ) {
+    tpcfollower_put(server, vote->data, vote->data + strlen(vote->data) + 1);
+  } else if (vote->type == DELREQ) {
+    tpcfollower_del(server, vote->data);
+  } else if (vote->type == PUTBLOB) {
+    /* The spool is kept as long as the log holds the vote, which is older
+     * than anything logged from now on. */
+    if (tpcfollower_put_blob(server, vote->txid, vote->data) == 0)
+      kvblob_retire(&server->blobs, vote->txid, tpclog_next_seq(&server->log));
+  } else if (vote->type == BATCH) {
+    strview_t batch = {vote->data, vote->length - 1};
+    tpcfollower_batch_apply(server, batch);
+  }
+}
+
+/* The functions below which take no lock themselves must be called with the
+ * pending lock of SERVER held, or before SERVER handles any request. */
+
+/* Returns true if none of the keys VOTE writes is locked by another
+ * transaction than its own. Else sets OLDER if one of them is locked by an
+ * older transaction, with a lower ID. */
+static bool tpcfollower_can_lock(tpcfollower_t *server, tpcfollower_vote_t *vote, bool *older) {
+  tpcfollower_lock_t *lock;
+  strview_t key;
+  size_t offset = 0;
+  bool unlocked = true;
+  *older = false;
+  while (tpcfollower_vote_key(vote, &offset, &key)) {
+    HASH_FIND(hh, server->locks, key.data, key.length, lock);
+    if (lock && lock->txid != vote->txid) {
+      unlocked = false;
+      *older = *older || lock->txid < vote->txid;
     }
-    tpclog_clear_log(&server->log);
-}
-
-bool is_in_queue(tpcfollower_t *server, kvrequest_t *req) {
-    logentry_t curr;
-    tpclog_iterate_begin(&server->log);
-    while (tpclog_iterate_has_next(&server->log)) {
-        if (tpclog_iterate_next(&server->log, &curr) != NULL) {
-            if (curr.type == PUTREQ) {
-                if (strcmp(curr.data, req->key) == 0)
-                    return true;
-            }
-        }
+  }
+  return unlocked;
+}
+
+/* Locks the keys VOTE writes for its transaction, which must be able to lock
+ * them all (see tpcfollower_can_lock). */
+static void tpcfollower_lock(tpcfollower_t *server, tpcfollower_vote_t *vote) {
+  tpcfollower_lock_t *lock;
+  strview_t key;
+  size_t offset = 0;
+  while (tpcfollower_vote_key(vote, &offset, &key)) {
+    HASH_FIND(hh, server->locks, key.data, key.length, lock);
+    if (lock)
+      continue;
+    lock = malloc(sizeof(tpcfollower_lock_t) + key.length + 1);
+    if (!lock)
+      fatal_malloc();
+    lock->txid = vote->txid;
+    strview_copy(lock->key, key, key.length);
+    HASH_ADD_KEYPTR(hh, server->locks, lock->key, key.length, lock);
+  }
+}
+
+/* Unlocks the keys VOTE writes which are held by its transaction, and wakes
+ * any votes waiting for them. */
+static void tpcfollower_unlock(tpcfollower_t *server, tpcfollower_vote_t *vote) {
+  tpcfollower_lock_t *lock;
+  strview_t key;
+  size_t offset = 0;
+  while (tpcfollower_vote_key(vote, &offset, &key)) {
+    HASH_FIND(hh, server->locks, key.data, key.length, lock);
+    if (lock && lock->txid == vote->txid) {
+      HASH_DEL(server->locks, lock);
+      free(lock);
     }
-    return false;
+  }
+  pthread_cond_broadcast(&server->changed);
+}
+
+/* Sets DEADLINE to MS milliseconds from now. */
+static void tpcfollower_deadline(struct timespec *deadline, long ms) {
+  clock_gettime(CLOCK_MONOTONIC, deadline);
+  deadline->tv_sec += ms / 1000;
+  deadline->tv_nsec += (ms % 1000) * 1000000;
+  if (deadline->tv_nsec >= 1000000000) {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000000000;
+  }
+}
+
+/* Waits until the state of SERVER changes or DEADLINE passes, and sets
+ * WAITED. Returns false if DEADLINE has passed. */
+static bool tpcfollower_wait(tpcfollower_t *server, struct timespec *deadline, bool *waited) {
+  *waited = true;
+  return pthread_cond_timedwait(&server->changed, &server->pending_lock, deadline) != ETIMEDOUT;
+}
+
+/* Removes the pending votes of transaction TXID from SERVER and returns them,
+ * as a list of COUNT votes. */
+static tpcfollower_vote_t *tpcfollower_take(tpcfollower_t *server, uint64_t txid,
+                                            unsigned int *count) {
+  tpcfollower_vote_t *votes = NULL, *vote, *tmp;
+  *count = 0;
+  DL_FOREACH_SAFE(server->pending, vote, tmp) {
+    if (vote->txid == txid) {
+      DL_DELETE(server->pending, vote);
+      DL_APPEND(votes, vote);
+      (*count)++;
+    }
+  }
+  server->npending -= *count;
+  if (server->npending == 0)
+    server->state = TPC_INIT;
+  return votes;
+}
+
+/* Returns true if SERVER has decided transaction TXID, as far as it
+ * remembers. */
+static bool tpcfollower_is_decided(tpcfollower_t *server, uint64_t txid) {
+  tpcfollower_decided_t *decided;
+  HASH_FIND(hh, server->decided, &txid, sizeof(txid), decided);
+  return decided != NULL;
+}
+
+/* Remembers that SERVER has decided transaction TXID, forgetting the oldest
+ * decision once it remembers TPCFOLLOWER_DECIDED of them. */
+static void tpcfollower_set_decided(tpcfollower_t *server, uint64_t txid) {
+  tpcfollower_decided_t *decided;
+  if (tpcfollower_is_decided(server, txid))
+    return;
+  decided = malloc(sizeof(tpcfollower_decided_t));
+  if (!decided)
+    fatal_malloc();
+  decided->txid = txid;
+  HASH_ADD(hh, server->decided, txid, sizeof(txid), decided);
+  if (HASH_COUNT(server->decided) > TPCFOLLOWER_DECIDED) {
+    /* The head of the hash is the entry which was added first. */
+    decided = server->decided;
+    HASH_DEL(server->decided, decided);
+    free(decided);
+  }
+}
+
+/* Returns the sequence number of the oldest entry in the log of SERVER which
+ * may still be needed: that of the oldest vote which is pending, or being
+ * logged or resolved. */
+static uint64_t tpcfollower_oldest(tpcfollower_t *server) {
+  uint64_t oldest = tpclog_next_seq(&server->log);
+  tpcfollower_vote_t *vote;
+  tpcfollower_pin_t *pin;
+  DL_FOREACH(server->pending, vote) {
+    if (vote->seq < oldest)
+      oldest = vote->seq;
+  }
+  DL_FOREACH(server->pins, pin) {
+    if (pin->seq < oldest)
+      oldest = pin->seq;
+  }
+  return oldest;
+}
+
+/* Truncates the log of SERVER past the segments which only hold finished
+ * transactions, and removes the spools of the large values they committed.
+ * Must be called without the pending lock held. */
+static void tpcfollower_truncate(tpcfollower_t *server) {
+  uint64_t oldest;
+  pthread_mutex_lock(&server->pending_lock);
+  oldest = tpcfollower_oldest(server);
+  pthread_mutex_unlock(&server->pending_lock);
+  kvblob_sweep(&server->blobs, tpclog_truncate(&server->log, oldest));
+}
+
+/* Prepares VOTE, which SERVER has been asked for: waits until its keys can be
+ * locked, for at most TPCFOLLOWER_LOCK_TIMEOUT milliseconds (or
+ * TPCFOLLOWER_YIELD_TIMEOUT, while an older transaction holds one of them),
+ * then checks that it can be applied, logs it and adds it to the pending
+ * votes. A vote of a transaction which has already been decided, before or
+ * while it was logged, is refused. Returns 0 if SERVER may vote to commit,
+ * else a negative error code, in which case VOTE is freed. */
+static int tpcfollower_prepare(tpcfollower_t *server, tpcfollower_vote_t *vote) {
+  struct timespec deadline, yield;
+  bool waited = false, older;
+  tpcfollower_pin_t pin;
+  int ret;
+  tpcfollower_deadline(&deadline, TPCFOLLOWER_LOCK_TIMEOUT);
+  tpcfollower_deadline(&yield, TPCFOLLOWER_YIELD_TIMEOUT);
+
+  pthread_mutex_lock(&server->pending_lock);
+  if (tpcfollower_is_decided(server, vote->txid)) {
+    pthread_mutex_unlock(&server->pending_lock);
+    free(vote);
+    return ERR_INVLDMSG;
+  }
+  while (!tpcfollower_can_lock(server, vote, &older)) {
+    if (!tpcfollower_wait(server, older ? &yield : &deadline, &waited))
+      goto timeout;
+  }
+  tpcfollower_lock(server, vote);
+  server->lock_waits += waited;
+  vote->seq = pin.seq = tpclog_next_seq(&server->log);
+  DL_APPEND(server->pins, &pin);
+  pthread_mutex_unlock(&server->pending_lock);
+
+  ret = tpcfollower_vote_check(server, vote);
+  if (ret == 0)
+    ret = tpcfollower_vote_log(server, vote);
+
+  pthread_mutex_lock(&server->pending_lock);
+  DL_DELETE(server->pins, &pin);
+  if (ret == 0 && tpcfollower_is_decided(server, vote->txid))
+    ret = ERR_INVLDMSG;
+  if (ret == 0) {
+    DL_APPEND(server->pending, vote);
+    server->npending++;
+    server->state = TPC_WAIT;
+  } else {
+    tpcfollower_unlock(server, vote);
+    free(vote);
+  }
+  pthread_mutex_unlock(&server->pending_lock);
+  return ret;
+
+timeout:
+  server->lock_waits++;
+  server->lock_timeouts++;
+  pthread_mutex_unlock(&server->pending_lock);
+  free(vote);
+  return ERR_LOCKED;
+}
+
+/* Reads the large value of the PUTREQ REQ from its body into a spool, then
+ * prepares the vote for it as tpcfollower_prepare does. Returns 0 if SERVER
+ * may vote to commit, else a negative error code, in which case the spool is
+ * removed. */
+static int tpcfollower_prepare_blob(tpcfollower_t *server, kvrequest_t *req) {
+  ssize_t length = kvblob_receive(&server->blobs, req->txid, req->key, &req->body);
+  int ret;
+  if (length < 0)
+    return length;
+  ret = tpcfollower_prepare(server,
+                            tpcfollower_new_vote(req->txid, PUTBLOB, req->key, strlen(req->key)));
+  if (ret < 0)
+    kvblob_discard(&server->blobs, req->txid);
+  return ret;
+}
+
+/* Resolves transaction TXID on SERVER. Remembers and logs the decision, so
+ * that a COMMIT is finished by tpcfollower_rebuild_state should SERVER crash
+ * while applying it, and a vote of the transaction still being prepared is
+ * refused, then applies the pending votes of the transaction if COMMIT is set
+ * (or discards the spools of their large values if not), forgets them, unlocks
+ * their keys and truncates the log. Returns 0 if successful, else the negative
+ * error code of logging the decision, in which case the votes are left
+ * pending, to be resolved when the decision is sent again. */
+static int tpcfollower_decide(tpcfollower_t *server, uint64_t txid, bool commit) {
+  tpcfollower_vote_t *votes, *vote, *tmp;
+  tpcfollower_pin_t pin;
+  unsigned int count;
+  int ret;
+  pthread_mutex_lock(&server->pending_lock);
+  tpcfollower_set_decided(server, txid);
+  votes = tpcfollower_take(server, txid, &count);
+  pin.seq = tpclog_next_seq(&server->log);
+  DL_FOREACH(votes, vote) {
+    if (vote->seq < pin.seq)
+      pin.seq = vote->seq;
+  }
+  DL_APPEND(server->pins, &pin);
+  pthread_mutex_unlock(&server->pending_lock);
+
+  ret = tpclog_log(&server->log, txid, commit ? COMMIT : ABORT, NULL, NULL);
+  if (ret < 0) {
+    pthread_mutex_lock(&server->pending_lock);
+    DL_CONCAT(server->pending, votes);
+    server->npending += count;
+    if (count > 0)
+      server->state = TPC_WAIT;
+    DL_DELETE(server->pins, &pin);
+    pthread_mutex_unlock(&server->pending_lock);
+    return ret;
+  }
+  DL_FOREACH(votes, vote) {
+    if (commit)
+      tpcfollower_apply(server, vote);
+    else if (vote->type == PUTBLOB)
+      kvblob_discard(&server->blobs, txid);
+  }
+
+  pthread_mutex_lock(&server->pending_lock);
+  DL_FOREACH_SAFE(votes, vote, tmp) {
+    DL_DELETE(votes, vote);
+    tpcfollower_unlock(server, vote);
+    free(vote);
+  }
+  DL_DELETE(server->pins, &pin);
+  pthread_mutex_unlock(&server->pending_lock);
+  tpcfollower_truncate(server);
+  return 0;
 }
 
 /* Handles an incoming kvrequest REQ, and populates RES as a response.  REQ and
@@ -150,11 +610,12 @@ bool is_in_queue(tpcfollower_t *server, kvrequest_t *req) {
  */
 void tpcfollower_handle_tpc(tpcfollower_t *server, kvrequest_t *req, kvresponse_t *res) {
     /* TODO: Implement me! */
+    uint64_t start = histogram_now();
     int ret;
     *(res->body) = 0;
     switch (req->type) {
     case GETREQ:
-        ret = tpcfollower_get(server, req->key, res->body);
+        ret = tpcfollower_get_hashed(server, req->key, req->hash, res->body);
         if (ret == 0)
             res->type = GETRESP;
         else {
@@ -163,9 +624,13 @@ void tpcfollower_handle_tpc(tpcfollower_t *server, kvrequest_t *req, kvresponse_
         }
         break;
     case PUTREQ:
-        ret = tpcfollower_put_check(server, req->key, req->val);
-        if (ret == 0)
-            ret = tpclog_log(&server->log, req->type, req->key, req->val);
+    case DELREQ:
+    case BATCH:
+        if (req->large)
+            ret = tpcfollower_prepare_blob(server, req);
+        else
+            ret = tpcfollower_prepare(server, tpcfollower_request_vote(req));
+        stats_record(STATS_TPC_PREPARE, histogram_now() - start);
         if (ret == 0) {
             res->type = VOTE;
             strcpy(res->body, MSG_COMMIT);
@@ -174,29 +639,20 @@ void tpcfollower_handle_tpc(tpcfollower_t *server, kvrequest_t *req, kvresponse_
             strcpy(res->body, GETMSG(ret));
         }
         break;
-    case DELREQ:
-        ret = tpcfollower_del_check(server, req->key);
-        if (ret == 0)
-            ret = tpclog_log(&server->log, req->type, req->key, req->val);
+    case COMMIT:
+    case ABORT:
+        /* A decision which could not be logged is not acknowledged, so the
+         * leader sends it again. */
+        ret = tpcfollower_decide(server, req->txid, req->type == COMMIT);
+        stats_record(req->type == COMMIT ? STATS_TPC_COMMIT : STATS_TPC_ABORT,
+                     histogram_now() - start);
         if (ret == 0) {
-            res->type = VOTE;
-            strcpy(res->body, MSG_COMMIT);
+            res->type = ACK;
         } else {
             res->type = ERROR;
-            if (is_in_queue(server, req))
-                strcpy(res->body, ERRMSG_INVALID);
-            else
-                strcpy(res->body, GETMSG(ret));
+            strcpy(res->body, GETMSG(ret));
         }
         break;
-    case COMMIT:
-        res->type = ACK;
-        commit_all(server);
-        break;
-    case ABORT:
-        res->type = ACK;
-        tpclog_clear_log(&server->log);
-        break;
     default:
         res->type = ERROR;
         strcpy(res->body, ERRMSG_INVALID_REQUEST);
@@ -206,42 +662,220 @@ void tpcfollower_handle_tpc(tpcfollower_t *server, kvrequest_t *req, kvresponse_
 /* Generic entrypoint for this SERVER. Takes in a socket on SOCKFD, which
  * should already be connected to an incoming request. Processes the request
  * and sends back a response message.  This should call out to the appropriate
- * internal handler. */
-void tpcfollower_handle(tpcfollower_t *server, int sockfd) {
+ * internal handler. Returns true if the connection may be kept open for
+ * another request. */
+bool tpcfollower_handle(tpcfollower_t *server, int sockfd) {
+  char buf[HTTP_RECV_MAX_SIZE];
   kvrequest_t req;
+  kvarena_t arena;
+  http_buffer_t out;
+  bool keep_alive;
+  uint64_t start;
+  http_buffer_init(&out);
+  req.arena = &arena;
+  kvrequest_receive(&req, sockfd, buf, sizeof(buf));
+  keep_alive = tpcfollower_handle_request(server, &req, &out);
+  start = histogram_now();
+  if (http_buffer_send(&out, sockfd) < 0)
+    keep_alive = false;
+  stats_record(STATS_SEND, histogram_now() - start);
+  http_buffer_free(&out);
+  return keep_alive;
+}
+
+/* Appends the counters of the cache of SERVER, its number of blobs, its
+ * startup time, its number of pending votes and locked keys, its lock
+ * counters and the stats of its stages (see stats.h) to OUT as a plain text
+ * response, one "name value" line per counter. */
+static void tpcfollower_encode_metrics(tpcfollower_t *server, http_buffer_t *out) {
+  char *buf = NULL;
+  size_t size = 0;
+  FILE *metrics = open_memstream(&buf, &size);
+  if (!metrics)
+    fatal_malloc();
+  kvcache_print(&server->cache, metrics, "tpcfollower_cache");
+  kvstore_print(&server->store, metrics, "tpcfollower_store");
+  fprintf(metrics, "tpcfollower_blobs %lu\n",
+          __atomic_load_n(&server->blobs.count, __ATOMIC_RELAXED));
+  fprintf(metrics, "tpcfollower_startup_us %" PRIu64 "\n", server->startup_us);
+  pthread_mutex_lock(&server->pending_lock);
+  fprintf(metrics, "tpcfollower_pending_votes %u\n", server->npending);
+  fprintf(metrics, "tpcfollower_locked_keys %u\n", HASH_COUNT(server->locks));
+  fprintf(metrics, "tpcfollower_lock_waits %lu\n", server->lock_waits);
+  fprintf(metrics, "tpcfollower_lock_timeouts %lu\n", server->lock_timeouts);
+  pthread_mutex_unlock(&server->pending_lock);
+  stats_print(metrics, "tpcfollower");
+  fclose(metrics);
+  http_encode_response(out, 200, "text/plain", buf, size);
+  free(buf);
+}
+
+/* A page of a scan being built by a follower. */
+typedef struct {
+  http_buffer_t body; /* The entries of the page, as a batch. */
+  unsigned int count; /* The number of entries in BODY. */
+  unsigned int limit; /* The most entries BODY may hold. */
+} tpcfollower_page_t;
+
+/* Appends the entry KEY, VALUE to the page at ARG. Returns false, leaving the
+ * page as it is, if the page is full. */
+static bool tpcfollower_page_add(void *arg, const char *key, const char *value) {
+  tpcfollower_page_t *page = arg;
+  kvbatch_op_t op = {PUTREQ, {key, strlen(key)}, {value, strlen(value)}};
+  /* "PUT <key> <value>\n" */
+  if (page->count == page->limit ||
+      page->body.length + op.key.length + op.val.length + 6 > MAX_SCANLEN)
+    return false;
+  kvbatch_append(&page->body, &op);
+  page->count++;
+  return true;
+}
+
+/* Appends to OUT the page of the entries of SERVER which the SCAN request REQ
+ * asks for (see kvmessage.h), read from its store, or an error response. */
+static void tpcfollower_handle_scan(tpcfollower_t *server, kvrequest_t *req, http_buffer_t *out) {
+  tpcfollower_page_t page = {.count = 0, .limit = req->limit};
   kvresponse_t res;
-  bool success = kvrequest_receive(&req, sockfd);
-  do {
-    if (!success) {
-      res.type = ERROR;
-      strcpy(res.body, ERRMSG_INVALID_REQUEST);
-    } else if (req.type == INDEX) {
-      index_send(sockfd, 0);
-      break;
-    } else {
-      tpcfollower_handle_tpc(server, &req, &res);
-    }
-    kvresponse_send(&res, sockfd);
-  } while (0);
+  int ret;
+  http_buffer_init(&page.body);
+  ret = kvstore_scan(&server->store, req->key, req->val, tpcfollower_page_add, &page);
+  if (ret >= 0) {
+    http_encode_response(out, ret ? 206 : 200, "text/plain", page.body.data, page.body.length);
+  } else {
+    res.type = ERROR;
+    strcpy(res.body, ret == ERR_INVLDMSG ? ERRMSG_NOT_IMPLEMENTED : GETMSG(ret));
+    kvresponse_encode(&res, out);
+  }
+  http_buffer_free(&page.body);
+}
+
+/* Sends the large value of the key of the BLOB request REQ from the blobs of
+ * SERVER, as the body of the response, straight to the socket of REQ. Else
+ * appends a GET response (as a GETREQ would have been answered) to OUT.
+ * Returns false if the connection must be closed. */
+static bool tpcfollower_handle_blob(tpcfollower_t *server, kvrequest_t *req, http_buffer_t *out) {
+  kvresponse_t res;
+  size_t length;
+  off_t offset;
+  bool sent;
+  int fd = kvblob_open(&server->blobs, req->key, &length, &offset);
+  if (fd < 0) {
+    req->type = GETREQ;
+    tpcfollower_handle_tpc(server, req, &res);
+    kvresponse_encode(&res, out);
+    return req->keep_alive;
+  }
+  /* Anything already in OUT goes first. */
+  sent = http_encode_headers(out, 200, "application/octet-stream", length) &&
+         http_buffer_send(out, req->sockfd) >= 0 &&
+         http_sendfile(req->sockfd, fd, offset, length) >= 0;
+  close(fd);
+  return sent && req->keep_alive;
+}
+
+/* Processes the request REQ, which has already been received by SERVER, and
+ * appends the response message to OUT, in the framing REQ arrived in.
+ * REQ->type is EMPTY if the request was invalid. Returns true if the
+ * connection may be kept open for another request. */
+bool tpcfollower_handle_request(tpcfollower_t *server, kvrequest_t *req, http_buffer_t *out) {
+  kvresponse_t res;
+  if (req->type == EMPTY) {
+    res.type = ERROR;
+    strcpy(res.body, ERRMSG_INVALID_REQUEST);
+  } else if (req->type == INDEX) {
+    /* The index page is delimited by closing the connection. */
+    index_encode(out, 0);
+    return false;
+  } else if (req->type == METRICS) {
+    tpcfollower_encode_metrics(server, out);
+    return req->keep_alive;
+  } else if (req->type == SCAN) {
+    tpcfollower_handle_scan(server, req, out);
+    return req->keep_alive;
+  } else if (req->type == BLOB) {
+    return tpcfollower_handle_blob(server, req, out);
+  } else {
+    tpcfollower_handle_tpc(server, req, &res);
+  }
+  if (req->binary)
+    kvresponse_encode_frame(&res, out);
+  else
+    kvresponse_encode(&res, out);
+  /* A large value left unread cannot be skipped to reach the next request. */
+  if (req->large && !req->body.done)
+    return false;
+  return req->type != EMPTY && req->keep_alive;
+}
+
+/* Returns true if the transaction TXID has a pending PUTBLOB vote on the
+ * server at ARG, so that its spool is still needed. */
+static bool tpcfollower_blob_pending(void *arg, uint64_t txid) {
+  tpcfollower_t *server = arg;
+  tpcfollower_vote_t *vote;
+  DL_FOREACH(server->pending, vote) {
+    if (vote->txid == txid && vote->type == PUTBLOB)
+      return true;
+  }
+  return false;
 }
 
 /* Restore SERVER back to the state it should be in, according to the
- * associated LOG.  Must be called on an initialized  SERVER. Only restores the
- * state of the most recent TPC transaction, assuming that all previous actions
- * have been written to persistent storage. Should restore SERVER to its exact
- * state; e.g. if SERVER had written into its log that it received a PUTREQ but
- * no corresponding COMMIT/ABORT, after calling this function SERVER should
- * again be waiting for a COMMIT/ABORT.  This should also ensure that as soon
- * as a server logs a COMMIT, even if it crashes immediately after (before the
- * KVStore has a chance to write to disk), the COMMIT will be finished upon
- * rebuild.
+ * associated LOG, which is read once. Must be called on an initialized SERVER
+ * with no pending votes. Only restores the state of the TPC transactions which
+ * were in progress, assuming that all previous actions have been written to
+ * persistent storage: if SERVER had written into its log that it received a
+ * PUTREQ but no COMMIT/ABORT of the same transaction, after calling this
+ * function SERVER again holds the key of the PUTREQ and is waiting for a
+ * COMMIT/ABORT. A logged COMMIT whose votes may not all have reached the
+ * KVStore before a crash is finished here. The entries of finished
+ * transactions which are left in the log are replayed again, in order, by the
+ * next startup, which leaves the store as it is. Returns 0 if successful, else
+ * a negative error code.
  */
 int tpcfollower_rebuild_state(tpcfollower_t *server) {
-  /* TODO: Implement me! */
-  return -1;
+  logentry_t entry;
+  tpcfollower_vote_t *votes, *vote, *tmp;
+  unsigned int count;
+  uint64_t seq;
+  tpclog_iterate_begin(&server->log);
+  while (tpclog_iterate_has_next(&server->log)) {
+    seq = server->log.iterseq;
+    if (tpclog_iterate_next(&server->log, &entry) == NULL)
+      return ERR_FILACCESS;
+    if (entry.type == COMMIT || entry.type == ABORT) {
+      tpcfollower_set_decided(server, entry.txid);
+      votes = tpcfollower_take(server, entry.txid, &count);
+      DL_FOREACH_SAFE(votes, vote, tmp) {
+        if (entry.type == COMMIT)
+          tpcfollower_apply(server, vote);
+        DL_DELETE(votes, vote);
+        free(vote);
+      }
+    } else if ((entry.type == PUTREQ || entry.type == DELREQ || entry.type == PUTBLOB ||
+                entry.type == BATCH) &&
+               !tpcfollower_is_decided(server, entry.txid)) {
+      /* A vote logged after its decision was refused. */
+      vote = tpcfollower_new_vote(entry.txid, entry.type, entry.data, entry.length - 1);
+      vote->seq = seq;
+      DL_APPEND(server->pending, vote);
+      server->npending++;
+      server->state = TPC_WAIT;
+    }
+  }
+  DL_FOREACH(server->pending, vote) {
+    tpcfollower_lock(server, vote);
+  }
+  /* The finished transactions are dropped from the log as usual, rather than
+   * by rewriting it, which a crash could leave half done. */
+  tpcfollower_truncate(server);
+  kvblob_recover(&server->blobs, tpcfollower_blob_pending, server);
+  return 0;
 }
 
 /* Deletes all current entries in SERVER's store and removes the store
  * directory.  Also cleans the associated log. Note that you will be required
  * to reinitialize SERVER following this action. */
-int tpcfollower_clean(tpcfollower_t *server) { return kvstore_clean(&server->store); }
+int tpcfollower_clean(tpcfollower_t *server) {
+  kvblob_clean(&server->blobs);
+  return kvstore_destroy(&server->store);
+}
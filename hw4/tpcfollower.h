@@ -2,6 +2,10 @@
 #define __TPC_FOLLOWER__
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "kvblob.h"
+#include "kvcache.h"
 #include "kvstore.h"
 #include "kvmessage.h"
 #include "tpclog.h"
@@ -14,7 +18,9 @@
  * A TPCFollower accepts incoming messages on a socket using the HTTP API described in the spec,
  * and responds accordingly on the same socket. There is one generic entrypoint,
  * tpcfollower_handle, which takes in a socket that has already been connected to a leader or
- * client and handles all further communication.
+ * client and handles all further communication. A server which does its own socket I/O (see
+ * socket_server.h) instead passes each received request to tpcfollower_handle_request, which
+ * appends the response to a buffer.
  *
  * A TPCFollower has an associated KVStore.
  *
@@ -22,19 +28,120 @@
  * reinitialized using a DIRNAME which contains a previous TPCFollower and all old entries will be
  * available, enabling easy crash recovery.
  *
+ * Values read from or written to the KVStore are also kept in a cache (see kvcache.h) of
+ * TPCFOLLOWER_CACHE_SIZE bytes, so hot keys are read without touching the file system. The cache
+ * uses TinyLFU admission, so keys read only once do not flush it. Its counters are reported on the
+ * metrics endpoint.
+ *
+ * A SCAN (see kvmessage.h) is answered with a page of the entries of the KVStore, read in order
+ * by kvstore_scan, bypassing the cache. It only sees committed entries, not pending votes, and
+ * skips large values.
+ *
+ * Values too long for the KVStore (large values, see kvmessage.h) are kept in a KVBlob instead.
+ * The vote for a PUT of one is only sent once its value has been read from the request into a
+ * spool, and only its key is logged. A GET of one is answered with ERRMSG_STREAMED, and the value
+ * is sent, straight from its file, as the body of the response to a BLOB request.
+ *
  * A TPCFollower maintains state beyond the current KVStore entries, so a TPCLog is used to log
  * incoming requests and can be used to recreate the state of the server upon crash recovery.
+ *
+ * Every TPC message carries the ID of its transaction (see kvmessage.h), so a follower may hold
+ * the votes of many transactions at once. Before voting, a transaction locks the keys it writes in
+ * a lock table, all of them or none. A key locked by another transaction is waited for up to
+ * TPCFOLLOWER_LOCK_TIMEOUT milliseconds, after which the follower votes to abort (ERR_LOCKED).
+ * Transactions whose votes reach the replicas of a key in different orders wait for each other,
+ * so, as in wait-die locking, a transaction waits for an older one (with a lower ID) only up to
+ * the much shorter TPCFOLLOWER_YIELD_TIMEOUT: the younger of the two gives way quickly, and the
+ * leader retries it. Once its keys are locked, the vote is checked against the store, logged, and
+ * kept in memory in a list of pending votes, until a COMMIT of its transaction applies it to the
+ * store or an ABORT discards it. Since the keys stay locked until then, transactions on different
+ * keys prepare and commit concurrently, while those on the same key take turns.
+ *
+ * A COMMIT or ABORT is itself logged, under its transaction's ID, before the votes are applied or
+ * discarded, even if the follower holds none: the vote may still be being prepared, since an ABORT
+ * can overtake it. The IDs of the last TPCFOLLOWER_DECIDED decided transactions are remembered, and
+ * a vote of one of them is refused, even once logged, so it never waits for a decision which has
+ * already come. As each transaction finishes, the log is truncated (see tpclog.h) past the
+ * segments which only hold finished transactions, or cleared if none is in progress, so no
+ * transaction waits for any other to free up the log. tpcfollower_rebuild_state reads the log
+ * once on startup: it finishes applying every logged COMMIT, and restores the votes of all other
+ * unfinished transactions as pending, with their keys locked, so the follower is again waiting for
+ * the leader's decisions (TPC_WAIT). The KVStore bounds its own recovery with checkpoints (see
+ * kvseg.h); the time from tpcfollower_init to being ready is kept in STARTUP_US and reported as a
+ * metric.
  */
+/* The number of bytes of values a follower caches; 0 disables the cache. */
+#ifndef TPCFOLLOWER_CACHE_SIZE
+#define TPCFOLLOWER_CACHE_SIZE (4 * 1024 * 1024)
+#endif
+
+/* The time (in milliseconds) a vote waits for a key locked by another transaction. This must be
+ * well below the leader's TPCLEADER_PHASE_TIMEOUT. */
+#ifndef TPCFOLLOWER_LOCK_TIMEOUT
+#define TPCFOLLOWER_LOCK_TIMEOUT 500
+#endif
+
+/* The time (in milliseconds) a vote waits for a key locked by an older transaction. */
+#ifndef TPCFOLLOWER_YIELD_TIMEOUT
+#define TPCFOLLOWER_YIELD_TIMEOUT 20
+#endif
+
+/* The number of decided transactions whose late votes a follower refuses. */
+#ifndef TPCFOLLOWER_DECIDED
+#define TPCFOLLOWER_DECIDED 65536
+#endif
+
 struct tpcfollower;
 
+/* A vote to commit which awaits the leader's decision. */
+typedef struct tpcfollower_vote {
+  uint64_t txid;                 /* The transaction this vote belongs to. */
+  msgtype_t type;                /* PUTREQ, DELREQ, PUTBLOB or BATCH. */
+  uint64_t seq;                  /* A sequence number of the log no later than its entry's. */
+  struct tpcfollower_vote *prev; /* The previous vote. */
+  struct tpcfollower_vote *next; /* The next vote. */
+  int length;                    /* The total length of DATA, including null terminators. */
+  char data[];                   /* Laid out as the DATA of a logentry_t (see tpclog.h). */
+} tpcfollower_vote_t;
+
+/* A key locked by a transaction. */
+typedef struct {
+  uint64_t txid;     /* The transaction holding the lock. */
+  UT_hash_handle hh; /* Makes this structure hashable by KEY. */
+  char key[];        /* The null terminated key. */
+} tpcfollower_lock_t;
+
+/* A position in the log of a follower which must be kept, held while votes are logged or
+ * resolved outside the list of pending votes. */
+typedef struct tpcfollower_pin {
+  uint64_t seq;                 /* A sequence number no later than that of any of the votes. */
+  struct tpcfollower_pin *prev; /* The previous pin. */
+  struct tpcfollower_pin *next; /* The next pin. */
+} tpcfollower_pin_t;
+
+/* A transaction which has been decided. */
+typedef struct {
+  uint64_t txid;     /* The ID of the transaction. */
+  UT_hash_handle hh; /* Makes this structure hashable by TXID, in the order of the decisions. */
+} tpcfollower_decided_t;
+
 /* A TPCFollower. Stores the associated KVStore. */
 typedef struct tpcfollower {
   kvstore_t store; /* The store this server will use. */
+  kvblob_t blobs;  /* The large values of this server. */
   tpclog_t log;    /* The log this server will use. */
-  tpc_state_t state;
-  msgtype_t pending_msg;
-  char pending_key[MAX_KEYLEN + 1];
-  char pending_value[MAX_VALLEN + 1];
+  kvcache_t cache; /* Recently read and written values of STORE. */
+  tpc_state_t state;              /* TPC_WAIT while any vote is pending, else TPC_INIT. */
+  tpcfollower_vote_t *pending;    /* The logged votes, in order. */
+  unsigned int npending;          /* The number of votes in PENDING. */
+  tpcfollower_lock_t *locks;      /* The locked keys. */
+  tpcfollower_pin_t *pins;        /* The positions of the votes being logged or resolved. */
+  tpcfollower_decided_t *decided; /* The last TPCFOLLOWER_DECIDED decided transactions. */
+  unsigned long lock_waits;       /* Votes which had to wait for a key. */
+  unsigned long lock_timeouts;    /* Votes which gave up waiting, and voted to abort. */
+  pthread_mutex_t pending_lock;   /* Protects all of the above. */
+  pthread_cond_t changed;         /* Signalled when keys are unlocked. */
+  uint64_t startup_us;            /* The time tpcfollower_init took, in microseconds. */
   int max_threads;   /* The max threads this server will run on. */
   int listening;     /* 1 if this server is currently listening for requests, else 0. */
   int sockfd;        /* The socket fd this server is currently listening on (if any).  */
@@ -47,7 +154,8 @@ int tpcfollower_init(tpcfollower_t *, char *dirname, unsigned int max_threads, c
 
 bool tpcfollower_register_leader(tpcfollower_t *server, int sockfd);
 
-void tpcfollower_handle(tpcfollower_t *server, int sockfd);
+bool tpcfollower_handle(tpcfollower_t *server, int sockfd);
+bool tpcfollower_handle_request(tpcfollower_t *server, kvrequest_t *, http_buffer_t *out);
 
 void tpcfollower_handle_tpc(tpcfollower_t *, kvrequest_t *, kvresponse_t *);
 
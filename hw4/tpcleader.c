@@ -2,15 +2,24 @@
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include "kvconstants.h"
+#include "histogram.h"
+#include "kvcache.h"
 #include "kvmessage.h"
+#include "libhttp.h"
 #include "index.h"
 #include "md5.h"
 #include "socket_server.h"
+#include "stats.h"
 #include "time.h"
 #include "tpcleader.h"
+#include "utlist.h"
+
+static void *tpcleader_retry_aborts(void *arg);
 
 /* Initializes a tpcleader. Will return 0 if successful, or a negative error
  * code if not. FOLLOWER_CAPACITY indicates the maximum number of followers that
@@ -18,6 +27,7 @@
  * that
  * each key will be stored in. */
 int tpcleader_init(tpcleader_t *leader, unsigned int follower_capacity, unsigned int redundancy) {
+  pthread_t thread;
   int ret;
   ret = pthread_rwlock_init(&leader->follower_lock, NULL);
   if (ret < 0)
@@ -31,7 +41,70 @@ int tpcleader_init(tpcleader_t *leader, unsigned int follower_capacity, unsigned
     leader->redundancy = redundancy;
   }
   leader->followers_head = NULL;
-  return 0;
+  leader->ring = NULL;
+  leader->vnodes = TPCLEADER_DEFAULT_VNODES;
+  histogram_init(&leader->prepare_latency);
+  histogram_init(&leader->commit_latency);
+  histogram_init(&leader->get_latency);
+  leader->hedged_reads = leader->hedge_wins = leader->lock_retries = 0;
+  leader->next_txid = ((uint64_t)time(NULL)) << 20;
+  leader->aborts = NULL;
+  leader->naborts = 0;
+  pthread_mutex_init(&leader->abort_lock, NULL);
+  pthread_cond_init(&leader->abort_ready, NULL);
+  if ((ret = pthread_create(&thread, NULL, tpcleader_retry_aborts, leader)) != 0)
+    return -ret;
+  pthread_detach(thread);
+  return kvcache_init(&leader->cache, TPCLEADER_CACHE_SIZE, false);
+}
+
+static int ring_point_compare(const void *a, const void *b) {
+  uint64_t x = ((const ring_point_t *)a)->hash, y = ((const ring_point_t *)b)->hash;
+  return x < y ? -1 : x > y;
+}
+
+/* Builds a ring from the list of followers of LEADER and publishes it in place
+ * of the current one. Must be called with the follower lock held for
+ * writing. */
+static void tpcleader_rebuild_ring(tpcleader_t *leader) {
+  unsigned int n = leader->follower_count, npoints = n * leader->vnodes, i = 0;
+  char address[MAX_KEYLEN + 32];
+  tpcring_t *ring;
+  follower_t *fol = leader->followers_head;
+  uint64_t arc;
+
+  ring = malloc(sizeof(tpcring_t) + n * sizeof(follower_t *) + npoints * sizeof(ring_point_t));
+  if (!ring)
+    fatal_malloc();
+  ring->nfollowers = n;
+  ring->npoints = npoints;
+  ring->points = (ring_point_t *)(ring + 1);
+  ring->followers = (follower_t **)(ring->points + npoints);
+  do {
+    ring->followers[i] = fol;
+    fol->ring_share = 0;
+    for (unsigned int v = 0; v < leader->vnodes; v++) {
+      ring->points[i * leader->vnodes + v].follower = fol;
+      if (v == 0) {
+        ring->points[i * leader->vnodes].hash = fol->id;
+      } else {
+        sprintf(address, "%u:%s#%u", fol->port, fol->host, v);
+        ring->points[i * leader->vnodes + v].hash = strhash64(address);
+      }
+    }
+    i++;
+    fol = fol->next;
+  } while (fol != leader->followers_head);
+  qsort(ring->points, npoints, sizeof(ring_point_t), ring_point_compare);
+
+  for (i = 0; i < npoints; i++) {
+    /* Unsigned arithmetic wraps the first arc around the top of the ring. */
+    arc = ring->points[i].hash - ring->points[i ? i - 1 : npoints - 1].hash;
+    ring->points[i].follower->ring_share += npoints == 1 ? 1 : arc / 18446744073709551616.0;
+  }
+
+  ring->retired = leader->ring;
+  __atomic_store_n(&leader->ring, ring, __ATOMIC_RELEASE);
 }
 
 /* Handles an incoming kvrequest REQ, and populates RES as a response. REQ and
@@ -51,7 +124,7 @@ void tpcleader_register(tpcleader_t *leader, kvrequest_t *req, kvresponse_t *res
     return;
   }
 
-  follower_t *new_follower = malloc(sizeof(tpcfollower_t));
+  follower_t *new_follower = malloc(sizeof(follower_t));
   if (!new_follower)
     fatal_malloc();
 
@@ -60,11 +133,24 @@ void tpcleader_register(tpcleader_t *leader, kvrequest_t *req, kvresponse_t *res
     fatal_malloc();
   strcpy(new_follower->host, req->key);
   new_follower->port = atoi(req->val);
-  char address[strlen(new_follower->host) + strlen(req->val)];
+  new_follower->binary = TPCLEADER_BINARY_FRAMING && req->accepts_binary;
+  if (!resolve_host(new_follower->host, new_follower->port, &new_follower->addr)) {
+    free(new_follower->host);
+    free(new_follower);
+    res->type = ERROR;
+    strcpy(res->body, ERRMSG_GENERIC_ERROR);
+    return;
+  }
+  char address[strlen(new_follower->host) + strlen(req->val) + 2];
   sprintf(address, "%s:%s", req->val, new_follower->host);
   new_follower->id = strhash64(address);
   new_follower->prev = new_follower;
   new_follower->next = new_follower;
+  pthread_mutex_init(&new_follower->pool_lock, NULL);
+  new_follower->pool_count = 0;
+  new_follower->pool_hits = new_follower->pool_misses = new_follower->pool_reconnects = 0;
+  new_follower->outstanding = 0;
+  new_follower->latency_ewma = 0;
 
   res->type = SUCCESS;
   pthread_rwlock_wrlock(&leader->follower_lock);
@@ -86,7 +172,11 @@ void tpcleader_register(tpcleader_t *leader, kvrequest_t *req, kvresponse_t *res
       leader->follower_count++;
       goto end;
     } else if (curr_follower->id == new_follower->id) {
-      goto end;
+      /* A restarted follower may offer a different framing. */
+      curr_follower->binary = new_follower->binary;
+      free(new_follower->host);
+      free(new_follower);
+      goto unlock;
     }
     curr_follower = curr_follower->next;
   } while (curr_follower != first_follower);
@@ -98,74 +188,561 @@ void tpcleader_register(tpcleader_t *leader, kvrequest_t *req, kvresponse_t *res
   leader->follower_count++;
 
 end:
+  tpcleader_rebuild_ring(leader);
+unlock:
   pthread_rwlock_unlock(&leader->follower_lock);
   return;
 }
 
+/* Returns the current ring of LEADER if it is at its follower capacity, else
+ * NULL. */
+static tpcring_t *tpcleader_ring(tpcleader_t *leader) {
+  tpcring_t *ring = __atomic_load_n(&leader->ring, __ATOMIC_ACQUIRE);
+  if (!ring || ring->nfollowers < leader->follower_capacity)
+    return NULL;
+  return ring;
+}
+
+/* Returns the index of the first point of RING whose hash is greater than
+ * HASH, wrapping around to the first point if there is none. */
+static unsigned int ring_search(tpcring_t *ring, uint64_t hash) {
+  unsigned int lo = 0, hi = ring->npoints, mid;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (ring->points[mid].hash > hash)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return lo == ring->npoints ? 0 : lo;
+}
+
 /* Hashes KEY and finds the first follower that should contain it.
- * It should return the first follower whose ID is greater than the
- * KEY's hash, and the one with lowest ID if none matches the
- * requirement. Returns NULL if we're not yet at our follower capacity.
+ * It should return the follower owning the first point on the ring above the
+ * KEY's hash (with one virtual node, the first follower whose ID is greater
+ * than the KEY's hash), and the one owning the lowest point if none matches
+ * the requirement. Returns NULL if we're not yet at our follower capacity.
  */
 follower_t *tpcleader_get_primary(tpcleader_t *leader, char *key) {
-  if (leader->follower_count < leader->follower_capacity)
+  tpcring_t *ring = tpcleader_ring(leader);
+  if (!ring)
     return NULL;
-  uint64_t hash = strhash64(key);
-  pthread_rwlock_wrlock(&leader->follower_lock);
-  follower_t *curr_follower = leader->followers_head;
-  do {
-    if (curr_follower->id > hash) {
-      pthread_rwlock_unlock(&leader->follower_lock);
-      return curr_follower;
-    }
-    curr_follower = curr_follower->next;
-  } while (curr_follower != leader->followers_head);
-  curr_follower = leader->followers_head;
-  pthread_rwlock_unlock(&leader->follower_lock);
-  return curr_follower;
+  return ring->points[ring_search(ring, strhash64(key))].follower;
 }
 
 /* Returns the follower whose ID comes after PREDECESSOR's, sorted
  * in increasing order.
  */
 follower_t *tpcleader_get_successor(tpcleader_t *leader, follower_t *predecessor) {
-  pthread_rwlock_wrlock(&leader->follower_lock);
-  follower_t *result = predecessor->next;
-  pthread_rwlock_unlock(&leader->follower_lock);
-  return result;
+  tpcring_t *ring = __atomic_load_n(&leader->ring, __ATOMIC_ACQUIRE);
+  unsigned int lo = 0, hi = ring->nfollowers, mid;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (ring->followers[mid]->id > predecessor->id)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return ring->followers[lo == ring->nfollowers ? 0 : lo];
+}
+
+/* Fills REPLICAS with the followers which should store KEY, primary first,
+ * and returns how many there are: the LEADER's redundancy, or 0 if we're not
+ * yet at our follower capacity. The replicas are the distinct followers
+ * owning the points which follow the KEY's hash on the ring. */
+unsigned int tpcleader_get_replicas(tpcleader_t *leader, char *key, follower_t **replicas) {
+  tpcring_t *ring = tpcleader_ring(leader);
+  unsigned int count = 0, point, i;
+  follower_t *fol;
+  if (!ring)
+    return 0;
+  point = ring_search(ring, strhash64(key));
+  for (unsigned int seen = 0; seen < ring->npoints && count < leader->redundancy; seen++) {
+    fol = ring->points[point].follower;
+    for (i = 0; i < count && replicas[i] != fol; i++)
+      ;
+    if (i == count)
+      replicas[count++] = fol;
+    point = point + 1 == ring->npoints ? 0 : point + 1;
+  }
+  return count;
+}
+
+/* Returns a connection to FOLLOWER, reusing an idle one from its pool if
+ * possible, in which case REUSED is set. Returns -1 if no connection could be
+ * made. */
+static int follower_acquire(follower_t *follower, bool *reused) {
+  time_t now = time(NULL);
+  int sockfd;
+  char c;
+  pthread_mutex_lock(&follower->pool_lock);
+  while (follower->pool_count > 0) {
+    follower->pool_count--;
+    sockfd = follower->pool[follower->pool_count];
+    /* A connection the follower has closed reads as EOF rather than EAGAIN. */
+    if (now - follower->pool_idle[follower->pool_count] < TPCLEADER_POOL_IDLE &&
+        recv(sockfd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+        (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      follower->pool_hits++;
+      pthread_mutex_unlock(&follower->pool_lock);
+      *reused = true;
+      return sockfd;
+    }
+    close(sockfd);
+  }
+  follower->pool_misses++;
+  pthread_mutex_unlock(&follower->pool_lock);
+  *reused = false;
+  return connect_to_addr(&follower->addr, TIMEOUT);
+}
+
+/* Returns SOCKFD to the pool of FOLLOWER if it is REUSABLE and the pool has
+ * room, else closes it. */
+static void follower_release(follower_t *follower, int sockfd, bool reusable) {
+  if (reusable) {
+    pthread_mutex_lock(&follower->pool_lock);
+    if (follower->pool_count < TPCLEADER_POOL_SIZE) {
+      follower->pool[follower->pool_count] = sockfd;
+      follower->pool_idle[follower->pool_count] = time(NULL);
+      follower->pool_count++;
+      pthread_mutex_unlock(&follower->pool_lock);
+      return;
+    }
+    pthread_mutex_unlock(&follower->pool_lock);
+  }
+  close(sockfd);
+}
+
+/* Sends REQ to FOLLOWER on SOCKFD, as a binary frame if the follower accepts
+ * them and REQ has no large value. Returns the number of bytes sent, or -1 on
+ * error. */
+static int follower_send(follower_t *follower, kvrequest_t *req, int sockfd) {
+  if (follower->binary && req->blob_fd < 0)
+    return kvrequest_send_frame(req, sockfd);
+  return kvrequest_send(req, sockfd);
+}
+
+/* A message sent to one follower as part of a fan-out. */
+typedef struct {
+  follower_t *follower; /* The follower the message is sent to. */
+  kvrequest_t *req;     /* The message. */
+  int sockfd;           /* The connection it was sent on, or -1 if it failed. */
+  bool reused;          /* Whether SOCKFD was taken from the pool. */
+  bool sent;            /* Whether the message was sent, so the follower may act on it. */
+  bool done;            /* Whether RES holds the follower's response. */
+  uint64_t start;       /* When the message was sent, in microseconds. */
+  kvresponse_t res;     /* The follower's response. */
+} fanout_t;
+
+/* Adds a response time of US microseconds to the moving average latency of
+ * FOLLOWER. Concurrent updates may overwrite each other, which only loses a
+ * sample. */
+static void follower_observe(follower_t *follower, uint64_t us) {
+  uint64_t avg = __atomic_load_n(&follower->latency_ewma, __ATOMIC_RELAXED);
+  avg = avg ? avg - (avg >> TPCLEADER_EWMA_SHIFT) + (us >> TPCLEADER_EWMA_SHIFT) : us;
+  __atomic_store_n(&follower->latency_ewma, avg, __ATOMIC_RELAXED);
+}
+
+/* Returns how long a new request to FOLLOWER is expected to wait: its moving
+ * average latency for each request already outstanding, plus its own. */
+static uint64_t follower_cost(follower_t *follower) {
+  return (__atomic_load_n(&follower->outstanding, __ATOMIC_RELAXED) + 1) *
+         __atomic_load_n(&follower->latency_ewma, __ATOMIC_RELAXED);
+}
+
+/* Opens a new connection to the follower of OUT, in place of a reused one
+ * which turned out to have been closed by the follower, and sends its message
+ * on it. Returns false (with OUT->SOCKFD set to -1) if this failed. */
+static bool fanout_reconnect(fanout_t *out) {
+  close(out->sockfd);
+  pthread_mutex_lock(&out->follower->pool_lock);
+  out->follower->pool_reconnects++;
+  pthread_mutex_unlock(&out->follower->pool_lock);
+  /* The follower closed the connection before it could read the message. */
+  out->reused = out->sent = false;
+  if ((out->sockfd = connect_to_addr(&out->follower->addr, TIMEOUT)) < 0)
+    return false;
+  if (follower_send(out->follower, out->req, out->sockfd) >= 0)
+    return out->sent = true;
+  close(out->sockfd);
+  out->sockfd = -1;
+  return false;
+}
+
+/* Sends the message of OUT to its follower, over a pooled connection if
+ * possible. If a reused connection turns out to have been closed, the message
+ * is sent again on a new one. OUT->SOCKFD is -1 if this failed. */
+static void fanout_send(fanout_t *out) {
+  out->done = out->sent = false;
+  out->start = histogram_now();
+  __atomic_fetch_add(&out->follower->outstanding, 1, __ATOMIC_RELAXED);
+  out->sockfd = follower_acquire(out->follower, &out->reused);
+  if (out->sockfd < 0)
+    return;
+  if (follower_send(out->follower, out->req, out->sockfd) >= 0) {
+    out->sent = true;
+  } else if (!out->reused) {
+    close(out->sockfd);
+    out->sockfd = -1;
+  } else {
+    fanout_reconnect(out);
+  }
+}
+
+/* Waits until WANTED of the N entries of OUTS have responses, none of the
+ * others can still respond, or DEADLINE (see histogram_now) has passed,
+ * whichever comes first. Returns the number of entries with responses. */
+static int fanout_wait(fanout_t *outs, int n, uint64_t deadline, int wanted) {
+  struct pollfd fds[n];
+  fanout_t *polled[n];
+  fanout_t *out;
+  int nfds, ndone, ready;
+  uint64_t now;
+
+  while (true) {
+    nfds = ndone = 0;
+    for (int i = 0; i < n; i++) {
+      if (outs[i].done) {
+        ndone++;
+      } else if (outs[i].sockfd >= 0) {
+        fds[nfds].fd = outs[i].sockfd;
+        fds[nfds].events = POLLIN;
+        polled[nfds++] = &outs[i];
+      }
+    }
+    now = histogram_now();
+    if (ndone >= wanted || nfds == 0 || now >= deadline)
+      return ndone;
+    ready = poll(fds, nfds, (deadline - now + 999) / 1000);
+    if (ready < 0 && errno == EINTR)
+      continue;
+    if (ready <= 0)
+      return ndone;
+    for (int i = 0; i < nfds; i++) {
+      if (!fds[i].revents)
+        continue;
+      out = polled[i];
+      if (kvresponse_receive(&out->res, out->sockfd)) {
+        out->done = true;
+        follower_observe(out->follower, histogram_now() - out->start);
+      } else if (!out->reused || !fanout_reconnect(out)) {
+        if (out->sockfd >= 0)
+          close(out->sockfd);
+        out->sockfd = -1;
+      }
+    }
+  }
+}
+
+/* Ends the fan-out to the N entries of OUTS, returning the connections of
+ * those which responded to the pool and closing the others. A follower which
+ * could not be reached at all is charged the full TIMEOUT in its moving
+ * average latency, and one which has not yet responded the time it has taken
+ * so far. */
+static void fanout_finish(fanout_t *outs, int n) {
+  for (int i = 0; i < n; i++) {
+    __atomic_fetch_sub(&outs[i].follower->outstanding, 1, __ATOMIC_RELAXED);
+    if (outs[i].sockfd < 0) {
+      if (!outs[i].done)
+        follower_observe(outs[i].follower, (uint64_t)TIMEOUT * 1000000);
+      continue;
+    }
+    if (!outs[i].done)
+      follower_observe(outs[i].follower, histogram_now() - outs[i].start);
+    follower_release(outs[i].follower, outs[i].sockfd, outs[i].done);
+  }
+}
+
+/* Sends the message of each of the N entries of OUTS to its follower, all at
+ * once, then waits until each has responded or TIMEOUT_MS milliseconds have
+ * passed since the last was sent (which, for a large value, may take a
+ * while), whichever comes first. The response of every follower which
+ * answered in time is left in the RES of its entry, and its DONE flag is set.
+ *
+ * Pooled connections are used where possible. If a reused connection turns
+ * out to have been closed by the follower, the request is retried once on a
+ * new connection; it is never retried after the deadline, since the follower
+ * may then have acted on it. Connections still awaiting a response at the
+ * deadline are closed rather than returned to the pool. */
+static void fanout(fanout_t *outs, int n, int timeout_ms) {
+  uint64_t deadline;
+  for (int i = 0; i < n; i++)
+    fanout_send(&outs[i]);
+  deadline = histogram_now() + (uint64_t)timeout_ms * 1000;
+  fanout_wait(outs, n, deadline, n);
+  fanout_finish(outs, n);
+}
+
+/* Moves the replica which should be asked for a key first to the front of
+ * the COUNT followers in REPLICAS: of two picked at random, the one with the
+ * lower expected wait (see follower_cost). */
+static void tpcleader_balance(follower_t **replicas, unsigned int count) {
+  unsigned int a, b;
+  follower_t *first;
+  if (count < 2)
+    return;
+  a = rand() % count;
+  b = rand() % (count - 1);
+  if (b >= a)
+    b++;
+  if (follower_cost(replicas[b]) < follower_cost(replicas[a]))
+    a = b;
+  first = replicas[a];
+  replicas[a] = replicas[0];
+  replicas[0] = first;
 }
 
 /* Handles an incoming GET request REQ, and populates response RES. REQ and
  * RES both must point to valid kvrequest_t and kvrespont_t structs,
  * respectively.
+ *
+ * The replica chosen by tpcleader_balance is asked first. If it cannot be
+ * reached or gives no answer within TIMEOUT seconds, the next replica is
+ * asked, and so on. If it is merely slower than the 95th percentile of GET
+ * latency, the next replica is asked as well (a hedged request), and
+ * whichever answers first is used.
  */
 void tpcleader_handle_get(tpcleader_t *leader, kvrequest_t *req, kvresponse_t *res) {
-    /* TODO: Implement me! */
-    follower_t *fol = tpcleader_get_primary(leader, req->key);
-    if (fol == NULL) {
-        res->type = ERROR;
-        strcpy(res->body, ERRMSG_NOT_AT_CAPACITY);
-        return;
+  follower_t *replicas[leader->redundancy];
+  unsigned int count = tpcleader_get_replicas(leader, req->key, replicas);
+  if (count == 0) {
+    res->type = ERROR;
+    strcpy(res->body, ERRMSG_NOT_AT_CAPACITY);
+    return;
+  }
+  uint64_t ticket;
+  if (kvcache_get(&leader->cache, req->key, req->hash, res->body, &ticket)) {
+    res->type = GETRESP;
+    return;
+  }
+  tpcleader_balance(replicas, count);
+
+  fanout_t outs[count];
+  unsigned int sent = 0, pending, hedge = 0;
+  uint64_t now, deadline = 0, hedge_at = UINT64_MAX, delay = 0;
+  if (TPCLEADER_HEDGED_READS && count > 1 &&
+      __atomic_load_n(&leader->get_latency.count, __ATOMIC_RELAXED) >=
+          TPCLEADER_HEDGE_MIN_SAMPLES)
+    delay = histogram_percentile(&leader->get_latency, 95);
+
+  while (true) {
+    now = histogram_now();
+    pending = 0;
+    for (unsigned int i = 0; i < sent; i++)
+      pending += !outs[i].done && outs[i].sockfd >= 0;
+    if (sent < count && (pending == 0 || now >= deadline || (!hedge && now >= hedge_at))) {
+      if (pending > 0 && now < deadline) {
+        hedge = sent;
+        __atomic_fetch_add(&leader->hedged_reads, 1, __ATOMIC_RELAXED);
+      } else {
+        deadline = now + (uint64_t)TIMEOUT * 1000000;
+        if (delay && !hedge)
+          hedge_at = now + delay;
+      }
+      outs[sent].follower = replicas[sent];
+      outs[sent].req = req;
+      fanout_send(&outs[sent++]);
+      continue;
+    }
+    if (pending == 0 || now >= deadline)
+      break;
+    if (fanout_wait(outs, sent, (hedge || sent == count) ? deadline : min(hedge_at, deadline), 1))
+      break;
+  }
+
+  for (unsigned int i = 0; i < sent; i++) {
+    if (outs[i].done) {
+      histogram_record(&leader->get_latency, histogram_now() - outs[i].start);
+      if (hedge && i == hedge)
+        __atomic_fetch_add(&leader->hedge_wins, 1, __ATOMIC_RELAXED);
+      *res = outs[i].res;
+      fanout_finish(outs, sent);
+      if (res->type == GETRESP)
+        kvcache_fill(&leader->cache, req->key, req->hash, res->body, ticket);
+      return;
+    }
+  }
+  fanout_finish(outs, sent);
+
+  res->type = ERROR;
+  strcpy(res->body, ERRMSG_GENERIC_ERROR);
+}
+
+/* Returns the ID of a new transaction of LEADER. */
+static uint64_t tpcleader_next_txid(tpcleader_t *leader) {
+  return __atomic_fetch_add(&leader->next_txid, 1, __ATOMIC_RELAXED);
+}
+
+/* Queues an ABORT of transaction TXID for FOLLOWER, which has not
+ * acknowledged it yet, to be sent again by the background thread of LEADER. */
+static void tpcleader_queue_abort(tpcleader_t *leader, follower_t *follower, uint64_t txid) {
+  tpcleader_abort_t *abort = malloc(sizeof(tpcleader_abort_t));
+  if (!abort)
+    fatal_malloc();
+  abort->follower = follower;
+  abort->txid = txid;
+  pthread_mutex_lock(&leader->abort_lock);
+  DL_APPEND(leader->aborts, abort);
+  leader->naborts++;
+  pthread_cond_signal(&leader->abort_ready);
+  pthread_mutex_unlock(&leader->abort_lock);
+}
+
+/* The background thread of the leader at ARG: sends the queued ABORTs again,
+ * all at once, every TPCLEADER_RETRY_DELAY milliseconds, until each has been
+ * acknowledged. */
+static void *tpcleader_retry_aborts(void *arg) {
+  tpcleader_t *leader = arg;
+  tpcleader_abort_t *aborts, *abort, *tmp;
+  kvrequest_t *reqs;
+  fanout_t *outs;
+  int n, i;
+  while (true) {
+    pthread_mutex_lock(&leader->abort_lock);
+    while (!leader->aborts)
+      pthread_cond_wait(&leader->abort_ready, &leader->abort_lock);
+    aborts = leader->aborts;
+    leader->aborts = NULL;
+    pthread_mutex_unlock(&leader->abort_lock);
+    usleep(TPCLEADER_RETRY_DELAY * 1000);
+
+    DL_COUNT(aborts, abort, n);
+    outs = malloc(n * sizeof(fanout_t));
+    reqs = malloc(n * sizeof(kvrequest_t));
+    if (!outs || !reqs)
+      fatal_malloc();
+    i = 0;
+    DL_FOREACH(aborts, abort) {
+      kvrequest_clear(&reqs[i]);
+      reqs[i].type = ABORT;
+      reqs[i].txid = abort->txid;
+      outs[i].follower = abort->follower;
+      outs[i].req = &reqs[i];
+      i++;
+    }
+    fanout(outs, n, TPCLEADER_PHASE_TIMEOUT);
+
+    i = 0;
+    pthread_mutex_lock(&leader->abort_lock);
+    DL_FOREACH_SAFE(aborts, abort, tmp) {
+      if (outs[i].done && outs[i].res.type == ACK) {
+        DL_DELETE(aborts, abort);
+        free(abort);
+        leader->naborts--;
+      }
+      i++;
     }
-    int count = 0;
-    while (count < leader->redundancy) {
-        int sockfd = connect_to(fol->host, fol->port, 0);
-        if (sockfd < 0) {
-            // close(sockfd);
-            fol = tpcleader_get_successor(leader, fol);
-            ++count;
-            continue;
-        }
-
-        kvrequest_send(req, sockfd);
-        kvresponse_receive(res, sockfd);
-
-        close(sockfd);
-        return;
+    DL_CONCAT(leader->aborts, aborts);
+    pthread_mutex_unlock(&leader->abort_lock);
+    free(outs);
+    free(reqs);
+  }
+  return NULL;
+}
+
+/* Runs one round of TPC as transaction TXID with the followers of the N
+ * entries of OUTS, asking each to vote on the message of its entry, and
+ * populates RES with the outcome. Returns true if some follower voted to
+ * abort because another transaction held one of the keys (ERR_LOCKED).
+ *
+ * The messages of each phase are sent to all followers at once (see fanout),
+ * so a phase takes as long as its slowest follower rather than the sum of
+ * all of them. A follower which has not voted within TPCLEADER_PHASE_TIMEOUT
+ * counts as a vote to abort. A COMMIT is sent again to the followers which
+ * have not acknowledged it, every TPCLEADER_RETRY_DELAY milliseconds, until
+ * every one of them has. An ABORT is also due to the followers which were
+ * sent the vote but did not answer in time, since they may yet have logged it
+ * and locked its keys. They are left to the background thread (see
+ * tpcleader_retry_aborts) rather than waited for again, as are the voters
+ * which do not acknowledge their ABORT. */
+static bool tpcleader_run_round(tpcleader_t *leader, uint64_t txid, fanout_t *outs, int n,
+                                kvresponse_t *res) {
+  follower_t *asked[n];
+  int voters = 0, count, pending;
+  kvrequest_t decision;
+  bool locked = false;
+  uint64_t start;
+
+  for (int i = 0; i < n; i++)
+    outs[i].req->txid = txid;
+  start = histogram_now();
+  fanout(outs, n, TPCLEADER_PHASE_TIMEOUT);
+  histogram_record(&leader->prepare_latency, histogram_now() - start);
+
+  /* Only followers which voted to commit have logged REQ and await phase 2.
+   * Those which were sent REQ but did not vote may have logged it too. */
+  for (int i = 0; i < n; i++) {
+    if (outs[i].done && outs[i].res.type == VOTE && strcmp(outs[i].res.body, MSG_COMMIT) == 0)
+      asked[voters++] = outs[i].follower;
+    else if (outs[i].done && strcmp(outs[i].res.body, ERRMSG_LOCKED) == 0)
+      locked = true;
+    else if (!outs[i].done && outs[i].sent)
+      tpcleader_queue_abort(leader, outs[i].follower, txid);
+  }
+  count = voters;
+  kvrequest_clear(&decision);
+  decision.txid = txid;
+  decision.type = voters < n ? ABORT : COMMIT;
+  for (int i = 0; i < count; i++) {
+    outs[i].follower = asked[i];
+    outs[i].req = &decision;
+  }
+
+  start = histogram_now();
+  if (count > 0)
+    fanout(outs, count, TPCLEADER_PHASE_TIMEOUT);
+  for (pending = count; pending > 0;) {
+    count = pending;
+    pending = 0;
+    for (int i = 0; i < count; i++) {
+      if (outs[i].done && outs[i].res.type == ACK)
+        continue;
+      if (decision.type == ABORT)
+        tpcleader_queue_abort(leader, outs[i].follower, txid);
+      else
+        outs[pending++].follower = outs[i].follower;
+    }
+    if (pending > 0) {
+      usleep(TPCLEADER_RETRY_DELAY * 1000);
+      fanout(outs, pending, TPCLEADER_PHASE_TIMEOUT);
     }
+  }
+  histogram_record(&leader->commit_latency, histogram_now() - start);
 
+  if (decision.type == COMMIT) {
+    res->type = SUCCESS;
+    *(res->body) = 0;
+  } else {
     res->type = ERROR;
     strcpy(res->body, ERRMSG_GENERIC_ERROR);
+  }
+  return locked;
+}
+
+/* Runs TPC with the followers of the N entries of OUTS, asking each to vote
+ * on the message of its entry, and populates RES with the outcome. Each
+ * attempt is a new transaction (see tpcleader_next_txid). A round which was
+ * aborted only because another transaction held some of its keys is tried
+ * again, up to TPCLEADER_LOCK_RETRIES times, after a random delay of up to
+ * TPCLEADER_LOCK_BACKOFF milliseconds, doubled with every retry. */
+static void tpcleader_run_tpc(tpcleader_t *leader, fanout_t *outs, int n, kvresponse_t *res) {
+  follower_t *followers[n];
+  kvrequest_t *reqs[n];
+  for (int i = 0; i < n; i++) {
+    followers[i] = outs[i].follower;
+    reqs[i] = outs[i].req;
+  }
+  for (int attempt = 0;; attempt++) {
+    if (!tpcleader_run_round(leader, tpcleader_next_txid(leader), outs, n, res) ||
+        res->type == SUCCESS || attempt == TPCLEADER_LOCK_RETRIES)
+      return;
+    __atomic_fetch_add(&leader->lock_retries, 1, __ATOMIC_RELAXED);
+    usleep(rand() % ((TPCLEADER_LOCK_BACKOFF * 1000) << attempt));
+    for (int i = 0; i < n; i++) {
+      outs[i].follower = followers[i];
+      outs[i].req = reqs[i];
+    }
+  }
 }
 
 /* Handles an incoming TPC request REQ, and populates RES as a response.
@@ -174,66 +751,378 @@ void tpcleader_handle_get(tpcleader_t *leader, kvrequest_t *req, kvresponse_t *r
  *
  * Implements the TPC algorithm, polling all the followers for a vote first and
  * sending a COMMIT or ABORT message in the second phase.  Must wait for an ACK
- * from every follower after sending the second phase messages.
- */
+ * from every follower after sending the second phase messages. */
 void tpcleader_handle_tpc(tpcleader_t *leader, kvrequest_t *req, kvresponse_t *res) {
-    /* TODO: Implement me! */
-    follower_t *fol = tpcleader_get_primary(leader, req->key);
-    if (fol == NULL) {
-        res->type = ERROR;
-        strcpy(res->body, ERRMSG_NOT_AT_CAPACITY);
-        return;
+  follower_t *replicas[leader->redundancy];
+  unsigned int count = tpcleader_get_replicas(leader, req->key, replicas);
+  if (count == 0) {
+    res->type = ERROR;
+    strcpy(res->body, ERRMSG_NOT_AT_CAPACITY);
+    return;
+  }
+  fanout_t outs[count];
+  for (unsigned int i = 0; i < count; i++) {
+    outs[i].follower = replicas[i];
+    outs[i].req = req;
+  }
+  kvcache_del(&leader->cache, req->key, req->hash);
+  tpcleader_run_tpc(leader, outs, count, res);
+  /* Concurrent rounds on one key may finish in any order, so the new value is
+   * not cached here; the next GET fills it, unless another write intervenes. */
+  kvcache_del(&leader->cache, req->key, req->hash);
+}
+
+/* Handles an incoming PUT request REQ whose value is large, and populates RES
+ * as a response. The value is read from the body of REQ into a spool file
+ * first. One which turns out to fit in a KVStore after all (as a short value
+ * sent in chunks may) is put as usual; any other is sent to the followers
+ * from the spool, by tpcleader_handle_tpc. */
+static void tpcleader_handle_large_put(tpcleader_t *leader, kvrequest_t *req, kvresponse_t *res) {
+  char spoolname[] = TPCLEADER_SPOOL_DIR "/kvleader-XXXXXX", val[MAX_VALLEN + 1];
+  ssize_t length;
+  int fd = mkstemp(spoolname);
+  res->type = ERROR;
+  if (fd < 0) {
+    strcpy(res->body, ERRMSG_GENERIC_ERROR);
+    return;
+  }
+  unlink(spoolname);
+  length = http_body_copy(&req->body, fd);
+  if (length < 0) {
+    strcpy(res->body, req->body.done ? ERRMSG_GENERIC_ERROR : ERRMSG_INVALID_REQUEST);
+  } else if (length <= MAX_VALLEN) {
+    if (pread(fd, val, length, 0) == length) {
+      val[length] = '\0';
+      req->val = val;
+      req->large = false;
+      tpcleader_handle_tpc(leader, req, res);
+    } else {
+      strcpy(res->body, ERRMSG_GENERIC_ERROR);
+    }
+  } else {
+    req->blob_fd = fd;
+    req->blob_length = length;
+    tpcleader_handle_tpc(leader, req, res);
+    req->blob_fd = -1;
+  }
+  close(fd);
+}
+
+/* Handles an incoming BATCH request REQ, and populates RES as a response.
+ *
+ * The operations of the batch are grouped by follower, each going to all
+ * replicas of its key, and every follower involved is sent the operations on
+ * its keys as a single BATCH message. The whole batch is then committed or
+ * aborted in one round of TPC, however many operations it holds. */
+void tpcleader_handle_batch(tpcleader_t *leader, kvrequest_t *req, kvresponse_t *res) {
+  char key[MAX_KEYLEN + 1];
+  fanout_t outs[leader->follower_capacity];
+  kvrequest_t reqs[leader->follower_capacity];
+  http_buffer_t batches[leader->follower_capacity];
+  follower_t *replicas[leader->redundancy];
+  unsigned int count;
+  kvbatch_op_t op;
+  size_t offset = 0;
+  int n = 0, i, ret;
+
+  while ((ret = kvbatch_next(req->batch, &offset, &op)) > 0) {
+    strview_copy(key, op.key, MAX_KEYLEN);
+    count = tpcleader_get_replicas(leader, key, replicas);
+    if (count == 0) {
+      res->type = ERROR;
+      strcpy(res->body, ERRMSG_NOT_AT_CAPACITY);
+      goto done;
     }
-    int count = 0;
-    follower_t *first_fol = fol;
-    while (count < leader->redundancy) {
-        int sockfd = connect_to(fol->host, fol->port, 0);
-        if (sockfd < 0) {
-            // close(sockfd);
-            break;
-        }
-
-        kvrequest_send(req, sockfd);
-        kvresponse_receive(res, sockfd);
-        close(sockfd);
-
-        if (res->type == VOTE && strcmp(res->body, MSG_COMMIT) == 0) {
-            ++count;
-            fol = tpcleader_get_successor(leader, fol);
-        } else
-            break;
+    kvcache_del(&leader->cache, key, kvhash_str(key));
+    for (unsigned int r = 0; r < count; r++) {
+      for (i = 0; i < n && outs[i].follower != replicas[r]; i++)
+        ;
+      if (i == n) {
+        outs[n].follower = replicas[r];
+        outs[n].req = &reqs[n];
+        http_buffer_init(&batches[n]);
+        n++;
+      }
+      kvbatch_append(&batches[i], &op);
     }
-    fol = first_fol;
-    kvrequest_t reqx;
-    if (count < leader->redundancy) {
-        reqx.type = ABORT;
-    } else {
-        reqx.type = COMMIT;
+  }
+  if (ret < 0 || n == 0) {
+    res->type = ERROR;
+    strcpy(res->body, ERRMSG_INVALID_REQUEST);
+    goto done;
+  }
+
+  for (i = 0; i < n; i++) {
+    kvrequest_clear(&reqs[i]);
+    reqs[i].type = BATCH;
+    reqs[i].batch.data = batches[i].data;
+    reqs[i].batch.length = batches[i].length;
+  }
+  tpcleader_run_tpc(leader, outs, n, res);
+
+  /* As for a single write, see tpcleader_handle_tpc. */
+  offset = 0;
+  while (kvbatch_next(req->batch, &offset, &op) > 0) {
+    strview_copy(key, op.key, MAX_KEYLEN);
+    kvcache_del(&leader->cache, key, kvhash_str(key));
+  }
+
+done:
+  for (i = 0; i < n; i++)
+    http_buffer_free(&batches[i]);
+}
+
+/* One follower's page of a scan. */
+typedef struct {
+  follower_t *follower; /* The follower asked for the page. */
+  int sockfd;           /* The connection the request was sent on, or -1. */
+  bool reused;          /* Whether SOCKFD was taken from the pool. */
+  char *buf;            /* HTTP_RECV_MAX_SIZE bytes to receive the page into. */
+  http_response_t res;  /* The page, once received. */
+  size_t offset;        /* The offset within the page of the entry after OP. */
+  kvbatch_op_t op;      /* The next entry of the page to merge, if HAS_OP is set. */
+  bool has_op;
+} scan_page_t;
+
+/* Compares the keys A and B bytewise, as strcmp does. */
+static int scan_compare(strview_t a, strview_t b) {
+  int ret = memcmp(a.data, b.data, min(a.length, b.length));
+  return ret ? ret : (a.length > b.length) - (a.length < b.length);
+}
+
+/* Sends the SCAN request REQ to the follower of PAGE, over a pooled
+ * connection unless RETRY is set. PAGE->SOCKFD is -1 if this failed. */
+static void scan_send(scan_page_t *page, kvrequest_t *req, bool retry) {
+  if (retry) {
+    pthread_mutex_lock(&page->follower->pool_lock);
+    page->follower->pool_reconnects++;
+    pthread_mutex_unlock(&page->follower->pool_lock);
+    page->reused = false;
+    page->sockfd = connect_to_addr(&page->follower->addr, TIMEOUT);
+  } else {
+    page->sockfd = follower_acquire(page->follower, &page->reused);
+  }
+  if (page->sockfd >= 0 && kvrequest_send(req, page->sockfd) < 0) {
+    close(page->sockfd);
+    page->sockfd = -1;
+  }
+}
+
+/* Receives the page of PAGE, the answer to REQ, and reads its first entry.
+ * If a reused connection turns out to have been closed, REQ is sent again on
+ * a new one, which is always safe as a scan changes nothing. Returns false if
+ * no valid page was received. */
+static bool scan_receive(scan_page_t *page, kvrequest_t *req) {
+  bool received = page->sockfd >= 0 &&
+                  http_response_receive(&page->res, page->sockfd, page->buf, HTTP_RECV_MAX_SIZE);
+  if (!received && page->reused) {
+    if (page->sockfd >= 0)
+      close(page->sockfd);
+    scan_send(page, req, true);
+    received = page->sockfd >= 0 &&
+               http_response_receive(&page->res, page->sockfd, page->buf, HTTP_RECV_MAX_SIZE);
+  }
+  if (page->sockfd >= 0)
+    follower_release(page->follower, page->sockfd, received);
+  page->sockfd = -1;
+  page->offset = 0;
+  page->has_op = false;
+  return received && (page->res.status == 200 || page->res.status == 206);
+}
+
+/* Reads the next entry of PAGE into its OP, or clears HAS_OP at the end of
+ * the page. Returns false if the page is malformed. */
+static bool scan_next(scan_page_t *page) {
+  int ret = kvbatch_next(page->res.body, &page->offset, &page->op);
+  page->has_op = ret > 0;
+  return ret == 0 || (ret > 0 && page->op.type == PUTREQ);
+}
+
+/* Appends to OUT the page of entries which the SCAN request REQ asks for (see
+ * kvmessage.h), or an error response.
+ *
+ * Every follower is asked for a page of the same entries, in parallel, and
+ * the pages are merged in order of their keys, each entry being taken once
+ * however many replicas have it. Once a follower's page is used up, its
+ * entries past the last one are unknown, so unless the follower had no more,
+ * the merged page ends there. The scan fails if any follower does not answer,
+ * since some of the entries might then be missing. */
+void tpcleader_handle_scan(tpcleader_t *leader, kvrequest_t *req, http_buffer_t *out) {
+  tpcring_t *ring = tpcleader_ring(leader);
+  scan_page_t *pages, *next;
+  kvresponse_t res;
+  http_buffer_t body;
+  strview_t key;
+  unsigned int n, i, count = 0;
+  bool ok = true, more = false;
+
+  if (!ring) {
+    res.type = ERROR;
+    strcpy(res.body, ERRMSG_NOT_AT_CAPACITY);
+    kvresponse_encode(&res, out);
+    return;
+  }
+  n = ring->nfollowers;
+  pages = calloc(n, sizeof(scan_page_t));
+  if (!pages)
+    fatal_malloc();
+  for (i = 0; i < n; i++) {
+    pages[i].follower = ring->followers[i];
+    if (!(pages[i].buf = malloc(HTTP_RECV_MAX_SIZE)))
+      fatal_malloc();
+    scan_send(&pages[i], req, false);
+  }
+  for (i = 0; i < n; i++) {
+    if (!scan_receive(&pages[i], req) || !scan_next(&pages[i]))
+      ok = false;
+  }
+
+  http_buffer_init(&body);
+  while (ok) {
+    next = NULL;
+    for (i = 0; i < n; i++) {
+      if (!pages[i].has_op)
+        more |= pages[i].res.status == 206;
+      else if (!next || scan_compare(pages[i].op.key, next->op.key) < 0)
+        next = &pages[i];
     }
-    while (count) {
-        int sockfd = connect_to(fol->host, fol->port, 0);
-        if (sockfd < 0) {
-            // close(sockfd);
-            continue;
-        }
-
-        kvrequest_send(&reqx, sockfd);
-        kvresponse_receive(res, sockfd);
-        close(sockfd);
-
-        if (res->type == ACK) {
-            --count;
-            fol = tpcleader_get_successor(leader, fol);
-        } else
-            continue;
+    if (more || !next)
+      break;
+    /* "PUT <key> <value>\n" */
+    if (count == req->limit ||
+        body.length + next->op.key.length + next->op.val.length + 6 > MAX_SCANLEN) {
+      more = true;
+      break;
     }
-    if (reqx.type == COMMIT) {
-        res->type = SUCCESS;
-        *(res->body) = 0;
-    } else {
-        res->type = ERROR;
-        strcpy(res->body, ERRMSG_GENERIC_ERROR);
+    kvbatch_append(&body, &next->op);
+    count++;
+    key = next->op.key;
+    for (i = 0; i < n; i++) {
+      if (pages[i].has_op && !scan_compare(pages[i].op.key, key) && !scan_next(&pages[i]))
+        ok = false;
     }
+  }
+
+  if (ok) {
+    http_encode_response(out, more ? 206 : 200, "text/plain", body.data, body.length);
+  } else {
+    res.type = ERROR;
+    strcpy(res.body, ERRMSG_GENERIC_ERROR);
+    kvresponse_encode(&res, out);
+  }
+  http_buffer_free(&body);
+  for (i = 0; i < n; i++)
+    free(pages[i].buf);
+  free(pages);
+}
+
+/* Sends the response to the GET request REQ, for a key whose value is large,
+ * to the client of REQ, after anything already in OUT. A BLOB request for the
+ * key is sent to its replicas, first to the one picked by tpcleader_balance
+ * and then to each of the others which cannot be reached in turn, and the
+ * response of the first to answer is copied to the client, with its body
+ * streamed through a buffer of HTTP_STREAM_BUFFER_SIZE bytes. If none
+ * answers, an error response is appended to OUT instead. Returns false if the
+ * connection to the client must be closed. */
+static bool tpcleader_handle_blob(tpcleader_t *leader, kvrequest_t *req, http_buffer_t *out) {
+  follower_t *replicas[leader->redundancy];
+  unsigned int count = tpcleader_get_replicas(leader, req->key, replicas);
+  char buf[HTTP_RECV_MAX_SIZE], data[HTTP_STREAM_BUFFER_SIZE];
+  kvrequest_t blob;
+  kvresponse_t res;
+  http_response_t response;
+  http_body_t body;
+  ssize_t bytes_read = 0;
+  bool reused;
+  int sockfd;
+
+  kvrequest_clear(&blob);
+  blob.type = BLOB;
+  blob.key = req->key;
+  tpcleader_balance(replicas, count);
+  for (unsigned int i = 0; i < count; i++) {
+    if ((sockfd = follower_acquire(replicas[i], &reused)) < 0)
+      continue;
+    if (kvrequest_send(&blob, sockfd) < 0 ||
+        !http_response_receive(&response, sockfd, buf, sizeof(buf))) {
+      close(sockfd);
+      continue;
+    }
+    http_body_init(&body, sockfd, response.body, response.chunked, response.content_length);
+    if (!http_encode_headers(out, response.status,
+                             response.status == 200 ? "application/octet-stream" : NULL,
+                             response.content_length) ||
+        http_buffer_send(out, req->sockfd) < 0) {
+      close(sockfd);
+      return false;
+    }
+    while ((bytes_read = http_body_read(&body, data, sizeof(data))) > 0) {
+      if (http_write(req->sockfd, data, bytes_read) < 0)
+        break;
+    }
+    follower_release(replicas[i], sockfd, body.done);
+    return body.done && req->keep_alive;
+  }
+  res.type = ERROR;
+  strcpy(res.body, ERRMSG_GENERIC_ERROR);
+  kvresponse_encode(&res, out);
+  return req->keep_alive;
+}
+
+/* Appends the runtime counters and latency histograms of LEADER, and the
+ * stats of its stages (see stats.h), to OUT as a plain text response, one
+ * "name{labels} value" line per counter. */
+static void tpcleader_encode_metrics(tpcleader_t *leader, http_buffer_t *out) {
+  char *buf = NULL;
+  size_t size = 0;
+  FILE *metrics = open_memstream(&buf, &size);
+  if (!metrics)
+    fatal_malloc();
+  pthread_rwlock_rdlock(&leader->follower_lock);
+  follower_t *fol = leader->followers_head;
+  if (fol) {
+    do {
+      pthread_mutex_lock(&fol->pool_lock);
+      fprintf(metrics, "tpcleader_pool_hits{follower=\"%s:%u\"} %lu\n", fol->host, fol->port,
+              fol->pool_hits);
+      fprintf(metrics, "tpcleader_pool_misses{follower=\"%s:%u\"} %lu\n", fol->host, fol->port,
+              fol->pool_misses);
+      fprintf(metrics, "tpcleader_pool_reconnects{follower=\"%s:%u\"} %lu\n", fol->host,
+              fol->port, fol->pool_reconnects);
+      fprintf(metrics, "tpcleader_pool_idle{follower=\"%s:%u\"} %u\n", fol->host, fol->port,
+              fol->pool_count);
+      fprintf(metrics, "tpcleader_binary_framing{follower=\"%s:%u\"} %d\n", fol->host,
+              fol->port, fol->binary);
+      fprintf(metrics, "tpcleader_ring_share{follower=\"%s:%u\"} %.4f\n", fol->host,
+              fol->port, fol->ring_share);
+      fprintf(metrics, "tpcleader_outstanding{follower=\"%s:%u\"} %u\n", fol->host, fol->port,
+              __atomic_load_n(&fol->outstanding, __ATOMIC_RELAXED));
+      fprintf(metrics, "tpcleader_latency_ewma_us{follower=\"%s:%u\"} %" PRIu64 "\n",
+              fol->host, fol->port, __atomic_load_n(&fol->latency_ewma, __ATOMIC_RELAXED));
+      pthread_mutex_unlock(&fol->pool_lock);
+      fol = fol->next;
+    } while (fol != leader->followers_head);
+  }
+  pthread_rwlock_unlock(&leader->follower_lock);
+  histogram_print(&leader->prepare_latency, metrics, "tpcleader_phase_latency_us",
+                  "phase=\"prepare\"");
+  histogram_print(&leader->commit_latency, metrics, "tpcleader_phase_latency_us",
+                  "phase=\"commit\"");
+  histogram_print(&leader->get_latency, metrics, "tpcleader_get_latency_us", "");
+  kvcache_print(&leader->cache, metrics, "tpcleader_cache");
+  fprintf(metrics, "tpcleader_hedged_reads %lu\n",
+          __atomic_load_n(&leader->hedged_reads, __ATOMIC_RELAXED));
+  fprintf(metrics, "tpcleader_hedge_wins %lu\n",
+          __atomic_load_n(&leader->hedge_wins, __ATOMIC_RELAXED));
+  fprintf(metrics, "tpcleader_lock_retries %lu\n",
+          __atomic_load_n(&leader->lock_retries, __ATOMIC_RELAXED));
+  pthread_mutex_lock(&leader->abort_lock);
+  fprintf(metrics, "tpcleader_pending_aborts %u\n", leader->naborts);
+  pthread_mutex_unlock(&leader->abort_lock);
+  stats_print(metrics, "tpcleader");
+  fclose(metrics);
+  http_encode_response(out, 200, "text/plain", buf, size);
+  free(buf);
 }
 
 /* Generic entrypoint for this LEADER. Takes in a socket on SOCKFD, which
@@ -241,24 +1130,62 @@ void tpcleader_handle_tpc(tpcleader_t *leader, kvrequest_t *req, kvresponse_t *r
  * and sends back a response message.  This should call out to the appropriate
  * internal handler. */
 void tpcleader_handle(tpcleader_t *leader, int sockfd) {
-  kvresponse_t res;
+  char buf[HTTP_RECV_MAX_SIZE];
   kvrequest_t req;
-  bool success = kvrequest_receive(&req, sockfd);
+  kvarena_t arena;
+  http_buffer_t out;
+  uint64_t start;
+  http_buffer_init(&out);
+  req.arena = &arena;
+  kvrequest_receive(&req, sockfd, buf, sizeof(buf));
+  tpcleader_handle_request(leader, &req, &out);
+  start = histogram_now();
+  http_buffer_send(&out, sockfd);
+  stats_record(STATS_SEND, histogram_now() - start);
+  http_buffer_free(&out);
+}
 
-  do {
-    if (!success) {
-      res.type = ERROR;
-      strcpy(res.body, ERRMSG_INVALID_REQUEST);
-    } else if (req.type == INDEX) {
-      index_send(sockfd, 1);
-      break;
-    } else if (req.type == REGISTER) {
-      tpcleader_register(leader, &req, &res);
-    } else if (req.type == GETREQ) {
-      tpcleader_handle_get(leader, &req, &res);
-    } else {
-      tpcleader_handle_tpc(leader, &req, &res);
-    }
-    kvresponse_send(&res, sockfd);
-  } while (0);
+/* Processes the request REQ, which has already been received by LEADER, and
+ * appends the response message to OUT. REQ->type is EMPTY if the request was
+ * invalid. Returns true if the connection may be kept open for another
+ * request. */
+bool tpcleader_handle_request(tpcleader_t *leader, kvrequest_t *req, http_buffer_t *out) {
+  kvresponse_t res;
+  if (req->type == EMPTY) {
+    res.type = ERROR;
+    strcpy(res.body, ERRMSG_INVALID_REQUEST);
+  } else if (req->type == INDEX) {
+    /* The index page is delimited by closing the connection. */
+    index_encode(out, 1);
+    return false;
+  } else if (req->type == METRICS) {
+    tpcleader_encode_metrics(leader, out);
+    return req->keep_alive;
+  } else if (req->type == SCAN) {
+    tpcleader_handle_scan(leader, req, out);
+    return req->keep_alive;
+  } else if (req->type == REGISTER) {
+    tpcleader_register(leader, req, &res);
+  } else if (req->type == GETREQ || req->type == BLOB) {
+    /* A BLOB request to the leader is answered as the GET it stands for. */
+    req->type = GETREQ;
+    tpcleader_handle_get(leader, req, &res);
+    /* A binary frame cannot carry a large value, so the error is passed on. */
+    if (!req->binary && res.type == ERROR && !strcmp(res.body, ERRMSG_STREAMED))
+      return tpcleader_handle_blob(leader, req, out);
+  } else if (req->type == BATCH) {
+    tpcleader_handle_batch(leader, req, &res);
+  } else if (req->type == PUTREQ && req->large) {
+    tpcleader_handle_large_put(leader, req, &res);
+  } else {
+    tpcleader_handle_tpc(leader, req, &res);
+  }
+  if (req->binary)
+    kvresponse_encode_frame(&res, out);
+  else
+    kvresponse_encode(&res, out);
+  /* A large value left unread cannot be skipped to reach the next request. */
+  if (req->large && !req->body.done)
+    return false;
+  return req->type != EMPTY && req->keep_alive;
 }
@@ -3,6 +3,10 @@
 
 #include <pthread.h>
 #include <inttypes.h>
+#include <time.h>
+#include <netinet/in.h>
+#include "histogram.h"
+#include "kvcache.h"
 #include "kvmessage.h"
 
 /* TPCLeader defines a leader server which will communicate with multiple
@@ -21,25 +25,218 @@
  *
  * For this project, you can assume that the TPCLeader will never fail. Thus,
  * you don't need to maintain a TPCLog for it.
+ *
+ * Keys are placed on a consistent hashing ring. Each follower owns VNODES
+ * points on it (virtual nodes), the first at its ID and the others at hashes
+ * derived from its address; a key belongs to the follower owning the first
+ * point above the key's hash, and is replicated on the next distinct
+ * followers clockwise from there. With a single virtual node, this is the
+ * follower with the next higher ID and its successors. More virtual nodes
+ * spread the keys more evenly across followers.
+ *
+ * The ring is an immutable, sorted array of points, rebuilt whenever a
+ * follower registers and published by swapping a pointer, so requests route
+ * by binary search without taking any lock. A replaced ring is never freed,
+ * since readers may still be using it, but one is only ever replaced when a
+ * new follower registers, so at most FOLLOWER_CAPACITY rings are built.
+ *
+ * Rather than opening a new connection for every message, the TPCLeader keeps
+ * a small pool of idle, persistent (HTTP/1.1 keep-alive) connections to each
+ * follower. A follower closes a connection after KEEPALIVE_TIMEOUT seconds
+ * without a request, so pooled connections are dropped once they have been
+ * idle for TPCLEADER_POOL_IDLE seconds or are found to be closed, and a
+ * request which fails on a reused connection is retried once on a new one.
+ * Unless the follower runs an event loop (see socket_server.h), each pooled
+ * connection occupies one of its worker threads while it is open, so
+ * TPCLEADER_POOL_SIZE should stay below the follower's thread count.
+ *
+ * Both phases of TPC are fanned out to all replicas of a key concurrently:
+ * the leader sends its message to every replica, then polls their
+ * connections until each has responded or TPCLEADER_PHASE_TIMEOUT has
+ * passed. The latency of each phase is recorded in a histogram and reported
+ * on the metrics endpoint.
+ *
+ * Every round of TPC is a transaction with its own ID, which is sent with
+ * each of its messages (see kvmessage.h), so followers may hold the votes of
+ * many transactions at once and commit or abort each of them on its own (see
+ * tpcfollower.h). IDs are taken from a counter seeded from the clock, so that
+ * a restarted leader does not reuse the IDs of transactions its followers may
+ * still be waiting on. A follower which voted to commit still holds the keys
+ * of the transaction until the leader tells it the outcome, so, as ever with
+ * TPC, they stay blocked for as long as the leader is unreachable. A round
+ * aborted because some follower found a key locked by another transaction
+ * is retried as a new transaction, after a short random delay.
+ *
+ * An ABORT is due to every follower which was sent the vote, including those
+ * which did not answer in time, as they may have logged it. The client is
+ * answered once each follower which voted has been sent it; a follower which
+ * did not vote, or has not acknowledged its ABORT, is asked again by a
+ * background thread every TPCLEADER_RETRY_DELAY milliseconds until it does,
+ * so a follower which is down holds up no worker thread.
+ *
+ * A BATCH request (see kvmessage.h) runs a single round of TPC for all of its
+ * operations: each follower involved is asked to vote on the operations on
+ * its keys at once, and logs them as a single entry.
+ *
+ * GETs are spread over all replicas of a key: of two replicas picked at
+ * random (power of two choices), the one with the lower expected wait is
+ * asked first, that is its moving average latency times its number of
+ * outstanding requests plus one. Unless TPCLEADER_HEDGED_READS is defined as
+ * 0, a GET which has not been answered within the 95th percentile of GET
+ * latency is also sent to a second replica, and the first answer is used.
+ * Hedging only starts once TPCLEADER_HEDGE_MIN_SAMPLES GETs have been timed.
+ *
+ * Values are cached on the leader (see kvcache.h), up to TPCLEADER_CACHE_SIZE
+ * bytes, so hot keys are served without asking a follower. A GET which
+ * misses the cache fills it with the follower's answer. Since every write
+ * goes through the leader, the cache is kept consistent without asking the
+ * followers: a key is dropped from the cache before its TPC round starts, so
+ * it is not served while followers may disagree on it, and dropped again once
+ * the round is over. The new value is not cached then, as concurrent rounds on
+ * the same key may finish in a different order than they committed in; the
+ * next GET fills it, through a ticket which any write in between voids.
+ *
+ * A SCAN request (see kvmessage.h) is sent to every follower, as no follower
+ * holds all keys, and the leader merges the pages they answer with into one
+ * page of its own, dropping the copies of each entry held by other replicas
+ * (see tpcleader_handle_scan). Each hop holds at most a page of entries at a
+ * time, so a scan of any length costs memory in proportion to its page size,
+ * and the client streams through the result by asking for one page after
+ * another. Scans bypass the cache.
+ *
+ * Followers which offer binary framing when they register (see kvmessage.h)
+ * are sent every request as a binary frame rather than as HTTP, unless
+ * TPCLEADER_BINARY_FRAMING is defined as 0.
+ *
+ * The large value of a PUT (see kvmessage.h) is read from the client into an
+ * unlinked spool file in TPCLEADER_SPOOL_DIR before its round of TPC starts,
+ * as it may have to be sent to several followers, and again on a retry. It is
+ * sent from there with sendfile, always over HTTP. A GET which a replica
+ * answers with ERRMSG_STREAMED is sent to a replica again as a BLOB request,
+ * and the body of its response is copied to the client as it arrives, a
+ * buffer at a time, so neither hop holds the value in memory. Large values
+ * are never cached.
  */
 
+/* The maximum number of idle connections pooled per follower. */
+#define TPCLEADER_POOL_SIZE 2
+
+/* The time (in seconds) after which an idle pooled connection is dropped. */
+#define TPCLEADER_POOL_IDLE (KEEPALIVE_TIMEOUT - 1)
+
+/* The time (in milliseconds) the leader waits for the replies of one phase. */
+#define TPCLEADER_PHASE_TIMEOUT (TIMEOUT * 1000)
+
+/* The time (in milliseconds) the leader waits before sending a decision again
+ * to the followers which have not acknowledged it, such as one which is down. */
+#define TPCLEADER_RETRY_DELAY 10
+
+/* The number of times a round of TPC which lost a lock conflict is retried. */
+#define TPCLEADER_LOCK_RETRIES 4
+
+/* The longest delay (in milliseconds) before the first retry of a round. */
+#define TPCLEADER_LOCK_BACKOFF 2
+
+/* Whether to send binary frames to the followers which accept them. */
+#ifndef TPCLEADER_BINARY_FRAMING
+#define TPCLEADER_BINARY_FRAMING 1
+#endif
+
+/* Whether to hedge GETs which take longer than usual. */
+#ifndef TPCLEADER_HEDGED_READS
+#define TPCLEADER_HEDGED_READS 1
+#endif
+
+/* The number of GETs timed before their percentiles are trusted for hedging. */
+#define TPCLEADER_HEDGE_MIN_SAMPLES 100
+
+/* The weight of the newest sample in a follower's moving average latency,
+ * as a power of two (1/8). */
+#define TPCLEADER_EWMA_SHIFT 3
+
+/* The directory the large values of PUTs are spooled in. */
+#ifndef TPCLEADER_SPOOL_DIR
+#define TPCLEADER_SPOOL_DIR "/tmp"
+#endif
+
+/* The number of bytes of values the leader caches; 0 disables the cache. */
+#ifndef TPCLEADER_CACHE_SIZE
+#define TPCLEADER_CACHE_SIZE (4 * 1024 * 1024)
+#endif
+
+/* The default number of points each follower owns on the ring. A single point
+ * keeps keys where earlier versions placed them. */
+#ifndef TPCLEADER_DEFAULT_VNODES
+#define TPCLEADER_DEFAULT_VNODES 1
+#endif
+
 /* A struct used to represent the followers which this TPC Leader is aware of. */
 typedef struct follower {
-  uint64_t id;           /* The unique ID for this follower. */
-  char *host;            /* The host where this follower can be reached. */
-  unsigned int port;     /* The port where this follower can be reached. */
-  struct follower *next; /* The next follower in the list of followers. */
-  struct follower *prev; /* The previous follower in the list of followers. */
+  uint64_t id;                           /* The unique ID for this follower. */
+  char *host;                            /* The host where this follower can be reached. */
+  unsigned int port;                     /* The port where this follower can be reached. */
+  struct sockaddr_in addr;               /* The resolved address of HOST:PORT. */
+  bool binary;                           /* Whether requests are sent as binary frames. */
+  double ring_share;                     /* The fraction of the ring this follower owns. */
+  unsigned int outstanding;              /* Requests awaiting a response from this follower. */
+  uint64_t latency_ewma;                 /* The moving average latency (us) of responses. */
+  pthread_mutex_t pool_lock;             /* A lock used to protect the connection pool. */
+  int pool[TPCLEADER_POOL_SIZE];         /* Idle connections to this follower. */
+  time_t pool_idle[TPCLEADER_POOL_SIZE]; /* When each pooled connection became idle. */
+  unsigned int pool_count;               /* The number of pooled connections. */
+  unsigned long pool_hits;               /* Requests sent over a pooled connection. */
+  unsigned long pool_misses;             /* Requests which needed a new connection. */
+  unsigned long pool_reconnects;         /* Pooled connections found closed mid-request. */
+  struct follower *next;                 /* The next follower in the list of followers. */
+  struct follower *prev;                 /* The previous follower in the list of followers. */
 } follower_t;
 
+/* An ABORT which a follower has not acknowledged yet. */
+typedef struct tpcleader_abort {
+  follower_t *follower;         /* The follower which may hold a vote of the transaction. */
+  uint64_t txid;                /* The aborted transaction. */
+  struct tpcleader_abort *prev; /* The previous ABORT. */
+  struct tpcleader_abort *next; /* The next ABORT. */
+} tpcleader_abort_t;
+
+/* A point on the ring. Keys which hash below HASH, and at or above the hash of
+ * the previous point, belong to FOLLOWER. */
+typedef struct {
+  uint64_t hash;
+  follower_t *follower;
+} ring_point_t;
+
+/* An immutable snapshot of the consistent hashing ring. */
+typedef struct tpcring {
+  unsigned int nfollowers;  /* The number of followers on the ring. */
+  unsigned int npoints;     /* The number of points, VNODES per follower. */
+  follower_t **followers;   /* The followers, sorted by ID. */
+  ring_point_t *points;     /* The points of all followers, sorted by hash. */
+  struct tpcring *retired;  /* The ring which this one replaced. */
+} tpcring_t;
+
 /* A TPC Leader. */
 struct tpcleader;
 typedef struct tpcleader {
   unsigned int follower_capacity; /* The number of followers this leader will use. */
   unsigned int follower_count;    /* The current number of followers this leader is aware of. */
   unsigned int redundancy;        /* The number of followers a single value will be stored on. */
+  unsigned int vnodes;            /* The number of points per follower on the ring. */
   follower_t *followers_head;     /* The head of the list of followers. */
   pthread_rwlock_t follower_lock; /* A lock used to protect the list of followers. */
+  tpcring_t *ring;                /* The current ring, or NULL before any registration. */
+  histogram_t prepare_latency;    /* Microseconds taken by phase 1 of TPC. */
+  histogram_t commit_latency;     /* Microseconds taken by phase 2 of TPC. */
+  histogram_t get_latency;        /* Microseconds taken by a follower to answer a GET. */
+  unsigned long hedged_reads;     /* GETs which were also sent to a second replica. */
+  unsigned long hedge_wins;       /* Hedged GETs answered first by the second replica. */
+  kvcache_t cache;                /* Recently read and written values. */
+  uint64_t next_txid;             /* The ID of the next transaction. */
+  unsigned long lock_retries;     /* Rounds of TPC retried after a lock conflict. */
+  tpcleader_abort_t *aborts;      /* The ABORTs awaiting the background thread. */
+  unsigned int naborts;           /* ABORTs not yet acknowledged, in ABORTS or being sent. */
+  pthread_mutex_t abort_lock;     /* A lock used to protect ABORTS and NABORTS. */
+  pthread_cond_t abort_ready;     /* Signalled when ABORTS is no longer empty. */
 } tpcleader_t;
 
 int tpcleader_init(tpcleader_t *leader, unsigned int follower_capacity, unsigned int redundancy);
@@ -47,10 +244,14 @@ int tpcleader_init(tpcleader_t *leader, unsigned int follower_capacity, unsigned
 void tpcleader_register(tpcleader_t *leader, kvrequest_t *, kvresponse_t *);
 follower_t *tpcleader_get_primary(tpcleader_t *leader, char *key);
 follower_t *tpcleader_get_successor(tpcleader_t *leader, follower_t *predecessor);
+unsigned int tpcleader_get_replicas(tpcleader_t *leader, char *key, follower_t **replicas);
 
 void tpcleader_handle(tpcleader_t *leader, int sockfd);
+bool tpcleader_handle_request(tpcleader_t *leader, kvrequest_t *, http_buffer_t *out);
 
 void tpcleader_handle_get(tpcleader_t *leader, kvrequest_t *, kvresponse_t *);
 void tpcleader_handle_tpc(tpcleader_t *leader, kvrequest_t *req, kvresponse_t *res);
+void tpcleader_handle_batch(tpcleader_t *leader, kvrequest_t *req, kvresponse_t *res);
+void tpcleader_handle_scan(tpcleader_t *leader, kvrequest_t *req, http_buffer_t *out);
 
 #endif
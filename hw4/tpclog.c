@@ -1,22 +1,279 @@
 #include <stdbool.h>
+#include <dirent.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stddef.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include "crc32.h"
+#include "histogram.h"
 #include "kvconstants.h"
+#include "stats.h"
 #include "tpclog.h"
 
+/* The size of a logentry_t without its DATA array. */
+#define LOGENTRY_HEADER_SIZE offsetof(logentry_t, data)
+
+/* The size of the marker record written at the start of the log. */
+#define MARKER_SIZE (sizeof(logrecord_t) + LOGENTRY_HEADER_SIZE)
+
+/* Writes the filename of segment ID of LOG into FILENAME. */
+static void tpclog_segment_name(tpclog_t *log, unsigned int id, char *filename) {
+  sprintf(filename, "%s/%u%s", log->dirname, id, TPCLOG_FILETYPE);
+}
+
+/* Returns the lowest ID of any segment within the directory of LOG, or 0 if
+ * there are none. */
+static unsigned int tpclog_first_segment(tpclog_t *log) {
+  unsigned int id, first = 0;
+  bool found = false;
+  struct dirent *dent;
+  char *end;
+  DIR *dir = opendir(log->dirname);
+  if (dir == NULL)
+    return 0;
+  while ((dent = readdir(dir)) != NULL) {
+    id = strtoul(dent->d_name, &end, 10);
+    if (end != dent->d_name && !strcmp(end, TPCLOG_FILETYPE) && (!found || id < first)) {
+      first = id;
+      found = true;
+    }
+  }
+  closedir(dir);
+  return first;
+}
+
+/* Syncs the directory of LOG, if LOG is synced at all, so that the removal of
+ * a segment is durable. */
+static void tpclog_sync_dir(tpclog_t *log) {
+  int fd;
+  if (log->sync == TPCLOG_SYNC_NONE || (fd = open(log->dirname, O_RDONLY | O_DIRECTORY)) < 0)
+    return;
+  fsync(fd);
+  close(fd);
+}
+
+/* Opens segment ID of LOG, creating it if CREATE is set, preallocates it and
+ * appends it to LOG's list of segments. Returns 0 if successful, else
+ * ERR_FILACCESS (with errno set to ENOENT if the segment does not exist). */
+static int tpclog_open(tpclog_t *log, unsigned int id, bool create) {
+  char filename[MAX_FILENAME];
+  int fd, ret;
+  tpclog_segment_name(log, id, filename);
+  if ((fd = open(filename, O_RDWR | (create ? O_CREAT : 0), S_IRUSR | S_IWUSR)) < 0)
+    return ERR_FILACCESS;
+  /* posix_fallocate returns its error rather than setting errno, which must
+   * not be left holding a stale ENOENT. */
+  if ((ret = posix_fallocate(fd, 0, TPCLOG_SEGMENT_SIZE)) != 0) {
+    close(fd);
+    errno = ret;
+    return ERR_FILACCESS;
+  }
+  if (log->nsegs == log->capacity) {
+    log->capacity = log->capacity ? log->capacity * 2 : 4;
+    log->fds = realloc(log->fds, log->capacity * sizeof(int));
+    log->segseqs = realloc(log->segseqs, log->capacity * sizeof(uint64_t));
+    if (!log->fds || !log->segseqs)
+      fatal_malloc();
+  }
+  log->segseqs[log->nsegs] = log->nextseq;
+  log->fds[log->nsegs++] = fd;
+  return 0;
+}
+
+/* Closes and removes every segment of LOG after the first NSEGS. */
+static void tpclog_truncate_segments(tpclog_t *log, unsigned int nsegs) {
+  char filename[MAX_FILENAME];
+  while (log->nsegs > nsegs) {
+    log->nsegs--;
+    close(log->fds[log->nsegs]);
+    tpclog_segment_name(log, log->first + log->nsegs, filename);
+    remove(filename);
+  }
+}
+
+/* Computes the checksum of a record with sequence number SEQ holding ENTRY. */
+static uint32_t tpclog_crc(uint64_t seq, logentry_t *entry) {
+  uint32_t crc = crc32(0, &seq, sizeof(seq));
+  return crc32(crc, entry, LOGENTRY_HEADER_SIZE + entry->length);
+}
+
+/* Reads the record at OFFSET within segment SEG of LOG into ENTRY, and its
+ * sequence number into SEQ. Returns the size of the record, or -1 if there is
+ * no valid record at that position. */
+static ssize_t tpclog_read_record(tpclog_t *log, unsigned int seg, off_t offset, uint64_t *seq,
+                                  logentry_t *entry) {
+  logrecord_t rec;
+  if (seg >= log->nsegs || offset + sizeof(logrecord_t) > TPCLOG_SEGMENT_SIZE)
+    return -1;
+  if (pread(log->fds[seg], &rec, sizeof(rec), offset) < (ssize_t)sizeof(rec))
+    return -1;
+  if (rec.length < LOGENTRY_HEADER_SIZE || rec.length > sizeof(logentry_t) ||
+      offset + sizeof(rec) + rec.length > TPCLOG_SEGMENT_SIZE)
+    return -1;
+  if (pread(log->fds[seg], entry, rec.length, offset + sizeof(rec)) < (ssize_t)rec.length)
+    return -1;
+  if (entry->length != rec.length - LOGENTRY_HEADER_SIZE ||
+      tpclog_crc(rec.seq, entry) != rec.crc)
+    return -1;
+  *seq = rec.seq;
+  return sizeof(rec) + rec.length;
+}
+
+/* Reads the record with sequence number SEQ into ENTRY, given that it directly
+ * follows OFFSET within segment SEG of LOG. Since a record never spans two
+ * segments, it is either found there or at the start of the next segment.
+ * On success, advances SEG and OFFSET past the record and returns 0, else
+ * returns -1. */
+static int tpclog_read_next(tpclog_t *log, unsigned int *seg, off_t *offset, uint64_t seq,
+                            logentry_t *entry) {
+  uint64_t found;
+  ssize_t size = tpclog_read_record(log, *seg, *offset, &found, entry);
+  if (size < 0 || found != seq) {
+    size = tpclog_read_record(log, *seg + 1, 0, &found, entry);
+    if (size < 0 || found != seq)
+      return -1;
+    (*seg)++;
+    *offset = 0;
+  }
+  *offset += size;
+  return 0;
+}
+
+/* Appends a record holding ENTRY to LOG, starting a new segment if it does not
+ * fit into the current one. Must be called with LOG's write lock held. Returns
+ * the sequence number of the record, or a negative error code. */
+static int64_t tpclog_append(tpclog_t *log, logentry_t *entry) {
+  size_t size = sizeof(logrecord_t) + LOGENTRY_HEADER_SIZE + entry->length;
+  logrecord_t *rec;
+  ssize_t written;
+  int fd;
+
+  if (log->tail + size > TPCLOG_SEGMENT_SIZE) {
+    /* Records are only synced through the segment they were written to, so
+     * make sure nothing is left behind in this one. */
+    if (log->sync != TPCLOG_SYNC_NONE && fdatasync(log->fds[log->nsegs - 1]) < 0)
+      return ERR_FILACCESS;
+    if (tpclog_open(log, log->first + log->nsegs, true) < 0)
+      return ERR_FILACCESS;
+    log->tail = 0;
+  }
+  fd = log->fds[log->nsegs - 1];
+
+  rec = malloc(size);
+  if (!rec)
+    fatal_malloc();
+  rec->length = LOGENTRY_HEADER_SIZE + entry->length;
+  rec->seq = log->nextseq;
+  rec->crc = tpclog_crc(rec->seq, entry);
+  memcpy(rec + 1, entry, rec->length);
+  written = pwrite(fd, rec, size, log->tail);
+  free(rec);
+  if (written < (ssize_t)size)
+    return ERR_FILACCESS;
+  log->tail += size;
+
+  pthread_mutex_lock(&log->sync_lock);
+  log->written_seq = log->nextseq;
+  log->written_fd = fd;
+  pthread_mutex_unlock(&log->sync_lock);
+  return log->nextseq++;
+}
+
+/* In TPCLOG_SYNC_GROUP mode, waits until the record with sequence number SEQ
+ * is durable, syncing it (and everything written before it) if no other
+ * thread is already doing so. Returns 0 if successful, else a negative error
+ * code. */
+static int tpclog_sync(tpclog_t *log, uint64_t seq) {
+  uint64_t target;
+  int ret = 0, fd;
+  if (log->sync != TPCLOG_SYNC_GROUP)
+    return 0;
+
+  pthread_mutex_lock(&log->sync_lock);
+  while (log->synced_seq < seq) {
+    if (log->syncing) {
+      pthread_cond_wait(&log->synced, &log->sync_lock);
+      continue;
+    }
+    /* Become the syncing thread for everything written so far. */
+    log->syncing = true;
+    target = log->written_seq;
+    fd = log->written_fd;
+    pthread_mutex_unlock(&log->sync_lock);
+    ret = fdatasync(fd) < 0 ? ERR_FILACCESS : 0;
+    pthread_mutex_lock(&log->sync_lock);
+    log->syncing = false;
+    if (ret == 0 && target > log->synced_seq)
+      log->synced_seq = target;
+    pthread_cond_broadcast(&log->synced);
+    if (ret < 0)
+      break;
+  }
+  pthread_mutex_unlock(&log->sync_lock);
+  return ret;
+}
+
+/* Waits until no thread of LOG is syncing, since the sync may be using a
+ * segment which is about to be removed. */
+static void tpclog_wait_sync(tpclog_t *log) {
+  pthread_mutex_lock(&log->sync_lock);
+  while (log->syncing)
+    pthread_cond_wait(&log->synced, &log->sync_lock);
+  pthread_mutex_unlock(&log->sync_lock);
+}
+
+/* Overwrites the start of the first segment of LOG with a marker record which
+ * begins a new, empty log, syncs it as required by LOG's sync mode and then
+ * removes all later segments. Must be called with LOG's write lock held.
+ * Returns 0 if successful, else a negative error code. */
+static int tpclog_write_marker(tpclog_t *log) {
+  struct {
+    logrecord_t rec;
+    logentry_t entry;
+  } marker;
+  marker.entry.type = EMPTY;
+  marker.entry.length = 0;
+  marker.entry.txid = 0;
+  marker.rec.length = LOGENTRY_HEADER_SIZE;
+  marker.rec.seq = log->nextseq;
+  marker.rec.crc = tpclog_crc(marker.rec.seq, &marker.entry);
+  if (pwrite(log->fds[0], &marker, MARKER_SIZE, 0) < (ssize_t)MARKER_SIZE)
+    return ERR_FILACCESS;
+  if (log->sync != TPCLOG_SYNC_NONE && fdatasync(log->fds[0]) < 0)
+    return ERR_FILACCESS;
+  tpclog_truncate_segments(log, 1);
+  log->head = log->tail = MARKER_SIZE;
+  log->segseqs[0] = log->nextseq++;
+  log->firstseq = log->nextseq;
+  log->nextid = 0;
+
+  pthread_mutex_lock(&log->sync_lock);
+  log->written_seq = log->synced_seq = log->segseqs[0];
+  log->written_fd = log->fds[0];
+  pthread_cond_broadcast(&log->synced);
+  pthread_mutex_unlock(&log->sync_lock);
+  return 0;
+}
+
 /* Initialize TPCLog LOG to use the provided DIRNAME to store its associated
- * entries. Sets LOG's NEXTID field based on the entries that currently exist
- * in DIRNAME. */
-int tpclog_init(tpclog_t *log, char *dirname) {
+ * segments, and SYNC to determine how entries are made durable. Sets LOG's
+ * NEXTID field based on the entries that currently exist in DIRNAME. Returns 0
+ * if successful, else a negative error code. */
+int tpclog_init(tpclog_t *log, char *dirname, tpclog_sync_t sync) {
   struct stat st;
-  unsigned long nextid = 0;
-  char filename[MAX_FILENAME];
+  logentry_t entry;
+  unsigned int seg = 0, prev;
+  uint64_t seq;
+  ssize_t size;
+  /* Leave room for the names of the segments within DIRNAME. */
+  if (strlen(dirname) + sizeof("/4294967295" TPCLOG_FILETYPE) > MAX_FILENAME)
+    return ERR_FILLEN;
   if (stat(dirname, &st) == -1) {
     if (mkdir(dirname, 0700) == -1)
       return errno;
@@ -25,139 +282,207 @@ int tpclog_init(tpclog_t *log, char *dirname) {
   if (!log->dirname)
     fatal_malloc();
   strcpy(log->dirname, dirname);
+  log->fds = NULL;
+  log->segseqs = NULL;
+  log->nsegs = log->capacity = 0;
+  log->nextseq = 0;
+  log->sync = sync;
+  log->syncing = false;
   pthread_rwlock_init(&log->lock, NULL);
+  pthread_mutex_init(&log->sync_lock, NULL);
+  pthread_cond_init(&log->synced, NULL);
 
-  /* Iterate through entries to determine next available ID, since this log may
-   * be recovering from a crash. */
-  sprintf(filename, "%s/%lu%s", log->dirname, nextid++, TPCLOG_FILETYPE);
-  while (stat(filename, &st) != -1)
-    sprintf(filename, "%s/%lu%s", log->dirname, nextid++, TPCLOG_FILETYPE);
-  log->nextid = nextid - 1;
-  return 0;
-}
-
-/* Add a log entry to LOG which will store the message type TYPE and, as
- * applicable, the associated KEY and VALUE (which should be NULL if they are
- * not applicable). See tpclog.h for a complete description of how log entries
- * should be stored in the file system. */
-int tpclog_log(tpclog_t *log, msgtype_t type, char *key, char *value) {
-  char filename[MAX_FILENAME];
-  int fd, keylen, vallen;
-  size_t size;
-  logentry_t *entry;
-  if (type != PUTREQ && type != DELREQ && type != ABORT && type != COMMIT)
-    return ERR_INVLDMSG;
-  pthread_rwlock_wrlock(&log->lock);
-  sprintf(filename, "%s/%lu%s", log->dirname, log->nextid, TPCLOG_FILETYPE);
-  if ((fd = open(filename, O_WRONLY | O_CREAT, S_IRUSR)) < 0) {
-    pthread_rwlock_unlock(&log->lock);
+  log->first = tpclog_first_segment(log);
+  while (tpclog_open(log, log->first + log->nsegs, false) == 0)
+    ;
+  if (errno != ENOENT)
+    return ERR_FILACCESS;
+  if (log->nsegs == 0 && tpclog_open(log, log->first, true) < 0)
     return ERR_FILACCESS;
-  }
-  log->nextid++;
 
-  keylen = (type == PUTREQ || type == DELREQ) ? (strlen(key) + 1) : 0;
-  vallen = (type == PUTREQ) ? (strlen(value) + 1) : 0;
-  size = sizeof(logentry_t) + keylen + vallen;
-  entry = malloc(size);
-  if (!entry)
-    fatal_malloc();
-  if (entry == NULL) {
-    pthread_rwlock_unlock(&log->lock);
-    return -ENOMEM;
+  /* Replay the log to find where it ends, since this log may be recovering
+   * from a crash. A valid log starts with a marker, or with the first record
+   * of a segment which was left first by tpclog_truncate. */
+  size = tpclog_read_record(log, 0, 0, &seq, &entry);
+  if (size < 0) {
+    /* Start a fresh log. Sequence numbers are seeded from the clock so that
+     * any stale records left over cannot continue the new sequence. */
+    log->nextseq = ((uint64_t)time(NULL)) << 20;
+    return tpclog_write_marker(log);
   }
-  entry->type = type;
-  entry->length = keylen + vallen;
-  if (type == PUTREQ || type == DELREQ)
-    strcpy(entry->data, key);
-  if (type == PUTREQ)
-    strcpy(entry->data + keylen, value);
-  errno = 0;
-  if (write(fd, entry, size) < size) {
-    pthread_rwlock_unlock(&log->lock);
-    return ERR_FILACCESS;
+  log->segseqs[0] = seq;
+  log->head = entry.type == EMPTY ? size : 0;
+  log->firstseq = entry.type == EMPTY ? seq + 1 : seq;
+  log->nextseq = log->firstseq;
+  log->nextid = 0;
+  log->tail = log->head;
+  for (prev = seg; tpclog_read_next(log, &seg, &log->tail, log->nextseq, &entry) == 0;
+       prev = seg) {
+    if (seg != prev)
+      log->segseqs[seg] = log->nextseq;
+    log->nextseq++;
+    log->nextid++;
   }
-  close(fd);
-  pthread_rwlock_unlock(&log->lock);
-  free(entry);
+  tpclog_truncate_segments(log, seg + 1);
+  log->written_seq = log->synced_seq = log->nextseq - 1;
+  log->written_fd = log->fds[seg];
   return 0;
 }
 
-/* Load the logentry located at FILENAME into ENTRY, which will be set to
- * malloc()d memory which should be later free()d. Returns 0 if successful,
- * else a negative error code (and ENTRY will be NULL). */
-int tpclog_load_entry(logentry_t *entry, char *filename) {
-  logentry_t tmp;
+/* Appends ENTRY to LOG and returns once it is as durable as LOG's sync mode
+ * requires. Returns 0 if successful, else a negative error code. */
+static int tpclog_log_entry(tpclog_t *log, logentry_t *entry) {
+  uint64_t start = histogram_now();
+  int64_t seq;
   int fd;
-  size_t size;
+  pthread_rwlock_wrlock(&log->lock);
+  seq = tpclog_append(log, entry);
+  fd = log->fds[log->nsegs - 1];
+  if (seq >= 0)
+    log->nextid++;
+  if (seq >= 0 && log->sync == TPCLOG_SYNC_EACH && fdatasync(fd) < 0)
+    seq = ERR_FILACCESS;
+  pthread_rwlock_unlock(&log->lock);
+  if (seq < 0)
+    return seq;
+  seq = tpclog_sync(log, seq);
+  stats_record(STATS_LOG_APPEND, histogram_now() - start);
+  return seq;
+}
 
-  if ((fd = open(filename, O_RDONLY)) < 0)
-    return ERR_FILACCESS;
-  if (read(fd, &tmp, sizeof(logentry_t) - MAX_LOGENTRY) < sizeof(logentry_t) - MAX_LOGENTRY)
-    return ERR_FILACCESS;
-  lseek(fd, SEEK_SET, 0);
-  size = tmp.length + sizeof(logentry_t) - MAX_LOGENTRY;
-  if (read(fd, entry, size) < size) {
-    return ERR_FILACCESS;
-  }
-  close(fd);
-  return 0;
+/* Add a log entry to LOG which will store the message type TYPE of
+ * transaction TXID and, as applicable, the associated KEY and VALUE (which
+ * should be NULL if they are not applicable). See tpclog.h for a complete
+ * description of how log entries are stored in the file system. Returns once
+ * the entry is as durable as LOG's sync mode requires. */
+int tpclog_log(tpclog_t *log, uint64_t txid, msgtype_t type, char *key, char *value) {
+  int keylen, vallen;
+  logentry_t entry;
+  if (type != PUTREQ && type != DELREQ && type != PUTBLOB && type != ABORT && type != COMMIT)
+    return ERR_INVLDMSG;
+
+  keylen = (type == PUTREQ || type == DELREQ || type == PUTBLOB) ? (strlen(key) + 1) : 0;
+  vallen = (type == PUTREQ) ? (strlen(value) + 1) : 0;
+  if (keylen + vallen > MAX_LOGENTRY)
+    return ERR_INVLDMSG;
+  entry.type = type;
+  entry.length = keylen + vallen;
+  entry.txid = txid;
+  if (keylen > 0)
+    strcpy(entry.data, key);
+  if (type == PUTREQ)
+    strcpy(entry.data + keylen, value);
+  return tpclog_log_entry(log, &entry);
+}
+
+/* Add a log entry to LOG which will store the LENGTH bytes of batch
+ * operations at BATCH of transaction TXID, as a single record. Returns once
+ * the entry is as durable as LOG's sync mode requires. */
+int tpclog_log_batch(tpclog_t *log, uint64_t txid, const char *batch, size_t length) {
+  logentry_t entry;
+  if (length + 1 > MAX_LOGENTRY)
+    return ERR_INVLDMSG;
+  entry.type = BATCH;
+  entry.length = length + 1;
+  entry.txid = txid;
+  memcpy(entry.data, batch, length);
+  entry.data[length] = '\0';
+  return tpclog_log_entry(log, &entry);
 }
 
 /* Prepare LOG to be iterated over. Once this is called, use the functions
  * tpclog_iterate_has_next and tpclog_iterate_next to iterate through all of
  * the entries in LOG from oldest to most recent. */
-void tpclog_iterate_begin(tpclog_t *log) { log->iterpos = 0; }
+void tpclog_iterate_begin(tpclog_t *log) {
+  pthread_rwlock_rdlock(&log->lock);
+  log->iterseq = log->firstseq;
+  log->iterseg = 0;
+  log->iteroffset = log->head;
+  pthread_rwlock_unlock(&log->lock);
+}
 
 /* Must be called after tpclog_iterate_begin has been called on LOG. Returns
  * true iff LOG has another entry that is more recent than the most previously
  * iterated over log entry. */
 bool tpclog_iterate_has_next(tpclog_t *log) {
-  struct stat st;
-  char filename[MAX_FILENAME];
-  sprintf(filename, "%s/%lu%s", log->dirname, log->iterpos, TPCLOG_FILETYPE);
-  if (stat(filename, &st) == -1)
-    return false;
-  return true;
+  bool has_next;
+  pthread_rwlock_rdlock(&log->lock);
+  has_next = log->iterseq < log->nextseq;
+  pthread_rwlock_unlock(&log->lock);
+  return has_next;
 }
 
 /* Must be called after tpclog_iterate_begin has been called on LOG. Attempts
- * to return the next most recent entry after the entry previously returned
+ * to read the next most recent entry after the entry previously returned
  * during the current iteration, or, immediately after tpclog_iterate_begin,
- * the oldest entry in LOG, using malloc()d memory which should later be
- * free()d. Returns NULL if there is an error or no more recent entry exists
- * (i.e., all entries have been iterated over). */
+ * the oldest entry in LOG, into ENTRY. Returns NULL if there is an error or no
+ * more recent entry exists (i.e., all entries have been iterated over). */
 logentry_t *tpclog_iterate_next(tpclog_t *log, logentry_t *entry) {
-  char filename[MAX_FILENAME];
-  int ret;
+  int ret = -1;
   pthread_rwlock_rdlock(&log->lock);
-  if (!tpclog_iterate_has_next(log)) {
-    pthread_rwlock_unlock(&log->lock);
-    return NULL;
+  if (log->iterseq < log->nextseq) {
+    ret = tpclog_read_next(log, &log->iterseg, &log->iteroffset, log->iterseq, entry);
+    log->iterseq++;
   }
-  sprintf(filename, "%s/%lu%s", log->dirname, log->iterpos++, TPCLOG_FILETYPE);
-  ret = tpclog_load_entry(entry, filename);
   pthread_rwlock_unlock(&log->lock);
   return (ret < 0) ? NULL : entry;
 }
 
+/* Returns the sequence number which the next record appended to LOG will
+ * have. Every entry logged after this returns has at least this number. */
+uint64_t tpclog_next_seq(tpclog_t *log) {
+  uint64_t seq;
+  pthread_rwlock_rdlock(&log->lock);
+  seq = log->nextseq;
+  pthread_rwlock_unlock(&log->lock);
+  return seq;
+}
+
 /* Clear the log of all entries. Should be called periodically to keep the
  * number of entries from becoming too large, since a server rebuild will
  * iterate through all existing entries. */
 int tpclog_clear_log(tpclog_t *log) {
-  struct stat st;
-  char filename[MAX_FILENAME];
-  unsigned long count = 0;
+  int ret;
+  pthread_rwlock_wrlock(&log->lock);
+  tpclog_wait_sync(log);
+  ret = tpclog_write_marker(log);
+  pthread_rwlock_unlock(&log->lock);
+  return ret;
+}
 
+/* Removes the leading segments of LOG which only hold entries with sequence
+ * numbers below SEQ, keeping at least the segment being appended to, or clears
+ * LOG if that is all of its entries. Must not be called while LOG is being
+ * iterated over. Returns the sequence number of the first entry LOG still
+ * holds (or of the next one, if it holds none). */
+uint64_t tpclog_truncate(tpclog_t *log, uint64_t seq) {
+  char filename[MAX_FILENAME];
+  unsigned int drop = 0;
+  uint64_t first;
   pthread_rwlock_wrlock(&log->lock);
-  sprintf(filename, "%s/%lu%s", log->dirname, count++, TPCLOG_FILETYPE);
-  while (stat(filename, &st) != -1) {
-    if (remove(filename) < 0) {
-      pthread_rwlock_unlock(&log->lock);
-      return errno;
+  if (seq >= log->nextseq && log->nextseq > log->firstseq) {
+    tpclog_wait_sync(log);
+    tpclog_write_marker(log);
+  }
+  while (drop + 1 < log->nsegs && log->segseqs[drop + 1] <= seq)
+    drop++;
+  if (drop > 0) {
+    tpclog_wait_sync(log);
+    for (unsigned int i = 0; i < drop; i++) {
+      close(log->fds[i]);
+      tpclog_segment_name(log, log->first + i, filename);
+      remove(filename);
+      tpclog_sync_dir(log);
     }
-    sprintf(filename, "%s/%lu%s", log->dirname, count++, TPCLOG_FILETYPE);
+    log->nsegs -= drop;
+    memmove(log->fds, log->fds + drop, log->nsegs * sizeof(int));
+    memmove(log->segseqs, log->segseqs + drop, log->nsegs * sizeof(uint64_t));
+    log->first += drop;
+    log->head = 0;
+    log->nextid -= log->segseqs[0] - log->firstseq;
+    log->firstseq = log->segseqs[0];
   }
+  first = log->firstseq;
   pthread_rwlock_unlock(&log->lock);
-  log->nextid = 0;
-  return 0;
+  return first;
 }
@@ -2,16 +2,41 @@
 #define __TPC_LOG__
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <sys/types.h>
 #include "kvconstants.h"
 
 /* TPCLog defines a log which will log the TPC actions for a server such that
  * it can recreate its state after a crash.
  *
- * Entries in the log are stored within DIRNAME with an incrementing id. The
- * first entry has a filename of "0.log", the second has a filename of "1.log",
- * and so on. Files should always be sequential; for example, there should
- * never be a filename of "2.log" without a filename of "1.log"
+ * Entries in the log are appended to segment files within DIRNAME. The first
+ * segment has a filename of "0.log", the second "1.log", and so on; a new
+ * segment is only started once an entry no longer fits into the current one.
+ * Segments are preallocated to TPCLOG_SEGMENT_SIZE when they are created, so
+ * that appending to them never changes the file size and a data sync does not
+ * have to write back any file metadata.
+ *
+ * Each entry is stored as a logrecord_t header followed by the logentry_t
+ * itself (without the unused tail of its DATA array). The header holds the
+ * length of the entry, a sequence number which increases by one with every
+ * record ever written to the log, and a CRC-32 over both. On initialization
+ * the log is replayed from the start of the first segment until a record is
+ * found whose checksum or sequence number is not the expected one, so torn
+ * writes and stale records left behind from before a clear are never
+ * mistaken for entries.
+ *
+ * Clearing the log overwrites the start of the first segment with a marker
+ * record, which begins a new run of sequence numbers but is otherwise not an
+ * entry, and removes all later segments. Truncating it instead removes the
+ * leading segments which only hold entries older than a given sequence
+ * number, so the log then starts with the first record of a later segment;
+ * segments keep their IDs, so the first is not necessarily "0.log". Segments
+ * are removed in order, and in a synced log the directory is synced after
+ * each removal, so that a crash can never leave a gap among them.
+ *
+ * Every entry records the transaction it belongs to, so the votes and
+ * decisions of concurrent transactions may be interleaved in the log.
  *
  * Servers can use the TPCLog to log each incoming action they receive, and
  * later use the tpclog_iterate methods to iterate over all entries in the log,
@@ -19,52 +44,126 @@
  * iterator will walk over all entries in the log, servers should call
  * tpclog_clear_log periodically to clear the log. This will erase all entries
  * in the log, so it should only be called when the server is confident that it
- * will not need any existing entry to recreate state.
+ * will not need any existing entry to recreate state. A server which keeps
+ * some transactions in progress at all times should call tpclog_truncate as
+ * they finish instead.
+ *
+ * How durable an entry is once tpclog_log returns is determined by the sync
+ * mode given to tpclog_init. In TPCLOG_SYNC_GROUP mode, threads that log
+ * concurrently share a single fdatasync: the first thread to finish its append
+ * syncs everything written so far while the others wait for it, and whoever
+ * appended during that sync starts the next one.
  */
 
-/* Filetype to use as an extension for the filenames of entries in the TPCLog.
+/* Filetype to use as an extension for the filenames of segments in the TPCLog.
  */
 #define TPCLOG_FILETYPE ".log"
-#define MAX_LOGENTRY (MAX_KEYLEN + MAX_VALLEN + 2)
+/* An entry holds at most a key and a value, or the operations of a batch,
+ * which may be longer. */
+#define MAX_LOGENTRY (MAX_BATCHLEN + 1)
+
+/* The size to which each segment is preallocated. */
+#define TPCLOG_SEGMENT_SIZE (1024 * 1024)
+
+/* How entries are made durable by tpclog_log. */
+typedef enum {
+  TPCLOG_SYNC_NONE,  /* Entries are left to the page cache. */
+  TPCLOG_SYNC_EACH,  /* Every entry is followed by its own fdatasync. */
+  TPCLOG_SYNC_GROUP, /* Concurrently logged entries share one fdatasync. */
+} tpclog_sync_t;
+
+/* The sync mode used by TPCFollowers. */
+#ifndef TPCLOG_DEFAULT_SYNC
+#define TPCLOG_DEFAULT_SYNC TPCLOG_SYNC_GROUP
+#endif
 
 /* A TPCLog. */
 typedef struct {
-  /* The name of the directory in which to store log entries. */
+  /* The name of the directory in which to store log segments. */
   char *dirname;
-  /* The ID of the next entry to be stored in the log. */
+  /* Open file descriptors of all segments; the last one is being appended to. */
+  int *fds;
+  /* The sequence number of the first record of each segment. */
+  uint64_t *segseqs;
+  /* The number of segments, and the allocated length of FDS and SEGSEQS. */
+  unsigned int nsegs, capacity;
+  /* The ID of the first segment. */
+  unsigned int first;
+  /* The offset within the first segment at which its entries start: past
+   * the marker, if it starts with one. */
+  off_t head;
+  /* The offset at which the next record will be appended. */
+  off_t tail;
+  /* The number of entries currently in the log. */
   unsigned long nextid;
-  /* The position of the current iteration over the entries. */
-  unsigned long iterpos;
+  /* The sequence number of the first entry in the log. */
+  uint64_t firstseq;
+  /* The sequence number of the next record to be appended. */
+  uint64_t nextseq;
+  /* The position of the current iteration over the entries: the sequence
+   * number of the next record and where it should be found. */
+  uint64_t iterseq;
+  unsigned int iterseg;
+  off_t iteroffset;
+  /* How entries are made durable. */
+  tpclog_sync_t sync;
   /* A read-write lock used to make TPCLog thread-safe. */
   pthread_rwlock_t lock;
+  /* Group commit state, protected by SYNC_LOCK: the last sequence number
+   * appended and where, the last one known to be durable, and whether some
+   * thread is currently syncing. */
+  pthread_mutex_t sync_lock;
+  pthread_cond_t synced;
+  uint64_t written_seq, synced_seq;
+  int written_fd;
+  bool syncing;
 } tpclog_t;
 
-/* A single log entry.
+/* The on-disk header of a single record. */
+typedef struct {
+  /* The length of the entry which follows. */
+  uint32_t length;
+  /* CRC-32 of SEQ and the entry. */
+  uint32_t crc;
+  /* The sequence number of this record. */
+  uint64_t seq;
+} logrecord_t;
+
+/* A single log entry, which belongs to the transaction TXID.
  * For messages of type COMMIT and ABORT, data is empty.
  * For messages of type DELREQ, data holds the relevant key.
+ * For messages of type PUTBLOB, the vote for a PUT of a large value, data
+ * holds the key; the value is kept in a spool of the transaction (see
+ * kvblob.h), as it may be far too long for an entry.
  * For messages of type PUTREQ, data holds both the key and the value, in the
  * form:
  *   key_string \0 value_string \0
- *   (that is, two concatenated and null terminated strings) */
+ *   (that is, two concatenated and null terminated strings)
+ * For messages of type BATCH, data holds the operations of the batch (see
+ * kvmessage.h) as a null terminated string. */
 typedef struct {
   /* The type of message this log entry represents. */
   msgtype_t type;
   /* Stores the total length of DATA, including null terminators. */
   int length;
+  /* The ID of the transaction this entry belongs to (see kvmessage.h). */
+  uint64_t txid;
   /* Described above. */
   char data[MAX_LOGENTRY];
 } logentry_t;
 
-int tpclog_init(tpclog_t *, char *dirname);
-
-int tpclog_log(tpclog_t *, msgtype_t type, char *key, char *value);
+int tpclog_init(tpclog_t *, char *dirname, tpclog_sync_t sync);
 
-int tpclog_load_entry(logentry_t *entry, char *filename);
+int tpclog_log(tpclog_t *, uint64_t txid, msgtype_t type, char *key, char *value);
+int tpclog_log_batch(tpclog_t *, uint64_t txid, const char *batch, size_t length);
 
 void tpclog_iterate_begin(tpclog_t *log);
 bool tpclog_iterate_has_next(tpclog_t *log);
 logentry_t *tpclog_iterate_next(tpclog_t *log, logentry_t *entry);
 
+uint64_t tpclog_next_seq(tpclog_t *);
+
 int tpclog_clear_log(tpclog_t *);
+uint64_t tpclog_truncate(tpclog_t *, uint64_t seq);
 
 #endif
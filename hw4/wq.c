@@ -1,14 +1,102 @@
-#include <stdlib.h>
+#include <stdbool.h>
+#include <sched.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "histogram.h"
+#include "stats.h"
 #include "wq.h"
 #include "kvconstants.h"
-#include "utlist.h"
+
+/* The number of times an idle consumer polls the queue before sleeping. */
+#define WQ_SPINS 1000
+
+/* The number of times it yields instead, if there is only one CPU. */
+#define WQ_YIELDS 2
+
+/* Tells the CPU that this thread is spinning. */
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#else
+  __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+/* Sleeps until woken, unless *ADDR no longer holds VAL. */
+static void futex_wait(int *addr, int val) {
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+/* Wakes up to COUNT threads sleeping on ADDR. */
+static void futex_wake(int *addr, int count) {
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
 
 /* Initializes a work queue WQ. */
 void wq_init(wq_t *wq) {
-  pthread_mutex_init(&wq->mutex, NULL);
-  pthread_cond_init(&wq->condvar, NULL);
-  wq->size = 0;
-  wq->head = NULL;
+  for (unsigned long i = 0; i < WQ_CAPACITY; i++) {
+    wq->cells[i].seq = i;
+    wq->cells[i].item = NULL;
+  }
+  wq->enqueue_pos = 0;
+  wq->dequeue_pos = 0;
+  wq->available = 0;
+  wq->wakeups = 0;
+  wq->multicore = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+  wq->timed = false;
+}
+
+/* Stores ITEM, pushed at PUSHED, in the next free slot of WQ. Returns false
+ * if WQ is full. */
+static bool wq_try_enqueue(wq_t *wq, void *item, uint64_t pushed) {
+  unsigned long pos = __atomic_load_n(&wq->enqueue_pos, __ATOMIC_RELAXED), seq;
+  wq_cell_t *cell;
+  long diff;
+  while (true) {
+    cell = &wq->cells[pos & (WQ_CAPACITY - 1)];
+    seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    diff = (long)seq - (long)pos;
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&wq->enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      return false; /* The slot still holds an item from the previous lap. */
+    } else {
+      pos = __atomic_load_n(&wq->enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+  cell->item = item;
+  cell->pushed = pushed;
+  __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+/* Removes the oldest item from WQ into *ITEM, and when it was pushed into
+ * *PUSHED. Returns false if the slot at the head of WQ holds no item yet. */
+static bool wq_try_dequeue(wq_t *wq, void **item, uint64_t *pushed) {
+  unsigned long pos = __atomic_load_n(&wq->dequeue_pos, __ATOMIC_RELAXED), seq;
+  wq_cell_t *cell;
+  long diff;
+  while (true) {
+    cell = &wq->cells[pos & (WQ_CAPACITY - 1)];
+    seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    diff = (long)seq - (long)(pos + 1);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&wq->dequeue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = __atomic_load_n(&wq->dequeue_pos, __ATOMIC_RELAXED);
+    }
+  }
+  *item = cell->item;
+  *pushed = cell->pushed;
+  __atomic_store_n(&cell->seq, pos + WQ_CAPACITY, __ATOMIC_RELEASE);
+  return true;
 }
 
 /* Remove an item from the WQ. This function will wait until the queue
@@ -16,28 +104,59 @@ void wq_init(wq_t *wq) {
  * return it. */
 void *wq_pop(wq_t *wq) {
   void *job;
-  wq_item_t *wq_item;
-
-  pthread_mutex_lock(&wq->mutex);
-  while (wq->size == 0)
-    pthread_cond_wait(&wq->condvar, &wq->mutex);
-  wq_item = wq->head;
-  job = wq->head->item;
-  wq->size--;
-  DL_DELETE(wq->head, wq->head);
-  pthread_mutex_unlock(&wq->mutex);
-
-  free(wq_item);
+  uint64_t pushed;
+  int wakeups;
+
+  /* Wait briefly for an item before committing to sleep: spin if another CPU
+   * may push one meanwhile, else yield to let the producers run. */
+  for (int i = 0; i < (wq->multicore ? WQ_SPINS : WQ_YIELDS) &&
+                  __atomic_load_n(&wq->available, __ATOMIC_RELAXED) <= 0;
+       i++) {
+    if (wq->multicore)
+      cpu_relax();
+    else
+      sched_yield();
+  }
+
+  /* Claim an item, or else wait until a push hands this consumer one. */
+  if (__atomic_fetch_sub(&wq->available, 1, __ATOMIC_ACQUIRE) <= 0) {
+    wakeups = __atomic_load_n(&wq->wakeups, __ATOMIC_RELAXED);
+    while (true) {
+      if (wakeups > 0) {
+        if (__atomic_compare_exchange_n(&wq->wakeups, &wakeups, wakeups - 1, true,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+          break;
+        continue;
+      }
+      futex_wait(&wq->wakeups, 0);
+      wakeups = __atomic_load_n(&wq->wakeups, __ATOMIC_RELAXED);
+    }
+  }
+
+  /* The claimed item has been fully pushed, but a push to an earlier slot
+   * may still be in progress, in which case it finishes shortly. */
+  while (!wq_try_dequeue(wq, &job, &pushed))
+    sched_yield();
+  if (wq->timed)
+    stats_record(STATS_WQ_WAIT, histogram_now() - pushed);
   return job;
 }
 
 /* Add ITEM to WQ. */
 void wq_push(wq_t *wq, void *item) {
-  pthread_mutex_lock(&wq->mutex);
-  wq_item_t *wq_item = calloc(1, sizeof(wq_item_t));
-  wq_item->item = item;
-  DL_APPEND(wq->head, wq_item);
-  wq->size++;
-  pthread_cond_broadcast(&wq->condvar);
-  pthread_mutex_unlock(&wq->mutex);
+  uint64_t pushed = 0;
+  long depth;
+  if (wq->timed) {
+    pushed = histogram_now();
+    /* A pop between the two loads may make this briefly appear negative. */
+    depth = (long)(__atomic_load_n(&wq->enqueue_pos, __ATOMIC_RELAXED) -
+                   __atomic_load_n(&wq->dequeue_pos, __ATOMIC_RELAXED));
+    stats_record(STATS_WQ_DEPTH, depth > 0 ? depth : 0);
+  }
+  while (!wq_try_enqueue(wq, item, pushed))
+    sched_yield();
+  if (__atomic_fetch_add(&wq->available, 1, __ATOMIC_RELEASE) < 0) {
+    __atomic_fetch_add(&wq->wakeups, 1, __ATOMIC_RELEASE);
+    futex_wake(&wq->wakeups, 1);
+  }
 }
@@ -1,27 +1,64 @@
 #ifndef __WQ__
 #define __WQ__
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <pthread.h>
 
 /* WQ defines a work queue which will be used to store jobs which are waiting to
- * be processed. */
+ * be processed.
+ *
+ * The queue is a bounded, lock-free multi-producer multi-consumer ring buffer
+ * of WQ_CAPACITY slots, so pushing and popping never allocate. Each slot
+ * carries a sequence number which tells producers and consumers whether it is
+ * free to be written or ready to be read in the current lap around the ring;
+ * a thread claims a position by advancing the shared enqueue or dequeue
+ * counter with a compare-and-swap.
+ *
+ * AVAILABLE counts the items pushed but not yet claimed by a consumer; every
+ * pop decrements it, and it goes negative by one for each consumer which found
+ * nothing to claim. Such a consumer (after spinning briefly, on machines with
+ * more than one CPU) sleeps on a futex until a push which found AVAILABLE
+ * negative hands it a wakeup through WAKEUPS. A push thus only makes a system
+ * call when a consumer is actually asleep, and then wakes exactly one. A
+ * producer which finds the queue full yields until a slot frees up. */
 
-typedef struct wq_item {
+/* The number of slots in the ring; must be a power of two. */
+#define WQ_CAPACITY 1024
+
+/* The size of a cache line, used to keep the counters apart. */
+#define WQ_CACHE_LINE 64
+
+typedef struct wq_cell {
+  /* The position this slot is ready to be written at (if equal to it) or read
+   * at (if one past it). */
+  unsigned long seq;
   /* The item which is being stored. */
   void *item;
-  /* The next item in the queue. */
-  struct wq_item *next;
-  /* The previous item in the queue. */
-  struct wq_item *prev;
-} wq_item_t;
+  /* The histogram_now of its push, if the queue is timed. */
+  uint64_t pushed;
+} wq_cell_t;
 
 typedef struct wq {
-  int size;
-  pthread_mutex_t mutex;
-  pthread_cond_t condvar;
-  wq_item_t *head;
+  wq_cell_t cells[WQ_CAPACITY];
+  /* The position the next item will be pushed at. */
+  unsigned long enqueue_pos __attribute__((aligned(WQ_CACHE_LINE)));
+  /* The position the next item will be popped from. */
+  unsigned long dequeue_pos __attribute__((aligned(WQ_CACHE_LINE)));
+  /* The number of pushed items not yet claimed by a consumer, less the
+   * number of consumers waiting for one. */
+  int available __attribute__((aligned(WQ_CACHE_LINE)));
+  /* Wakeups handed to waiting consumers but not yet taken; the futex word
+   * which waiting consumers sleep on. */
+  int wakeups;
+  /* Whether there is more than one CPU for a waiting consumer to spin on. */
+  bool multicore;
+  /* Whether to record the wait of each item, and the depth of the queue as
+   * it is pushed, in the stats of the calling thread (see stats.h). */
+  bool timed;
 } wq_t;
 
+/* Initializes WQ, which is not timed. */
 void wq_init(wq_t *wq);
 
 void wq_push(wq_t *wq, void *item);